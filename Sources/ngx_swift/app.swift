@@ -61,6 +61,10 @@ public class App {
         var libnginxBytes = [UInt8](data)
 #endif
 
+        // state shared by all instances: ssl session cache zones, quic routes
+        let shared = UnsafeMutablePointer<ngx_as_lib_shared_t>.allocate(capacity: 1)
+        shared.initialize(to: ngx_as_lib_shared_t())
+
         // start
         for i in 0 ..< threadCount {
 #if !os(Linux)
@@ -104,6 +108,7 @@ public class App {
             upcall.pointee.postconfiguration = Http.postconfiguration
             upcall.pointee.get_upstream_peer = Upstream.getpeer
             upcall.pointee.looptick = Self.looptick
+            upcall.pointee.shared = shared
 
             api.pointee.set_upcall(upcall)
 
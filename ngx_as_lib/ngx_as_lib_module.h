@@ -156,9 +156,13 @@ struct ngx_as_lib_api_s {
 
 #if (NGX_AS_LIB_WITH_DLOPEN)
 #define LIBNGX "libngx"
+#define LIBNGX_QUIT "ngx_as_lib_quit"
 typedef ngx_as_lib_api_t*(*libngx_entrypoint)(void);
+typedef void(*libngx_quit_entrypoint)(void);
 #else
 ngx_as_lib_api_t* libngx(void);
+// graceful exit, cache indexes are saved
+void ngx_as_lib_quit(void);
 #endif
 
 // redefine nginx structs
@@ -341,10 +341,19 @@ main
 
     ccf = (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module);
 
+    /*
+     * an embedded instance always runs the single process cycle,
+     * thread pools and other per-worker state are initialized there
+     */
+
+#if !(NGX_AS_LIB)
+
     if (ccf->master && ngx_process == NGX_PROCESS_SINGLE) {
         ngx_process = NGX_PROCESS_MASTER;
     }
 
+#endif
+
 #if !(NGX_WIN32)
 
     if (ngx_init_signals(cycle->log) != NGX_OK) {
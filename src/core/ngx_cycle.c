@@ -11,6 +11,9 @@
 
 
 static void ngx_destroy_cycle_pools(ngx_conf_t *conf);
+static ngx_int_t ngx_create_shared_memory(ngx_cycle_t *cycle,
+    ngx_shm_zone_t *shm_zone, void *data);
+static void ngx_free_shared_memory(ngx_shm_zone_t *shm_zone);
 static ngx_int_t ngx_init_zone_pool(ngx_cycle_t *cycle,
     ngx_shm_zone_t *shm_zone);
 static ngx_int_t ngx_test_lockfile(u_char *file, ngx_log_t *log);
@@ -25,6 +28,23 @@ static ngx_pool_t     *ngx_temp_pool;
 static ngx_event_t     ngx_cleaner_event;
 static ngx_event_t     ngx_shutdown_event;
 
+#if (NGX_AS_LIB)
+
+/*
+ * embedded instances run as threads of a single process; zones marked
+ * with the "process" flag are mapped once and shared by all instances.
+ * The zones are matched by name and size only, as each instance has its
+ * own copy of the library and hence its own module tags.
+ */
+
+struct ngx_process_zone_s {
+    ngx_process_zone_t    *next;
+    ngx_shm_t              shm;
+    ngx_uint_t             count;
+};
+
+#endif
+
 ngx_uint_t             ngx_test_config;
 ngx_uint_t             ngx_dump_config;
 ngx_uint_t             ngx_quiet_mode;
@@ -488,15 +508,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             break;
         }
 
-        if (ngx_shm_alloc(&shm_zone[i].shm) != NGX_OK) {
-            goto failed;
-        }
-
-        if (ngx_init_zone_pool(cycle, &shm_zone[i]) != NGX_OK) {
-            goto failed;
-        }
-
-        if (shm_zone[i].init(&shm_zone[i], data) != NGX_OK) {
+        if (ngx_create_shared_memory(cycle, &shm_zone[i], data) != NGX_OK) {
             goto failed;
         }
 
@@ -698,7 +710,7 @@ ngx_init_cycle(ngx_cycle_t *old_cycle)
             break;
         }
 
-        ngx_shm_free(&oshm_zone[i].shm);
+        ngx_free_shared_memory(&oshm_zone[i]);
 
     live_shm_zone:
 
@@ -915,7 +927,7 @@ failed:
             break;
         }
 
-        ngx_shm_free(&shm_zone[i].shm);
+        ngx_free_shared_memory(&shm_zone[i]);
 
     old_shm_zone_found:
 
@@ -954,6 +966,152 @@ ngx_destroy_cycle_pools(ngx_conf_t *conf)
 }
 
 
+static ngx_int_t
+ngx_create_shared_memory(ngx_cycle_t *cycle, ngx_shm_zone_t *shm_zone,
+    void *data)
+{
+#if (NGX_AS_LIB)
+    ngx_int_t             rc;
+    ngx_process_zone_t   *pz;
+    ngx_as_lib_shared_t  *shared;
+
+    shared = ngx_as_lib_shared();
+
+    if (shm_zone->process && shared) {
+
+        /* the lock is held until the zone is initialized */
+
+        ngx_spinlock(&shared->lock, 1, 2048);
+
+        for (pz = shared->zones; pz; pz = pz->next) {
+
+            if (pz->shm.size == shm_zone->shm.size
+                && pz->shm.name.len == shm_zone->shm.name.len
+                && ngx_strncmp(pz->shm.name.data, shm_zone->shm.name.data,
+                               pz->shm.name.len)
+                   == 0)
+            {
+                break;
+            }
+        }
+
+        if (pz) {
+            shm_zone->shm.addr = pz->shm.addr;
+            shm_zone->shm.exists = 1;
+
+            rc = ngx_init_zone_pool(cycle, shm_zone);
+
+            if (rc == NGX_OK) {
+                rc = shm_zone->init(shm_zone, data);
+            }
+
+            if (rc == NGX_OK) {
+                pz->count++;
+
+                ngx_log_debug2(NGX_LOG_DEBUG_CORE, cycle->log, 0,
+                               "shared zone \"%V\" is used by %ui instances",
+                               &shm_zone->shm.name, pz->count);
+
+            } else {
+                shm_zone->shm.addr = NULL;
+            }
+
+            ngx_unlock(&shared->lock);
+
+            return rc;
+        }
+
+        pz = ngx_alloc(sizeof(ngx_process_zone_t) + shm_zone->shm.name.len,
+                       cycle->log);
+        if (pz == NULL) {
+            ngx_unlock(&shared->lock);
+            return NGX_ERROR;
+        }
+
+        if (ngx_shm_alloc(&shm_zone->shm) != NGX_OK) {
+            ngx_unlock(&shared->lock);
+            ngx_free(pz);
+            return NGX_ERROR;
+        }
+
+        if (ngx_init_zone_pool(cycle, shm_zone) != NGX_OK
+            || shm_zone->init(shm_zone, data) != NGX_OK)
+        {
+            ngx_unlock(&shared->lock);
+            ngx_shm_free(&shm_zone->shm);
+            shm_zone->shm.addr = NULL;
+            ngx_free(pz);
+            return NGX_ERROR;
+        }
+
+        pz->shm = shm_zone->shm;
+        pz->shm.name.data = (u_char *) pz + sizeof(ngx_process_zone_t);
+        ngx_memcpy(pz->shm.name.data, shm_zone->shm.name.data,
+                   shm_zone->shm.name.len);
+        pz->count = 1;
+
+        pz->next = shared->zones;
+        shared->zones = pz;
+
+        ngx_unlock(&shared->lock);
+
+        return NGX_OK;
+    }
+
+#endif
+
+    if (ngx_shm_alloc(&shm_zone->shm) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_init_zone_pool(cycle, shm_zone) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return shm_zone->init(shm_zone, data);
+}
+
+
+static void
+ngx_free_shared_memory(ngx_shm_zone_t *shm_zone)
+{
+#if (NGX_AS_LIB)
+    ngx_process_zone_t   *pz, **ppz;
+    ngx_as_lib_shared_t  *shared;
+
+    shared = ngx_as_lib_shared();
+
+    if (shm_zone->process && shared) {
+
+        ngx_spinlock(&shared->lock, 1, 2048);
+
+        for (ppz = &shared->zones; *ppz; ppz = &(*ppz)->next) {
+            pz = *ppz;
+
+            if (pz->shm.addr != shm_zone->shm.addr) {
+                continue;
+            }
+
+            if (--pz->count) {
+                ngx_unlock(&shared->lock);
+                return;
+            }
+
+            *ppz = pz->next;
+            ngx_free(pz);
+
+            break;
+        }
+
+        ngx_unlock(&shared->lock);
+    }
+
+#endif
+
+    ngx_shm_free(&shm_zone->shm);
+}
+
+
 static ngx_int_t
 ngx_init_zone_pool(ngx_cycle_t *cycle, ngx_shm_zone_t *zn)
 {
@@ -1363,6 +1521,7 @@ ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, void *tag)
     shm_zone->init = NULL;
     shm_zone->tag = tag;
     shm_zone->noreuse = 0;
+    shm_zone->process = 0;
 
     return shm_zone;
 }
@@ -33,9 +33,28 @@ struct ngx_shm_zone_s {
     void                     *tag;
     void                     *sync;
     ngx_uint_t                noreuse;  /* unsigned  noreuse:1; */
+    ngx_uint_t                process;  /* unsigned  process:1; */
 };
 
 
+#if (NGX_AS_LIB)
+
+/*
+ * every embedded instance runs its own copy of the library, so the state
+ * shared by instances is allocated by the host and passed with the upcall
+ */
+
+typedef struct ngx_process_zone_s  ngx_process_zone_t;
+
+typedef struct {
+    ngx_atomic_t              lock;
+    ngx_process_zone_t       *zones;
+    void                     *quic_routes;
+} ngx_as_lib_shared_t;
+
+#endif
+
+
 struct ngx_cycle_s {
     void                  ****conf_ctx;
     ngx_pool_t               *pool;
@@ -136,6 +155,9 @@ ngx_cpuset_t *ngx_get_cpu_affinity(ngx_uint_t n);
 ngx_shm_zone_t *ngx_shared_memory_add(ngx_conf_t *cf, ngx_str_t *name,
     size_t size, void *tag);
 void ngx_set_shutdown_timer(ngx_cycle_t *cycle);
+#if (NGX_AS_LIB)
+ngx_as_lib_shared_t *ngx_as_lib_shared(void);
+#endif
 
 
 extern volatile ngx_cycle_t  *ngx_cycle;
@@ -45,6 +45,7 @@ struct ngx_file_s {
 typedef ngx_msec_t (*ngx_path_manager_pt) (void *data);
 typedef ngx_msec_t (*ngx_path_purger_pt) (void *data);
 typedef void (*ngx_path_loader_pt) (void *data);
+typedef void (*ngx_path_saver_pt) (void *data);
 
 
 typedef struct {
@@ -55,8 +56,13 @@ typedef struct {
     ngx_path_manager_pt        manager;
     ngx_path_purger_pt         purger;
     ngx_path_loader_pt         loader;
+    ngx_path_saver_pt          saver;
     void                      *data;
 
+#if (NGX_THREADS)
+    ngx_thread_pool_t         *thread_pool;
+#endif
+
     u_char                    *conf_file;
     ngx_uint_t                 line;
 } ngx_path_t;
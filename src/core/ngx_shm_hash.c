@@ -0,0 +1,526 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+/*
+ * The table is an array of buckets of NGX_SHM_HASH_WAYS fixed-size slots.
+ * A key is mapped to exactly one bucket.  The bucket header occupies
+ * a cache line and keeps hashes of all the slots, so a lookup usually
+ * touches the header and the matching slot only.
+ *
+ * If all slots of a bucket are in use and none of them can be evicted,
+ * an overflow bucket is linked to it, so the capacity of the table is
+ * only limited by the zone size.  Overflow buckets are carved from slab
+ * pages and are never freed: lockless readers may follow the chain at
+ * any time.  The whole chain is protected by the lock of the first bucket.
+ *
+ * Keys longer than key_size are allocated from the slab pool, and
+ * the slot keeps a pointer to them.
+ *
+ * The bucket lock is a sequence lock: an unlocked bucket keeps an even
+ * sequence number in it, and a writer replaces the number with its pid
+ * shifted left and ORed with 1.  On unlock, the number is incremented
+ * by 2 and stored back.  Readers copy the value without locking and
+ * retry if the lock has changed meanwhile.  Long keys are only compared
+ * under the lock, as they may be freed by a writer.  The pid allows
+ * the master process to release locks held by a crashed worker.
+ *
+ * When a bucket is full, a slot is evicted with the CLOCK algorithm:
+ * a hit sets the slot reference bit, and the bucket hand skips and clears
+ * referenced slots.  The reference bits are updated atomically, since
+ * lockless readers set them too.
+ */
+
+
+#define ngx_shm_hash_slot(hash, bucket, i)                                    \
+    ((ngx_shm_hash_slot_t *) ((u_char *) (bucket) + (hash)->bucket_size       \
+                              - (NGX_SHM_HASH_WAYS - (i)) * (hash)->slot_size))
+
+#define ngx_shm_hash_slot_data(slot)                                          \
+    ((u_char **) ngx_align_ptr((slot)->key, sizeof(u_char *)))
+
+#define ngx_shm_hash_locked(pid)                                              \
+    (((ngx_atomic_uint_t) (pid) << 1) | 1)
+
+
+static ngx_int_t ngx_shm_hash_lookup(ngx_shm_hash_t *hash,
+    ngx_shm_hash_bucket_t **bucket, uint32_t key, ngx_str_t *name);
+static ngx_shm_hash_bucket_t *ngx_shm_hash_alloc_bucket(ngx_shm_hash_t *hash);
+static void ngx_shm_hash_ref(ngx_shm_hash_bucket_t *bucket, ngx_uint_t i,
+    ngx_uint_t on);
+static void ngx_shm_hash_free_key(ngx_shm_hash_t *hash,
+    ngx_shm_hash_slot_t *slot);
+
+
+ngx_shm_hash_t *
+ngx_shm_hash_create(ngx_slab_pool_t *shpool, size_t size, size_t key_size,
+    size_t value_size)
+{
+    u_char          *p;
+    ngx_uint_t       n;
+    ngx_shm_hash_t  *hash;
+
+    if (key_size < 16) {
+        key_size = 16;
+    }
+
+    p = ngx_slab_alloc(shpool, size);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    hash = (ngx_shm_hash_t *) p;
+
+    hash->shpool = shpool;
+    hash->next = shpool->hashes;
+    hash->free = NULL;
+    hash->key_size = key_size;
+    hash->value_size = value_size;
+    hash->value_offset = ngx_align(offsetof(ngx_shm_hash_slot_t, key)
+                                   + key_size, NGX_ALIGNMENT);
+    hash->slot_size = ngx_align(hash->value_offset + value_size,
+                                ngx_cacheline_size);
+    hash->bucket_size = ngx_align(sizeof(ngx_shm_hash_bucket_t),
+                                  ngx_cacheline_size)
+                        + NGX_SHM_HASH_WAYS * hash->slot_size;
+
+    hash->buckets = ngx_align_ptr(p + sizeof(ngx_shm_hash_t),
+                                  ngx_cacheline_size);
+
+    n = (p + size - hash->buckets) / hash->bucket_size;
+
+    if (n == 0) {
+        ngx_slab_free(shpool, p);
+        return NULL;
+    }
+
+    hash->nbuckets = n;
+
+    ngx_memzero(hash->buckets, n * hash->bucket_size);
+
+    shpool->hashes = hash;
+
+    return hash;
+}
+
+
+void
+ngx_shm_hash_lock(ngx_shm_hash_bucket_t *bucket)
+{
+    ngx_uint_t         i, n;
+    ngx_atomic_uint_t  lock;
+
+    for ( ;; ) {
+
+        lock = bucket->lock;
+
+        if ((lock & 1) == 0
+            && ngx_atomic_cmp_set(&bucket->lock, lock,
+                                  ngx_shm_hash_locked(ngx_pid)))
+        {
+            return;
+        }
+
+        if (ngx_ncpu > 1) {
+
+            for (n = 1; n < 2048; n <<= 1) {
+
+                for (i = 0; i < n; i++) {
+                    ngx_cpu_pause();
+                }
+
+                lock = bucket->lock;
+
+                if ((lock & 1) == 0
+                    && ngx_atomic_cmp_set(&bucket->lock, lock,
+                                          ngx_shm_hash_locked(ngx_pid)))
+                {
+                    return;
+                }
+            }
+        }
+
+        ngx_sched_yield();
+    }
+}
+
+
+void
+ngx_shm_hash_unlock(ngx_shm_hash_bucket_t *bucket)
+{
+    bucket->seq += 2;
+
+    (void) ngx_atomic_cmp_set(&bucket->lock, ngx_shm_hash_locked(ngx_pid),
+                              bucket->seq);
+}
+
+
+ngx_uint_t
+ngx_shm_hash_force_unlock(ngx_slab_pool_t *shpool, ngx_pid_t pid)
+{
+    ngx_uint_t              i, n;
+    ngx_shm_hash_t         *hash;
+    ngx_shm_hash_bucket_t  *bucket;
+
+    n = 0;
+
+    for (hash = shpool->hashes; hash; hash = hash->next) {
+
+        for (i = 0; i < hash->nbuckets; i++) {
+
+            bucket = (ngx_shm_hash_bucket_t *)
+                         (hash->buckets + i * hash->bucket_size);
+
+            if (bucket->lock != ngx_shm_hash_locked(pid)) {
+                continue;
+            }
+
+            /*
+             * the bucket may be left inconsistent, much like data
+             * protected by a mutex, but readers are not stuck anymore
+             */
+
+            bucket->seq += 2;
+
+            if (ngx_atomic_cmp_set(&bucket->lock, ngx_shm_hash_locked(pid),
+                                   bucket->seq))
+            {
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
+
+
+void *
+ngx_shm_hash_find_locked(ngx_shm_hash_t *hash, ngx_shm_hash_bucket_t *bucket,
+    uint32_t key, ngx_str_t *name)
+{
+    ngx_int_t  i;
+
+    i = ngx_shm_hash_lookup(hash, &bucket, key, name);
+
+    if (i == NGX_DECLINED) {
+        return NULL;
+    }
+
+    ngx_shm_hash_ref(bucket, i, 1);
+
+    return (u_char *) ngx_shm_hash_slot(hash, bucket, i) + hash->value_offset;
+}
+
+
+void *
+ngx_shm_hash_insert_locked(ngx_shm_hash_t *hash, ngx_shm_hash_bucket_t *bucket,
+    uint32_t key, ngx_str_t *name, ngx_shm_hash_evict_pt evict, void *data)
+{
+    u_char                 *p, *value;
+    ngx_uint_t              i, n;
+    ngx_shm_hash_slot_t    *slot;
+    ngx_shm_hash_bucket_t  *b, *last;
+
+    p = NULL;
+
+    if (name->len > hash->key_size) {
+        p = ngx_slab_alloc(hash->shpool, name->len);
+        if (p == NULL) {
+            return NULL;
+        }
+
+        ngx_memcpy(p, name->data, name->len);
+    }
+
+    last = NULL;
+
+    for (b = bucket; b; b = b->next) {
+
+        for (i = 0; i < NGX_SHM_HASH_WAYS; i++) {
+            if (!(b->used & (1 << i))) {
+                goto found;
+            }
+        }
+
+        last = b;
+    }
+
+    for (b = bucket; b; b = b->next) {
+
+        for (n = 0; n < 2 * NGX_SHM_HASH_WAYS; n++) {
+
+            i = b->hand;
+            b->hand = (i + 1) % NGX_SHM_HASH_WAYS;
+
+            if (b->refs & ((ngx_atomic_uint_t) 1 << i)) {
+                ngx_shm_hash_ref(b, i, 0);
+                continue;
+            }
+
+            value = (u_char *) ngx_shm_hash_slot(hash, b, i)
+                    + hash->value_offset;
+
+            if (evict && evict(hash, value, data) != NGX_OK) {
+                continue;
+            }
+
+            ngx_shm_hash_free_key(hash, ngx_shm_hash_slot(hash, b, i));
+
+            goto found;
+        }
+    }
+
+    b = ngx_shm_hash_alloc_bucket(hash);
+
+    if (b) {
+        i = 0;
+
+        /* the bucket is zeroed before it is seen by readers */
+
+        ngx_memory_barrier();
+
+        last->next = b;
+
+        goto found;
+    }
+
+    if (p) {
+        ngx_slab_free(hash->shpool, p);
+    }
+
+    return NULL;
+
+found:
+
+    slot = ngx_shm_hash_slot(hash, b, i);
+
+    slot->len = (u_short) name->len;
+
+    if (p) {
+        *ngx_shm_hash_slot_data(slot) = p;
+
+    } else {
+        ngx_memcpy(slot->key, name->data, name->len);
+    }
+
+    b->hash[i] = key;
+    b->used |= 1 << i;
+
+    ngx_shm_hash_ref(b, i, 0);
+
+    return (u_char *) slot + hash->value_offset;
+}
+
+
+void
+ngx_shm_hash_delete_locked(ngx_shm_hash_t *hash, ngx_shm_hash_bucket_t *bucket,
+    void *value)
+{
+    ngx_uint_t  i;
+
+    while ((u_char *) value < (u_char *) bucket
+           || (u_char *) value >= (u_char *) bucket + hash->bucket_size)
+    {
+        bucket = bucket->next;
+    }
+
+    i = ((u_char *) value - hash->value_offset
+         - (u_char *) ngx_shm_hash_slot(hash, bucket, 0))
+        / hash->slot_size;
+
+    ngx_shm_hash_free_key(hash, ngx_shm_hash_slot(hash, bucket, i));
+
+    bucket->used &= ~(1 << i);
+
+    ngx_shm_hash_ref(bucket, i, 0);
+}
+
+
+ngx_int_t
+ngx_shm_hash_read(ngx_shm_hash_t *hash, uint32_t key, ngx_str_t *name,
+    void *value)
+{
+    ngx_int_t               i;
+    ngx_atomic_uint_t       lock;
+    ngx_shm_hash_bucket_t  *bucket, *b;
+
+    bucket = ngx_shm_hash_bucket(hash, key);
+
+    if (name->len > hash->key_size) {
+        ngx_shm_hash_lock(bucket);
+
+        b = bucket;
+
+        i = ngx_shm_hash_lookup(hash, &b, key, name);
+
+        if (i != NGX_DECLINED) {
+            ngx_memcpy(value, (u_char *) ngx_shm_hash_slot(hash, b, i)
+                              + hash->value_offset,
+                       hash->value_size);
+
+            ngx_shm_hash_ref(b, i, 1);
+        }
+
+        ngx_shm_hash_unlock(bucket);
+
+        return (i == NGX_DECLINED) ? NGX_DECLINED : NGX_OK;
+    }
+
+    for ( ;; ) {
+
+        lock = bucket->lock;
+
+        if (lock & 1) {
+
+            if (ngx_ncpu > 1) {
+                ngx_cpu_pause();
+
+            } else {
+                ngx_sched_yield();
+            }
+
+            continue;
+        }
+
+        ngx_memory_barrier();
+
+        b = bucket;
+
+        i = ngx_shm_hash_lookup(hash, &b, key, name);
+
+        if (i != NGX_DECLINED) {
+            ngx_memcpy(value, (u_char *) ngx_shm_hash_slot(hash, b, i)
+                              + hash->value_offset,
+                       hash->value_size);
+        }
+
+        ngx_memory_barrier();
+
+        if (bucket->lock == lock) {
+            break;
+        }
+    }
+
+    if (i == NGX_DECLINED) {
+        return NGX_DECLINED;
+    }
+
+    ngx_shm_hash_ref(b, i, 1);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_shm_hash_lookup(ngx_shm_hash_t *hash, ngx_shm_hash_bucket_t **bucket,
+    uint32_t key, ngx_str_t *name)
+{
+    u_char                 *data;
+    ngx_uint_t              i;
+    ngx_shm_hash_slot_t    *slot;
+    ngx_shm_hash_bucket_t  *b;
+
+    for (b = *bucket; b; b = b->next) {
+
+        for (i = 0; i < NGX_SHM_HASH_WAYS; i++) {
+
+            if (!(b->used & (1 << i)) || b->hash[i] != key) {
+                continue;
+            }
+
+            slot = ngx_shm_hash_slot(hash, b, i);
+
+            if (slot->len != name->len) {
+                continue;
+            }
+
+            data = (slot->len > hash->key_size) ? *ngx_shm_hash_slot_data(slot)
+                                                : slot->key;
+
+            if (ngx_memcmp(data, name->data, name->len) == 0) {
+                *bucket = b;
+                return i;
+            }
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_shm_hash_bucket_t *
+ngx_shm_hash_alloc_bucket(ngx_shm_hash_t *hash)
+{
+    u_char                 *p;
+    ngx_uint_t              i, n;
+    ngx_shm_hash_bucket_t  *b;
+
+    ngx_shmtx_lock(&hash->shpool->mutex);
+
+    if (hash->free == NULL) {
+
+        /* overflow buckets are allocated a page at a time */
+
+        n = ngx_pagesize / hash->bucket_size;
+
+        if (n == 0) {
+            n = 1;
+        }
+
+        p = ngx_slab_alloc_locked(hash->shpool, n * hash->bucket_size);
+
+        if (p == NULL) {
+            ngx_shmtx_unlock(&hash->shpool->mutex);
+            return NULL;
+        }
+
+        for (i = 0; i < n; i++) {
+            b = (ngx_shm_hash_bucket_t *) (p + i * hash->bucket_size);
+            b->next = hash->free;
+            hash->free = b;
+        }
+    }
+
+    b = hash->free;
+    hash->free = b->next;
+
+    ngx_shmtx_unlock(&hash->shpool->mutex);
+
+    ngx_memzero(b, hash->bucket_size);
+
+    return b;
+}
+
+
+static void
+ngx_shm_hash_ref(ngx_shm_hash_bucket_t *bucket, ngx_uint_t i, ngx_uint_t on)
+{
+    ngx_atomic_uint_t  old, new, bit;
+
+    bit = (ngx_atomic_uint_t) 1 << i;
+
+    for ( ;; ) {
+        old = bucket->refs;
+        new = on ? (old | bit) : (old & ~bit);
+
+        if (old == new || ngx_atomic_cmp_set(&bucket->refs, old, new)) {
+            return;
+        }
+    }
+}
+
+
+static void
+ngx_shm_hash_free_key(ngx_shm_hash_t *hash, ngx_shm_hash_slot_t *slot)
+{
+    if (slot->len > hash->key_size) {
+        ngx_slab_free(hash->shpool, *ngx_shm_hash_slot_data(slot));
+        slot->len = 0;
+    }
+}
@@ -0,0 +1,81 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_SHM_HASH_H_INCLUDED_
+#define _NGX_SHM_HASH_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_SHM_HASH_WAYS  8
+
+
+typedef struct ngx_shm_hash_bucket_s  ngx_shm_hash_bucket_t;
+
+struct ngx_shm_hash_bucket_s {
+    ngx_atomic_t              lock;
+    ngx_atomic_t              refs;
+    ngx_shm_hash_bucket_t    *next;
+    uint32_t                  hash[NGX_SHM_HASH_WAYS];
+    u_char                    used;
+    u_char                    hand;
+    uint32_t                  seq;
+};
+
+
+typedef struct {
+    u_short                   len;
+    u_char                    key[1];
+} ngx_shm_hash_slot_t;
+
+
+struct ngx_shm_hash_s {
+    ngx_slab_pool_t          *shpool;
+    ngx_shm_hash_t           *next;
+    ngx_shm_hash_bucket_t    *free;
+    u_char                   *buckets;
+    ngx_uint_t                nbuckets;
+    size_t                    bucket_size;
+    size_t                    slot_size;
+    size_t                    key_size;
+    size_t                    value_size;
+    size_t                    value_offset;
+};
+
+
+typedef ngx_int_t (*ngx_shm_hash_evict_pt)(ngx_shm_hash_t *hash, void *value,
+    void *data);
+
+
+#define ngx_shm_hash_key(data, len)  ngx_crc32_short(data, len)
+
+#define ngx_shm_hash_bucket(hash, key)                                        \
+    ((ngx_shm_hash_bucket_t *) ((hash)->buckets                               \
+        + (((uint64_t) (key) * (hash)->nbuckets) >> 32) * (hash)->bucket_size))
+
+
+ngx_shm_hash_t *ngx_shm_hash_create(ngx_slab_pool_t *shpool, size_t size,
+    size_t key_size, size_t value_size);
+
+void ngx_shm_hash_lock(ngx_shm_hash_bucket_t *bucket);
+void ngx_shm_hash_unlock(ngx_shm_hash_bucket_t *bucket);
+ngx_uint_t ngx_shm_hash_force_unlock(ngx_slab_pool_t *shpool, ngx_pid_t pid);
+
+void *ngx_shm_hash_find_locked(ngx_shm_hash_t *hash,
+    ngx_shm_hash_bucket_t *bucket, uint32_t key, ngx_str_t *name);
+void *ngx_shm_hash_insert_locked(ngx_shm_hash_t *hash,
+    ngx_shm_hash_bucket_t *bucket, uint32_t key, ngx_str_t *name,
+    ngx_shm_hash_evict_pt evict, void *data);
+void ngx_shm_hash_delete_locked(ngx_shm_hash_t *hash,
+    ngx_shm_hash_bucket_t *bucket, void *value);
+
+ngx_int_t ngx_shm_hash_read(ngx_shm_hash_t *hash, uint32_t key,
+    ngx_str_t *name, void *value);
+
+
+#endif /* _NGX_SHM_HASH_H_INCLUDED_ */
@@ -165,6 +165,56 @@ ngx_slab_init(ngx_slab_pool_t *pool)
 }
 
 
+ngx_slab_pool_t *
+ngx_slab_create_pool(ngx_slab_pool_t *parent, size_t size)
+{
+    u_char           *p, *file;
+    ngx_slab_pool_t  *pool;
+
+    size = ngx_align(size, ngx_pagesize);
+
+    if (size < 2 * ngx_pagesize) {
+        return NULL;
+    }
+
+    p = ngx_slab_alloc(parent, size);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    /*
+     * the pool is carved out of the parent's pages, so it has
+     * its own mutex and can be used without taking the parent's one
+     */
+
+    pool = (ngx_slab_pool_t *) p;
+
+    ngx_memzero(pool, sizeof(ngx_slab_pool_t));
+
+    pool->end = p + size;
+    pool->min_shift = parent->min_shift;
+    pool->addr = p;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+    file = NULL;
+#else
+    file = parent->mutex.name;
+#endif
+
+    if (ngx_shmtx_create(&pool->mutex, &pool->lock, file) != NGX_OK) {
+        ngx_slab_free(parent, p);
+        return NULL;
+    }
+
+    ngx_slab_init(pool);
+
+    pool->log_nomem = parent->log_nomem;
+    pool->log_ctx = parent->log_ctx;
+
+    return pool;
+}
+
+
 void *
 ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size)
 {
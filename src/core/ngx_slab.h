@@ -56,11 +56,14 @@ typedef struct {
 
     void             *data;
     void             *addr;
+
+    ngx_shm_hash_t   *hashes;
 } ngx_slab_pool_t;
 
 
 void ngx_slab_sizes_init(void);
 void ngx_slab_init(ngx_slab_pool_t *pool);
+ngx_slab_pool_t *ngx_slab_create_pool(ngx_slab_pool_t *parent, size_t size);
 void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
@@ -138,6 +138,7 @@ static ngx_uint_t           nevents;
 static int                  notify_fd = -1;
 static ngx_event_t          notify_event;
 static ngx_connection_t     notify_conn;
+static ngx_atomic_t         notify_handler;
 #endif
 
 #if (NGX_HAVE_FILE_AIO)
@@ -452,9 +453,21 @@ ngx_epoll_notify_handler(ngx_event_t *ev)
         }
     }
 
-    handler = ev->data;
-    if (handler)
+    /*
+     * the handler is taken atomically, so that a wake-up without
+     * a handler, ngx_notify(NULL), does not run a stale one, while
+     * a handler stored by another thread just before is not lost
+     */
+
+    do {
+        handler = (ngx_event_handler_pt) notify_handler;
+    } while (handler
+             && !ngx_atomic_cmp_set(&notify_handler,
+                                    (ngx_atomic_uint_t) handler, 0));
+
+    if (handler) {
         handler(ev);
+    }
 }
 
 #endif
@@ -790,7 +803,7 @@ ngx_epoll_notify(ngx_event_handler_pt handler)
     static uint64_t inc = 1;
 
     if (handler) {
-        notify_event.data = handler;
+        notify_handler = (ngx_atomic_uint_t) handler;
     }
 
     if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
@@ -822,7 +835,6 @@ ngx_epoll_process_events(ngx_cycle_t *cycle, ngx_msec_t timer, ngx_uint_t flags)
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
                    "epoll timer: %M", timer);
 
-    notify_event.data = NULL; // clear last notify event handler
     events = epoll_wait(ep, event_list, (int) nevents, timer);
 
     err = (events == -1) ? ngx_errno : 0;
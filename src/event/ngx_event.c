@@ -74,6 +74,10 @@ static ngx_atomic_t   ngx_stat_writing0;
 ngx_atomic_t         *ngx_stat_writing = &ngx_stat_writing0;
 static ngx_atomic_t   ngx_stat_waiting0;
 ngx_atomic_t         *ngx_stat_waiting = &ngx_stat_waiting0;
+static ngx_atomic_t   ngx_stat_ktls_send0;
+ngx_atomic_t         *ngx_stat_ktls_send = &ngx_stat_ktls_send0;
+static ngx_atomic_t   ngx_stat_ktls_recv0;
+ngx_atomic_t         *ngx_stat_ktls_recv = &ngx_stat_ktls_recv0;
 
 #endif
 
@@ -571,7 +575,9 @@ ngx_event_module_init(ngx_cycle_t *cycle)
            + cl          /* ngx_stat_active */
            + cl          /* ngx_stat_reading */
            + cl          /* ngx_stat_writing */
-           + cl;         /* ngx_stat_waiting */
+           + cl          /* ngx_stat_waiting */
+           + cl          /* ngx_stat_ktls_send */
+           + cl;         /* ngx_stat_ktls_recv */
 
 #endif
 
@@ -618,6 +624,8 @@ ngx_event_module_init(ngx_cycle_t *cycle)
     ngx_stat_reading = (ngx_atomic_t *) (shared + 7 * cl);
     ngx_stat_writing = (ngx_atomic_t *) (shared + 8 * cl);
     ngx_stat_waiting = (ngx_atomic_t *) (shared + 9 * cl);
+    ngx_stat_ktls_send = (ngx_atomic_t *) (shared + 10 * cl);
+    ngx_stat_ktls_recv = (ngx_atomic_t *) (shared + 11 * cl);
 
 #endif
 
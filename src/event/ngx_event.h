@@ -474,6 +474,8 @@ extern ngx_atomic_t  *ngx_stat_active;
 extern ngx_atomic_t  *ngx_stat_reading;
 extern ngx_atomic_t  *ngx_stat_writing;
 extern ngx_atomic_t  *ngx_stat_waiting;
+extern ngx_atomic_t  *ngx_stat_ktls_send;
+extern ngx_atomic_t  *ngx_stat_ktls_recv;
 
 #endif
 
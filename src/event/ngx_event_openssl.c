@@ -9,6 +9,10 @@
 #include <ngx_core.h>
 #include <ngx_event.h>
 
+#if (NGX_SSL_ASYNC)
+#include <ngx_thread_pool.h>
+#endif
+
 
 #define NGX_SSL_PASSWORD_BUFFER_SIZE  4096
 
@@ -18,6 +22,32 @@ typedef struct {
 } ngx_openssl_conf_t;
 
 
+#if (NGX_SSL_ASYNC)
+
+#define NGX_SSL_ASYNC_RSA_ENC  0
+#define NGX_SSL_ASYNC_RSA_DEC  1
+#define NGX_SSL_ASYNC_ECDSA    2
+
+
+typedef struct {
+    ngx_thread_task_t           task;
+    ngx_connection_t           *connection;
+    ngx_ssl_conn_t             *ssl_conn;
+    ngx_uint_t                  op;
+    void                       *key;
+    int                         type;
+    int                         padding;
+    int                         rc;
+    unsigned int                siglen;
+    size_t                      len;
+    ngx_uint_t                  done;      /* unsigned  done:1; */
+    u_char                     *out;
+    u_char                      in[1];
+} ngx_ssl_async_t;
+
+#endif
+
+
 static ngx_inline ngx_int_t ngx_ssl_cert_already_in_hash(void);
 static int ngx_ssl_verify_callback(int ok, X509_STORE_CTX *x509_store);
 static void ngx_ssl_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
@@ -31,6 +61,37 @@ static int ngx_ssl_new_client_session(ngx_ssl_conn_t *ssl_conn,
 static ngx_int_t ngx_ssl_try_early_data(ngx_connection_t *c);
 #endif
 static void ngx_ssl_handshake_handler(ngx_event_t *ev);
+#if (NGX_SSL_ASYNC)
+static ngx_int_t ngx_ssl_async_methods(ngx_log_t *log);
+static ngx_int_t ngx_ssl_async_rsa_kx(ngx_conf_t *cf, ngx_ssl_t *ssl);
+static ngx_int_t ngx_ssl_async_key(ngx_ssl_t *ssl, EVP_PKEY *pkey,
+    EVP_PKEY **key);
+static int ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding);
+static int ngx_ssl_async_rsa(ngx_uint_t op, int flen,
+    const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+#ifndef OPENSSL_NO_EC
+static int ngx_ssl_async_ecdsa_sign(int type, const unsigned char *dgst,
+    int dlen, unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey);
+#endif
+static ngx_ssl_async_t *ngx_ssl_async_alloc(ngx_uint_t op,
+    const unsigned char *in, size_t len, size_t size);
+static ngx_int_t ngx_ssl_async_run(ngx_ssl_async_t *a);
+static void ngx_ssl_async_thread_handler(void *data, ngx_log_t *log);
+static void ngx_ssl_async_event_handler(ngx_event_t *ev);
+static void ngx_ssl_async_cleanup(ngx_connection_t *c);
+static void ngx_ssl_async_finalize(ngx_ssl_conn_t *ssl_conn);
+static void ngx_ssl_async_info_callback(const ngx_ssl_conn_t *ssl_conn,
+    int where, int ret);
+#endif
+static void ngx_ssl_ktls_init(ngx_connection_t *c);
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+static ssize_t ngx_ssl_recv_ktls(ngx_connection_t *c, u_char *buf,
+    size_t size);
+#endif
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 static ssize_t ngx_ssl_recv_early(ngx_connection_t *c, u_char *buf,
     size_t size);
@@ -59,10 +120,11 @@ static ngx_ssl_session_t *ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy);
 static void ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess);
-static void ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n);
-static void ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_ssl_session_class(size_t len);
+static void ngx_ssl_delete_session(ngx_ssl_session_cache_t *cache,
+    ngx_str_t *id);
+static ngx_int_t ngx_ssl_evict_session(ngx_shm_hash_t *hash, void *value,
+    void *data);
 
 #ifdef SSL_CTRL_SET_TLSEXT_TICKET_KEY_CB
 static int ngx_ssl_ticket_key_callback(ngx_ssl_conn_t *ssl_conn,
@@ -123,6 +185,17 @@ ngx_module_t  ngx_openssl_module = {
 };
 
 
+#if (NGX_SSL_ASYNC)
+
+static RSA_METHOD        *ngx_ssl_async_rsa_method;
+#ifndef OPENSSL_NO_EC
+static EC_KEY_METHOD     *ngx_ssl_async_ec_method;
+#endif
+static ngx_connection_t  *ngx_ssl_async_connection;
+
+#endif
+
+
 int  ngx_ssl_connection_index;
 int  ngx_ssl_server_conf_index;
 int  ngx_ssl_session_cache_index;
@@ -562,15 +635,16 @@ ngx_ssl_certificate(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *cert,
 
 ngx_int_t
 ngx_ssl_connection_certificate(ngx_connection_t *c, ngx_pool_t *pool,
-    ngx_str_t *cert, ngx_str_t *key, ngx_array_t *passwords)
+    ngx_str_t *cert, ngx_str_t *key, ngx_ssl_cache_t *cache,
+    ngx_array_t *passwords)
 {
     char            *err;
     X509            *x509;
     EVP_PKEY        *pkey;
     STACK_OF(X509)  *chain;
 
-    chain = ngx_ssl_cache_connection_fetch(pool, NGX_SSL_CACHE_CERT, &err,
-                                           cert, NULL);
+    chain = ngx_ssl_cache_connection_fetch(cache, pool, NGX_SSL_CACHE_CERT,
+                                           &err, cert, NULL);
     if (chain == NULL) {
         if (err != NULL) {
             ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
@@ -581,6 +655,16 @@ ngx_ssl_connection_certificate(ngx_connection_t *c, ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
+    /*
+     * OCSP responses are only stapled for cached certificates,
+     * as the staple is kept with the certificate object
+     */
+
+    if (cache && ngx_ssl_connection_stapling(c, chain, cert) != NGX_OK) {
+        sk_X509_pop_free(chain, X509_free);
+        return NGX_ERROR;
+    }
+
     x509 = sk_X509_shift(chain);
 
     if (SSL_use_certificate(c->ssl->connection, x509) == 0) {
@@ -610,8 +694,8 @@ ngx_ssl_connection_certificate(ngx_connection_t *c, ngx_pool_t *pool,
 
 #endif
 
-    pkey = ngx_ssl_cache_connection_fetch(pool, NGX_SSL_CACHE_PKEY, &err,
-                                          key, passwords);
+    pkey = ngx_ssl_cache_connection_fetch(cache, pool, NGX_SSL_CACHE_PKEY,
+                                          &err, key, passwords);
     if (pkey == NULL) {
         if (err != NULL) {
             ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
@@ -1474,6 +1558,340 @@ ngx_ssl_early_data(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
 }
 
 
+ngx_int_t
+ngx_ssl_ktls(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_uint_t enable)
+{
+    if (!enable) {
+        return NGX_OK;
+    }
+
+#ifdef SSL_OP_ENABLE_KTLS
+
+    SSL_CTX_set_options(ssl->ctx, SSL_OP_ENABLE_KTLS);
+
+#else
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "kTLS is not supported on this platform, ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_ssl_async(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_thread_pool_t *tp)
+{
+#if (NGX_SSL_ASYNC)
+
+    int         rc;
+    EVP_PKEY   *pkey, *key;
+    ngx_uint_t  rsa;
+
+    if (tp == NULL) {
+        return NGX_OK;
+    }
+
+    /*
+     * private keys are replaced with copies which use methods
+     * that pass signing and decryption to the thread pool when
+     * called from an asynchronous job
+     */
+
+    if (ngx_ssl_async_methods(ssl->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rsa = 0;
+
+    for (rc = SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_FIRST);
+         rc;
+         rc = SSL_CTX_set_current_cert(ssl->ctx, SSL_CERT_SET_NEXT))
+    {
+        pkey = SSL_CTX_get0_privatekey(ssl->ctx);
+
+        if (pkey == NULL) {
+            continue;
+        }
+
+        switch (ngx_ssl_async_key(ssl, pkey, &key)) {
+
+        case NGX_OK:
+            break;
+
+        case NGX_DECLINED:
+            continue;
+
+        default: /* NGX_ERROR */
+            return NGX_ERROR;
+        }
+
+        if (SSL_CTX_use_PrivateKey(ssl->ctx, key) == 0) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_use_PrivateKey() failed");
+            EVP_PKEY_free(key);
+            return NGX_ERROR;
+        }
+
+        if (EVP_PKEY_base_id(key) == EVP_PKEY_RSA) {
+            rsa = 1;
+        }
+
+        EVP_PKEY_free(key);
+    }
+
+    if (rsa && ngx_ssl_async_rsa_kx(cf, ssl) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ssl->thread_pool = tp;
+
+#else
+
+    if (tp == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "asynchronous handshakes are not supported "
+                  "on this platform, ignored");
+#endif
+
+    return NGX_OK;
+}
+
+
+#if (NGX_SSL_ASYNC)
+
+static ngx_int_t
+ngx_ssl_async_methods(ngx_log_t *log)
+{
+#ifndef OPENSSL_NO_EC
+    int         (*sign_setup)(EC_KEY *eckey, BN_CTX *ctx, BIGNUM **kinv,
+                              BIGNUM **rp);
+    ECDSA_SIG  *(*sign_sig)(const unsigned char *dgst, int dgst_len,
+                            const BIGNUM *in_kinv, const BIGNUM *in_r,
+                            EC_KEY *eckey);
+#endif
+
+    if (ngx_ssl_async_rsa_method == NULL) {
+
+        ngx_ssl_async_rsa_method = RSA_meth_dup(RSA_PKCS1_OpenSSL());
+        if (ngx_ssl_async_rsa_method == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, log, 0, "RSA_meth_dup() failed");
+            return NGX_ERROR;
+        }
+
+        RSA_meth_set1_name(ngx_ssl_async_rsa_method, "nginx async RSA");
+        RSA_meth_set_priv_enc(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_enc);
+        RSA_meth_set_priv_dec(ngx_ssl_async_rsa_method,
+                              ngx_ssl_async_rsa_priv_dec);
+    }
+
+#ifndef OPENSSL_NO_EC
+
+    if (ngx_ssl_async_ec_method == NULL) {
+        ngx_ssl_async_ec_method = EC_KEY_METHOD_new(EC_KEY_OpenSSL());
+        if (ngx_ssl_async_ec_method == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, log, 0,
+                          "EC_KEY_METHOD_new() failed");
+            return NGX_ERROR;
+        }
+
+        EC_KEY_METHOD_get_sign(ngx_ssl_async_ec_method, NULL, &sign_setup,
+                               &sign_sig);
+        EC_KEY_METHOD_set_sign(ngx_ssl_async_ec_method,
+                               ngx_ssl_async_ecdsa_sign, sign_setup,
+                               sign_sig);
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_async_rsa_kx(ngx_conf_t *cf, ngx_ssl_t *ssl)
+{
+#ifdef RSA_PKCS1_WITH_TLS_PADDING
+
+    int                    i, n;
+    size_t                 len;
+    u_char                *p, *list;
+    ngx_uint_t             removed;
+    const char            *name;
+    const SSL_CIPHER      *cipher;
+    STACK_OF(SSL_CIPHER)  *ciphers;
+
+    /*
+     * OpenSSL 3.0 decrypts RSA key exchange with the implicit rejection
+     * padding, which is not supported for keys with custom methods,
+     * so RSA key exchange ciphers are removed from the list
+     */
+
+    ciphers = SSL_CTX_get_ciphers(ssl->ctx);
+
+    if (ciphers == NULL) {
+        return NGX_OK;
+    }
+
+    n = sk_SSL_CIPHER_num(ciphers);
+    len = 0;
+
+    for (i = 0; i < n; i++) {
+        cipher = sk_SSL_CIPHER_value(ciphers, i);
+        len += ngx_strlen(SSL_CIPHER_get_name(cipher)) + 1;
+    }
+
+    list = ngx_pnalloc(cf->pool, len + 1);
+    if (list == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = list;
+    removed = 0;
+
+    for (i = 0; i < n; i++) {
+        cipher = sk_SSL_CIPHER_value(ciphers, i);
+
+        switch (SSL_CIPHER_get_kx_nid(cipher)) {
+
+        case NID_kx_rsa:
+            removed++;
+            continue;
+
+        case NID_kx_any:
+            /* TLSv1.3 ciphers are configured separately */
+            continue;
+        }
+
+        if (p != list) {
+            *p++ = ':';
+        }
+
+        name = SSL_CIPHER_get_name(cipher);
+        p = ngx_cpymem(p, name, ngx_strlen(name));
+    }
+
+    *p = '\0';
+
+    if (removed == 0) {
+        return NGX_OK;
+    }
+
+    if (p == list) {
+        ngx_log_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "no ciphers left for asynchronous handshakes "
+                      "without RSA key exchange");
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, ssl->log, 0,
+                  "%ui RSA key exchange ciphers are disabled "
+                  "for asynchronous handshakes", removed);
+
+    if (SSL_CTX_set_cipher_list(ssl->ctx, (char *) list) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_cipher_list(\"%s\") failed", list);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_async_key(ngx_ssl_t *ssl, EVP_PKEY *pkey, EVP_PKEY **key)
+{
+    RSA     *rsa, *dup;
+#ifndef OPENSSL_NO_EC
+    EC_KEY  *ec, *ecdup;
+#endif
+
+    switch (EVP_PKEY_base_id(pkey)) {
+
+    case EVP_PKEY_RSA:
+
+        rsa = EVP_PKEY_get1_RSA(pkey);
+        if (rsa == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "EVP_PKEY_get1_RSA() failed");
+            return NGX_ERROR;
+        }
+
+        dup = RSAPrivateKey_dup(rsa);
+
+        RSA_free(rsa);
+
+        if (dup == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "RSAPrivateKey_dup() failed");
+            return NGX_ERROR;
+        }
+
+        *key = EVP_PKEY_new();
+
+        if (*key == NULL
+            || RSA_set_method(dup, ngx_ssl_async_rsa_method) == 0
+            || EVP_PKEY_assign_RSA(*key, dup) == 0)
+        {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "cannot set RSA key method");
+            EVP_PKEY_free(*key);
+            RSA_free(dup);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+
+#ifndef OPENSSL_NO_EC
+
+    case EVP_PKEY_EC:
+
+        ec = EVP_PKEY_get1_EC_KEY(pkey);
+        if (ec == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "EVP_PKEY_get1_EC_KEY() failed");
+            return NGX_ERROR;
+        }
+
+        ecdup = EC_KEY_dup(ec);
+
+        EC_KEY_free(ec);
+
+        if (ecdup == NULL) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0, "EC_KEY_dup() failed");
+            return NGX_ERROR;
+        }
+
+        *key = EVP_PKEY_new();
+
+        if (*key == NULL
+            || EC_KEY_set_method(ecdup, ngx_ssl_async_ec_method) == 0
+            || EVP_PKEY_assign_EC_KEY(*key, ecdup) == 0)
+        {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "cannot set EC key method");
+            EVP_PKEY_free(*key);
+            EC_KEY_free(ecdup);
+            return NGX_ERROR;
+        }
+
+        return NGX_OK;
+
+#endif
+
+    default:
+        return NGX_DECLINED;
+    }
+}
+
+#endif
+
+
 ngx_int_t
 ngx_ssl_conf_commands(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_array_t *commands)
 {
@@ -1624,6 +2042,13 @@ ngx_ssl_create_connection(ngx_ssl_t *ssl, ngx_connection_t *c, ngx_uint_t flags)
 #ifdef SSL_OP_NO_RENEGOTIATION
         SSL_set_options(sc->connection, SSL_OP_NO_RENEGOTIATION);
 #endif
+
+#if (NGX_SSL_ASYNC)
+        if (ssl->thread_pool) {
+            SSL_set_mode(sc->connection, SSL_MODE_ASYNC);
+            sc->thread_pool = ssl->thread_pool;
+        }
+#endif
     }
 
     if (SSL_set_ex_data(sc->connection, ngx_ssl_connection_index, c) == 0) {
@@ -1695,12 +2120,26 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
     ngx_ssl_clear_error(c->log);
 
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = c;
+#endif
+
     n = SSL_do_handshake(c->ssl->connection);
 
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = NULL;
+#endif
+
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "SSL_do_handshake: %d", n);
 
     if (n == 1) {
 
+#if (NGX_SSL_ASYNC)
+        if (c->ssl->thread_pool) {
+            SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+        }
+#endif
+
         if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -1733,15 +2172,7 @@ ngx_ssl_handshake(ngx_connection_t *c)
 
 #endif
 
-#if (defined BIO_get_ktls_send && !NGX_WIN32)
-
-        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "BIO_get_ktls_send(): 1");
-            c->ssl->sendfile = 1;
-        }
-
-#endif
+        ngx_ssl_ktls_init(c);
 
         rc = ngx_ssl_ocsp_validate(c);
 
@@ -1796,6 +2227,17 @@ ngx_ssl_handshake(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_ASYNC)
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        /* resumed by ngx_ssl_async_event_handler() */
+
+        return NGX_AGAIN;
+    }
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -1839,8 +2281,16 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
 
     readbytes = 0;
 
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = c;
+#endif
+
     n = SSL_read_early_data(c->ssl->connection, &buf, 1, &readbytes);
 
+#if (NGX_SSL_ASYNC)
+    ngx_ssl_async_connection = NULL;
+#endif
+
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
                    "SSL_read_early_data: %d, %uz", n, readbytes);
 
@@ -1851,6 +2301,12 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
 
     if (n == SSL_READ_EARLY_DATA_SUCCESS) {
 
+#if (NGX_SSL_ASYNC)
+        if (c->ssl->thread_pool) {
+            SSL_clear_mode(c->ssl->connection, SSL_MODE_ASYNC);
+        }
+#endif
+
         if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
             return NGX_ERROR;
         }
@@ -1878,15 +2334,7 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
         c->read->ready = 1;
         c->write->ready = 1;
 
-#if (defined BIO_get_ktls_send && !NGX_WIN32)
-
-        if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
-            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "BIO_get_ktls_send(): 1");
-            c->ssl->sendfile = 1;
-        }
-
-#endif
+        ngx_ssl_ktls_init(c);
 
         rc = ngx_ssl_ocsp_validate(c);
 
@@ -1943,6 +2391,17 @@ ngx_ssl_try_early_data(ngx_connection_t *c)
         return NGX_AGAIN;
     }
 
+#if (NGX_SSL_ASYNC)
+    if (sslerr == SSL_ERROR_WANT_ASYNC) {
+        c->read->handler = ngx_ssl_handshake_handler;
+        c->write->handler = ngx_ssl_handshake_handler;
+
+        /* resumed by ngx_ssl_async_event_handler() */
+
+        return NGX_AGAIN;
+    }
+#endif
+
     err = (sslerr == SSL_ERROR_SYSCALL) ? ngx_errno : 0;
 
     c->ssl->no_wait_shutdown = 1;
@@ -2037,11 +2496,403 @@ ngx_ssl_handshake_handler(ngx_event_t *ev)
         return;
     }
 
-    if (ngx_ssl_handshake(c) == NGX_AGAIN) {
-        return;
+    if (ngx_ssl_handshake(c) == NGX_AGAIN) {
+        return;
+    }
+
+    c->ssl->handler(c);
+}
+
+
+#if (NGX_SSL_ASYNC)
+
+static int
+ngx_ssl_async_rsa_priv_enc(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    return ngx_ssl_async_rsa(NGX_SSL_ASYNC_RSA_ENC, flen, from, to, rsa,
+                             padding);
+}
+
+
+static int
+ngx_ssl_async_rsa_priv_dec(int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    return ngx_ssl_async_rsa(NGX_SSL_ASYNC_RSA_DEC, flen, from, to, rsa,
+                             padding);
+}
+
+
+static int
+ngx_ssl_async_rsa(ngx_uint_t op, int flen, const unsigned char *from,
+    unsigned char *to, RSA *rsa, int padding)
+{
+    int                rc;
+    ngx_ssl_async_t   *a;
+    const RSA_METHOD  *meth;
+
+    a = ngx_ssl_async_alloc(op, from, flen, RSA_size(rsa));
+
+    if (a == NULL) {
+        meth = RSA_PKCS1_OpenSSL();
+
+        if (op == NGX_SSL_ASYNC_RSA_ENC) {
+            return RSA_meth_get_priv_enc(meth)(flen, from, to, rsa, padding);
+        }
+
+        return RSA_meth_get_priv_dec(meth)(flen, from, to, rsa, padding);
+    }
+
+    RSA_up_ref(rsa);
+
+    a->key = rsa;
+    a->padding = padding;
+
+    if (ngx_ssl_async_run(a) != NGX_OK) {
+        return -1;
+    }
+
+    rc = a->rc;
+
+    if (rc > 0) {
+        ngx_memcpy(to, a->out, rc);
+    }
+
+    ngx_free(a);
+
+    return rc;
+}
+
+
+#ifndef OPENSSL_NO_EC
+
+static int
+ngx_ssl_async_ecdsa_sign(int type, const unsigned char *dgst, int dlen,
+    unsigned char *sig, unsigned int *siglen, const BIGNUM *kinv,
+    const BIGNUM *r, EC_KEY *eckey)
+{
+    int               rc;
+    ngx_ssl_async_t  *a;
+    int             (*sign)(int type, const unsigned char *dgst, int dlen,
+                            unsigned char *sig, unsigned int *siglen,
+                            const BIGNUM *kinv, const BIGNUM *r,
+                            EC_KEY *eckey);
+
+    a = NULL;
+
+    if (kinv == NULL && r == NULL) {
+        a = ngx_ssl_async_alloc(NGX_SSL_ASYNC_ECDSA, dgst, dlen,
+                                ECDSA_size(eckey));
+    }
+
+    if (a == NULL) {
+        EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+        return sign(type, dgst, dlen, sig, siglen, kinv, r, eckey);
+    }
+
+    EC_KEY_up_ref(eckey);
+
+    a->key = eckey;
+    a->type = type;
+
+    if (ngx_ssl_async_run(a) != NGX_OK) {
+        return 0;
+    }
+
+    rc = a->rc;
+
+    if (rc == 1) {
+        ngx_memcpy(sig, a->out, a->siglen);
+        *siglen = a->siglen;
+    }
+
+    ngx_free(a);
+
+    return rc;
+}
+
+#endif
+
+
+static ngx_ssl_async_t *
+ngx_ssl_async_alloc(ngx_uint_t op, const unsigned char *in, size_t len,
+    size_t size)
+{
+    ngx_ssl_async_t   *a;
+    ngx_connection_t  *c;
+
+    c = ngx_ssl_async_connection;
+
+    /*
+     * operations are only offloaded during handshakes of connections
+     * with a thread pool, and only if called from an asynchronous job
+     */
+
+    if (c == NULL
+        || c->ssl->thread_pool == NULL
+        || ASYNC_get_current_job() == NULL)
+    {
+        return NULL;
+    }
+
+    a = ngx_alloc(offsetof(ngx_ssl_async_t, in) + len + size, c->log);
+    if (a == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(a, offsetof(ngx_ssl_async_t, in));
+
+    a->task.ctx = a;
+    a->task.handler = ngx_ssl_async_thread_handler;
+    a->task.event.data = a;
+    a->task.event.handler = ngx_ssl_async_event_handler;
+
+    a->connection = c;
+    a->op = op;
+    a->len = len;
+    a->out = a->in + len;
+
+    ngx_memcpy(a->in, in, len);
+
+    return a;
+}
+
+
+static ngx_int_t
+ngx_ssl_async_run(ngx_ssl_async_t *a)
+{
+    ngx_connection_t  *c;
+
+    c = a->connection;
+
+    if (ngx_thread_task_post(c->ssl->thread_pool, &a->task) != NGX_OK) {
+        ngx_ssl_async_thread_handler(a, c->log);
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL async operation %ui posted", a->op);
+
+    c->ssl->async = a;
+
+    /*
+     * the job is resumed by the next SSL_do_handshake() call,
+     * which may happen on other events before the task is done
+     */
+
+    while (!a->done) {
+
+        if (ASYNC_pause_job() == 0) {
+            c->ssl->async = NULL;
+            a->connection = NULL;
+            return NGX_ERROR;
+        }
+    }
+
+    if (a->connection == NULL) {
+        /* resumed by ngx_ssl_async_finalize(), the connection is closed */
+        ngx_free(a);
+        return NGX_ERROR;
+    }
+
+    c->ssl->async = NULL;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_async_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_ssl_async_t *a = data;
+
+    const RSA_METHOD  *meth;
+#ifndef OPENSSL_NO_EC
+    int              (*sign)(int type, const unsigned char *dgst, int dlen,
+                             unsigned char *sig, unsigned int *siglen,
+                             const BIGNUM *kinv, const BIGNUM *r,
+                             EC_KEY *eckey);
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "SSL async operation %ui", a->op);
+
+    switch (a->op) {
+
+    case NGX_SSL_ASYNC_RSA_ENC:
+    case NGX_SSL_ASYNC_RSA_DEC:
+
+        meth = RSA_PKCS1_OpenSSL();
+
+        if (a->op == NGX_SSL_ASYNC_RSA_ENC) {
+            a->rc = RSA_meth_get_priv_enc(meth)(a->len, a->in, a->out,
+                                                a->key, a->padding);
+
+        } else {
+            a->rc = RSA_meth_get_priv_dec(meth)(a->len, a->in, a->out,
+                                                a->key, a->padding);
+        }
+
+        RSA_free(a->key);
+        break;
+
+#ifndef OPENSSL_NO_EC
+
+    default: /* NGX_SSL_ASYNC_ECDSA */
+
+        EC_KEY_METHOD_get_sign(EC_KEY_OpenSSL(), &sign, NULL, NULL);
+
+        a->rc = sign(a->type, a->in, a->len, a->out, &a->siglen, NULL, NULL,
+                     a->key);
+
+        EC_KEY_free(a->key);
+        break;
+
+#endif
+    }
+
+    /* errors are not reported from other threads */
+
+    ERR_clear_error();
+}
+
+
+static void
+ngx_ssl_async_event_handler(ngx_event_t *ev)
+{
+    ngx_ssl_async_t   *a;
+    ngx_connection_t  *c;
+
+    a = ev->data;
+    c = a->connection;
+
+    a->done = 1;
+
+    if (c == NULL) {
+
+        if (a->ssl_conn) {
+            ngx_ssl_async_finalize(a->ssl_conn);
+            return;
+        }
+
+        ngx_free(a);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL async operation %ui done", a->op);
+
+    ngx_post_event(c->read, &ngx_posted_events);
+}
+
+
+static void
+ngx_ssl_async_cleanup(ngx_connection_t *c)
+{
+    BIO              *bio;
+    ngx_ssl_async_t  *a;
+
+    a = c->ssl->async;
+
+    if (a == NULL) {
+        return;
+    }
+
+    c->ssl->async = NULL;
+    a->connection = NULL;
+
+    /*
+     * a paused job is only freed by OpenSSL once it is finished, so
+     * the SSL object is detached from the connection and the handshake
+     * is resumed as soon as the operation is done; the job then fails,
+     * and the SSL object is freed
+     */
+
+    bio = BIO_new(BIO_s_null());
+
+    if (bio == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "BIO_new() failed");
+
+        if (a->done) {
+            ngx_free(a);
+        }
+
+        /* otherwise the context is freed on task completion */
+
+        return;
+    }
+
+    SSL_set_bio(c->ssl->connection, bio, bio);
+
+    SSL_set_ex_data(c->ssl->connection, ngx_ssl_connection_index, NULL);
+    SSL_set_info_callback(c->ssl->connection, ngx_ssl_async_info_callback);
+
+    a->ssl_conn = c->ssl->connection;
+    c->ssl->connection = NULL;
+
+    if (a->done) {
+        ngx_ssl_async_finalize(a->ssl_conn);
+    }
+}
+
+
+static void
+ngx_ssl_async_finalize(ngx_ssl_conn_t *ssl_conn)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "SSL async operation done on closed connection");
+
+    /* the context is freed by the resumed job */
+
+    (void) SSL_do_handshake(ssl_conn);
+
+    ERR_clear_error();
+
+    SSL_free(ssl_conn);
+}
+
+
+static void
+ngx_ssl_async_info_callback(const ngx_ssl_conn_t *ssl_conn, int where,
+    int ret)
+{
+    /* the connection is already closed */
+}
+
+#endif
+
+
+static void
+ngx_ssl_ktls_init(ngx_connection_t *c)
+{
+#if (defined BIO_get_ktls_send && !NGX_WIN32)
+
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "BIO_get_ktls_send(): 1");
+        c->ssl->sendfile = 1;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_ktls_send, 1);
+#endif
+    }
+
+#endif
+
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+    if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl->connection)) == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "BIO_get_ktls_recv(): 1");
+        c->ssl->ktls_recv = 1;
+
+#if (NGX_STAT_STUB)
+        (void) ngx_atomic_fetch_add(ngx_stat_ktls_recv, 1);
+#endif
     }
 
-    c->ssl->handler(c);
+#endif
 }
 
 
@@ -2131,6 +2982,18 @@ ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
         return 0;
     }
 
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+    if (c->ssl->ktls_recv && !SSL_has_pending(c->ssl->connection)) {
+        n = ngx_ssl_recv_ktls(c, buf, size);
+
+        if (n != NGX_DECLINED) {
+            return n;
+        }
+    }
+
+#endif
+
     bytes = 0;
 
     ngx_ssl_clear_error(c->log);
@@ -2236,6 +3099,76 @@ ngx_ssl_recv(ngx_connection_t *c, u_char *buf, size_t size)
 }
 
 
+#if (defined BIO_get_ktls_recv && !NGX_WIN32)
+
+static ssize_t
+ngx_ssl_recv_ktls(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    /*
+     * the kernel decrypts application data records, so they are read
+     * directly from the socket; other records (alerts, session tickets,
+     * key updates) fail with EIO and are left to SSL_read()
+     */
+
+    rev = c->read;
+
+    for ( ;; ) {
+        n = recv(c->fd, buf, size, 0);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "ktls recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+
+            /*
+             * a short read may stop at a non-data record, which will not
+             * be reported by the next event, so the read event remains
+             * ready until recv() would block
+             */
+
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_socket_errno;
+
+        if (err == NGX_EINTR) {
+            continue;
+        }
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "ktls recv() not ready");
+            rev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        if (err == NGX_EIO) {
+            ngx_log_debug0(NGX_LOG_DEBUG_EVENT, c->log, err,
+                           "ktls recv() non-data record");
+            return NGX_DECLINED;
+        }
+
+        rev->ready = 0;
+        rev->error = 1;
+        ngx_connection_error(c, err, "recv() failed");
+
+        return NGX_ERROR;
+    }
+}
+
+#endif
+
+
 #ifdef SSL_READ_EARLY_DATA_SUCCESS
 
 static ssize_t
@@ -3130,6 +4063,17 @@ ngx_ssl_shutdown(ngx_connection_t *c)
 
     ngx_ssl_ocsp_cleanup(c);
 
+#if (NGX_SSL_ASYNC)
+
+    ngx_ssl_async_cleanup(c);
+
+    if (c->ssl->connection == NULL) {
+        /* freed when the asynchronous operation is done */
+        goto done;
+    }
+
+#endif
+
     if (SSL_in_init(c->ssl->connection)) {
         /*
          * OpenSSL 1.0.2f complains if SSL_shutdown() is called during
@@ -3240,7 +4184,22 @@ done:
         return rc;
     }
 
-    SSL_free(c->ssl->connection);
+#if (NGX_STAT_STUB)
+
+    if (c->ssl->sendfile) {
+        (void) ngx_atomic_fetch_add(ngx_stat_ktls_send, -1);
+    }
+
+    if (c->ssl->ktls_recv) {
+        (void) ngx_atomic_fetch_add(ngx_stat_ktls_recv, -1);
+    }
+
+#endif
+
+    if (c->ssl->connection) {
+        SSL_free(c->ssl->connection);
+    }
+
     c->ssl = NULL;
     c->recv = ngx_recv;
 
@@ -3785,9 +4744,16 @@ ngx_int_t
 ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
     size_t                    len;
+    ngx_uint_t                i, n[3];
     ngx_slab_pool_t          *shpool;
     ngx_ssl_session_cache_t  *cache;
 
+    static size_t             sizes[] = {
+        NGX_SSL_SMALL_SESSION_SIZE,
+        NGX_SSL_MEDIUM_SESSION_SIZE,
+        NGX_SSL_MAX_SESSION_SIZE
+    };
+
     if (data) {
         shm_zone->data = data;
         return NGX_OK;
@@ -3808,11 +4774,6 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     shpool->data = cache;
     shm_zone->data = cache;
 
-    ngx_rbtree_init(&cache->session_rbtree, &cache->sentinel,
-                    ngx_ssl_session_rbtree_insert_value);
-
-    ngx_queue_init(&cache->expire_queue);
-
     cache->ticket_keys[0].expire = 0;
     cache->ticket_keys[1].expire = 0;
     cache->ticket_keys[2].expire = 0;
@@ -3831,6 +4792,34 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 
     shpool->log_nomem = 0;
 
+    /*
+     * sessions are kept in three tables with fixed-size slots:
+     * five eighths of the zone are used for typical sessions,
+     * a quarter for bigger ones, and an eighth for the biggest
+     */
+
+    n[2] = shpool->pfree / 8;
+    n[1] = shpool->pfree / 4;
+    n[0] = shpool->pfree - n[1] - n[2];
+
+    for (i = 0; i < 3; i++) {
+        cache->sessions[i] = NULL;
+
+        if (n[i] == 0) {
+            continue;
+        }
+
+        len = offsetof(ngx_ssl_sess_id_t, session) + sizes[i];
+
+        cache->sessions[i] = ngx_shm_hash_create(shpool,
+                                                 n[i] << ngx_pagesize_shift,
+                                                 32, len);
+    }
+
+    if (cache->sessions[0] == NULL) {
+        return NGX_ERROR;
+    }
+
     return NGX_OK;
 }
 
@@ -3841,30 +4830,33 @@ ngx_ssl_session_cache_init(ngx_shm_zone_t *shm_zone, void *data)
  * Typical length of the external ASN1 representation of a session
  * is about 150 bytes plus SNI server name.
  *
- * On 32-bit platforms we allocate an rbtree node, a session id, and
- * an ASN1 representation in a single allocation, it typically takes
- * 256 bytes.
- *
- * On 64-bit platforms we allocate separately an rbtree node + session_id,
- * and an ASN1 representation, they take accordingly 128 and 256 bytes.
+ * Sessions up to NGX_SSL_SMALL_SESSION_SIZE bytes are stored in 320-byte
+ * slots, so a typical session takes 328 bytes with the bucket header.
+ * Sessions up to NGX_SSL_MEDIUM_SESSION_SIZE bytes are stored in 512-byte
+ * slots, and bigger sessions in 4k slots.  A session id is kept in one
+ * table only.  Slots are reused in the CLOCK order, expired sessions are
+ * removed on lookup.
  *
  * OpenSSL's i2d_SSL_SESSION() and d2i_SSL_SESSION are slow,
- * so they are outside the code locked by shared pool mutex
+ * so they are outside the code locked by the bucket lock
  */
 
 static int
 ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
 {
     int                       len;
-    u_char                   *p, *session_id;
-    size_t                    n;
-    uint32_t                  hash;
+    u_char                   *p;
+    uint32_t                  key;
+    ngx_str_t                 id;
+    ngx_int_t                 n;
+    ngx_uint_t                i;
     SSL_CTX                  *ssl_ctx;
     unsigned int              session_id_length;
+    ngx_shm_hash_t           *hash;
     ngx_shm_zone_t           *shm_zone;
     ngx_connection_t         *c;
-    ngx_slab_pool_t          *shpool;
     ngx_ssl_sess_id_t        *sess_id;
+    ngx_shm_hash_bucket_t    *bucket;
     ngx_ssl_session_cache_t  *cache;
     u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
 
@@ -3896,7 +4888,8 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     p = buf;
     i2d_SSL_SESSION(sess, &p);
 
-    session_id = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+    id.data = (u_char *) SSL_SESSION_get_id(sess, &session_id_length);
+    id.len = session_id_length;
 
     /* do not cache sessions with too long session id */
 
@@ -3910,94 +4903,97 @@ ngx_ssl_new_session(ngx_ssl_conn_t *ssl_conn, ngx_ssl_session_t *sess)
     shm_zone = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-
-    ngx_shmtx_lock(&shpool->mutex);
 
-    /* drop one or two expired sessions */
-    ngx_ssl_expire_sessions(cache, shpool, 1);
+    n = ngx_ssl_session_class(len);
 
-#if (NGX_PTR_SIZE == 8)
-    n = sizeof(ngx_ssl_sess_id_t);
-#else
-    n = offsetof(ngx_ssl_sess_id_t, session) + len;
-#endif
+    hash = cache->sessions[n];
 
-    sess_id = ngx_slab_alloc_locked(shpool, n);
+    if (hash == NULL) {
+        goto failed;
+    }
 
-    if (sess_id == NULL) {
+    key = ngx_shm_hash_key(id.data, id.len);
 
-        /* drop the oldest non-expired session and try once more */
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "ssl new session: %08XD:%ud:%d",
+                   key, session_id_length, len);
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+    /* a session with the same id might be kept in another table */
 
-        sess_id = ngx_slab_alloc_locked(shpool, n);
+    for (i = 0; i < 3; i++) {
 
-        if (sess_id == NULL) {
-            goto failed;
+        if ((ngx_int_t) i == n || cache->sessions[i] == NULL) {
+            continue;
         }
-    }
 
-#if (NGX_PTR_SIZE == 8)
+        bucket = ngx_shm_hash_bucket(cache->sessions[i], key);
+
+        ngx_shm_hash_lock(bucket);
+
+        sess_id = ngx_shm_hash_find_locked(cache->sessions[i], bucket, key,
+                                           &id);
 
-    sess_id->session = ngx_slab_alloc_locked(shpool, len);
+        if (sess_id) {
+            ngx_explicit_memzero(sess_id->session, sess_id->len);
+            ngx_shm_hash_delete_locked(cache->sessions[i], bucket, sess_id);
+        }
+
+        ngx_shm_hash_unlock(bucket);
+    }
 
-    if (sess_id->session == NULL) {
+    bucket = ngx_shm_hash_bucket(hash, key);
 
-        /* drop the oldest non-expired session and try once more */
+    ngx_shm_hash_lock(bucket);
 
-        ngx_ssl_expire_sessions(cache, shpool, 0);
+    sess_id = ngx_shm_hash_find_locked(hash, bucket, key, &id);
 
-        sess_id->session = ngx_slab_alloc_locked(shpool, len);
+    if (sess_id == NULL) {
+        sess_id = ngx_shm_hash_insert_locked(hash, bucket, key, &id,
+                                             ngx_ssl_evict_session, NULL);
 
-        if (sess_id->session == NULL) {
+        if (sess_id == NULL) {
+            ngx_shm_hash_unlock(bucket);
             goto failed;
         }
     }
 
-#endif
-
     ngx_memcpy(sess_id->session, buf, len);
-    ngx_memcpy(sess_id->id, session_id, session_id_length);
-
-    hash = ngx_crc32_short(session_id, session_id_length);
-
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl new session: %08XD:%ud:%d",
-                   hash, session_id_length, len);
 
-    sess_id->node.key = hash;
-    sess_id->node.data = (u_char) session_id_length;
     sess_id->len = len;
-
     sess_id->expire = ngx_time() + SSL_CTX_get_timeout(ssl_ctx);
 
-    ngx_queue_insert_head(&cache->expire_queue, &sess_id->queue);
-
-    ngx_rbtree_insert(&cache->session_rbtree, &sess_id->node);
-
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_shm_hash_unlock(bucket);
 
     return 0;
 
 failed:
 
-    if (sess_id) {
-        ngx_slab_free_locked(shpool, sess_id);
-    }
-
-    ngx_shmtx_unlock(&shpool->mutex);
-
     if (cache->fail_time != ngx_time()) {
         cache->fail_time = ngx_time();
         ngx_log_error(NGX_LOG_WARN, c->log, 0,
-                      "could not allocate new session%s", shpool->log_ctx);
+                      "could not allocate new session%s",
+                      ((ngx_slab_pool_t *) shm_zone->shm.addr)->log_ctx);
     }
 
     return 0;
 }
 
 
+static ngx_int_t
+ngx_ssl_session_class(size_t len)
+{
+    if (len <= NGX_SSL_SMALL_SESSION_SIZE) {
+        return 0;
+    }
+
+    if (len <= NGX_SSL_MEDIUM_SESSION_SIZE) {
+        return 1;
+    }
+
+    return 2;
+}
+
+
 static ngx_ssl_session_t *
 ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #if OPENSSL_VERSION_NUMBER >= 0x10100003L
@@ -4005,97 +5001,67 @@ ngx_ssl_get_cached_session(ngx_ssl_conn_t *ssl_conn,
 #endif
     u_char *id, int len, int *copy)
 {
-    size_t                    slen;
-    uint32_t                  hash;
+    uint32_t                  key;
     ngx_int_t                 rc;
+    ngx_str_t                 name;
+    ngx_uint_t                i;
     const u_char             *p;
     ngx_shm_zone_t           *shm_zone;
-    ngx_slab_pool_t          *shpool;
-    ngx_rbtree_node_t        *node, *sentinel;
     ngx_ssl_session_t        *sess;
-    ngx_ssl_sess_id_t        *sess_id;
     ngx_ssl_session_cache_t  *cache;
-    u_char                    buf[NGX_SSL_MAX_SESSION_SIZE];
     ngx_connection_t         *c;
 
-    hash = ngx_crc32_short((u_char *) (uintptr_t) id, (size_t) len);
+    union {
+        ngx_ssl_sess_id_t     sess_id;
+        u_char                data[offsetof(ngx_ssl_sess_id_t, session)
+                                   + NGX_SSL_MAX_SESSION_SIZE];
+    } buf;
+
+    name.data = (u_char *) (uintptr_t) id;
+    name.len = len;
+
+    key = ngx_shm_hash_key(name.data, name.len);
     *copy = 0;
 
     c = ngx_ssl_get_connection(ssl_conn);
 
     ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "ssl get session: %08XD:%d", hash, len);
+                   "ssl get session: %08XD:%d", key, len);
 
     shm_zone = SSL_CTX_get_ex_data(c->ssl->session_ctx,
                                    ngx_ssl_session_cache_index);
 
     cache = shm_zone->data;
 
-    sess = NULL;
+    rc = NGX_DECLINED;
 
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-
-    ngx_shmtx_lock(&shpool->mutex);
-
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
-
-    while (node != sentinel) {
-
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+    for (i = 0; i < 3; i++) {
 
-        if (hash > node->key) {
-            node = node->right;
+        if (cache->sessions[i] == NULL) {
             continue;
         }
 
-        /* hash == node->key */
-
-        sess_id = (ngx_ssl_sess_id_t *) node;
-
-        rc = ngx_memn2cmp((u_char *) (uintptr_t) id, sess_id->id,
-                          (size_t) len, (size_t) node->data);
-
-        if (rc == 0) {
-
-            if (sess_id->expire > ngx_time()) {
-                slen = sess_id->len;
-
-                ngx_memcpy(buf, sess_id->session, slen);
-
-                ngx_shmtx_unlock(&shpool->mutex);
-
-                p = buf;
-                sess = d2i_SSL_SESSION(NULL, &p, slen);
-
-                return sess;
-            }
-
-            ngx_queue_remove(&sess_id->queue);
-
-            ngx_rbtree_delete(&cache->session_rbtree, node);
-
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
-
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
-
-            sess = NULL;
+        rc = ngx_shm_hash_read(cache->sessions[i], key, &name, &buf);
 
-            goto done;
+        if (rc == NGX_OK) {
+            break;
         }
+    }
 
-        node = (rc < 0) ? node->left : node->right;
+    if (rc != NGX_OK) {
+        return NULL;
     }
 
-done:
+    if (buf.sess_id.expire <= ngx_time()) {
+        ngx_explicit_memzero(buf.sess_id.session, buf.sess_id.len);
+        ngx_ssl_delete_session(cache, &name);
+        return NULL;
+    }
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    p = buf.sess_id.session;
+    sess = d2i_SSL_SESSION(NULL, &p, buf.sess_id.len);
+
+    ngx_explicit_memzero(buf.sess_id.session, buf.sess_id.len);
 
     return sess;
 }
@@ -4113,15 +5079,9 @@ ngx_ssl_remove_cached_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 static void
 ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
 {
-    u_char                   *id;
-    uint32_t                  hash;
-    ngx_int_t                 rc;
-    unsigned int              len;
-    ngx_shm_zone_t           *shm_zone;
-    ngx_slab_pool_t          *shpool;
-    ngx_rbtree_node_t        *node, *sentinel;
-    ngx_ssl_sess_id_t        *sess_id;
-    ngx_ssl_session_cache_t  *cache;
+    ngx_str_t        id;
+    unsigned int     len;
+    ngx_shm_zone_t  *shm_zone;
 
     shm_zone = SSL_CTX_get_ex_data(ssl, ngx_ssl_session_cache_index);
 
@@ -4129,145 +5089,62 @@ ngx_ssl_remove_session(SSL_CTX *ssl, ngx_ssl_session_t *sess)
         return;
     }
 
-    cache = shm_zone->data;
-
-    id = (u_char *) SSL_SESSION_get_id(sess, &len);
-
-    hash = ngx_crc32_short(id, len);
-
-    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
-                   "ssl remove session: %08XD:%ud", hash, len);
-
-    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
-
-    ngx_shmtx_lock(&shpool->mutex);
-
-    node = cache->session_rbtree.root;
-    sentinel = cache->session_rbtree.sentinel;
-
-    while (node != sentinel) {
-
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
-
-        if (hash > node->key) {
-            node = node->right;
-            continue;
-        }
-
-        /* hash == node->key */
-
-        sess_id = (ngx_ssl_sess_id_t *) node;
-
-        rc = ngx_memn2cmp(id, sess_id->id, len, (size_t) node->data);
-
-        if (rc == 0) {
-
-            ngx_queue_remove(&sess_id->queue);
-
-            ngx_rbtree_delete(&cache->session_rbtree, node);
-
-            ngx_explicit_memzero(sess_id->session, sess_id->len);
-
-#if (NGX_PTR_SIZE == 8)
-            ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-            ngx_slab_free_locked(shpool, sess_id);
-
-            goto done;
-        }
-
-        node = (rc < 0) ? node->left : node->right;
-    }
-
-done:
+    id.data = (u_char *) SSL_SESSION_get_id(sess, &len);
+    id.len = len;
 
-    ngx_shmtx_unlock(&shpool->mutex);
+    ngx_ssl_delete_session(shm_zone->data, &id);
 }
 
 
 static void
-ngx_ssl_expire_sessions(ngx_ssl_session_cache_t *cache,
-    ngx_slab_pool_t *shpool, ngx_uint_t n)
+ngx_ssl_delete_session(ngx_ssl_session_cache_t *cache, ngx_str_t *id)
 {
-    time_t              now;
-    ngx_queue_t        *q;
-    ngx_ssl_sess_id_t  *sess_id;
-
-    now = ngx_time();
+    uint32_t                key;
+    ngx_uint_t              i;
+    ngx_shm_hash_t         *hash;
+    ngx_ssl_sess_id_t      *sess_id;
+    ngx_shm_hash_bucket_t  *bucket;
 
-    while (n < 3) {
+    key = ngx_shm_hash_key(id->data, id->len);
 
-        if (ngx_queue_empty(&cache->expire_queue)) {
-            return;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "ssl remove session: %08XD:%uz", key, id->len);
 
-        q = ngx_queue_last(&cache->expire_queue);
+    for (i = 0; i < 3; i++) {
 
-        sess_id = ngx_queue_data(q, ngx_ssl_sess_id_t, queue);
+        hash = cache->sessions[i];
 
-        if (n++ != 0 && sess_id->expire > now) {
-            return;
+        if (hash == NULL) {
+            continue;
         }
 
-        ngx_queue_remove(q);
+        bucket = ngx_shm_hash_bucket(hash, key);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
-                       "expire session: %08Xi", sess_id->node.key);
+        ngx_shm_hash_lock(bucket);
 
-        ngx_rbtree_delete(&cache->session_rbtree, &sess_id->node);
+        sess_id = ngx_shm_hash_find_locked(hash, bucket, key, id);
 
-        ngx_explicit_memzero(sess_id->session, sess_id->len);
+        if (sess_id) {
+            ngx_explicit_memzero(sess_id->session, sess_id->len);
+            ngx_shm_hash_delete_locked(hash, bucket, sess_id);
+        }
 
-#if (NGX_PTR_SIZE == 8)
-        ngx_slab_free_locked(shpool, sess_id->session);
-#endif
-        ngx_slab_free_locked(shpool, sess_id);
+        ngx_shm_hash_unlock(bucket);
     }
 }
 
 
-static void
-ngx_ssl_session_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+static ngx_int_t
+ngx_ssl_evict_session(ngx_shm_hash_t *hash, void *value, void *data)
 {
-    ngx_rbtree_node_t  **p;
-    ngx_ssl_sess_id_t   *sess_id, *sess_id_temp;
-
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
+    ngx_ssl_sess_id_t  *sess_id = value;
 
-            p = &temp->left;
-
-        } else if (node->key > temp->key) {
-
-            p = &temp->right;
-
-        } else { /* node->key == temp->key */
-
-            sess_id = (ngx_ssl_sess_id_t *) node;
-            sess_id_temp = (ngx_ssl_sess_id_t *) temp;
-
-            p = (ngx_memn2cmp(sess_id->id, sess_id_temp->id,
-                              (size_t) node->data, (size_t) temp->data)
-                 < 0) ? &temp->left : &temp->right;
-        }
-
-        if (*p == sentinel) {
-            break;
-        }
+    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "evict session");
 
-        temp = *p;
-    }
+    ngx_explicit_memzero(sess_id->session, sess_id->len);
 
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
+    return NGX_OK;
 }
 
 
@@ -5159,6 +6036,26 @@ ngx_ssl_get_session_reused(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 }
 
 
+ngx_int_t
+ngx_ssl_get_ktls(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
+{
+    if (c->ssl->sendfile && c->ssl->ktls_recv) {
+        ngx_str_set(s, "tx,rx");
+
+    } else if (c->ssl->sendfile) {
+        ngx_str_set(s, "tx");
+
+    } else if (c->ssl->ktls_recv) {
+        ngx_str_set(s, "rx");
+
+    } else {
+        s->len = 0;
+    }
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_get_early_data(ngx_connection_t *c, ngx_pool_t *pool, ngx_str_t *s)
 {
@@ -36,22 +36,42 @@ typedef struct {
 
 typedef struct {
     ngx_rbtree_node_t           node;
+    ngx_queue_t                 queue;
     ngx_ssl_cache_key_t         id;
     ngx_ssl_cache_type_t       *type;
     void                       *value;
+
+    time_t                      created;
+    time_t                      accessed;
+
+    time_t                      mtime;
+    ngx_file_uniq_t             uniq;
 } ngx_ssl_cache_node_t;
 
 
-typedef struct {
+struct ngx_ssl_cache_s {
     ngx_rbtree_t                rbtree;
     ngx_rbtree_node_t           sentinel;
-} ngx_ssl_cache_t;
+
+    ngx_queue_t                 expire_queue;
+
+    ngx_uint_t                  current;
+    ngx_uint_t                  max;
+    time_t                      valid;
+    time_t                      inactive;
+};
 
 
 static ngx_int_t ngx_ssl_cache_init_key(ngx_pool_t *pool, ngx_uint_t index,
     ngx_str_t *path, ngx_ssl_cache_key_t *id);
 static ngx_ssl_cache_node_t *ngx_ssl_cache_lookup(ngx_ssl_cache_t *cache,
     ngx_ssl_cache_type_t *type, ngx_ssl_cache_key_t *id, uint32_t hash);
+static ngx_int_t ngx_ssl_cache_valid(ngx_ssl_cache_t *cache,
+    ngx_ssl_cache_node_t *cn, time_t now);
+static void ngx_ssl_cache_expire(ngx_ssl_cache_t *cache, ngx_uint_t n,
+    ngx_log_t *log);
+static void ngx_ssl_cache_node_free(ngx_ssl_cache_t *cache,
+    ngx_ssl_cache_node_t *cn);
 
 static void *ngx_ssl_cache_cert_create(ngx_ssl_cache_key_t *id, char **err,
     void *data);
@@ -179,11 +199,50 @@ ngx_ssl_cache_fetch(ngx_conf_t *cf, ngx_uint_t index, char **err,
 }
 
 
+ngx_ssl_cache_t *
+ngx_ssl_cache_init(ngx_pool_t *pool, ngx_uint_t max, time_t valid,
+    time_t inactive)
+{
+    ngx_ssl_cache_t     *cache;
+    ngx_pool_cleanup_t  *cln;
+
+    cache = ngx_pcalloc(pool, sizeof(ngx_ssl_cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel,
+                    ngx_ssl_cache_node_insert);
+
+    ngx_queue_init(&cache->expire_queue);
+
+    cache->max = max;
+    cache->valid = valid;
+    cache->inactive = inactive;
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    cln->handler = ngx_ssl_cache_cleanup;
+    cln->data = cache;
+
+    return cache;
+}
+
+
 void *
-ngx_ssl_cache_connection_fetch(ngx_pool_t *pool, ngx_uint_t index, char **err,
-    ngx_str_t *path, void *data)
+ngx_ssl_cache_connection_fetch(ngx_ssl_cache_t *cache, ngx_pool_t *pool,
+    ngx_uint_t index, char **err, ngx_str_t *path, void *data)
 {
-    ngx_ssl_cache_key_t  id;
+    void                  *value;
+    time_t                 now;
+    uint32_t               hash;
+    ngx_file_info_t        fi;
+    ngx_ssl_cache_key_t    id;
+    ngx_ssl_cache_type_t  *type;
+    ngx_ssl_cache_node_t  *cn;
 
     *err = NULL;
 
@@ -191,7 +250,86 @@ ngx_ssl_cache_connection_fetch(ngx_pool_t *pool, ngx_uint_t index, char **err,
         return NULL;
     }
 
-    return ngx_ssl_cache_types[index].create(&id, err, data);
+    type = &ngx_ssl_cache_types[index];
+
+    if (cache == NULL) {
+        return type->create(&id, err, data);
+    }
+
+    now = ngx_time();
+    hash = ngx_murmur_hash2(id.data, id.len);
+
+    cn = ngx_ssl_cache_lookup(cache, type, &id, hash);
+
+    if (cn != NULL) {
+
+        if (ngx_ssl_cache_valid(cache, cn, now) == NGX_OK) {
+            cn->accessed = now;
+
+            ngx_queue_remove(&cn->queue);
+            ngx_queue_insert_head(&cache->expire_queue, &cn->queue);
+
+            return type->ref(err, cn->value);
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                       "ssl cache stale: \"%s\"", cn->id.data);
+
+        ngx_queue_remove(&cn->queue);
+        ngx_ssl_cache_node_free(cache, cn);
+    }
+
+    /* file information is obtained before reading the file */
+
+    if (id.type == NGX_SSL_CACHE_PATH
+        && ngx_file_info(id.data, &fi) == NGX_FILE_ERROR)
+    {
+        ngx_memzero(&fi, sizeof(ngx_file_info_t));
+    }
+
+    value = type->create(&id, err, data);
+    if (value == NULL) {
+        return NULL;
+    }
+
+    ngx_ssl_cache_expire(cache, cache->current >= cache->max ? 0 : 1,
+                         ngx_cycle->log);
+
+    cn = ngx_alloc(sizeof(ngx_ssl_cache_node_t) + id.len + 1, ngx_cycle->log);
+    if (cn == NULL) {
+        return value;
+    }
+
+    cn->node.key = hash;
+    cn->id.data = (u_char *)(cn + 1);
+    cn->id.len = id.len;
+    cn->id.type = id.type;
+    cn->type = type;
+    cn->value = value;
+
+    ngx_cpystrn(cn->id.data, id.data, id.len + 1);
+
+    cn->created = now;
+    cn->accessed = now;
+
+    if (id.type == NGX_SSL_CACHE_PATH) {
+        cn->mtime = ngx_file_mtime(&fi);
+        cn->uniq = ngx_file_uniq(&fi);
+
+    } else {
+        cn->mtime = 0;
+        cn->uniq = 0;
+    }
+
+    ngx_rbtree_insert(&cache->rbtree, &cn->node);
+    ngx_queue_insert_head(&cache->expire_queue, &cn->queue);
+
+    cache->current++;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, ngx_cycle->log, 0,
+                   "ssl cache add: \"%s\"", cn->id.data);
+
+    return type->ref(err, value);
 }
 
 
@@ -278,6 +416,85 @@ ngx_ssl_cache_lookup(ngx_ssl_cache_t *cache, ngx_ssl_cache_type_t *type,
 }
 
 
+static ngx_int_t
+ngx_ssl_cache_valid(ngx_ssl_cache_t *cache, ngx_ssl_cache_node_t *cn,
+    time_t now)
+{
+    ngx_file_info_t  fi;
+
+    if (now - cn->created < cache->valid
+        || cn->id.type != NGX_SSL_CACHE_PATH)
+    {
+        return NGX_OK;
+    }
+
+    /* the file is only reloaded if it was changed */
+
+    if (ngx_file_info(cn->id.data, &fi) == NGX_FILE_ERROR
+        || ngx_file_uniq(&fi) != cn->uniq
+        || ngx_file_mtime(&fi) != cn->mtime)
+    {
+        return NGX_DECLINED;
+    }
+
+    cn->created = now;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_cache_expire(ngx_ssl_cache_t *cache, ngx_uint_t n, ngx_log_t *log)
+{
+    time_t                 now;
+    ngx_queue_t           *q;
+    ngx_ssl_cache_node_t  *cn;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two inactive objects
+     * n == 0 deletes least recently used object by force
+     *        and one or two inactive objects
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->expire_queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->expire_queue);
+
+        cn = ngx_queue_data(q, ngx_ssl_cache_node_t, queue);
+
+        if (n++ != 0 && now - cn->accessed <= cache->inactive) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                       "ssl cache expire: \"%s\"", cn->id.data);
+
+        ngx_ssl_cache_node_free(cache, cn);
+    }
+}
+
+
+static void
+ngx_ssl_cache_node_free(ngx_ssl_cache_t *cache, ngx_ssl_cache_node_t *cn)
+{
+    ngx_rbtree_delete(&cache->rbtree, &cn->node);
+
+    cache->current--;
+
+    cn->type->free(cn->value);
+
+    ngx_free(cn);
+}
+
+
 static void *
 ngx_ssl_cache_cert_create(ngx_ssl_cache_key_t *id, char **err, void *data)
 {
@@ -749,10 +966,26 @@ ngx_ssl_cache_cleanup(void *data)
 {
     ngx_ssl_cache_t  *cache = data;
 
+    ngx_queue_t           *q;
     ngx_rbtree_t          *tree;
     ngx_rbtree_node_t     *node;
     ngx_ssl_cache_node_t  *cn;
 
+    if (cache->max) {
+
+        /* connection cache, nodes are allocated from the heap */
+
+        while (!ngx_queue_empty(&cache->expire_queue)) {
+            q = ngx_queue_head(&cache->expire_queue);
+            ngx_queue_remove(q);
+
+            cn = ngx_queue_data(q, ngx_ssl_cache_node_t, queue);
+            ngx_ssl_cache_node_free(cache, cn);
+        }
+
+        return;
+    }
+
     tree = &cache->rbtree;
 
     if (tree->root == tree->sentinel) {
@@ -40,11 +40,22 @@ typedef struct {
     time_t                       valid;
     time_t                       refresh;
 
+    ngx_pool_t                  *pool;
+
     unsigned                     verify:1;
     unsigned                     loading:1;
 } ngx_ssl_stapling_t;
 
 
+typedef struct {
+    ngx_str_t                    responder;
+    ngx_uint_t                   verify;
+
+    ngx_resolver_t              *resolver;
+    ngx_msec_t                   resolver_timeout;
+} ngx_ssl_stapling_conf_t;
+
+
 typedef struct {
     ngx_addr_t                  *addrs;
     ngx_uint_t                   naddrs;
@@ -154,6 +165,13 @@ static ngx_int_t ngx_ssl_stapling_issuer(ngx_conf_t *cf, ngx_ssl_t *ssl,
 static ngx_int_t ngx_ssl_stapling_responder(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_ssl_stapling_t *staple, ngx_str_t *responder);
 
+static ngx_int_t ngx_ssl_stapling_connection_issuer(ngx_connection_t *c,
+    ngx_ssl_stapling_t *staple);
+static ngx_int_t ngx_ssl_stapling_connection_responder(ngx_connection_t *c,
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder);
+static void ngx_ssl_stapling_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+    int idx, long argl, void *argp);
+
 static int ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn,
     void *data);
 static ngx_ssl_stapling_t *ngx_ssl_stapling_lookup(ngx_ssl_t *ssl, X509 *cert);
@@ -194,12 +212,53 @@ static ngx_int_t ngx_ssl_ocsp_create_key(ngx_ssl_ocsp_ctx_t *ctx);
 static u_char *ngx_ssl_ocsp_log_error(ngx_log_t *log, u_char *buf, size_t len);
 
 
+/* stapling configuration, for certificates loaded during handshakes */
+static int  ngx_ssl_stapling_index = -1;
+
+/* staples of certificates loaded during handshakes */
+static int  ngx_ssl_stapling_cert_index = -1;
+
+
 ngx_int_t
 ngx_ssl_stapling(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *file,
     ngx_str_t *responder, ngx_uint_t verify)
 {
-    X509        *cert;
-    ngx_uint_t   k;
+    X509                     *cert;
+    ngx_uint_t                k;
+    ngx_ssl_stapling_conf_t  *scf;
+
+    if (ngx_ssl_stapling_index == -1) {
+
+        ngx_ssl_stapling_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL,
+                                                          NULL);
+        if (ngx_ssl_stapling_index == -1) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "SSL_CTX_get_ex_new_index() failed");
+            return NGX_ERROR;
+        }
+
+        ngx_ssl_stapling_cert_index = X509_get_ex_new_index(0, NULL, NULL, NULL,
+                                                     ngx_ssl_stapling_free);
+        if (ngx_ssl_stapling_cert_index == -1) {
+            ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                          "X509_get_ex_new_index() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    scf = ngx_pcalloc(cf->pool, sizeof(ngx_ssl_stapling_conf_t));
+    if (scf == NULL) {
+        return NGX_ERROR;
+    }
+
+    scf->responder = *responder;
+    scf->verify = verify;
+
+    if (SSL_CTX_set_ex_data(ssl->ctx, ngx_ssl_stapling_index, scf) == 0) {
+        ngx_ssl_error(NGX_LOG_EMERG, ssl->log, 0,
+                      "SSL_CTX_set_ex_data() failed");
+        return NGX_ERROR;
+    }
 
     for (k = 0; k < ssl->certs.nelts; k++) {
         cert = ((X509 **) ssl->certs.elts)[k];
@@ -547,9 +606,17 @@ ngx_int_t
 ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
     ngx_resolver_t *resolver, ngx_msec_t resolver_timeout)
 {
-    ngx_rbtree_t        *tree;
-    ngx_rbtree_node_t   *node;
-    ngx_ssl_stapling_t  *staple;
+    ngx_rbtree_t             *tree;
+    ngx_rbtree_node_t        *node;
+    ngx_ssl_stapling_t       *staple;
+    ngx_ssl_stapling_conf_t  *scf;
+
+    scf = SSL_CTX_get_ex_data(ssl->ctx, ngx_ssl_stapling_index);
+
+    if (scf) {
+        scf->resolver = resolver;
+        scf->resolver_timeout = resolver_timeout;
+    }
 
     tree = &ssl->staple_rbtree;
 
@@ -570,6 +637,309 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_connection_stapling(ngx_connection_t *c, STACK_OF(X509) *chain,
+    ngx_str_t *name)
+{
+    int                       i, n;
+    X509                     *cert, *x509;
+    SSL_CTX                  *ssl_ctx;
+    ngx_pool_t               *pool;
+    ngx_ssl_stapling_t       *staple;
+    ngx_ssl_stapling_conf_t  *scf;
+
+    if (ngx_ssl_stapling_index == -1) {
+        return NGX_OK;
+    }
+
+    ssl_ctx = SSL_get_SSL_CTX(c->ssl->connection);
+
+    scf = SSL_CTX_get_ex_data(ssl_ctx, ngx_ssl_stapling_index);
+    if (scf == NULL) {
+        return NGX_OK;
+    }
+
+    cert = sk_X509_value(chain, 0);
+
+    if (X509_get_ex_data(cert, ngx_ssl_stapling_cert_index) != NULL) {
+        return NGX_OK;
+    }
+
+    /*
+     * the staple is kept with the certificate object, and freed
+     * along with it by ngx_ssl_stapling_free()
+     */
+
+    pool = ngx_create_pool(512, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    staple = ngx_pcalloc(pool, sizeof(ngx_ssl_stapling_t));
+    if (staple == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    staple->pool = pool;
+
+    staple->name = ngx_pnalloc(pool, name->len + 1);
+    if (staple->name == NULL) {
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    ngx_cpystrn(staple->name, name->data, name->len + 1);
+
+    staple->chain = sk_X509_new_null();
+    if (staple->chain == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "sk_X509_new_null() failed");
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    staple->ssl_ctx = ssl_ctx;
+    staple->timeout = 60000;
+    staple->verify = scf->verify;
+    staple->cert = cert;
+    staple->resolver = scf->resolver;
+    staple->resolver_timeout = scf->resolver_timeout;
+
+    if (X509_set_ex_data(cert, ngx_ssl_stapling_cert_index, staple) == 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "X509_set_ex_data() failed");
+        sk_X509_free(staple->chain);
+        ngx_destroy_pool(pool);
+        return NGX_ERROR;
+    }
+
+    n = sk_X509_num(chain);
+
+    for (i = 1; i < n; i++) {
+        x509 = sk_X509_value(chain, i);
+
+        if (sk_X509_push(staple->chain, x509) == 0) {
+            ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "sk_X509_push() failed");
+            return NGX_ERROR;
+        }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+        X509_up_ref(x509);
+#else
+        CRYPTO_add(&x509->references, 1, CRYPTO_LOCK_X509);
+#endif
+    }
+
+    /*
+     * if stapling is not possible, the staple is kept without
+     * a responder, so it is not retried for the certificate
+     */
+
+    if (ngx_ssl_stapling_connection_issuer(c, staple) != NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (ngx_ssl_stapling_connection_responder(c, staple, &scf->responder)
+        != NGX_OK)
+    {
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "SSL stapling for certificate \"%s\"", staple->name);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_connection_issuer(ngx_connection_t *c,
+    ngx_ssl_stapling_t *staple)
+{
+    int              i, n, rc;
+    X509            *issuer;
+    X509_STORE      *store;
+    X509_STORE_CTX  *store_ctx;
+
+    n = sk_X509_num(staple->chain);
+
+    for (i = 0; i < n; i++) {
+        issuer = sk_X509_value(staple->chain, i);
+
+        if (X509_check_issued(issuer, staple->cert) == X509_V_OK) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+            X509_up_ref(issuer);
+#else
+            CRYPTO_add(&issuer->references, 1, CRYPTO_LOCK_X509);
+#endif
+            staple->issuer = issuer;
+            return NGX_OK;
+        }
+    }
+
+    store = SSL_CTX_get_cert_store(staple->ssl_ctx);
+    if (store == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
+                      "SSL_CTX_get_cert_store() failed");
+        return NGX_ERROR;
+    }
+
+    store_ctx = X509_STORE_CTX_new();
+    if (store_ctx == NULL) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0, "X509_STORE_CTX_new() failed");
+        return NGX_ERROR;
+    }
+
+    if (X509_STORE_CTX_init(store_ctx, store, NULL, NULL) == 0) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
+                      "X509_STORE_CTX_init() failed");
+        X509_STORE_CTX_free(store_ctx);
+        return NGX_ERROR;
+    }
+
+    rc = X509_STORE_CTX_get1_issuer(&issuer, store_ctx, staple->cert);
+
+    X509_STORE_CTX_free(store_ctx);
+
+    if (rc == -1) {
+        ngx_ssl_error(NGX_LOG_ALERT, c->log, 0,
+                      "X509_STORE_CTX_get1_issuer() failed");
+        return NGX_ERROR;
+    }
+
+    if (rc == 0) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "\"ssl_stapling\" ignored, "
+                      "issuer certificate not found for certificate \"%s\"",
+                      staple->name);
+        return NGX_DECLINED;
+    }
+
+    staple->issuer = issuer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_ssl_stapling_connection_responder(ngx_connection_t *c,
+    ngx_ssl_stapling_t *staple, ngx_str_t *responder)
+{
+    char                      *s;
+    ngx_str_t                  rsp;
+    ngx_url_t                  u;
+    STACK_OF(OPENSSL_STRING)  *aia;
+
+    if (responder->len == 0) {
+
+        /* extract OCSP responder URL from certificate */
+
+        aia = X509_get1_ocsp(staple->cert);
+        if (aia == NULL) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "\"ssl_stapling\" ignored, "
+                          "no OCSP responder URL in the certificate \"%s\"",
+                          staple->name);
+            return NGX_DECLINED;
+        }
+
+        s = sk_OPENSSL_STRING_value(aia, 0);
+        if (s == NULL) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "\"ssl_stapling\" ignored, "
+                          "no OCSP responder URL in the certificate \"%s\"",
+                          staple->name);
+            X509_email_free(aia);
+            return NGX_DECLINED;
+        }
+
+        responder = &rsp;
+
+        responder->len = ngx_strlen(s);
+        responder->data = ngx_pnalloc(staple->pool, responder->len);
+        if (responder->data == NULL) {
+            X509_email_free(aia);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(responder->data, s, responder->len);
+        X509_email_free(aia);
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = *responder;
+    u.default_port = 80;
+    u.uri_part = 1;
+    u.no_resolve = 1;
+
+    if (u.url.len > 7
+        && ngx_strncasecmp(u.url.data, (u_char *) "http://", 7) == 0)
+    {
+        u.url.len -= 7;
+        u.url.data += 7;
+
+    } else {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "\"ssl_stapling\" ignored, "
+                      "invalid URL prefix in OCSP responder \"%V\" "
+                      "in the certificate \"%s\"",
+                      &u.url, staple->name);
+        return NGX_DECLINED;
+    }
+
+    if (ngx_parse_url(staple->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "\"ssl_stapling\" ignored, "
+                          "%s in OCSP responder \"%V\" "
+                          "in the certificate \"%s\"",
+                          u.err, &u.url, staple->name);
+            return NGX_DECLINED;
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (u.host.len == 0) {
+        ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                      "\"ssl_stapling\" ignored, "
+                      "empty host in OCSP responder "
+                      "in the certificate \"%s\"", staple->name);
+        return NGX_DECLINED;
+    }
+
+    staple->addrs = u.addrs;
+    staple->naddrs = u.naddrs;
+    staple->host = u.host;
+    staple->uri = u.uri;
+    staple->port = u.port;
+
+    if (staple->uri.len == 0) {
+        ngx_str_set(&staple->uri, "/");
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_ssl_stapling_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx,
+    long argl, void *argp)
+{
+    ngx_ssl_stapling_t  *staple = ptr;
+
+    if (staple == NULL) {
+        return;
+    }
+
+    ngx_ssl_stapling_cleanup(staple);
+
+    sk_X509_pop_free(staple->chain, X509_free);
+
+    ngx_destroy_pool(staple->pool);
+}
+
+
 static int
 ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 {
@@ -599,6 +969,10 @@ ngx_ssl_certificate_status_callback(ngx_ssl_conn_t *ssl_conn, void *data)
 
     staple = ngx_ssl_stapling_lookup(ssl, cert);
 
+    if (staple == NULL) {
+        staple = X509_get_ex_data(cert, ngx_ssl_stapling_cert_index);
+    }
+
     if (staple == NULL) {
         return rc;
     }
@@ -689,6 +1063,20 @@ ngx_ssl_stapling_update(ngx_ssl_stapling_t *staple)
     ctx->handler = ngx_ssl_stapling_ocsp_handler;
     ctx->data = staple;
 
+    if (staple->pool) {
+
+        /*
+         * a certificate loaded during a handshake is referenced
+         * until the request is done, as it owns the staple
+         */
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100001L
+        X509_up_ref(staple->cert);
+#else
+        CRYPTO_add(&staple->cert->references, 1, CRYPTO_LOCK_X509);
+#endif
+    }
+
     ngx_ssl_ocsp_request(ctx);
 
     return;
@@ -742,15 +1130,21 @@ ngx_ssl_stapling_ocsp_handler(ngx_ssl_ocsp_ctx_t *ctx)
     staple->loading = 0;
     staple->refresh = ngx_max(ngx_min(ctx->valid - 300, now + 3600), now + 300);
 
-    ngx_ssl_ocsp_done(ctx);
-    return;
+    goto done;
 
 error:
 
     staple->loading = 0;
     staple->refresh = now + 300;
 
+done:
+
     ngx_ssl_ocsp_done(ctx);
+
+    if (staple->pool) {
+        /* may free the staple */
+        X509_free(staple->cert);
+    }
 }
 
 
@@ -2767,6 +3161,14 @@ ngx_ssl_stapling_resolver(ngx_conf_t *cf, ngx_ssl_t *ssl,
 }
 
 
+ngx_int_t
+ngx_ssl_connection_stapling(ngx_connection_t *c, STACK_OF(X509) *chain,
+    ngx_str_t *name)
+{
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_ssl_ocsp(ngx_conf_t *cf, ngx_ssl_t *ssl, ngx_str_t *responder,
     ngx_uint_t depth, ngx_shm_zone_t *shm_zone)
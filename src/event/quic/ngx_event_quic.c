@@ -10,6 +10,11 @@
 #include <ngx_event_quic_connection.h>
 
 
+typedef struct {
+    ngx_quic_memory_t      memory;
+} ngx_quic_core_conf_t;
+
+
 static ngx_quic_connection_t *ngx_quic_new_connection(ngx_connection_t *c,
     ngx_quic_conf_t *conf, ngx_quic_header_t *pkt);
 static ngx_int_t ngx_quic_handle_stateless_reset(ngx_connection_t *c,
@@ -30,18 +35,34 @@ static ngx_int_t ngx_quic_handle_frames(ngx_connection_t *c,
 
 static void ngx_quic_push_handler(ngx_event_t *ev);
 
+static void *ngx_quic_create_conf(ngx_cycle_t *cycle);
+static char *ngx_quic_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static ngx_command_t  ngx_quic_commands[] = {
+
+    { ngx_string("quic_memory_limit"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      0,
+      offsetof(ngx_quic_core_conf_t, memory.limit),
+      NULL },
+
+      ngx_null_command
+};
+
 
 static ngx_core_module_t  ngx_quic_module_ctx = {
     ngx_string("quic"),
-    NULL,
-    NULL
+    ngx_quic_create_conf,
+    ngx_quic_init_conf
 };
 
 
 ngx_module_t  ngx_quic_module = {
     NGX_MODULE_V1,
     &ngx_quic_module_ctx,                  /* module context */
-    NULL,                                  /* module directives */
+    ngx_quic_commands,                     /* module directives */
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
@@ -54,6 +75,57 @@ ngx_module_t  ngx_quic_module = {
 };
 
 
+static void *
+ngx_quic_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_quic_core_conf_t  *qcf;
+
+    qcf = ngx_pcalloc(cycle->pool, sizeof(ngx_quic_core_conf_t));
+    if (qcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     qcf->memory.used = 0;
+     *     qcf->memory.cached = 0;
+     *     qcf->memory.denied = 0;
+     */
+
+    qcf->memory.limit = NGX_CONF_UNSET_SIZE;
+
+    return qcf;
+}
+
+
+static char *
+ngx_quic_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_quic_core_conf_t  *qcf = conf;
+
+    ngx_conf_init_size_value(qcf->memory.limit, 0);
+
+    if (ngx_quic_init_memory_pool(cycle, &qcf->memory) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+ngx_quic_memory_t *
+ngx_quic_get_memory(ngx_cycle_t *cycle)
+{
+    ngx_quic_core_conf_t  *qcf;
+
+    qcf = (ngx_quic_core_conf_t *) ngx_get_conf(cycle->conf_ctx,
+                                                ngx_quic_module);
+
+    return &qcf->memory;
+}
+
+
 #if (NGX_DEBUG)
 
 void
@@ -237,6 +309,10 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
         return NULL;
     }
 
+    if (ngx_quic_init_memory(c, qc) != NGX_OK) {
+        return NULL;
+    }
+
     qc->keys = ngx_pcalloc(c->pool, sizeof(ngx_quic_keys_t));
     if (qc->keys == NULL) {
         return NULL;
@@ -261,8 +337,6 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
     qc->send_ctx[1].level = ssl_encryption_handshake;
     qc->send_ctx[2].level = ssl_encryption_application;
 
-    ngx_queue_init(&qc->free_frames);
-
     ngx_quic_init_rtt(qc);
 
     qc->pto.log = c->log;
@@ -308,12 +382,6 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
     qc->streams.client_max_streams_uni = qc->tp.initial_max_streams_uni;
     qc->streams.client_max_streams_bidi = qc->tp.initial_max_streams_bidi;
 
-    qc->congestion.window = ngx_min(10 * qc->tp.max_udp_payload_size,
-                                    ngx_max(2 * qc->tp.max_udp_payload_size,
-                                            14720));
-    qc->congestion.ssthresh = (size_t) -1;
-    qc->congestion.recovery_start = ngx_current_msec;
-
     if (pkt->validated && pkt->retried) {
         qc->tp.retry_scid.len = pkt->dcid.len;
         qc->tp.retry_scid.data = ngx_pstrdup(c->pool, &pkt->dcid);
@@ -335,6 +403,8 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
         return NULL;
     }
 
+    ngx_quic_congestion_init(c);
+
     c->idle = 1;
     ngx_reusable_connection(c, 1);
 
@@ -24,10 +24,18 @@
 
 #define NGX_QUIC_MIN_INITIAL_SIZE            1200
 
+#define NGX_QUIC_CC_RENO                     0
+#define NGX_QUIC_CC_CUBIC                    1
+#define NGX_QUIC_CC_BBR                      2
+
 #define NGX_QUIC_STREAM_SERVER_INITIATED     0x01
 #define NGX_QUIC_STREAM_UNIDIRECTIONAL       0x02
 
 
+#define ngx_quic_memory_pressure(m)                                           \
+    ((m)->limit && (m)->used > (m)->limit / 4 * 3)
+
+
 typedef ngx_int_t (*ngx_quic_init_pt)(ngx_connection_t *c);
 typedef void (*ngx_quic_shutdown_pt)(ngx_connection_t *c);
 
@@ -52,6 +60,24 @@ typedef enum {
 } ngx_quic_stream_recv_state_e;
 
 
+typedef struct {
+    ngx_queue_t                    free;
+    ngx_queue_t                    blocks;
+    size_t                         size;
+    ngx_uint_t                     nchunks;
+} ngx_quic_chunk_cache_t;
+
+
+typedef struct {
+    size_t                         limit;
+    ngx_uint_t                     used;
+    ngx_uint_t                     cached;
+    ngx_uint_t                     denied;
+    ngx_quic_chunk_cache_t         frames;
+    ngx_quic_chunk_cache_t         buffers;
+} ngx_quic_memory_t;
+
+
 typedef struct {
     uint64_t                       size;
     uint64_t                       offset;
@@ -67,6 +93,8 @@ typedef struct {
     ngx_flag_t                     retry;
     ngx_flag_t                     gso_enabled;
     ngx_flag_t                     disable_active_migration;
+    ngx_flag_t                     pacing;
+    ngx_uint_t                     congestion_control;
     ngx_msec_t                     handshake_timeout;
     ngx_msec_t                     idle_timeout;
     ngx_str_t                      host_key;
@@ -106,12 +134,17 @@ struct ngx_quic_stream_s {
     ngx_quic_buffer_t              recv;
     ngx_quic_stream_send_state_e   send_state;
     ngx_quic_stream_recv_state_e   recv_state;
+    unsigned                       urgency:4;
     unsigned                       cancelable:1;
     unsigned                       fin_acked:1;
 };
 
 
+ngx_quic_memory_t *ngx_quic_get_memory(ngx_cycle_t *cycle);
 void ngx_quic_recvmsg(ngx_event_t *ev);
+ngx_int_t ngx_quic_dispatch_datagram(ngx_connection_t *lc, ngx_buf_t *b,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen);
 void ngx_quic_run(ngx_connection_t *c, ngx_quic_conf_t *conf);
 ngx_connection_t *ngx_quic_open_stream(ngx_connection_t *c, ngx_uint_t bidi);
 void ngx_quic_finalize_connection(ngx_connection_t *c, ngx_uint_t err,
@@ -121,6 +154,8 @@ void ngx_quic_shutdown_connection(ngx_connection_t *c, ngx_uint_t err,
 ngx_int_t ngx_quic_reset_stream(ngx_connection_t *c, ngx_uint_t err);
 ngx_int_t ngx_quic_shutdown_stream(ngx_connection_t *c, int how);
 void ngx_quic_cancelable_stream(ngx_connection_t *c);
+void ngx_quic_set_stream_priority(ngx_connection_t *c, uint64_t id,
+    ngx_uint_t urgency);
 ngx_int_t ngx_quic_get_packet_dcid(ngx_log_t *log, u_char *data, size_t len,
     ngx_str_t *dcid);
 ngx_int_t ngx_quic_derive_key(ngx_log_t *log, const char *label,
@@ -40,9 +40,6 @@ static void ngx_quic_drop_ack_ranges(ngx_connection_t *c,
 static ngx_int_t ngx_quic_detect_lost(ngx_connection_t *c,
     ngx_quic_ack_stat_t *st);
 static ngx_msec_t ngx_quic_pcg_duration(ngx_connection_t *c);
-static void ngx_quic_persistent_congestion(ngx_connection_t *c);
-static void ngx_quic_congestion_lost(ngx_connection_t *c,
-    ngx_quic_frame_t *frame);
 static void ngx_quic_lost_handler(ngx_event_t *ev);
 
 
@@ -310,70 +307,6 @@ ngx_quic_handle_ack_frame_range(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
 }
 
 
-void
-ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
-{
-    ngx_uint_t              blocked;
-    ngx_msec_t              timer;
-    ngx_quic_congestion_t  *cg;
-    ngx_quic_connection_t  *qc;
-
-    if (f->plen == 0) {
-        return;
-    }
-
-    qc = ngx_quic_get_connection(c);
-    cg = &qc->congestion;
-
-    if (f->pnum < qc->rst_pnum) {
-        return;
-    }
-
-    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
-
-    cg->in_flight -= f->plen;
-
-    timer = f->send_time - cg->recovery_start;
-
-    if ((ngx_msec_int_t) timer <= 0) {
-        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic congestion ack recovery win:%uz ss:%z if:%uz",
-                       cg->window, cg->ssthresh, cg->in_flight);
-
-        goto done;
-    }
-
-    if (cg->window < cg->ssthresh) {
-        cg->window += f->plen;
-
-        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic congestion slow start win:%uz ss:%z if:%uz",
-                       cg->window, cg->ssthresh, cg->in_flight);
-
-    } else {
-        cg->window += qc->tp.max_udp_payload_size * f->plen / cg->window;
-
-        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic congestion avoidance win:%uz ss:%z if:%uz",
-                       cg->window, cg->ssthresh, cg->in_flight);
-    }
-
-    /* prevent recovery_start from wrapping */
-
-    timer = cg->recovery_start - ngx_current_msec + qc->tp.max_idle_timeout * 2;
-
-    if ((ngx_msec_int_t) timer < 0) {
-        cg->recovery_start = ngx_current_msec - qc->tp.max_idle_timeout * 2;
-    }
-
-done:
-
-    if (blocked && cg->in_flight < cg->window) {
-        ngx_post_event(&qc->push, &ngx_posted_events);
-    }
-}
-
-
 static void
 ngx_quic_drop_ack_ranges(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
     uint64_t pn)
@@ -511,7 +444,7 @@ ngx_quic_detect_lost(ngx_connection_t *c, ngx_quic_ack_stat_t *st)
     if (st && nlost >= 2 && (st->newest < oldest || st->oldest > newest)) {
 
         if (newest - oldest > ngx_quic_pcg_duration(c)) {
-            ngx_quic_persistent_congestion(c);
+            ngx_quic_congestion_persistent(c);
         }
     }
 
@@ -538,23 +471,6 @@ ngx_quic_pcg_duration(ngx_connection_t *c)
 }
 
 
-static void
-ngx_quic_persistent_congestion(ngx_connection_t *c)
-{
-    ngx_quic_congestion_t  *cg;
-    ngx_quic_connection_t  *qc;
-
-    qc = ngx_quic_get_connection(c);
-    cg = &qc->congestion;
-
-    cg->recovery_start = ngx_current_msec;
-    cg->window = qc->tp.max_udp_payload_size * 2;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "quic persistent congestion win:%uz", cg->window);
-}
-
-
 void
 ngx_quic_resend_frames(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
 {
@@ -655,61 +571,6 @@ ngx_quic_resend_frames(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
 }
 
 
-static void
-ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
-{
-    ngx_uint_t              blocked;
-    ngx_msec_t              timer;
-    ngx_quic_congestion_t  *cg;
-    ngx_quic_connection_t  *qc;
-
-    if (f->plen == 0) {
-        return;
-    }
-
-    qc = ngx_quic_get_connection(c);
-    cg = &qc->congestion;
-
-    if (f->pnum < qc->rst_pnum) {
-        return;
-    }
-
-    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
-
-    cg->in_flight -= f->plen;
-    f->plen = 0;
-
-    timer = f->send_time - cg->recovery_start;
-
-    if ((ngx_msec_int_t) timer <= 0) {
-        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic congestion lost recovery win:%uz ss:%z if:%uz",
-                       cg->window, cg->ssthresh, cg->in_flight);
-
-        goto done;
-    }
-
-    cg->recovery_start = ngx_current_msec;
-    cg->window /= 2;
-
-    if (cg->window < qc->tp.max_udp_payload_size * 2) {
-        cg->window = qc->tp.max_udp_payload_size * 2;
-    }
-
-    cg->ssthresh = cg->window;
-
-    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "quic congestion lost win:%uz ss:%z if:%uz",
-                   cg->window, cg->ssthresh, cg->in_flight);
-
-done:
-
-    if (blocked && cg->in_flight < cg->window) {
-        ngx_post_event(&qc->push, &ngx_posted_events);
-    }
-}
-
-
 void
 ngx_quic_set_lost_timer(ngx_connection_t *c)
 {
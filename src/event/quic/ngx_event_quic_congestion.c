@@ -0,0 +1,1166 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+#define ngx_quic_cc_mss(qc)                                                   \
+    ((qc)->path ? (qc)->path->mtu : NGX_QUIC_MIN_INITIAL_SIZE)
+
+#define ngx_quic_cc_initial_window(mss)                                       \
+    ngx_min(10 * (mss), ngx_max(2 * (mss), 14720))
+
+/* pacing burst allowance, ms */
+#define NGX_QUIC_PACING_QUANTUM              2
+
+/* RFC 9438: beta_cubic = 0.7, C = 0.4 */
+#define NGX_QUIC_CUBIC_BETA                  70
+#define NGX_QUIC_CUBIC_ALPHA                 53
+#define NGX_QUIC_CUBIC_MAX_T                 100000
+
+#define NGX_QUIC_BBR_UNIT                    256
+#define NGX_QUIC_BBR_HIGH_GAIN               739  /* 2.885 */
+#define NGX_QUIC_BBR_DRAIN_GAIN              88   /* 1 / 2.885 */
+#define NGX_QUIC_BBR_CWND_GAIN               512
+#define NGX_QUIC_BBR_CYCLE_LEN               8
+#define NGX_QUIC_BBR_MIN_RTT_WINDOW          10000
+#define NGX_QUIC_BBR_PROBE_RTT_TIME          200
+#define NGX_QUIC_BBR_MIN_CWND                4
+#define NGX_QUIC_BBR_LOSS_THRESH             50   /* 2% */
+
+#define NGX_QUIC_BBR_STARTUP                 0
+#define NGX_QUIC_BBR_DRAIN                   1
+#define NGX_QUIC_BBR_PROBE_BW                2
+#define NGX_QUIC_BBR_PROBE_RTT               3
+
+
+static void ngx_quic_congestion_rate_sample(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+static ngx_uint_t ngx_quic_congestion_recovery(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+static void ngx_quic_congestion_recovery_wrap(ngx_connection_t *c);
+static void ngx_quic_congestion_pacing_rate(ngx_connection_t *c);
+
+static void ngx_quic_reno_init(ngx_connection_t *c);
+static void ngx_quic_reno_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_reno_lost(ngx_connection_t *c, ngx_quic_frame_t *f,
+    size_t plen);
+static void ngx_quic_reno_persistent(ngx_connection_t *c);
+
+static uint64_t ngx_quic_cubic_root(uint64_t n);
+static void ngx_quic_cubic_init(ngx_connection_t *c);
+static void ngx_quic_cubic_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_cubic_lost(ngx_connection_t *c, ngx_quic_frame_t *f,
+    size_t plen);
+static void ngx_quic_cubic_persistent(ngx_connection_t *c);
+
+static void ngx_quic_bbr_init(ngx_connection_t *c);
+static void ngx_quic_bbr_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_bbr_lost(ngx_connection_t *c, ngx_quic_frame_t *f,
+    size_t plen);
+static void ngx_quic_bbr_persistent(ngx_connection_t *c);
+static void ngx_quic_bbr_update_bw(ngx_connection_t *c);
+static void ngx_quic_bbr_update_state(ngx_connection_t *c,
+    ngx_quic_frame_t *f);
+static void ngx_quic_bbr_enter_probe_bw(ngx_connection_t *c);
+static void ngx_quic_bbr_update_cwnd(ngx_connection_t *c, size_t acked);
+static size_t ngx_quic_bbr_bdp(ngx_connection_t *c, ngx_uint_t gain);
+static void ngx_quic_bbr_pacing_rate(ngx_connection_t *c);
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_reno = {
+    ngx_string("reno"),
+    ngx_quic_reno_init,
+    ngx_quic_reno_ack,
+    ngx_quic_reno_lost,
+    ngx_quic_reno_persistent
+};
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_cubic = {
+    ngx_string("cubic"),
+    ngx_quic_cubic_init,
+    ngx_quic_cubic_ack,
+    ngx_quic_cubic_lost,
+    ngx_quic_cubic_persistent
+};
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_bbr = {
+    ngx_string("bbr"),
+    ngx_quic_bbr_init,
+    ngx_quic_bbr_ack,
+    ngx_quic_bbr_lost,
+    ngx_quic_bbr_persistent
+};
+
+
+/* indexed by NGX_QUIC_CC_* */
+
+static ngx_quic_congestion_ops_t  *ngx_quic_congestion_ops[] = {
+    &ngx_quic_reno,
+    &ngx_quic_cubic,
+    &ngx_quic_bbr
+};
+
+
+static ngx_uint_t  ngx_quic_bbr_gain_cycle[NGX_QUIC_BBR_CYCLE_LEN] = {
+    NGX_QUIC_BBR_UNIT * 5 / 4,
+    NGX_QUIC_BBR_UNIT * 3 / 4,
+    NGX_QUIC_BBR_UNIT, NGX_QUIC_BBR_UNIT, NGX_QUIC_BBR_UNIT,
+    NGX_QUIC_BBR_UNIT, NGX_QUIC_BBR_UNIT, NGX_QUIC_BBR_UNIT
+};
+
+
+void
+ngx_quic_congestion_init(ngx_connection_t *c)
+{
+    size_t                  mss;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    ngx_memzero(cg, sizeof(ngx_quic_congestion_t));
+
+    cg->ops = ngx_quic_congestion_ops[qc->conf->congestion_control];
+
+    cg->ssthresh = (size_t) -1;
+    cg->recovery_start = ngx_current_msec;
+
+    /* BBR relies on pacing, its model is not meaningful without it */
+    cg->pacing = (qc->conf->pacing || cg->ops == &ngx_quic_bbr) ? 1 : 0;
+    cg->pacing_time = ngx_current_msec;
+
+    cg->ops->init(c);
+
+    mss = ngx_quic_cc_mss(qc);
+    cg->pacing_budget = ngx_max(cg->window, 10 * mss);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion %V init win:%uz pacing:%uL",
+                   &cg->ops->name, cg->window, cg->pacing_rate);
+}
+
+
+void
+ngx_quic_congestion_sent(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (cg->in_flight == 0) {
+        cg->first_sent_time = f->send_time;
+        cg->delivered_time = f->send_time;
+    }
+
+    f->delivered = cg->delivered;
+    f->delivered_time = cg->delivered_time;
+    f->first_sent_time = cg->first_sent_time;
+    f->app_limited = cg->app_limited ? 1 : 0;
+
+    cg->in_flight += f->plen;
+}
+
+
+void
+ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_uint_t              blocked;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (f->pnum < qc->rst_pnum) {
+        return;
+    }
+
+    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
+
+    cg->in_flight -= f->plen;
+
+    ngx_quic_congestion_rate_sample(c, f);
+
+    cg->ops->ack(c, f);
+
+    if (blocked && cg->in_flight < cg->window) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+}
+
+
+void
+ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  plen;
+    ngx_uint_t              blocked;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (f->pnum < qc->rst_pnum) {
+        return;
+    }
+
+    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
+
+    plen = f->plen;
+
+    cg->in_flight -= plen;
+    f->plen = 0;
+
+    cg->ops->lost(c, f, plen);
+
+    if (blocked && cg->in_flight < cg->window) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+}
+
+
+void
+ngx_quic_congestion_persistent(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->congestion.ops->persistent(c);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic persistent congestion win:%uz",
+                   qc->congestion.window);
+}
+
+
+void
+ngx_quic_congestion_app_limited(ngx_connection_t *c)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (cg->paced || cg->in_flight >= cg->window) {
+        return;
+    }
+
+    /* RFC draft-cheng-iccrg-delivery-rate-estimation, 3.4 */
+
+    cg->app_limited = cg->delivered + cg->in_flight;
+
+    if (cg->app_limited == 0) {
+        cg->app_limited = 1;
+    }
+}
+
+
+static void
+ngx_quic_congestion_rate_sample(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_msec_t              now, interval, ack_elapsed;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    now = ngx_current_msec;
+
+    cg->delivered += f->plen;
+    cg->delivered_time = now;
+
+    if (cg->app_limited && cg->delivered > cg->app_limited) {
+        cg->app_limited = 0;
+    }
+
+    cg->rate_valid = 0;
+
+    if (f->level != ssl_encryption_application) {
+        return;
+    }
+
+    interval = f->send_time - f->first_sent_time;
+    ack_elapsed = now - f->delivered_time;
+
+    interval = ngx_max(interval, ack_elapsed);
+    interval = ngx_max(interval, 1);
+
+    cg->first_sent_time = f->send_time;
+
+    cg->rate_delivered = cg->delivered - f->delivered;
+    cg->rate_app_limited = f->app_limited;
+    cg->rate_rtt = now - f->send_time;
+    cg->rate = cg->rate_delivered * 1000 / interval;
+    cg->rate_valid = 1;
+}
+
+
+static ngx_uint_t
+ngx_quic_congestion_recovery(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_msec_t              timer;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    timer = f->send_time - qc->congestion.recovery_start;
+
+    return ((ngx_msec_int_t) timer <= 0) ? 1 : 0;
+}
+
+
+static void
+ngx_quic_congestion_recovery_wrap(ngx_connection_t *c)
+{
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    /* prevent recovery_start from wrapping */
+
+    timer = cg->recovery_start - ngx_current_msec + qc->tp.max_idle_timeout * 2;
+
+    if ((ngx_msec_int_t) timer < 0) {
+        cg->recovery_start = ngx_current_msec - qc->tp.max_idle_timeout * 2;
+    }
+}
+
+
+static void
+ngx_quic_congestion_pacing_rate(ngx_connection_t *c)
+{
+    ngx_uint_t              gain;
+    ngx_msec_t              rtt;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (!cg->pacing) {
+        return;
+    }
+
+    /*
+     * RFC 9002, 7.7.  Pacing: rate = N * congestion_window / smoothed_rtt,
+     * with N = 2 in slow start and 1.25 in congestion avoidance
+     */
+
+    gain = (cg->window < cg->ssthresh) ? 200 : 125;
+    rtt = ngx_max(qc->avg_rtt, 1);
+
+    cg->pacing_rate = (uint64_t) cg->window * gain * 10 / rtt;
+}
+
+
+ngx_int_t
+ngx_quic_pacing_check(ngx_connection_t *c, size_t queued)
+{
+    size_t                  mss;
+    ssize_t                 burst;
+    uint64_t                need;
+    ngx_msec_t              now, elapsed, delay;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (!cg->pacing || cg->pacing_rate == 0) {
+        return NGX_OK;
+    }
+
+    mss = ngx_quic_cc_mss(qc);
+
+    now = ngx_current_msec;
+    elapsed = now - cg->pacing_time;
+
+    if (elapsed) {
+        cg->pacing_time = now;
+
+        burst = ngx_max(cg->pacing_rate * NGX_QUIC_PACING_QUANTUM / 1000,
+                        10 * mss);
+
+        elapsed = ngx_min(elapsed, 1000);
+        cg->pacing_budget += cg->pacing_rate * elapsed / 1000;
+
+        if (cg->pacing_budget > burst) {
+            cg->pacing_budget = burst;
+        }
+    }
+
+    if (cg->pacing_budget > (ssize_t) queued) {
+        return NGX_OK;
+    }
+
+    cg->paced = 1;
+
+    if (!qc->push.timer_set && !qc->closing) {
+        need = queued - cg->pacing_budget + mss;
+        delay = need * 1000 / cg->pacing_rate + 1;
+
+        /* do not hold back acknowledgements for longer than allowed */
+        delay = ngx_min(delay, qc->tp.max_ack_delay);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic pacing delay:%M rate:%uL",
+                       delay, cg->pacing_rate);
+
+        ngx_add_timer(&qc->push, ngx_max(delay, 1));
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_quic_pacing_sent(ngx_connection_t *c, size_t len)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc->congestion.pacing) {
+        qc->congestion.pacing_budget -= len;
+    }
+}
+
+
+static void
+ngx_quic_reno_init(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->congestion.window =
+                   ngx_quic_cc_initial_window(qc->tp.max_udp_payload_size);
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_reno_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (ngx_quic_congestion_recovery(c, f)) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion ack recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        return;
+    }
+
+    if (cg->window < cg->ssthresh) {
+        cg->window += f->plen;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion slow start win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+
+    } else {
+        cg->window += qc->tp.max_udp_payload_size * f->plen / cg->window;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion avoidance win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+    }
+
+    ngx_quic_congestion_recovery_wrap(c);
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_reno_lost(ngx_connection_t *c, ngx_quic_frame_t *f, size_t plen)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (ngx_quic_congestion_recovery(c, f)) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion lost recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        return;
+    }
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window /= 2;
+
+    if (cg->window < qc->tp.max_udp_payload_size * 2) {
+        cg->window = qc->tp.max_udp_payload_size * 2;
+    }
+
+    cg->ssthresh = cg->window;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion lost win:%uz ss:%z if:%uz",
+                   cg->window, cg->ssthresh, cg->in_flight);
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_reno_persistent(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->congestion.recovery_start = ngx_current_msec;
+    qc->congestion.window = qc->tp.max_udp_payload_size * 2;
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+/* Hacker's Delight, 11-2: integer cube root */
+
+static uint64_t
+ngx_quic_cubic_root(uint64_t n)
+{
+    int       s;
+    uint64_t  y, b;
+
+    y = 0;
+
+    for (s = 63; s >= 0; s -= 3) {
+        y += y;
+        b = 3 * y * (y + 1) + 1;
+
+        if ((n >> s) >= b) {
+            n -= b << s;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+
+static void
+ngx_quic_cubic_init(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->congestion.window = ngx_quic_cc_initial_window(ngx_quic_cc_mss(qc));
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_cubic_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  mss, target, delta;
+    uint64_t                d;
+    ngx_uint_t              alpha;
+    ngx_msec_t              t, now;
+    ngx_quic_cubic_t       *cb;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    cb = &cg->u.cubic;
+
+    if (ngx_quic_congestion_recovery(c, f)) {
+        return;
+    }
+
+    if (cg->window < cg->ssthresh) {
+        cg->window += f->plen;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic cubic slow start win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        goto done;
+    }
+
+    mss = ngx_quic_cc_mss(qc);
+    now = ngx_current_msec;
+
+    if (!cb->epoch) {
+        cb->epoch = 1;
+        cb->epoch_start = now;
+        cb->w_est = cg->window;
+
+        if (cg->window < cb->w_max) {
+            /* RFC 9438, 4.2: K = cubic_root((W_max - cwnd_epoch) / C) */
+            cb->k = ngx_quic_cubic_root((uint64_t) (cb->w_max - cg->window)
+                                        * 2500000000 / mss);
+            cb->origin = cb->w_max;
+
+        } else {
+            cb->k = 0;
+            cb->origin = cg->window;
+        }
+    }
+
+    /* W_cubic(t + RTT), t and K in ms */
+
+    t = now - cb->epoch_start + qc->avg_rtt;
+
+    d = (t > cb->k) ? t - cb->k : cb->k - t;
+    d = ngx_min(d, NGX_QUIC_CUBIC_MAX_T);
+
+    delta = (d * d * d / 1000) * 4 * mss / 10000000;
+
+    if (t > cb->k) {
+        target = cb->origin + delta;
+
+    } else {
+        target = (cb->origin > delta) ? cb->origin - delta : 0;
+    }
+
+    target = ngx_min(target, cg->window + cg->window / 2);
+
+    /* RFC 9438, 4.3: Reno-friendly region */
+
+    alpha = (cb->w_est >= cb->origin) ? 100 : NGX_QUIC_CUBIC_ALPHA;
+    cb->w_est += alpha * mss * f->plen / (100 * cg->window);
+
+    if (cb->w_est > target) {
+        if (cb->w_est > cg->window) {
+            cg->window = cb->w_est;
+        }
+
+    } else if (target > cg->window) {
+        cg->window += (target - cg->window) * f->plen / cg->window;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic cubic avoidance win:%uz target:%uz est:%uz if:%uz",
+                   cg->window, target, cb->w_est, cg->in_flight);
+
+done:
+
+    ngx_quic_congestion_recovery_wrap(c);
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_cubic_lost(ngx_connection_t *c, ngx_quic_frame_t *f, size_t plen)
+{
+    size_t                  mss;
+    ngx_quic_cubic_t       *cb;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    cb = &cg->u.cubic;
+
+    if (ngx_quic_congestion_recovery(c, f)) {
+        return;
+    }
+
+    mss = ngx_quic_cc_mss(qc);
+
+    cg->recovery_start = ngx_current_msec;
+
+    /* RFC 9438, 4.7: fast convergence */
+
+    if (cg->window < cb->w_max) {
+        cb->w_max = cg->window * (100 + NGX_QUIC_CUBIC_BETA) / 200;
+
+    } else {
+        cb->w_max = cg->window;
+    }
+
+    cg->window = cg->window * NGX_QUIC_CUBIC_BETA / 100;
+    cg->window = ngx_max(cg->window, 2 * mss);
+    cg->ssthresh = cg->window;
+
+    cb->epoch = 0;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic cubic lost win:%uz wmax:%uz if:%uz",
+                   cg->window, cb->w_max, cg->in_flight);
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_cubic_persistent(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    qc->congestion.recovery_start = ngx_current_msec;
+    qc->congestion.window = 2 * ngx_quic_cc_mss(qc);
+    qc->congestion.u.cubic.epoch = 0;
+
+    ngx_quic_congestion_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_bbr_init(ngx_connection_t *c)
+{
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    bbr = &qc->congestion.u.bbr;
+
+    qc->congestion.window = ngx_quic_cc_initial_window(ngx_quic_cc_mss(qc));
+
+    bbr->state = NGX_QUIC_BBR_STARTUP;
+    bbr->pacing_gain = NGX_QUIC_BBR_HIGH_GAIN;
+    bbr->cwnd_gain = NGX_QUIC_BBR_HIGH_GAIN;
+    bbr->min_rtt = NGX_TIMER_INFINITE;
+    bbr->min_rtt_stamp = ngx_current_msec;
+
+    ngx_quic_bbr_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_bbr_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    bbr->round_start = 0;
+
+    if (f->delivered >= bbr->next_round_delivered) {
+        bbr->next_round_delivered = cg->delivered;
+        bbr->round_count++;
+        bbr->round_start = 1;
+
+        bbr->bw[bbr->round_count % NGX_QUIC_BBR_BW_ROUNDS] = 0;
+
+        if (!bbr->loss_in_round && bbr->inflight_hi
+            && bbr->state == NGX_QUIC_BBR_PROBE_BW
+            && bbr->pacing_gain > NGX_QUIC_BBR_UNIT)
+        {
+            /* no excessive loss while probing up, relax the bound */
+
+            bbr->inflight_hi += bbr->inflight_hi / 4;
+
+            if (bbr->inflight_hi
+                > 2 * ngx_quic_bbr_bdp(c, NGX_QUIC_BBR_CWND_GAIN))
+            {
+                bbr->inflight_hi = 0;
+            }
+        }
+
+        bbr->loss_in_round = 0;
+        bbr->round_lost = 0;
+        bbr->round_delivered = cg->delivered;
+    }
+
+    ngx_quic_bbr_update_bw(c);
+    ngx_quic_bbr_update_state(c, f);
+    ngx_quic_bbr_update_cwnd(c, f->plen);
+    ngx_quic_bbr_pacing_rate(c);
+
+    ngx_log_debug6(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic bbr ack state:%ui win:%uz if:%uz bw:%uL rtt:%M "
+                   "hi:%uz", bbr->state, cg->window, cg->in_flight,
+                   bbr->max_bw, bbr->min_rtt, bbr->inflight_hi);
+}
+
+
+static void
+ngx_quic_bbr_update_bw(ngx_connection_t *c)
+{
+    uint64_t               *slot;
+    ngx_uint_t              i;
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    if (!cg->rate_valid) {
+        return;
+    }
+
+    if (cg->rate_app_limited && cg->rate < bbr->max_bw) {
+        return;
+    }
+
+    slot = &bbr->bw[bbr->round_count % NGX_QUIC_BBR_BW_ROUNDS];
+
+    if (cg->rate > *slot) {
+        *slot = cg->rate;
+    }
+
+    bbr->max_bw = 0;
+
+    for (i = 0; i < NGX_QUIC_BBR_BW_ROUNDS; i++) {
+        bbr->max_bw = ngx_max(bbr->max_bw, bbr->bw[i]);
+    }
+}
+
+
+static void
+ngx_quic_bbr_update_state(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_uint_t              gain, expired, advance;
+    ngx_msec_t              now, rtt;
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    now = ngx_current_msec;
+
+    /* full pipe: bandwidth did not grow by 25% for 3 rounds */
+
+    if (!bbr->filled_pipe && bbr->round_start && !cg->rate_app_limited) {
+
+        if (bbr->max_bw >= bbr->full_bw + bbr->full_bw / 4) {
+            bbr->full_bw = bbr->max_bw;
+            bbr->full_bw_count = 0;
+
+        } else if (++bbr->full_bw_count >= 3) {
+            bbr->filled_pipe = 1;
+        }
+    }
+
+    if (bbr->state == NGX_QUIC_BBR_STARTUP && bbr->filled_pipe) {
+        bbr->state = NGX_QUIC_BBR_DRAIN;
+        bbr->pacing_gain = NGX_QUIC_BBR_DRAIN_GAIN;
+        bbr->cwnd_gain = NGX_QUIC_BBR_HIGH_GAIN;
+    }
+
+    if (bbr->state == NGX_QUIC_BBR_DRAIN
+        && cg->in_flight <= ngx_quic_bbr_bdp(c, NGX_QUIC_BBR_UNIT))
+    {
+        ngx_quic_bbr_enter_probe_bw(c);
+    }
+
+    if (bbr->state == NGX_QUIC_BBR_PROBE_BW) {
+        gain = bbr->pacing_gain;
+        advance = (now - bbr->cycle_stamp > bbr->min_rtt) ? 1 : 0;
+
+        if (gain > NGX_QUIC_BBR_UNIT) {
+            advance = advance
+                      && (bbr->loss_in_round
+                          || cg->in_flight >= ngx_quic_bbr_bdp(c, gain));
+
+        } else if (gain < NGX_QUIC_BBR_UNIT) {
+            advance = advance
+                      || cg->in_flight <= ngx_quic_bbr_bdp(c,
+                                                          NGX_QUIC_BBR_UNIT);
+        }
+
+        if (advance) {
+            bbr->cycle_index = (bbr->cycle_index + 1) % NGX_QUIC_BBR_CYCLE_LEN;
+            bbr->cycle_stamp = now;
+            bbr->pacing_gain = ngx_quic_bbr_gain_cycle[bbr->cycle_index];
+        }
+    }
+
+    /* min_rtt filter and PROBE_RTT */
+
+    expired = (now - bbr->min_rtt_stamp > NGX_QUIC_BBR_MIN_RTT_WINDOW) ? 1 : 0;
+
+    if (cg->rate_valid) {
+        rtt = cg->rate_rtt;
+
+        if (rtt <= bbr->min_rtt || expired) {
+            bbr->min_rtt = rtt;
+            bbr->min_rtt_stamp = now;
+        }
+    }
+
+    if (expired && bbr->state != NGX_QUIC_BBR_PROBE_RTT) {
+        bbr->state = NGX_QUIC_BBR_PROBE_RTT;
+        bbr->pacing_gain = NGX_QUIC_BBR_UNIT;
+        bbr->cwnd_gain = NGX_QUIC_BBR_UNIT;
+        bbr->prior_cwnd = ngx_max(bbr->prior_cwnd, cg->window);
+        bbr->probe_rtt_done = 0;
+        bbr->probe_rtt_round_done = 0;
+    }
+
+    if (bbr->state != NGX_QUIC_BBR_PROBE_RTT) {
+        return;
+    }
+
+    if (bbr->probe_rtt_done == 0) {
+
+        if (cg->in_flight
+            <= NGX_QUIC_BBR_MIN_CWND * ngx_quic_cc_mss(qc))
+        {
+            bbr->probe_rtt_done = now + NGX_QUIC_BBR_PROBE_RTT_TIME;
+            bbr->probe_rtt_done += (bbr->probe_rtt_done == 0);
+            bbr->probe_rtt_round_done = 0;
+            bbr->next_round_delivered = cg->delivered;
+        }
+
+        return;
+    }
+
+    if (bbr->round_start) {
+        bbr->probe_rtt_round_done = 1;
+    }
+
+    if (bbr->probe_rtt_round_done
+        && (ngx_msec_int_t) (now - bbr->probe_rtt_done) >= 0)
+    {
+        bbr->min_rtt_stamp = now;
+        cg->window = ngx_max(cg->window, bbr->prior_cwnd);
+        bbr->prior_cwnd = 0;
+
+        if (bbr->filled_pipe) {
+            ngx_quic_bbr_enter_probe_bw(c);
+
+        } else {
+            bbr->state = NGX_QUIC_BBR_STARTUP;
+            bbr->pacing_gain = NGX_QUIC_BBR_HIGH_GAIN;
+            bbr->cwnd_gain = NGX_QUIC_BBR_HIGH_GAIN;
+        }
+    }
+}
+
+
+static void
+ngx_quic_bbr_enter_probe_bw(ngx_connection_t *c)
+{
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    bbr = &qc->congestion.u.bbr;
+
+    bbr->state = NGX_QUIC_BBR_PROBE_BW;
+    bbr->cwnd_gain = NGX_QUIC_BBR_CWND_GAIN;
+
+    /* start at a random phase, but not at the draining one */
+
+    bbr->cycle_index = ngx_random() % (NGX_QUIC_BBR_CYCLE_LEN - 1);
+
+    if (bbr->cycle_index >= 1) {
+        bbr->cycle_index++;
+    }
+
+    bbr->cycle_stamp = ngx_current_msec;
+    bbr->pacing_gain = ngx_quic_bbr_gain_cycle[bbr->cycle_index];
+}
+
+
+static void
+ngx_quic_bbr_update_cwnd(ngx_connection_t *c, size_t acked)
+{
+    size_t                  mss, target, min;
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    mss = ngx_quic_cc_mss(qc);
+    min = NGX_QUIC_BBR_MIN_CWND * mss;
+
+    target = ngx_quic_bbr_bdp(c, bbr->cwnd_gain) + 3 * mss;
+
+    if (bbr->filled_pipe) {
+        cg->window = ngx_min(cg->window + acked, target);
+
+    } else if (cg->window < target
+               || cg->delivered < ngx_quic_cc_initial_window(mss))
+    {
+        cg->window += acked;
+    }
+
+    if (bbr->inflight_hi && cg->window > bbr->inflight_hi) {
+        cg->window = bbr->inflight_hi;
+    }
+
+    cg->window = ngx_max(cg->window, min);
+
+    if (bbr->state == NGX_QUIC_BBR_PROBE_RTT) {
+        cg->window = ngx_min(cg->window, min);
+    }
+}
+
+
+static size_t
+ngx_quic_bbr_bdp(ngx_connection_t *c, ngx_uint_t gain)
+{
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    bbr = &qc->congestion.u.bbr;
+
+    if (bbr->max_bw == 0 || bbr->min_rtt == NGX_TIMER_INFINITE) {
+        return ngx_quic_cc_initial_window(ngx_quic_cc_mss(qc))
+               * gain / NGX_QUIC_BBR_UNIT;
+    }
+
+    return bbr->max_bw * ngx_max(bbr->min_rtt, 1) / 1000
+           * gain / NGX_QUIC_BBR_UNIT;
+}
+
+
+static void
+ngx_quic_bbr_pacing_rate(ngx_connection_t *c)
+{
+    uint64_t                rate;
+    ngx_msec_t              rtt;
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    if (bbr->max_bw) {
+        rate = bbr->max_bw * bbr->pacing_gain / NGX_QUIC_BBR_UNIT;
+
+    } else {
+        rtt = (bbr->min_rtt != NGX_TIMER_INFINITE) ? bbr->min_rtt
+                                                   : qc->avg_rtt;
+        rtt = ngx_max(rtt, 1);
+
+        rate = (uint64_t) cg->window * bbr->pacing_gain * 1000
+               / (NGX_QUIC_BBR_UNIT * rtt);
+    }
+
+    /* do not slow down before the pipe is estimated to be full */
+
+    if (bbr->filled_pipe || rate > cg->pacing_rate) {
+        cg->pacing_rate = rate;
+    }
+}
+
+
+static void
+ngx_quic_bbr_lost(ngx_connection_t *c, ngx_quic_frame_t *f, size_t plen)
+{
+    size_t                  mss, inflight;
+    uint64_t                delivered;
+    ngx_quic_bbr_t         *bbr;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+    bbr = &cg->u.bbr;
+
+    bbr->round_lost += plen;
+
+    if (bbr->loss_in_round) {
+        return;
+    }
+
+    delivered = cg->delivered - bbr->round_delivered;
+
+    if (bbr->round_lost * NGX_QUIC_BBR_LOSS_THRESH
+        <= delivered + bbr->round_lost)
+    {
+        return;
+    }
+
+    /* BBRv2: loss rate exceeds the threshold, bound the in-flight data */
+
+    bbr->loss_in_round = 1;
+
+    mss = ngx_quic_cc_mss(qc);
+    inflight = cg->in_flight + plen;
+
+    if (bbr->state == NGX_QUIC_BBR_STARTUP) {
+        bbr->filled_pipe = 1;
+        bbr->inflight_hi = ngx_max(inflight,
+                                   ngx_quic_bbr_bdp(c, NGX_QUIC_BBR_UNIT));
+
+    } else {
+        bbr->inflight_hi = inflight * NGX_QUIC_CUBIC_BETA / 100;
+    }
+
+    bbr->inflight_hi = ngx_max(bbr->inflight_hi,
+                               NGX_QUIC_BBR_MIN_CWND * mss);
+
+    if (cg->window > bbr->inflight_hi) {
+        cg->window = bbr->inflight_hi;
+    }
+
+    if (bbr->state == NGX_QUIC_BBR_PROBE_BW
+        && bbr->pacing_gain > NGX_QUIC_BBR_UNIT)
+    {
+        bbr->cycle_index = 1;
+        bbr->cycle_stamp = ngx_current_msec;
+        bbr->pacing_gain = ngx_quic_bbr_gain_cycle[1];
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic bbr lost win:%uz hi:%uz if:%uz",
+                   cg->window, bbr->inflight_hi, cg->in_flight);
+
+    ngx_quic_bbr_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_bbr_persistent(ngx_connection_t *c)
+{
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    /* the model is kept, the window regrows towards the target on acks */
+
+    qc->congestion.window = NGX_QUIC_BBR_MIN_CWND * ngx_quic_cc_mss(qc);
+}
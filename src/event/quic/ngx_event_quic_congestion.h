@@ -0,0 +1,116 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_
+#define _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_QUIC_BBR_BW_ROUNDS               10
+
+
+typedef struct {
+    ngx_str_t                         name;
+
+    void                            (*init)(ngx_connection_t *c);
+    void                            (*ack)(ngx_connection_t *c,
+                                          ngx_quic_frame_t *f);
+    void                            (*lost)(ngx_connection_t *c,
+                                           ngx_quic_frame_t *f, size_t plen);
+    void                            (*persistent)(ngx_connection_t *c);
+} ngx_quic_congestion_ops_t;
+
+
+typedef struct {
+    size_t                            w_max;
+    size_t                            w_est;
+    size_t                            origin;
+    ngx_msec_t                        epoch_start;
+    ngx_msec_t                        k;
+    unsigned                          epoch:1;
+} ngx_quic_cubic_t;
+
+
+typedef struct {
+    ngx_uint_t                        state;
+    ngx_uint_t                        pacing_gain;
+    ngx_uint_t                        cwnd_gain;
+
+    uint64_t                          bw[NGX_QUIC_BBR_BW_ROUNDS];
+    uint64_t                          max_bw;
+    uint64_t                          full_bw;
+    ngx_uint_t                        full_bw_count;
+
+    uint64_t                          round_count;
+    uint64_t                          next_round_delivered;
+    uint64_t                          round_lost;
+    uint64_t                          round_delivered;
+
+    ngx_msec_t                        min_rtt;
+    ngx_msec_t                        min_rtt_stamp;
+    ngx_msec_t                        probe_rtt_done;
+
+    ngx_uint_t                        cycle_index;
+    ngx_msec_t                        cycle_stamp;
+
+    size_t                            inflight_hi;
+    size_t                            prior_cwnd;
+
+    unsigned                          filled_pipe:1;
+    unsigned                          round_start:1;
+    unsigned                          probe_rtt_round_done:1;
+    unsigned                          loss_in_round:1;
+} ngx_quic_bbr_t;
+
+
+typedef struct {
+    size_t                            in_flight;
+    size_t                            window;
+    size_t                            ssthresh;
+    ngx_msec_t                        recovery_start;
+
+    ngx_quic_congestion_ops_t        *ops;
+
+    /* delivery rate estimation */
+    uint64_t                          delivered;
+    ngx_msec_t                        delivered_time;
+    ngx_msec_t                        first_sent_time;
+    uint64_t                          app_limited;
+    uint64_t                          rate;
+    uint64_t                          rate_delivered;
+    ngx_msec_t                        rate_rtt;
+
+    /* pacing */
+    uint64_t                          pacing_rate;
+    ssize_t                           pacing_budget;
+    ngx_msec_t                        pacing_time;
+
+    unsigned                          pacing:1;
+    unsigned                          paced:1;
+    unsigned                          rate_app_limited:1;
+    unsigned                          rate_valid:1;
+
+    union {
+        ngx_quic_cubic_t              cubic;
+        ngx_quic_bbr_t                bbr;
+    } u;
+} ngx_quic_congestion_t;
+
+
+void ngx_quic_congestion_init(ngx_connection_t *c);
+void ngx_quic_congestion_sent(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_congestion_persistent(ngx_connection_t *c);
+void ngx_quic_congestion_app_limited(ngx_connection_t *c);
+
+ngx_int_t ngx_quic_pacing_check(ngx_connection_t *c, size_t queued);
+void ngx_quic_pacing_sent(ngx_connection_t *c, size_t len);
+
+#endif /* _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_ */
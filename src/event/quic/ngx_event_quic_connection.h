@@ -24,6 +24,7 @@ typedef struct ngx_quic_send_ctx_s    ngx_quic_send_ctx_t;
 typedef struct ngx_quic_socket_s      ngx_quic_socket_t;
 typedef struct ngx_quic_path_s        ngx_quic_path_t;
 typedef struct ngx_quic_keys_s        ngx_quic_keys_t;
+typedef struct ngx_quic_hp_batch_s    ngx_quic_hp_batch_t;
 
 #if (NGX_QUIC_OPENSSL_COMPAT)
 #include <ngx_event_quic_openssl_compat.h>
@@ -37,8 +38,10 @@ typedef struct ngx_quic_keys_s        ngx_quic_keys_t;
 #include <ngx_event_quic_ssl.h>
 #include <ngx_event_quic_tokens.h>
 #include <ngx_event_quic_ack.h>
+#include <ngx_event_quic_congestion.h>
 #include <ngx_event_quic_output.h>
 #include <ngx_event_quic_socket.h>
+#include <ngx_event_quic_route.h>
 
 
 /* RFC 9002, 6.2.2.  Handshakes and New Paths: kInitialRtt */
@@ -164,14 +167,6 @@ typedef struct {
 } ngx_quic_streams_t;
 
 
-typedef struct {
-    size_t                            in_flight;
-    size_t                            window;
-    size_t                            ssthresh;
-    ngx_msec_t                        recovery_start;
-} ngx_quic_congestion_t;
-
-
 /*
  * RFC 9000, 12.3.  Packet Numbers
  *
@@ -249,8 +244,9 @@ struct ngx_quic_connection_s {
 
     ngx_uint_t                        pto_count;
 
-    ngx_queue_t                       free_frames;
-    ngx_buf_t                        *free_bufs;
+    ngx_quic_memory_t                *memory;
+    ngx_queue_t                       frames;
+    ngx_queue_t                       buffers;
     ngx_buf_t                        *free_shadow_bufs;
 
     ngx_uint_t                        nframes;
@@ -38,6 +38,8 @@ ngx_quic_create_server_id(ngx_connection_t *c, u_char *id)
     }
 #endif
 
+    ngx_quic_route_encode_id(id);
+
     return NGX_OK;
 }
 
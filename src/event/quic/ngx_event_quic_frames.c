@@ -12,12 +12,58 @@
 
 #define NGX_QUIC_BUFFER_SIZE  4096
 
+#define NGX_QUIC_MEMORY_CACHE  (4 * 1024 * 1024)
+
+#define NGX_QUIC_FRAME_CHUNK                                                  \
+    (sizeof(ngx_quic_chunk_t) + sizeof(ngx_quic_frame_t))
+#define NGX_QUIC_BUFFER_CHUNK                                                 \
+    (sizeof(ngx_quic_chunk_t) + NGX_QUIC_BUFFER_SIZE)
+
+/* chunks per block */
+#define NGX_QUIC_FRAME_BLOCK    32
+#define NGX_QUIC_BUFFER_BLOCK    8
+
 #define ngx_quic_buf_refs(b)         (b)->shadow->num
 #define ngx_quic_buf_inc_refs(b)     ngx_quic_buf_refs(b)++
 #define ngx_quic_buf_dec_refs(b)     ngx_quic_buf_refs(b)--
 #define ngx_quic_buf_set_refs(b, v)  ngx_quic_buf_refs(b) = v
 
 
+/*
+ * Frames and buffer data are allocated from a pool shared by all
+ * connections of a cycle rather than from connection pools, so that
+ * memory released by one connection can be reused by another.
+ *
+ * Chunks are allocated in blocks.  Each chunk is linked into the list
+ * of its owning connection while in use, and into the free list of
+ * the pool while cached.  A block is only returned to the system once
+ * none of its chunks are in use.
+ */
+
+typedef struct {
+    ngx_queue_t            queue;
+    ngx_uint_t             nused;
+} ngx_quic_block_t;
+
+
+typedef struct {
+    ngx_queue_t            queue;
+    ngx_quic_block_t      *block;
+} ngx_quic_chunk_t;
+
+
+static void ngx_quic_cleanup_memory_pool(void *data);
+static void ngx_quic_cleanup_memory(void *data);
+static ngx_quic_chunk_t *ngx_quic_alloc_chunk(ngx_connection_t *c,
+    ngx_queue_t *owned, ngx_quic_chunk_cache_t *cache);
+static ngx_int_t ngx_quic_alloc_block(ngx_connection_t *c,
+    ngx_quic_memory_t *m, ngx_quic_chunk_cache_t *cache);
+static void ngx_quic_free_chunk(ngx_quic_memory_t *m,
+    ngx_quic_chunk_cache_t *cache, ngx_quic_chunk_t *ch);
+static void ngx_quic_free_block(ngx_quic_memory_t *m,
+    ngx_quic_chunk_cache_t *cache, ngx_quic_block_t *block);
+static void ngx_quic_trim_memory(ngx_quic_memory_t *m,
+    ngx_quic_chunk_cache_t *cache);
 static ngx_buf_t *ngx_quic_alloc_buf(ngx_connection_t *c);
 static void ngx_quic_free_buf(ngx_connection_t *c, ngx_buf_t *b);
 static ngx_buf_t *ngx_quic_clone_buf(ngx_connection_t *c, ngx_buf_t *b);
@@ -25,51 +71,293 @@ static ngx_int_t ngx_quic_split_chain(ngx_connection_t *c, ngx_chain_t *cl,
     off_t offset);
 
 
+ngx_int_t
+ngx_quic_init_memory_pool(ngx_cycle_t *cycle, ngx_quic_memory_t *m)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    ngx_queue_init(&m->frames.free);
+    ngx_queue_init(&m->frames.blocks);
+    m->frames.size = NGX_QUIC_FRAME_CHUNK;
+    m->frames.nchunks = NGX_QUIC_FRAME_BLOCK;
+
+    ngx_queue_init(&m->buffers.free);
+    ngx_queue_init(&m->buffers.blocks);
+    m->buffers.size = NGX_QUIC_BUFFER_CHUNK;
+    m->buffers.nchunks = NGX_QUIC_BUFFER_BLOCK;
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_quic_cleanup_memory_pool;
+    cln->data = m;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_cleanup_memory_pool(void *data)
+{
+    ngx_quic_memory_t  *m = data;
+
+    ngx_quic_trim_memory(m, &m->frames);
+    ngx_quic_trim_memory(m, &m->buffers);
+}
+
+
+ngx_int_t
+ngx_quic_init_memory(ngx_connection_t *c, ngx_quic_connection_t *qc)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    qc->memory = ngx_quic_get_memory((ngx_cycle_t *) ngx_cycle);
+
+    ngx_queue_init(&qc->frames);
+    ngx_queue_init(&qc->buffers);
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_quic_cleanup_memory;
+    cln->data = qc;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_cleanup_memory(void *data)
+{
+    ngx_quic_connection_t  *qc = data;
+
+    ngx_queue_t        *q;
+    ngx_quic_memory_t  *m;
+
+    m = qc->memory;
+
+    while (!ngx_queue_empty(&qc->frames)) {
+        q = ngx_queue_head(&qc->frames);
+
+        ngx_quic_free_chunk(m, &m->frames,
+                            ngx_queue_data(q, ngx_quic_chunk_t, queue));
+    }
+
+    while (!ngx_queue_empty(&qc->buffers)) {
+        q = ngx_queue_head(&qc->buffers);
+
+        ngx_quic_free_chunk(m, &m->buffers,
+                            ngx_queue_data(q, ngx_quic_chunk_t, queue));
+    }
+}
+
+
+static ngx_quic_chunk_t *
+ngx_quic_alloc_chunk(ngx_connection_t *c, ngx_queue_t *owned,
+    ngx_quic_chunk_cache_t *cache)
+{
+    ngx_queue_t            *q;
+    ngx_quic_chunk_t       *ch;
+    ngx_quic_memory_t      *m;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    m = qc->memory;
+
+    if (ngx_queue_empty(&cache->free)
+        && ngx_quic_alloc_block(c, m, cache) != NGX_OK)
+    {
+        return NULL;
+    }
+
+    q = ngx_queue_head(&cache->free);
+    ngx_queue_remove(q);
+
+    ch = ngx_queue_data(q, ngx_quic_chunk_t, queue);
+    ch->block->nused++;
+
+    m->cached -= cache->size;
+    m->used += cache->size;
+
+    ngx_queue_insert_tail(owned, &ch->queue);
+
+    return ch;
+}
+
+
+static ngx_int_t
+ngx_quic_alloc_block(ngx_connection_t *c, ngx_quic_memory_t *m,
+    ngx_quic_chunk_cache_t *cache)
+{
+    u_char            *p;
+    size_t             size;
+    ngx_uint_t         i;
+    ngx_quic_chunk_t  *ch;
+    ngx_quic_block_t  *block;
+
+    size = cache->size * cache->nchunks;
+
+    if (m->limit && m->used + m->cached + size > m->limit) {
+
+        /* unused blocks of both sizes go first */
+
+        ngx_quic_trim_memory(m, &m->frames);
+        ngx_quic_trim_memory(m, &m->buffers);
+
+        if (m->used + m->cached + size > m->limit) {
+            m->denied++;
+
+            ngx_log_error(NGX_LOG_INFO, c->log, 0,
+                          "quic memory limit reached");
+            return NGX_DECLINED;
+        }
+    }
+
+    block = ngx_alloc(sizeof(ngx_quic_block_t) + size, c->log);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    block->nused = 0;
+
+    ngx_queue_insert_tail(&cache->blocks, &block->queue);
+
+    p = (u_char *) block + sizeof(ngx_quic_block_t);
+
+    for (i = 0; i < cache->nchunks; i++) {
+        ch = (ngx_quic_chunk_t *) p;
+        ch->block = block;
+
+        ngx_queue_insert_tail(&cache->free, &ch->queue);
+
+        p += cache->size;
+    }
+
+    m->cached += size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_free_chunk(ngx_quic_memory_t *m, ngx_quic_chunk_cache_t *cache,
+    ngx_quic_chunk_t *ch)
+{
+    size_t             max;
+    ngx_quic_block_t  *block;
+
+    ngx_queue_remove(&ch->queue);
+    ngx_queue_insert_head(&cache->free, &ch->queue);
+
+    m->used -= cache->size;
+    m->cached += cache->size;
+
+    block = ch->block;
+
+    if (--block->nused) {
+        return;
+    }
+
+    max = m->limit ? m->limit / 8 : NGX_QUIC_MEMORY_CACHE;
+
+    if (ngx_quic_memory_pressure(m) || m->cached > max) {
+        ngx_quic_free_block(m, cache, block);
+    }
+}
+
+
+static void
+ngx_quic_free_block(ngx_quic_memory_t *m, ngx_quic_chunk_cache_t *cache,
+    ngx_quic_block_t *block)
+{
+    u_char            *p;
+    ngx_uint_t         i;
+    ngx_quic_chunk_t  *ch;
+
+    p = (u_char *) block + sizeof(ngx_quic_block_t);
+
+    for (i = 0; i < cache->nchunks; i++) {
+        ch = (ngx_quic_chunk_t *) p;
+        ngx_queue_remove(&ch->queue);
+
+        p += cache->size;
+    }
+
+    ngx_queue_remove(&block->queue);
+
+    m->cached -= cache->size * cache->nchunks;
+
+    ngx_free(block);
+}
+
+
+static void
+ngx_quic_trim_memory(ngx_quic_memory_t *m, ngx_quic_chunk_cache_t *cache)
+{
+    ngx_queue_t       *q, *next;
+    ngx_quic_block_t  *block;
+
+    for (q = ngx_queue_head(&cache->blocks);
+         q != ngx_queue_sentinel(&cache->blocks);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        block = ngx_queue_data(q, ngx_quic_block_t, queue);
+
+        if (block->nused == 0) {
+            ngx_quic_free_block(m, cache, block);
+        }
+    }
+}
+
+
 static ngx_buf_t *
 ngx_quic_alloc_buf(ngx_connection_t *c)
 {
     u_char                 *p;
     ngx_buf_t              *b;
+    ngx_quic_chunk_t       *ch;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
 
-    b = qc->free_bufs;
+    b = qc->free_shadow_bufs;
 
     if (b) {
-        qc->free_bufs = b->shadow;
-        p = b->start;
-
-    } else {
-        b = qc->free_shadow_bufs;
-
-        if (b) {
-            qc->free_shadow_bufs = b->shadow;
+        qc->free_shadow_bufs = b->shadow;
 
 #ifdef NGX_QUIC_DEBUG_ALLOC
-            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "quic use shadow buffer n:%ui %ui",
-                           ++qc->nbufs, --qc->nshadowbufs);
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic use shadow buffer n:%ui %ui",
+                       ++qc->nbufs, --qc->nshadowbufs);
 #endif
 
-        } else {
-            b = ngx_palloc(c->pool, sizeof(ngx_buf_t));
-            if (b == NULL) {
-                return NULL;
-            }
+    } else {
+        b = ngx_palloc(c->pool, sizeof(ngx_buf_t));
+        if (b == NULL) {
+            return NULL;
+        }
 
 #ifdef NGX_QUIC_DEBUG_ALLOC
-            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                           "quic new buffer n:%ui", ++qc->nbufs);
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic new buffer n:%ui", ++qc->nbufs);
 #endif
-        }
+    }
 
-        p = ngx_pnalloc(c->pool, NGX_QUIC_BUFFER_SIZE);
-        if (p == NULL) {
-            return NULL;
-        }
+    ch = ngx_quic_alloc_chunk(c, &qc->buffers, &qc->memory->buffers);
+    if (ch == NULL) {
+        b->shadow = qc->free_shadow_bufs;
+        qc->free_shadow_bufs = b;
+        return NULL;
     }
 
+    p = (u_char *) ch + sizeof(ngx_quic_chunk_t);
+
 #ifdef NGX_QUIC_DEBUG_ALLOC
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0, "quic alloc buffer %p", b);
 #endif
@@ -110,8 +398,12 @@ ngx_quic_free_buf(ngx_connection_t *c, ngx_buf_t *b)
     shadow = b->shadow;
 
     if (ngx_quic_buf_refs(b) == 0) {
-        shadow->shadow = qc->free_bufs;
-        qc->free_bufs = shadow;
+        ngx_quic_free_chunk(qc->memory, &qc->memory->buffers,
+                            (ngx_quic_chunk_t *)
+                                (shadow->start - sizeof(ngx_quic_chunk_t)));
+
+        shadow->shadow = qc->free_shadow_bufs;
+        qc->free_shadow_bufs = shadow;
     }
 
     if (b != shadow) {
@@ -196,41 +488,30 @@ ngx_quic_split_chain(ngx_connection_t *c, ngx_chain_t *cl, off_t offset)
 ngx_quic_frame_t *
 ngx_quic_alloc_frame(ngx_connection_t *c)
 {
-    ngx_queue_t            *q;
+    ngx_quic_chunk_t       *ch;
     ngx_quic_frame_t       *frame;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
 
-    if (!ngx_queue_empty(&qc->free_frames)) {
-
-        q = ngx_queue_head(&qc->free_frames);
-        frame = ngx_queue_data(q, ngx_quic_frame_t, queue);
-
-        ngx_queue_remove(&frame->queue);
-
-#ifdef NGX_QUIC_DEBUG_ALLOC
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic reuse frame n:%ui", qc->nframes);
-#endif
+    if (qc->nframes >= 10000) {
+        ngx_log_error(NGX_LOG_INFO, c->log, 0, "quic flood detected");
+        return NULL;
+    }
 
-    } else if (qc->nframes < 10000) {
-        frame = ngx_palloc(c->pool, sizeof(ngx_quic_frame_t));
-        if (frame == NULL) {
-            return NULL;
-        }
+    ch = ngx_quic_alloc_chunk(c, &qc->frames, &qc->memory->frames);
+    if (ch == NULL) {
+        return NULL;
+    }
 
-        ++qc->nframes;
+    ++qc->nframes;
 
 #ifdef NGX_QUIC_DEBUG_ALLOC
-        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                       "quic alloc frame n:%ui", qc->nframes);
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic alloc frame n:%ui", qc->nframes);
 #endif
 
-    } else {
-        ngx_log_error(NGX_LOG_INFO, c->log, 0, "quic flood detected");
-        return NULL;
-    }
+    frame = (ngx_quic_frame_t *) ((u_char *) ch + sizeof(ngx_quic_chunk_t));
 
     ngx_memzero(frame, sizeof(ngx_quic_frame_t));
 
@@ -249,7 +530,11 @@ ngx_quic_free_frame(ngx_connection_t *c, ngx_quic_frame_t *frame)
         ngx_quic_free_chain(c, frame->data);
     }
 
-    ngx_queue_insert_head(&qc->free_frames, &frame->queue);
+    --qc->nframes;
+
+    ngx_quic_free_chunk(qc->memory, &qc->memory->frames,
+                        (ngx_quic_chunk_t *)
+                            ((u_char *) frame - sizeof(ngx_quic_chunk_t)));
 
 #ifdef NGX_QUIC_DEBUG_ALLOC
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
@@ -298,11 +583,36 @@ ngx_quic_free_frames(ngx_connection_t *c, ngx_queue_t *frames)
 void
 ngx_quic_queue_frame(ngx_quic_connection_t *qc, ngx_quic_frame_t *frame)
 {
+    ngx_queue_t          *q;
+    ngx_quic_frame_t     *f;
     ngx_quic_send_ctx_t  *ctx;
 
     ctx = ngx_quic_get_send_ctx(qc, frame->level);
 
-    ngx_queue_insert_tail(&ctx->frames, &frame->queue);
+    q = ngx_queue_last(&ctx->frames);
+
+    if (frame->type == NGX_QUIC_FT_STREAM && frame->urgency) {
+
+        /*
+         * stream data goes ahead of data of less urgent streams;
+         * other frames and data of the same stream are not reordered
+         */
+
+        while (q != ngx_queue_sentinel(&ctx->frames)) {
+            f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+            if (f->type != NGX_QUIC_FT_STREAM
+                || f->urgency <= frame->urgency
+                || f->u.stream.stream_id == frame->u.stream.stream_id)
+            {
+                break;
+            }
+
+            q = ngx_queue_prev(q);
+        }
+    }
+
+    ngx_queue_insert_after(q, &frame->queue);
 
     frame->len = ngx_quic_create_frame(NULL, frame);
     /* always succeeds */
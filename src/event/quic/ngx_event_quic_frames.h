@@ -16,6 +16,9 @@ typedef ngx_int_t (*ngx_quic_frame_handler_pt)(ngx_connection_t *c,
     ngx_quic_frame_t *frame, void *data);
 
 
+ngx_int_t ngx_quic_init_memory_pool(ngx_cycle_t *cycle, ngx_quic_memory_t *m);
+ngx_int_t ngx_quic_init_memory(ngx_connection_t *c, ngx_quic_connection_t *qc);
+
 ngx_quic_frame_t *ngx_quic_alloc_frame(ngx_connection_t *c);
 void ngx_quic_free_frame(ngx_connection_t *c, ngx_quic_frame_t *frame);
 void ngx_quic_free_frames(ngx_connection_t *c, ngx_queue_t *frames);
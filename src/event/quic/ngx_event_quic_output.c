@@ -45,6 +45,7 @@
 
 
 static ngx_int_t ngx_quic_create_datagrams(ngx_connection_t *c);
+static ngx_uint_t ngx_quic_need_pacing(ngx_connection_t *c);
 static void ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx);
 static void ngx_quic_revert_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
     uint64_t pnum);
@@ -55,7 +56,8 @@ static ssize_t ngx_quic_send_segments(ngx_connection_t *c, u_char *buf,
     size_t len, struct sockaddr *sockaddr, socklen_t socklen, size_t segment);
 #endif
 static ssize_t ngx_quic_output_packet(ngx_connection_t *c,
-    ngx_quic_send_ctx_t *ctx, u_char *data, size_t max, size_t min);
+    ngx_quic_send_ctx_t *ctx, u_char *data, size_t max, size_t min,
+    ngx_quic_hp_batch_t *hpb);
 static void ngx_quic_init_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
     ngx_quic_header_t *pkt, ngx_quic_path_t *path);
 static ngx_uint_t ngx_quic_get_padding_level(ngx_connection_t *c);
@@ -80,6 +82,8 @@ ngx_quic_output(ngx_connection_t *c)
 
     in_flight = cg->in_flight;
 
+    cg->paced = 0;
+
 #if ((NGX_HAVE_UDP_SEGMENT) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
     if (ngx_quic_allow_segmentation(c)) {
         rc = ngx_quic_create_segments(c);
@@ -93,6 +97,8 @@ ngx_quic_output(ngx_connection_t *c)
         return NGX_ERROR;
     }
 
+    ngx_quic_congestion_app_limited(c);
+
     if (in_flight == cg->in_flight || qc->closing) {
         /* no ack-eliciting data was sent or we are done */
         return NGX_OK;
@@ -129,6 +135,11 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
 
     while (cg->in_flight < cg->window) {
 
+        if (ngx_quic_need_pacing(c) && ngx_quic_pacing_check(c, 0) != NGX_OK)
+        {
+            break;
+        }
+
         p = dst;
 
         len = ngx_quic_path_limit(c, path, path->mtu);
@@ -159,7 +170,7 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
                 return NGX_OK;
             }
 
-            n = ngx_quic_output_packet(c, ctx, p, len, min);
+            n = ngx_quic_output_packet(c, ctx, p, len, min, NULL);
             if (n == NGX_ERROR) {
                 return NGX_ERROR;
             }
@@ -192,6 +203,8 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
             ngx_quic_commit_send(c, &qc->send_ctx[i]);
         }
 
+        ngx_quic_pacing_sent(c, len);
+
         path->sent += len;
     }
 
@@ -199,18 +212,57 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
 }
 
 
+static ngx_uint_t
+ngx_quic_need_pacing(ngx_connection_t *c)
+{
+    ngx_queue_t            *q;
+    ngx_quic_frame_t       *f;
+    ngx_quic_send_ctx_t    *ctx;
+    ngx_quic_connection_t  *qc;
+
+    /*
+     * only ack-eliciting application data is paced, handshake
+     * and ACK-only packets are sent as soon as possible
+     */
+
+    qc = ngx_quic_get_connection(c);
+
+    ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_initial);
+    if (!ngx_queue_empty(&ctx->frames)) {
+        return 0;
+    }
+
+    ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_handshake);
+    if (!ngx_queue_empty(&ctx->frames)) {
+        return 0;
+    }
+
+    ctx = ngx_quic_get_send_ctx(qc, ssl_encryption_application);
+
+    for (q = ngx_queue_head(&ctx->frames);
+         q != ngx_queue_sentinel(&ctx->frames);
+         q = ngx_queue_next(q))
+    {
+        f = ngx_queue_data(q, ngx_quic_frame_t, queue);
+
+        if (f->need_ack) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
 static void
 ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
 {
     ngx_queue_t            *q;
     ngx_quic_frame_t       *f;
-    ngx_quic_congestion_t  *cg;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
 
-    cg = &qc->congestion;
-
     while (!ngx_queue_empty(&ctx->sending)) {
 
         q = ngx_queue_head(&ctx->sending);
@@ -221,7 +273,7 @@ ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
         if (f->pkt_need_ack && !qc->closing) {
             ngx_queue_insert_tail(&ctx->sent, q);
 
-            cg->in_flight += f->plen;
+            ngx_quic_congestion_sent(c, f);
 
         } else {
             ngx_quic_free_frame(c, f);
@@ -229,7 +281,7 @@ ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "quic congestion send if:%uz", cg->in_flight);
+                   "quic congestion send if:%uz", qc->congestion.in_flight);
 }
 
 
@@ -308,16 +360,17 @@ ngx_quic_allow_segmentation(ngx_connection_t *c)
 static ngx_int_t
 ngx_quic_create_segments(ngx_connection_t *c)
 {
-    size_t                  len, segsize;
-    ssize_t                 n;
-    u_char                 *p, *end;
-    uint64_t                preserved_pnum;
-    ngx_uint_t              nseg;
-    ngx_quic_path_t        *path;
-    ngx_quic_send_ctx_t    *ctx;
-    ngx_quic_congestion_t  *cg;
-    ngx_quic_connection_t  *qc;
-    static u_char           dst[NGX_QUIC_MAX_UDP_SEGMENT_BUF];
+    size_t                       len, segsize;
+    ssize_t                      n;
+    u_char                      *p, *end;
+    uint64_t                     preserved_pnum;
+    ngx_uint_t                   nseg;
+    ngx_quic_path_t             *path;
+    ngx_quic_send_ctx_t         *ctx;
+    ngx_quic_congestion_t       *cg;
+    ngx_quic_connection_t       *qc;
+    static u_char                dst[NGX_QUIC_MAX_UDP_SEGMENT_BUF];
+    static ngx_quic_hp_batch_t   hpb;
 
     qc = ngx_quic_get_connection(c);
     cg = &qc->congestion;
@@ -334,6 +387,7 @@ ngx_quic_create_segments(ngx_connection_t *c)
     end = dst + sizeof(dst);
 
     nseg = 0;
+    hpb.n = 0;
 
     preserved_pnum = ctx->pnum;
 
@@ -341,9 +395,11 @@ ngx_quic_create_segments(ngx_connection_t *c)
 
         len = ngx_min(segsize, (size_t) (end - p));
 
-        if (len && cg->in_flight + (p - dst) < cg->window) {
+        if (len && cg->in_flight + (p - dst) < cg->window
+            && ngx_quic_pacing_check(c, p - dst) == NGX_OK)
+        {
 
-            n = ngx_quic_output_packet(c, ctx, p, len, len);
+            n = ngx_quic_output_packet(c, ctx, p, len, len, &hpb);
             if (n == NGX_ERROR) {
                 return NGX_ERROR;
             }
@@ -362,6 +418,13 @@ ngx_quic_create_segments(ngx_connection_t *c)
         }
 
         if (n == 0 || nseg == NGX_QUIC_MAX_SEGMENTS) {
+
+            /* header protection for all the segments at once */
+
+            if (ngx_quic_hp_batch_apply(&hpb, c->log) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
             n = ngx_quic_send_segments(c, dst, p - dst, path->sockaddr,
                                        path->socklen, segsize);
             if (n == NGX_ERROR) {
@@ -376,6 +439,7 @@ ngx_quic_create_segments(ngx_connection_t *c)
             }
 
             ngx_quic_commit_send(c, ctx);
+            ngx_quic_pacing_sent(c, n);
 
             path->sent += n;
 
@@ -501,7 +565,7 @@ ngx_quic_get_padding_level(ngx_connection_t *c)
 
 static ssize_t
 ngx_quic_output_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
-    u_char *data, size_t max, size_t min)
+    u_char *data, size_t max, size_t min, ngx_quic_hp_batch_t *hpb)
 {
     size_t                  len, pad, min_payload, max_payload;
     u_char                 *p;
@@ -543,6 +607,8 @@ ngx_quic_output_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
 
     ngx_quic_init_packet(c, ctx, &pkt, qc->path);
 
+    pkt.hp_batch = hpb;
+
     min_payload = ngx_quic_payload_size(&pkt, min);
     max_payload = ngx_quic_payload_size(&pkt, max);
 
@@ -1277,10 +1343,12 @@ ngx_quic_frame_sendto(ngx_connection_t *c, ngx_quic_frame_t *frame,
 
     path->sent += sent;
 
+    ngx_quic_pacing_sent(c, sent);
+
     if (frame->need_ack && !qc->closing) {
         ngx_queue_insert_tail(&ctx->sent, &frame->queue);
 
-        cg->in_flight += frame->plen;
+        ngx_quic_congestion_sent(c, frame);
 
     } else {
         ngx_quic_free_frame(c, frame);
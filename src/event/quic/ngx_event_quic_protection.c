@@ -41,9 +41,13 @@ static ngx_int_t ngx_quic_crypto_common(ngx_quic_secret_t *s, ngx_str_t *out,
 static ngx_int_t ngx_quic_crypto_hp_init(const EVP_CIPHER *cipher,
     ngx_quic_secret_t *s, ngx_log_t *log);
 static ngx_int_t ngx_quic_crypto_hp(ngx_quic_secret_t *s,
-    u_char *out, u_char *in, ngx_log_t *log);
+    u_char *out, u_char *in, ngx_uint_t n, ngx_log_t *log);
 static void ngx_quic_crypto_hp_cleanup(ngx_quic_secret_t *s);
 
+static ngx_int_t ngx_quic_hp_batch_add(ngx_quic_hp_batch_t *b,
+    ngx_quic_secret_t *secret, ngx_quic_header_t *pkt, u_char *first,
+    u_char *pnp, u_char *sample);
+
 static ngx_int_t ngx_quic_create_packet(ngx_quic_header_t *pkt,
     ngx_str_t *res);
 static ngx_int_t ngx_quic_create_retry_packet(ngx_quic_header_t *pkt,
@@ -63,7 +67,7 @@ ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers)
 #else
         ciphers->c = EVP_aes_128_gcm();
 #endif
-        ciphers->hp = EVP_aes_128_ctr();
+        ciphers->hp = EVP_aes_128_ecb();
         ciphers->d = EVP_sha256();
         len = 16;
         break;
@@ -74,7 +78,7 @@ ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers)
 #else
         ciphers->c = EVP_aes_256_gcm();
 #endif
-        ciphers->hp = EVP_aes_256_ctr();
+        ciphers->hp = EVP_aes_256_ecb();
         ciphers->d = EVP_sha384();
         len = 32;
         break;
@@ -97,7 +101,7 @@ ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers)
 #ifndef OPENSSL_IS_BORINGSSL
     case TLS1_3_CK_AES_128_CCM_SHA256:
         ciphers->c = EVP_aes_128_ccm();
-        ciphers->hp = EVP_aes_128_ctr();
+        ciphers->hp = EVP_aes_128_ecb();
         ciphers->d = EVP_sha256();
         len = 16;
         break;
@@ -598,16 +602,34 @@ ngx_quic_crypto_hp_init(const EVP_CIPHER *cipher, ngx_quic_secret_t *s,
         return NGX_ERROR;
     }
 
+    if (EVP_CIPHER_mode(cipher) == EVP_CIPH_ECB_MODE
+        && EVP_CIPHER_CTX_set_padding(ctx, 0) != 1)
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                      "EVP_CIPHER_CTX_set_padding() failed");
+        return NGX_ERROR;
+    }
+
     s->hp_ctx = ctx;
     return NGX_OK;
 }
 
 
+/*
+ * RFC 9001, 5.4.3.  AES-Based Header Protection
+ *           5.4.4.  ChaCha20-Based Header Protection
+ *
+ * computes masks for "n" consecutive samples; with AES the key schedule
+ * is kept in an ECB context and all masks are produced in a single call
+ */
+
 static ngx_int_t
 ngx_quic_crypto_hp(ngx_quic_secret_t *s, u_char *out, u_char *in,
-    ngx_log_t *log)
+    ngx_uint_t n, ngx_log_t *log)
 {
     int              outlen;
+    ngx_uint_t       i;
     EVP_CIPHER_CTX  *ctx;
 
     static const u_char zero[NGX_QUIC_HP_LEN];
@@ -618,25 +640,50 @@ ngx_quic_crypto_hp(ngx_quic_secret_t *s, u_char *out, u_char *in,
     uint32_t         cnt;
 
     if (ctx == NULL) {
-        ngx_memcpy(&cnt, in, sizeof(uint32_t));
-        CRYPTO_chacha_20(out, zero, NGX_QUIC_HP_LEN, s->hp.data, &in[4], cnt);
+        for (i = 0; i < n; i++) {
+            ngx_memcpy(&cnt, in, sizeof(uint32_t));
+            CRYPTO_chacha_20(out, zero, NGX_QUIC_HP_LEN, s->hp.data, &in[4],
+                             cnt);
+
+            in += NGX_QUIC_HP_SAMPLE_LEN;
+            out += NGX_QUIC_HP_SAMPLE_LEN;
+        }
+
         return NGX_OK;
     }
 #endif
 
-    if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, in) != 1) {
-        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptInit_ex() failed");
-        return NGX_ERROR;
-    }
+    if (EVP_CIPHER_CTX_mode(ctx) == EVP_CIPH_ECB_MODE) {
+        if (!EVP_EncryptUpdate(ctx, out, &outlen, in,
+                               n * NGX_QUIC_HP_SAMPLE_LEN))
+        {
+            ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
+            return NGX_ERROR;
+        }
 
-    if (!EVP_EncryptUpdate(ctx, out, &outlen, zero, NGX_QUIC_HP_LEN)) {
-        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
-        return NGX_ERROR;
+        return NGX_OK;
     }
 
-    if (!EVP_EncryptFinal_ex(ctx, out + NGX_QUIC_HP_LEN, &outlen)) {
-        ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptFinal_Ex() failed");
-        return NGX_ERROR;
+    for (i = 0; i < n; i++) {
+
+        if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, in) != 1) {
+            ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptInit_ex() failed");
+            return NGX_ERROR;
+        }
+
+        if (!EVP_EncryptUpdate(ctx, out, &outlen, zero, NGX_QUIC_HP_LEN)) {
+            ngx_ssl_error(NGX_LOG_INFO, log, 0, "EVP_EncryptUpdate() failed");
+            return NGX_ERROR;
+        }
+
+        if (!EVP_EncryptFinal_ex(ctx, out + NGX_QUIC_HP_LEN, &outlen)) {
+            ngx_ssl_error(NGX_LOG_INFO, log, 0,
+                          "EVP_EncryptFinal_Ex() failed");
+            return NGX_ERROR;
+        }
+
+        in += NGX_QUIC_HP_SAMPLE_LEN;
+        out += NGX_QUIC_HP_SAMPLE_LEN;
     }
 
     return NGX_OK;
@@ -905,7 +952,8 @@ ngx_quic_create_packet(ngx_quic_header_t *pkt, ngx_str_t *res)
     ngx_str_t           ad, out;
     ngx_uint_t          i;
     ngx_quic_secret_t  *secret;
-    u_char              nonce[NGX_QUIC_IV_LEN], mask[NGX_QUIC_HP_LEN];
+    u_char              nonce[NGX_QUIC_IV_LEN];
+    u_char              mask[NGX_QUIC_HP_SAMPLE_LEN];
 
     ad.data = res->data;
     ad.len = ngx_quic_create_header(pkt, ad.data, &pnp);
@@ -930,7 +978,15 @@ ngx_quic_create_packet(ngx_quic_header_t *pkt, ngx_str_t *res)
     }
 
     sample = &out.data[4 - pkt->num_len];
-    if (ngx_quic_crypto_hp(secret, mask, sample, pkt->log) != NGX_OK) {
+
+    res->len = ad.len + out.len;
+
+    if (pkt->hp_batch) {
+        return ngx_quic_hp_batch_add(pkt->hp_batch, secret, pkt, ad.data, pnp,
+                                     sample);
+    }
+
+    if (ngx_quic_crypto_hp(secret, mask, sample, 1, pkt->log) != NGX_OK) {
         return NGX_ERROR;
     }
 
@@ -941,7 +997,67 @@ ngx_quic_create_packet(ngx_quic_header_t *pkt, ngx_str_t *res)
         pnp[i] ^= mask[i + 1];
     }
 
-    res->len = ad.len + out.len;
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_hp_batch_add(ngx_quic_hp_batch_t *b, ngx_quic_secret_t *secret,
+    ngx_quic_header_t *pkt, u_char *first, u_char *pnp, u_char *sample)
+{
+    ngx_uint_t  n;
+
+    if (b->n == NGX_QUIC_HP_BATCH_MAX || (b->n && b->secret != secret)) {
+        if (ngx_quic_hp_batch_apply(b, pkt->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    n = b->n++;
+
+    b->secret = secret;
+    b->first[n] = first;
+    b->pnp[n] = pnp;
+    b->flags_mask[n] = ngx_quic_pkt_hp_mask(pkt->flags);
+    b->num_len[n] = pkt->num_len;
+
+    ngx_memcpy(&b->samples[n * NGX_QUIC_HP_SAMPLE_LEN], sample,
+               NGX_QUIC_HP_SAMPLE_LEN);
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_quic_hp_batch_apply(ngx_quic_hp_batch_t *b, ngx_log_t *log)
+{
+    u_char      *mask;
+    ngx_uint_t   i, k;
+
+    if (b->n == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_quic_crypto_hp(b->secret, b->masks, b->samples, b->n, log)
+        != NGX_OK)
+    {
+        b->n = 0;
+        return NGX_ERROR;
+    }
+
+    /* RFC 9001, 5.4.1.  Header Protection Application */
+
+    for (i = 0; i < b->n; i++) {
+        mask = &b->masks[i * NGX_QUIC_HP_SAMPLE_LEN];
+
+        b->first[i][0] ^= mask[0] & b->flags_mask[i];
+
+        for (k = 0; k < b->num_len[i]; k++) {
+            b->pnp[i][k] ^= mask[k + 1];
+        }
+    }
+
+    b->n = 0;
 
     return NGX_OK;
 }
@@ -1128,7 +1244,8 @@ ngx_quic_decrypt(ngx_quic_header_t *pkt, uint64_t *largest_pn)
     ngx_str_t           in, ad;
     ngx_uint_t          key_phase;
     ngx_quic_secret_t  *secret;
-    uint8_t             nonce[NGX_QUIC_IV_LEN], mask[NGX_QUIC_HP_LEN];
+    uint8_t             nonce[NGX_QUIC_IV_LEN];
+    uint8_t             mask[NGX_QUIC_HP_SAMPLE_LEN];
 
     secret = &pkt->keys->secrets[pkt->level].client;
 
@@ -1152,7 +1269,7 @@ ngx_quic_decrypt(ngx_quic_header_t *pkt, uint64_t *largest_pn)
 
     /* header protection */
 
-    if (ngx_quic_crypto_hp(secret, mask, sample, pkt->log) != NGX_OK) {
+    if (ngx_quic_crypto_hp(secret, mask, sample, 1, pkt->log) != NGX_OK) {
         return NGX_DECLINED;
     }
 
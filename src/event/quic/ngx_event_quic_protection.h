@@ -23,6 +23,11 @@
 /* largest hash used in TLS is SHA-384 */
 #define NGX_QUIC_MAX_MD_SIZE          48
 
+/* RFC 9001, 5.4.2.  Header Protection Sample */
+#define NGX_QUIC_HP_SAMPLE_LEN        16
+
+#define NGX_QUIC_HP_BATCH_MAX         64
+
 
 #ifdef OPENSSL_IS_BORINGSSL
 #define ngx_quic_cipher_t             EVP_AEAD
@@ -67,6 +72,22 @@ struct ngx_quic_keys_s {
 };
 
 
+/* header protection deferred for a series of packets sealed with one key */
+
+struct ngx_quic_hp_batch_s {
+    ngx_quic_secret_t        *secret;
+    ngx_uint_t                n;
+    u_char                   *first[NGX_QUIC_HP_BATCH_MAX];
+    u_char                   *pnp[NGX_QUIC_HP_BATCH_MAX];
+    u_char                    flags_mask[NGX_QUIC_HP_BATCH_MAX];
+    u_char                    num_len[NGX_QUIC_HP_BATCH_MAX];
+    u_char                    samples[NGX_QUIC_HP_BATCH_MAX
+                                      * NGX_QUIC_HP_SAMPLE_LEN];
+    u_char                    masks[NGX_QUIC_HP_BATCH_MAX
+                                    * NGX_QUIC_HP_SAMPLE_LEN];
+};
+
+
 typedef struct {
     const ngx_quic_cipher_t  *c;
     const EVP_CIPHER         *hp;
@@ -106,6 +127,7 @@ void ngx_quic_keys_update(ngx_event_t *ev);
 void ngx_quic_keys_cleanup(ngx_quic_keys_t *keys);
 ngx_int_t ngx_quic_encrypt(ngx_quic_header_t *pkt, ngx_str_t *res);
 ngx_int_t ngx_quic_decrypt(ngx_quic_header_t *pkt, uint64_t *largest_pn);
+ngx_int_t ngx_quic_hp_batch_apply(ngx_quic_hp_batch_t *b, ngx_log_t *log);
 void ngx_quic_compute_nonce(u_char *nonce, size_t len, uint64_t pn);
 ngx_int_t ngx_quic_ciphers(ngx_uint_t id, ngx_quic_ciphers_t *ciphers);
 ngx_int_t ngx_quic_crypto_init(const ngx_quic_cipher_t *cipher,
@@ -0,0 +1,696 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_channel.h>
+#include <ngx_event_quic_connection.h>
+
+
+/*
+ * The owning worker is encoded in the server connection id right after
+ * the socket cookie used by quic_bpf.  Two more random bytes of the id
+ * are used to mask it, so that ids issued by the same worker do not share
+ * a constant pattern.
+ */
+
+#define NGX_QUIC_ROUTE_OFFSET  8
+
+#define NGX_QUIC_ROUTE_BATCH   32
+
+#if (NGX_AS_LIB)
+
+/*
+ * Each embedded instance runs its own event loop and has its own copy
+ * of the library.  Instances register their queues in a table kept in
+ * the state shared through the host; an instance index takes the place
+ * of the worker number in the id.
+ */
+
+#define NGX_QUIC_ROUTE_LOOPS   1024
+
+#endif
+
+
+#define ngx_quic_route_get_conf(cycle)                                        \
+    (ngx_quic_route_conf_t *) ngx_get_conf(cycle->conf_ctx,                   \
+                                           ngx_quic_route_module)
+
+#define ngx_core_get_conf(cycle)                                              \
+    (ngx_core_conf_t *) ngx_get_conf(cycle->conf_ctx, ngx_core_module)
+
+
+typedef struct {
+    ngx_flag_t            enabled;
+    ngx_uint_t            workers;
+    ngx_socket_t         *fds;        /* socket pair per worker */
+} ngx_quic_route_conf_t;
+
+
+typedef struct {
+    socklen_t             socklen;
+    socklen_t             local_socklen;
+    socklen_t             ls_socklen;
+    ngx_sockaddr_t        sockaddr;
+    ngx_sockaddr_t        local_sockaddr;
+    ngx_sockaddr_t        ls_sockaddr;
+} ngx_quic_route_header_t;
+
+
+#if (NGX_AS_LIB)
+
+typedef struct {
+    ngx_atomic_t          lock;
+    ngx_socket_t          fd;
+} ngx_quic_route_queue_t;
+
+
+static ngx_quic_route_queue_t  *ngx_quic_route_queues;
+static ngx_uint_t               ngx_quic_route_loop;
+static ngx_socket_t             ngx_quic_route_fds[2];
+
+#endif
+
+
+static void *ngx_quic_route_create_conf(ngx_cycle_t *cycle);
+static char *ngx_quic_route_init_conf(ngx_cycle_t *cycle, void *conf);
+static ngx_int_t ngx_quic_route_init_process(ngx_cycle_t *cycle);
+#if (NGX_AS_LIB)
+static ngx_int_t ngx_quic_route_add_loop(ngx_cycle_t *cycle);
+static void ngx_quic_route_exit_process(ngx_cycle_t *cycle);
+#else
+static ngx_int_t ngx_quic_route_module_init(ngx_cycle_t *cycle);
+static void ngx_quic_route_cleanup(void *data);
+#endif
+static ngx_int_t ngx_quic_route_open(ngx_cycle_t *cycle, ngx_socket_t *fds);
+
+static void ngx_quic_route_handler(ngx_event_t *ev);
+static ngx_connection_t *ngx_quic_route_find_listening(
+    ngx_quic_route_header_t *hdr);
+
+
+static ngx_command_t  ngx_quic_route_commands[] = {
+
+    { ngx_string("quic_route"),
+      NGX_MAIN_CONF|NGX_DIRECT_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      0,
+      offsetof(ngx_quic_route_conf_t, enabled),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_core_module_t  ngx_quic_route_module_ctx = {
+    ngx_string("quic_route"),
+    ngx_quic_route_create_conf,
+    ngx_quic_route_init_conf
+};
+
+
+ngx_module_t  ngx_quic_route_module = {
+    NGX_MODULE_V1,
+    &ngx_quic_route_module_ctx,            /* module context */
+    ngx_quic_route_commands,               /* module directives */
+    NGX_CORE_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+#if (NGX_AS_LIB)
+    NULL,                                  /* init module */
+#else
+    ngx_quic_route_module_init,            /* init module */
+#endif
+    ngx_quic_route_init_process,           /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+#if (NGX_AS_LIB)
+    ngx_quic_route_exit_process,           /* exit process */
+#else
+    NULL,                                  /* exit process */
+#endif
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static void *
+ngx_quic_route_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_quic_route_conf_t  *rcf;
+
+    rcf = ngx_pcalloc(cycle->pool, sizeof(ngx_quic_route_conf_t));
+    if (rcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     rcf->workers = 0;
+     *     rcf->fds = NULL;
+     */
+
+    rcf->enabled = NGX_CONF_UNSET;
+
+    return rcf;
+}
+
+
+static char *
+ngx_quic_route_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_quic_route_conf_t  *rcf = conf;
+
+    ngx_conf_init_value(rcf->enabled, 0);
+
+    return NGX_CONF_OK;
+}
+
+
+#if !(NGX_AS_LIB)
+
+static ngx_int_t
+ngx_quic_route_module_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t              i, n;
+    ngx_socket_t           *fds;
+    ngx_core_conf_t        *ccf;
+    ngx_pool_cleanup_t     *cln;
+    ngx_quic_route_conf_t  *rcf;
+
+    rcf = ngx_quic_route_get_conf(cycle);
+    ccf = ngx_core_get_conf(cycle);
+
+    if (!rcf->enabled || ngx_test_config) {
+        return NGX_OK;
+    }
+
+    if (!ccf->master || ccf->worker_processes < 2) {
+        /* a single event loop owns all connections */
+        return NGX_OK;
+    }
+
+    n = ccf->worker_processes;
+
+    fds = ngx_palloc(cycle->pool, 2 * n * sizeof(ngx_socket_t));
+    if (fds == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < 2 * n; i++) {
+        fds[i] = (ngx_socket_t) -1;
+    }
+
+    rcf->workers = n;
+    rcf->fds = fds;
+
+    cln = ngx_pool_cleanup_add(cycle->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->data = rcf;
+    cln->handler = ngx_quic_route_cleanup;
+
+    for (i = 0; i < n; i++) {
+        if (ngx_quic_route_open(cycle, &fds[2 * i]) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_quic_route_open(ngx_cycle_t *cycle, ngx_socket_t *fds)
+{
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                      "socketpair() failed for quic route");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(fds[0]) == -1 || ngx_nonblocking(fds[1]) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_socket_errno,
+                      ngx_nonblocking_n " failed for quic route");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_quic_route_init_process(ngx_cycle_t *cycle)
+{
+    ngx_quic_route_conf_t  *rcf;
+
+    rcf = ngx_quic_route_get_conf(cycle);
+
+#if (NGX_AS_LIB)
+
+    if (rcf->enabled) {
+        return ngx_quic_route_add_loop(cycle);
+    }
+
+#endif
+
+    if (rcf->fds == NULL || ngx_process != NGX_PROCESS_WORKER) {
+        return NGX_OK;
+    }
+
+    if (ngx_add_channel_event(cycle, rcf->fds[2 * ngx_worker],
+                              NGX_READ_EVENT, ngx_quic_route_handler)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+#if !(NGX_AS_LIB)
+
+static void
+ngx_quic_route_cleanup(void *data)
+{
+    ngx_quic_route_conf_t  *rcf = data;
+
+    ngx_uint_t  i;
+
+    for (i = 0; i < 2 * rcf->workers; i++) {
+        if (rcf->fds[i] == (ngx_socket_t) -1) {
+            continue;
+        }
+
+        if (ngx_close_socket(rcf->fds[i]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " quic route failed");
+        }
+    }
+}
+
+#else
+
+
+static ngx_int_t
+ngx_quic_route_add_loop(ngx_cycle_t *cycle)
+{
+    ngx_uint_t               i;
+    ngx_socket_t             fds[2];
+    ngx_as_lib_shared_t     *shared;
+    ngx_quic_route_queue_t  *queues;
+
+    shared = ngx_as_lib_shared();
+
+    if (shared == NULL) {
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "\"quic_route\" is ignored, no state is shared "
+                      "between instances");
+        return NGX_OK;
+    }
+
+    fds[0] = (ngx_socket_t) -1;
+    fds[1] = (ngx_socket_t) -1;
+
+    if (ngx_quic_route_open(cycle, fds) != NGX_OK) {
+        goto failed;
+    }
+
+    ngx_spinlock(&shared->lock, 1, 2048);
+
+    queues = shared->quic_routes;
+
+    if (queues == NULL) {
+
+        /* the table is allocated once and lives as long as the process */
+
+        queues = ngx_alloc(NGX_QUIC_ROUTE_LOOPS
+                           * sizeof(ngx_quic_route_queue_t), cycle->log);
+        if (queues == NULL) {
+            ngx_unlock(&shared->lock);
+            goto failed;
+        }
+
+        for (i = 0; i < NGX_QUIC_ROUTE_LOOPS; i++) {
+            queues[i].lock = 0;
+            queues[i].fd = (ngx_socket_t) -1;
+        }
+
+        shared->quic_routes = queues;
+    }
+
+    for (i = 0; i < NGX_QUIC_ROUTE_LOOPS; i++) {
+        if (queues[i].fd == (ngx_socket_t) -1) {
+            break;
+        }
+    }
+
+    if (i == NGX_QUIC_ROUTE_LOOPS) {
+        ngx_unlock(&shared->lock);
+
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "too many instances for quic route");
+        goto failed;
+    }
+
+    ngx_rwlock_wlock(&queues[i].lock);
+    queues[i].fd = fds[1];
+    ngx_rwlock_unlock(&queues[i].lock);
+
+    ngx_unlock(&shared->lock);
+
+    ngx_quic_route_queues = queues;
+    ngx_quic_route_loop = i;
+    ngx_quic_route_fds[0] = fds[0];
+    ngx_quic_route_fds[1] = fds[1];
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "quic route loop %ui", i);
+
+    if (ngx_add_channel_event(cycle, fds[0], NGX_READ_EVENT,
+                              ngx_quic_route_handler)
+        == NGX_ERROR)
+    {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+
+failed:
+
+    for (i = 0; i < 2; i++) {
+        if (fds[i] != (ngx_socket_t) -1) {
+            (void) ngx_close_socket(fds[i]);
+        }
+    }
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_quic_route_exit_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t               i;
+    ngx_quic_route_queue_t  *q;
+
+    if (ngx_quic_route_queues == NULL) {
+        return;
+    }
+
+    /* wait for other instances sending to the queue */
+
+    q = &ngx_quic_route_queues[ngx_quic_route_loop];
+
+    ngx_rwlock_wlock(&q->lock);
+    q->fd = (ngx_socket_t) -1;
+    ngx_rwlock_unlock(&q->lock);
+
+    ngx_quic_route_queues = NULL;
+
+    for (i = 0; i < 2; i++) {
+        if (ngx_close_socket(ngx_quic_route_fds[i]) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                          ngx_close_socket_n " quic route failed");
+        }
+    }
+}
+
+#endif
+
+
+void
+ngx_quic_route_encode_id(u_char *id)
+{
+    u_char                 *p;
+    ngx_uint_t              worker;
+#if !(NGX_AS_LIB)
+    ngx_quic_route_conf_t  *rcf;
+#endif
+
+#if (NGX_AS_LIB)
+
+    if (ngx_quic_route_queues == NULL) {
+        return;
+    }
+
+    worker = ngx_quic_route_loop;
+
+#else
+
+    rcf = ngx_quic_route_get_conf(ngx_cycle);
+
+    if (rcf->fds == NULL) {
+        return;
+    }
+
+    worker = ngx_worker;
+
+#endif
+
+    p = id + NGX_QUIC_ROUTE_OFFSET;
+
+    p[0] = (u_char) (worker >> 8) ^ p[2];
+    p[1] = (u_char) worker ^ p[3];
+}
+
+
+ngx_int_t
+ngx_quic_route_datagram(ngx_listening_t *ls, ngx_buf_t *b, ngx_str_t *key,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen)
+{
+    u_char                   *p;
+    ssize_t                   n;
+    ngx_err_t                 err;
+    ngx_uint_t                worker;
+    struct iovec              iov[2];
+    struct msghdr             msg;
+    ngx_quic_route_header_t   hdr;
+#if (NGX_AS_LIB)
+    ngx_quic_route_queue_t   *q;
+#else
+    ngx_quic_route_conf_t    *rcf;
+#endif
+
+#if (NGX_AS_LIB)
+
+    if (ngx_quic_route_queues == NULL) {
+        return NGX_DECLINED;
+    }
+
+#else
+
+    rcf = ngx_quic_route_get_conf(ngx_cycle);
+
+    if (rcf->fds == NULL) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    if (key->len != NGX_QUIC_SERVER_CID_LEN) {
+        return NGX_DECLINED;
+    }
+
+    /* client chosen ids in Initial and 0-RTT packets carry no route */
+
+    if (ngx_quic_long_pkt(b->pos[0])
+        && (ngx_quic_pkt_in(b->pos[0]) || ngx_quic_pkt_zrtt(b->pos[0])))
+    {
+        return NGX_DECLINED;
+    }
+
+    p = key->data + NGX_QUIC_ROUTE_OFFSET;
+
+    worker = ((ngx_uint_t) (p[0] ^ p[2]) << 8) | (p[1] ^ p[3]);
+
+#if (NGX_AS_LIB)
+
+    if (worker == ngx_quic_route_loop || worker >= NGX_QUIC_ROUTE_LOOPS) {
+        return NGX_DECLINED;
+    }
+
+#else
+
+    if (worker == ngx_worker || worker >= rcf->workers) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    hdr.socklen = socklen;
+    hdr.local_socklen = local_socklen;
+    hdr.ls_socklen = ls->socklen;
+
+    ngx_memcpy(&hdr.sockaddr, sockaddr, socklen);
+    ngx_memcpy(&hdr.local_sockaddr, local_sockaddr, local_socklen);
+    ngx_memcpy(&hdr.ls_sockaddr, ls->sockaddr, ls->socklen);
+
+    iov[0].iov_base = (void *) &hdr;
+    iov[0].iov_len = sizeof(ngx_quic_route_header_t);
+    iov[1].iov_base = (void *) b->pos;
+    iov[1].iov_len = b->last - b->pos;
+
+    ngx_memzero(&msg, sizeof(struct msghdr));
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+#if (NGX_AS_LIB)
+
+    /* the owner closes its queue only under the write lock */
+
+    q = &ngx_quic_route_queues[worker];
+
+    ngx_rwlock_rlock(&q->lock);
+
+    if (q->fd == (ngx_socket_t) -1) {
+        ngx_rwlock_unlock(&q->lock);
+        return NGX_DECLINED;
+    }
+
+    n = sendmsg(q->fd, &msg, 0);
+    err = ngx_socket_errno;
+
+    ngx_rwlock_unlock(&q->lock);
+
+#else
+
+    n = sendmsg(rcf->fds[2 * worker + 1], &msg, 0);
+    err = ngx_socket_errno;
+
+#endif
+
+    if (n == -1) {
+
+        if (err == NGX_EAGAIN) {
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, err,
+                           "quic route to worker %ui dropped", worker);
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, err,
+                      "quic route sendmsg() failed");
+        return NGX_OK;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                   "quic route to worker %ui n:%z", worker, n);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_quic_route_handler(ngx_event_t *ev)
+{
+    ssize_t                   n;
+    ngx_buf_t                 buf;
+    ngx_err_t                 err;
+    ngx_uint_t                i;
+    struct iovec              iov[2];
+    struct msghdr             msg;
+    ngx_connection_t         *c, *lc;
+    ngx_quic_route_header_t   hdr;
+    static u_char             buffer[NGX_QUIC_MAX_UDP_PAYLOAD_SIZE];
+
+    c = ev->data;
+
+    for (i = 0; i < NGX_QUIC_ROUTE_BATCH; i++) {
+
+        iov[0].iov_base = (void *) &hdr;
+        iov[0].iov_len = sizeof(ngx_quic_route_header_t);
+        iov[1].iov_base = (void *) buffer;
+        iov[1].iov_len = sizeof(buffer);
+
+        ngx_memzero(&msg, sizeof(struct msghdr));
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        n = recvmsg(c->fd, &msg, 0);
+
+        if (n == -1) {
+            err = ngx_socket_errno;
+
+            if (err == NGX_EAGAIN) {
+                return;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "quic route recvmsg() failed");
+            return;
+        }
+
+        if (n <= (ssize_t) sizeof(ngx_quic_route_header_t)
+            || (msg.msg_flags & MSG_TRUNC)
+            || hdr.socklen > (socklen_t) sizeof(ngx_sockaddr_t)
+            || hdr.local_socklen > (socklen_t) sizeof(ngx_sockaddr_t)
+            || hdr.ls_socklen > (socklen_t) sizeof(ngx_sockaddr_t))
+        {
+            continue;
+        }
+
+        n -= sizeof(ngx_quic_route_header_t);
+
+        lc = ngx_quic_route_find_listening(&hdr);
+        if (lc == NULL) {
+            continue;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "quic route on %V", &lc->listening->addr_text);
+
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
+
+        buf.pos = buffer;
+        buf.last = buffer + n;
+        buf.start = buf.pos;
+        buf.end = buffer + sizeof(buffer);
+
+        if (ngx_quic_dispatch_datagram(lc, &buf, &hdr.sockaddr.sockaddr,
+                                     hdr.socklen,
+                                     &hdr.local_sockaddr.sockaddr,
+                                     hdr.local_socklen)
+            != NGX_OK)
+        {
+            return;
+        }
+    }
+}
+
+
+static ngx_connection_t *
+ngx_quic_route_find_listening(ngx_quic_route_header_t *hdr)
+{
+    ngx_uint_t        i;
+    ngx_listening_t  *ls;
+
+    ls = ngx_cycle->listening.elts;
+
+    for (i = 0; i < ngx_cycle->listening.nelts; i++) {
+
+        if (!ls[i].quic || ls[i].connection == NULL) {
+            continue;
+        }
+
+        if (ngx_cmp_sockaddr(ls[i].sockaddr, ls[i].socklen,
+                             &hdr->ls_sockaddr.sockaddr, hdr->ls_socklen, 1)
+            == NGX_OK)
+        {
+            return ls[i].connection;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,20 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_ROUTE_H_INCLUDED_
+#define _NGX_EVENT_QUIC_ROUTE_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+void ngx_quic_route_encode_id(u_char *id);
+ngx_int_t ngx_quic_route_datagram(ngx_listening_t *ls, ngx_buf_t *b,
+    ngx_str_t *key, struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen);
+
+#endif /* _NGX_EVENT_QUIC_ROUTE_H_INCLUDED_ */
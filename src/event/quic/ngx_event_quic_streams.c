@@ -834,6 +834,32 @@ ngx_quic_cancelable_stream(ngx_connection_t *c)
 }
 
 
+void
+ngx_quic_set_stream_priority(ngx_connection_t *c, uint64_t id,
+    ngx_uint_t urgency)
+{
+    ngx_connection_t       *pc;
+    ngx_quic_stream_t      *qs;
+    ngx_quic_connection_t  *qc;
+
+    pc = c->quic ? c->quic->parent : c;
+    qc = ngx_quic_get_connection(pc);
+
+    qs = ngx_quic_find_stream(&qc->streams.tree, id);
+
+    if (qs == NULL) {
+        return;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, pc->log, 0,
+                   "quic stream id:0x%xL urgency:%ui", id, urgency);
+
+    /* stored as urgency + 1, so that zero means no priority set */
+
+    qs->urgency = urgency + 1;
+}
+
+
 static void
 ngx_quic_empty_handler(ngx_event_t *ev)
 {
@@ -1056,6 +1082,7 @@ ngx_quic_stream_flush(ngx_quic_stream_t *qs)
 
     frame->level = ssl_encryption_application;
     frame->type = NGX_QUIC_FT_STREAM;
+    frame->urgency = qs->urgency;
     frame->data = out;
 
     frame->u.stream.off = 1;
@@ -1734,7 +1761,7 @@ ngx_quic_update_flow(ngx_quic_stream_t *qs, uint64_t last)
 static ngx_int_t
 ngx_quic_update_max_stream_data(ngx_quic_stream_t *qs)
 {
-    uint64_t                recv_max_data;
+    uint64_t                window, recv_max_data;
     ngx_connection_t       *pc;
     ngx_quic_frame_t       *frame;
     ngx_quic_connection_t  *qc;
@@ -1746,9 +1773,15 @@ ngx_quic_update_max_stream_data(ngx_quic_stream_t *qs)
         return NGX_OK;
     }
 
-    recv_max_data = qs->recv_offset + qs->recv_window;
+    window = qs->recv_window;
 
-    if (qs->recv_max_data == recv_max_data) {
+    if (ngx_quic_memory_pressure(qc->memory)) {
+        window /= 4;
+    }
+
+    recv_max_data = qs->recv_offset + window;
+
+    if (qs->recv_max_data >= recv_max_data) {
         return NGX_OK;
     }
 
@@ -1777,15 +1810,21 @@ ngx_quic_update_max_stream_data(ngx_quic_stream_t *qs)
 static ngx_int_t
 ngx_quic_update_max_data(ngx_connection_t *c)
 {
-    uint64_t                recv_max_data;
+    uint64_t                window, recv_max_data;
     ngx_quic_frame_t       *frame;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
 
-    recv_max_data = qc->streams.recv_offset + qc->streams.recv_window;
+    window = qc->streams.recv_window;
+
+    if (ngx_quic_memory_pressure(qc->memory)) {
+        window /= 4;
+    }
+
+    recv_max_data = qc->streams.recv_offset + window;
 
-    if (qc->streams.recv_max_data == recv_max_data) {
+    if (qc->streams.recv_max_data >= recv_max_data) {
         return NGX_OK;
     }
 
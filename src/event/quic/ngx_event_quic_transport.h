@@ -268,9 +268,14 @@ struct ngx_quic_frame_s {
     size_t                                      plen;
     ngx_msec_t                                  send_time;
     ssize_t                                     len;
+    uint64_t                                    delivered;
+    ngx_msec_t                                  delivered_time;
+    ngx_msec_t                                  first_sent_time;
     unsigned                                    need_ack:1;
     unsigned                                    pkt_need_ack:1;
     unsigned                                    ignore_congestion:1;
+    unsigned                                    app_limited:1;
+    unsigned                                    urgency:4;
 
     ngx_chain_t                                *data;
     union {
@@ -301,6 +306,7 @@ typedef struct {
     ngx_quic_path_t                            *path;
 
     ngx_quic_keys_t                            *keys;
+    ngx_quic_hp_batch_t                        *hp_batch;
 
     ngx_msec_t                                  received;
     uint64_t                                    number;
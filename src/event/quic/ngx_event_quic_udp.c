@@ -19,22 +19,18 @@ static ngx_connection_t *ngx_quic_lookup_connection(ngx_listening_t *ls,
 void
 ngx_quic_recvmsg(ngx_event_t *ev)
 {
-    ssize_t             n;
-    ngx_str_t           key;
-    ngx_buf_t           buf;
-    ngx_log_t          *log;
-    ngx_err_t           err;
-    socklen_t           socklen, local_socklen;
-    ngx_event_t        *rev, *wev;
-    struct iovec        iov[1];
-    struct msghdr       msg;
-    ngx_sockaddr_t      sa, lsa;
-    struct sockaddr    *sockaddr, *local_sockaddr;
-    ngx_listening_t    *ls;
-    ngx_event_conf_t   *ecf;
-    ngx_connection_t   *c, *lc;
-    ngx_quic_socket_t  *qsock;
-    static u_char       buffer[NGX_QUIC_MAX_UDP_PAYLOAD_SIZE];
+    ssize_t            n;
+    ngx_buf_t          buf;
+    ngx_err_t          err;
+    socklen_t          socklen, local_socklen;
+    struct iovec       iov[1];
+    struct msghdr      msg;
+    ngx_sockaddr_t     sa, lsa;
+    struct sockaddr   *sockaddr, *local_sockaddr;
+    ngx_listening_t   *ls;
+    ngx_event_conf_t  *ecf;
+    ngx_connection_t  *lc;
+    static u_char      buffer[NGX_QUIC_MAX_UDP_PAYLOAD_SIZE];
 
 #if (NGX_HAVE_ADDRINFO_CMSG)
     u_char             msg_control[CMSG_SPACE(sizeof(ngx_addrinfo_t))];
@@ -152,199 +148,238 @@ ngx_quic_recvmsg(ngx_event_t *ev)
 
 #endif
 
-        if (ngx_quic_get_packet_dcid(ev->log, buffer, n, &key) != NGX_OK) {
-            goto next;
+        ngx_memzero(&buf, sizeof(ngx_buf_t));
+
+        buf.pos = buffer;
+        buf.last = buffer + n;
+        buf.start = buf.pos;
+        buf.end = buffer + sizeof(buffer);
+
+        if (ngx_quic_dispatch_datagram(lc, &buf, sockaddr, socklen,
+                                     local_sockaddr, local_socklen)
+            != NGX_OK)
+        {
+            return;
         }
 
-        c = ngx_quic_lookup_connection(ls, &key, local_sockaddr, local_socklen);
+    next:
 
-        if (c) {
+        if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
+            ev->available -= n;
+        }
 
-#if (NGX_DEBUG)
-            if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
-                ngx_log_handler_pt  handler;
+    } while (ev->available);
+}
+
+
+ngx_int_t
+ngx_quic_dispatch_datagram(ngx_connection_t *lc, ngx_buf_t *b,
+    struct sockaddr *sockaddr, socklen_t socklen,
+    struct sockaddr *local_sockaddr, socklen_t local_socklen)
+{
+    size_t              n;
+    ngx_str_t           key;
+    ngx_log_t          *log;
+    ngx_event_t        *rev, *wev;
+    ngx_listening_t    *ls;
+    ngx_connection_t   *c;
+    ngx_quic_socket_t  *qsock;
 
-                handler = c->log->handler;
-                c->log->handler = NULL;
+    ls = lc->listening;
+    n = b->last - b->pos;
 
-                ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                               "quic recvmsg: fd:%d n:%z", c->fd, n);
+    if (ngx_quic_get_packet_dcid(lc->read->log, b->pos, n, &key) != NGX_OK) {
+        return NGX_OK;
+    }
 
-                c->log->handler = handler;
-            }
-#endif
+    c = ngx_quic_lookup_connection(ls, &key, local_sockaddr, local_socklen);
 
-            ngx_memzero(&buf, sizeof(ngx_buf_t));
+    if (c) {
 
-            buf.pos = buffer;
-            buf.last = buffer + n;
-            buf.start = buf.pos;
-            buf.end = buffer + sizeof(buffer);
+#if (NGX_DEBUG)
+        if (c->log->log_level & NGX_LOG_DEBUG_EVENT) {
+            ngx_log_handler_pt  handler;
 
-            qsock = ngx_quic_get_socket(c);
+            handler = c->log->handler;
+            c->log->handler = NULL;
 
-            ngx_memcpy(&qsock->sockaddr, sockaddr, socklen);
-            qsock->socklen = socklen;
+            ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                           "quic recvmsg: fd:%d n:%uz", c->fd, n);
 
-            c->udp->buffer = &buf;
+            c->log->handler = handler;
+        }
+#endif
 
-            rev = c->read;
-            rev->ready = 1;
-            rev->active = 0;
+        qsock = ngx_quic_get_socket(c);
 
-            rev->handler(rev);
+        ngx_memcpy(&qsock->sockaddr, sockaddr, socklen);
+        qsock->socklen = socklen;
 
-            if (c->udp) {
-                c->udp->buffer = NULL;
-            }
+        c->udp->buffer = b;
 
-            rev->ready = 0;
-            rev->active = 1;
+        rev = c->read;
+        rev->ready = 1;
+        rev->active = 0;
 
-            goto next;
+        rev->handler(rev);
+
+        if (c->udp) {
+            c->udp->buffer = NULL;
         }
 
+        rev->ready = 0;
+        rev->active = 1;
+
+        return NGX_OK;
+    }
+
+    if (ngx_quic_route_datagram(ls, b, &key, sockaddr, socklen,
+                                local_sockaddr, local_socklen)
+        == NGX_OK)
+    {
+        return NGX_OK;
+    }
+
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_accepted, 1);
 #endif
 
-        ngx_accept_disabled = ngx_cycle->connection_n / 8
-                              - ngx_cycle->free_connection_n;
+    ngx_accept_disabled = ngx_cycle->connection_n / 8
+                          - ngx_cycle->free_connection_n;
 
-        c = ngx_get_connection(lc->fd, ev->log);
-        if (c == NULL) {
-            return;
-        }
+    c = ngx_get_connection(lc->fd, lc->read->log);
+    if (c == NULL) {
+        return NGX_ERROR;
+    }
 
-        c->shared = 1;
-        c->type = SOCK_DGRAM;
-        c->socklen = socklen;
+    c->shared = 1;
+    c->type = SOCK_DGRAM;
+    c->socklen = socklen;
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_active, 1);
 #endif
 
-        c->pool = ngx_create_pool(ls->pool_size, ev->log);
-        if (c->pool == NULL) {
-            ngx_quic_close_accepted_connection(c);
-            return;
-        }
-
-        c->sockaddr = ngx_palloc(c->pool, NGX_SOCKADDRLEN);
-        if (c->sockaddr == NULL) {
-            ngx_quic_close_accepted_connection(c);
-            return;
-        }
+    c->pool = ngx_create_pool(ls->pool_size, lc->read->log);
+    if (c->pool == NULL) {
+        ngx_quic_close_accepted_connection(c);
+        return NGX_ERROR;
+    }
 
-        ngx_memcpy(c->sockaddr, sockaddr, socklen);
+    c->sockaddr = ngx_palloc(c->pool, NGX_SOCKADDRLEN);
+    if (c->sockaddr == NULL) {
+        ngx_quic_close_accepted_connection(c);
+        return NGX_ERROR;
+    }
 
-        log = ngx_palloc(c->pool, sizeof(ngx_log_t));
-        if (log == NULL) {
-            ngx_quic_close_accepted_connection(c);
-            return;
-        }
+    ngx_memcpy(c->sockaddr, sockaddr, socklen);
 
-        *log = ls->log;
+    log = ngx_palloc(c->pool, sizeof(ngx_log_t));
+    if (log == NULL) {
+        ngx_quic_close_accepted_connection(c);
+        return NGX_ERROR;
+    }
 
-        c->log = log;
-        c->pool->log = log;
-        c->listening = ls;
+    *log = ls->log;
 
-        if (local_sockaddr == &lsa.sockaddr) {
-            local_sockaddr = ngx_palloc(c->pool, local_socklen);
-            if (local_sockaddr == NULL) {
-                ngx_quic_close_accepted_connection(c);
-                return;
-            }
+    c->log = log;
+    c->pool->log = log;
+    c->listening = ls;
 
-            ngx_memcpy(local_sockaddr, &lsa, local_socklen);
+    if (local_sockaddr != ls->sockaddr) {
+        c->local_sockaddr = ngx_palloc(c->pool, local_socklen);
+        if (c->local_sockaddr == NULL) {
+            ngx_quic_close_accepted_connection(c);
+            return NGX_ERROR;
         }
 
+        ngx_memcpy(c->local_sockaddr, local_sockaddr, local_socklen);
+
+    } else {
         c->local_sockaddr = local_sockaddr;
-        c->local_socklen = local_socklen;
+    }
 
-        c->buffer = ngx_create_temp_buf(c->pool, n);
-        if (c->buffer == NULL) {
-            ngx_quic_close_accepted_connection(c);
-            return;
-        }
+    c->local_socklen = local_socklen;
 
-        c->buffer->last = ngx_cpymem(c->buffer->last, buffer, n);
+    c->buffer = ngx_create_temp_buf(c->pool, n);
+    if (c->buffer == NULL) {
+        ngx_quic_close_accepted_connection(c);
+        return NGX_ERROR;
+    }
 
-        rev = c->read;
-        wev = c->write;
+    c->buffer->last = ngx_cpymem(c->buffer->last, b->pos, n);
 
-        rev->active = 1;
-        wev->ready = 1;
+    rev = c->read;
+    wev = c->write;
 
-        rev->log = log;
-        wev->log = log;
+    rev->active = 1;
+    wev->ready = 1;
 
-        /*
-         * TODO: MT: - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         *
-         * TODO: MP: - allocated in a shared memory
-         *           - ngx_atomic_fetch_add()
-         *             or protection by critical section or light mutex
-         */
+    rev->log = log;
+    wev->log = log;
 
-        c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    /*
+     * TODO: MT: - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     *
+     * TODO: MP: - allocated in a shared memory
+     *           - ngx_atomic_fetch_add()
+     *             or protection by critical section or light mutex
+     */
 
-        c->start_time = ngx_current_msec;
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    c->start_time = ngx_current_msec;
 
 #if (NGX_STAT_STUB)
-        (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
+    (void) ngx_atomic_fetch_add(ngx_stat_handled, 1);
 #endif
 
-        if (ls->addr_ntop) {
-            c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
-            if (c->addr_text.data == NULL) {
-                ngx_quic_close_accepted_connection(c);
-                return;
-            }
+    if (ls->addr_ntop) {
+        c->addr_text.data = ngx_pnalloc(c->pool, ls->addr_text_max_len);
+        if (c->addr_text.data == NULL) {
+            ngx_quic_close_accepted_connection(c);
+            return NGX_ERROR;
+        }
 
-            c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
-                                             c->addr_text.data,
-                                             ls->addr_text_max_len, 0);
-            if (c->addr_text.len == 0) {
-                ngx_quic_close_accepted_connection(c);
-                return;
-            }
+        c->addr_text.len = ngx_sock_ntop(c->sockaddr, c->socklen,
+                                         c->addr_text.data,
+                                         ls->addr_text_max_len, 0);
+        if (c->addr_text.len == 0) {
+            ngx_quic_close_accepted_connection(c);
+            return NGX_ERROR;
         }
+    }
 
 #if (NGX_DEBUG)
-        {
-        ngx_str_t  addr;
-        u_char     text[NGX_SOCKADDR_STRLEN];
+    {
+    ngx_str_t          addr;
+    ngx_event_conf_t  *ecf;
+    u_char             text[NGX_SOCKADDR_STRLEN];
 
-        ngx_debug_accepted_connection(ecf, c);
+    ecf = ngx_event_get_conf(ngx_cycle->conf_ctx, ngx_event_core_module);
 
-        if (log->log_level & NGX_LOG_DEBUG_EVENT) {
-            addr.data = text;
-            addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
-                                     NGX_SOCKADDR_STRLEN, 1);
+    ngx_debug_accepted_connection(ecf, c);
 
-            ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
-                           "*%uA quic recvmsg: %V fd:%d n:%z",
-                           c->number, &addr, c->fd, n);
-        }
+    if (log->log_level & NGX_LOG_DEBUG_EVENT) {
+        addr.data = text;
+        addr.len = ngx_sock_ntop(c->sockaddr, c->socklen, text,
+                                 NGX_SOCKADDR_STRLEN, 1);
 
-        }
-#endif
+        ngx_log_debug4(NGX_LOG_DEBUG_EVENT, log, 0,
+                       "*%uA quic recvmsg: %V fd:%d n:%uz",
+                       c->number, &addr, c->fd, n);
+    }
 
-        log->data = NULL;
-        log->handler = NULL;
+    }
+#endif
 
-        ls->handler(c);
+    log->data = NULL;
+    log->handler = NULL;
 
-    next:
+    ls->handler(c);
 
-        if (ngx_event_flags & NGX_USE_KQUEUE_EVENT) {
-            ev->available -= n;
-        }
-
-    } while (ev->available);
+    return NGX_OK;
 }
 
 
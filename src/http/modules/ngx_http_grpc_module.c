@@ -4822,7 +4822,8 @@ ngx_http_grpc_pass(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u.url.data = url->data + add;
     u.no_resolve = 1;
 
-    glcf->upstream.upstream = ngx_http_upstream_add(cf, &u, 0);
+    glcf->upstream.upstream = ngx_http_upstream_add(cf, &u,
+                                                    NGX_HTTP_UPSTREAM_HTTP2);
     if (glcf->upstream.upstream == NULL) {
         return NGX_CONF_ERROR;
     }
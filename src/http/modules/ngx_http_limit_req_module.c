@@ -17,23 +17,20 @@
 #define NGX_HTTP_LIMIT_REQ_REJECTED_DRY_RUN  5
 
 
+#define NGX_HTTP_LIMIT_REQ_KEY_SIZE          32
+
+
 typedef struct {
-    u_char                       color;
-    u_char                       dummy;
-    u_short                      len;
-    ngx_queue_t                  queue;
     ngx_msec_t                   last;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   excess;
     ngx_uint_t                   count;
-    u_char                       data[1];
 } ngx_http_limit_req_node_t;
 
 
 typedef struct {
-    ngx_rbtree_t                  rbtree;
-    ngx_rbtree_node_t             sentinel;
-    ngx_queue_t                   queue;
+    ngx_shm_hash_t              *hash;
+    time_t                       fail_time;
 } ngx_http_limit_req_shctx_t;
 
 
@@ -44,6 +41,7 @@ typedef struct {
     ngx_uint_t                   rate;
     ngx_http_complex_value_t     key;
     ngx_http_limit_req_node_t   *node;
+    ngx_shm_hash_bucket_t       *bucket;
 } ngx_http_limit_req_ctx_t;
 
 
@@ -66,13 +64,14 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account);
+    ngx_shm_hash_bucket_t *bucket, uint32_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
 static void ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n);
-static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
-    ngx_uint_t n);
+static ngx_int_t ngx_http_limit_req_evict(ngx_shm_hash_t *hash, void *value,
+    void *data);
 
 static ngx_int_t ngx_http_limit_req_status_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
@@ -202,6 +201,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
     ngx_http_limit_req_limit_t  *limit, *limits;
+    ngx_shm_hash_bucket_t       *bucket;
 
     if (r->main->limit_req_status) {
         return NGX_DECLINED;
@@ -241,14 +241,16 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
             continue;
         }
 
-        hash = ngx_crc32_short(key.data, key.len);
+        hash = ngx_shm_hash_key(key.data, key.len);
+
+        bucket = ngx_shm_hash_bucket(ctx->sh->hash, hash);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shm_hash_lock(bucket);
 
-        rc = ngx_http_limit_req_lookup(limit, hash, &key, &excess,
+        rc = ngx_http_limit_req_lookup(limit, bucket, hash, &key, &excess,
                                        (n == lrcf->limits.nelts - 1));
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shm_hash_unlock(bucket);
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -360,56 +362,14 @@ ngx_http_limit_req_delay(ngx_http_request_t *r)
 }
 
 
-static void
-ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
-    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
-{
-    ngx_rbtree_node_t          **p;
-    ngx_http_limit_req_node_t   *lrn, *lrnt;
-
-    for ( ;; ) {
-
-        if (node->key < temp->key) {
-
-            p = &temp->left;
-
-        } else if (node->key > temp->key) {
-
-            p = &temp->right;
-
-        } else { /* node->key == temp->key */
-
-            lrn = (ngx_http_limit_req_node_t *) &node->color;
-            lrnt = (ngx_http_limit_req_node_t *) &temp->color;
-
-            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
-                ? &temp->left : &temp->right;
-        }
-
-        if (*p == sentinel) {
-            break;
-        }
-
-        temp = *p;
-    }
-
-    *p = node;
-    node->parent = temp;
-    node->left = sentinel;
-    node->right = sentinel;
-    ngx_rbt_red(node);
-}
-
-
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    ngx_str_t *key, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_shm_hash_bucket_t *bucket, uint32_t hash, ngx_str_t *key,
+    ngx_uint_t *ep, ngx_uint_t account)
 {
-    size_t                      size;
-    ngx_int_t                   rc, excess;
+    ngx_int_t                   excess;
     ngx_msec_t                  now;
     ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node, *sentinel;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
 
@@ -417,106 +377,69 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    lr = ngx_shm_hash_find_locked(ctx->sh->hash, bucket, hash, key);
 
-    while (node != sentinel) {
+    if (lr) {
+        ms = (ngx_msec_int_t) (now - lr->last);
 
-        if (hash < node->key) {
-            node = node->left;
-            continue;
-        }
+        if (ms < -60000) {
+            ms = 1;
 
-        if (hash > node->key) {
-            node = node->right;
-            continue;
+        } else if (ms < 0) {
+            ms = 0;
         }
 
-        /* hash == node->key */
-
-        lr = (ngx_http_limit_req_node_t *) &node->color;
-
-        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
-
-        if (rc == 0) {
-            ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
-            ms = (ngx_msec_int_t) (now - lr->last);
-
-            if (ms < -60000) {
-                ms = 1;
-
-            } else if (ms < 0) {
-                ms = 0;
-            }
-
-            excess = lr->excess - ctx->rate * ms / 1000 + 1000;
-
-            if (excess < 0) {
-                excess = 0;
-            }
+        excess = lr->excess - ctx->rate * ms / 1000 + 1000;
 
-            *ep = excess;
+        if (excess < 0) {
+            excess = 0;
+        }
 
-            if ((ngx_uint_t) excess > limit->burst) {
-                return NGX_BUSY;
-            }
+        *ep = excess;
 
-            if (account) {
-                lr->excess = excess;
+        if ((ngx_uint_t) excess > limit->burst) {
+            return NGX_BUSY;
+        }
 
-                if (ms) {
-                    lr->last = now;
-                }
+        if (account) {
+            lr->excess = excess;
 
-                return NGX_OK;
+            if (ms) {
+                lr->last = now;
             }
 
-            lr->count++;
+            return NGX_OK;
+        }
 
-            ctx->node = lr;
+        lr->count++;
 
-            return NGX_AGAIN;
-        }
+        ctx->node = lr;
+        ctx->bucket = bucket;
 
-        node = (rc < 0) ? node->left : node->right;
+        return NGX_AGAIN;
     }
 
     *ep = 0;
 
-    size = offsetof(ngx_rbtree_node_t, color)
-           + offsetof(ngx_http_limit_req_node_t, data)
-           + key->len;
+    lr = ngx_shm_hash_insert_locked(ctx->sh->hash, bucket, hash, key,
+                                    ngx_http_limit_req_evict, ctx);
 
-    ngx_http_limit_req_expire(ctx, 1);
+    if (lr == NULL) {
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+        /* all nodes the key can be stored in are in use */
 
-    if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        if (ctx->sh->fail_time != ngx_time()) {
+            ctx->sh->fail_time = ngx_time();
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
-        if (node == NULL) {
             ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
                           "could not allocate node%s", ctx->shpool->log_ctx);
-            return NGX_ERROR;
         }
-    }
 
-    node->key = hash;
-
-    lr = (ngx_http_limit_req_node_t *) &node->color;
+        return NGX_ERROR;
+    }
 
-    lr->len = (u_short) key->len;
     lr->excess = 0;
 
-    ngx_memcpy(lr->data, key->data, key->len);
-
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
-
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
     if (account) {
         lr->last = now;
         lr->count = 0;
@@ -527,6 +450,7 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
     lr->count = 1;
 
     ctx->node = lr;
+    ctx->bucket = bucket;
 
     return NGX_AGAIN;
 }
@@ -560,7 +484,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shm_hash_lock(ctx->bucket);
 
         now = ngx_current_msec;
         ms = (ngx_msec_int_t) (now - lr->last);
@@ -585,7 +509,7 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
         lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shm_hash_unlock(ctx->bucket);
 
         ctx->node = NULL;
 
@@ -618,80 +542,47 @@ ngx_http_limit_req_unlock(ngx_http_limit_req_limit_t *limits, ngx_uint_t n)
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shm_hash_lock(ctx->bucket);
 
         ctx->node->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shm_hash_unlock(ctx->bucket);
 
         ctx->node = NULL;
     }
 }
 
 
-static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+static ngx_int_t
+ngx_http_limit_req_evict(ngx_shm_hash_t *hash, void *value, void *data)
 {
-    ngx_int_t                   excess;
-    ngx_msec_t                  now;
-    ngx_queue_t                *q;
-    ngx_msec_int_t              ms;
-    ngx_rbtree_node_t          *node;
-    ngx_http_limit_req_node_t  *lr;
-
-    now = ngx_current_msec;
-
-    /*
-     * n == 1 deletes one or two zero rate entries
-     * n == 0 deletes oldest entry by force
-     *        and one or two zero rate entries
-     */
-
-    while (n < 3) {
-
-        if (ngx_queue_empty(&ctx->sh->queue)) {
-            return;
-        }
+    ngx_http_limit_req_node_t  *lr = value;
+    ngx_http_limit_req_ctx_t   *ctx = data;
 
-        q = ngx_queue_last(&ctx->sh->queue);
+    ngx_msec_int_t  ms;
 
-        lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
+    /* nodes used by requests being processed cannot be evicted */
 
-        if (lr->count) {
-
-            /*
-             * There is not much sense in looking further,
-             * because we bump nodes on the lookup stage.
-             */
-
-            return;
-        }
-
-        if (n++ != 0) {
-
-            ms = (ngx_msec_int_t) (now - lr->last);
-            ms = ngx_abs(ms);
-
-            if (ms < 60000) {
-                return;
-            }
-
-            excess = lr->excess - ctx->rate * ms / 1000;
-
-            if (excess > 0) {
-                return;
-            }
-        }
+    if (lr->count) {
+        return NGX_DECLINED;
+    }
 
-        ngx_queue_remove(q);
+    /*
+     * a node is only evicted when its excess has decayed to zero,
+     * so that a client cannot reset its own state by cycling keys
+     */
 
-        node = (ngx_rbtree_node_t *)
-                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+    ms = (ngx_msec_int_t) (ngx_current_msec - lr->last);
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+    if (ms < 0) {
+        return NGX_DECLINED;
+    }
 
-        ngx_slab_free_locked(ctx->shpool, node);
+    if ((ngx_int_t) (lr->excess - ctx->rate * ms / 1000) > 0) {
+        return NGX_DECLINED;
     }
+
+    return NGX_OK;
 }
 
 
@@ -700,7 +591,7 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_http_limit_req_ctx_t  *octx = data;
 
-    size_t                     len;
+    size_t                     len, size;
     ngx_http_limit_req_ctx_t  *ctx;
 
     ctx = shm_zone->data;
@@ -733,18 +624,6 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
-    }
-
-    ctx->shpool->data = ctx->sh;
-
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
-
-    ngx_queue_init(&ctx->sh->queue);
-
     len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
 
     ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
@@ -757,6 +636,30 @@ ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 
     ctx->shpool->log_nomem = 0;
 
+    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->sh->fail_time = 0;
+
+    /*
+     * a quarter of the zone is left for overflow buckets and for keys
+     * longer than NGX_HTTP_LIMIT_REQ_KEY_SIZE; with 64-byte slots and
+     * short keys, a one-megabyte zone keeps about 14 thousand states
+     */
+
+    size = (ctx->shpool->pfree - ctx->shpool->pfree / 4) << ngx_pagesize_shift;
+
+    ctx->sh->hash = ngx_shm_hash_create(ctx->shpool, size,
+                                        NGX_HTTP_LIMIT_REQ_KEY_SIZE,
+                                        sizeof(ngx_http_limit_req_node_t));
+    if (ctx->sh->hash == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
     return NGX_OK;
 }
 
@@ -22,12 +22,21 @@ typedef struct {
 } ngx_http_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                          number;
+    ngx_http_upstream_rr_peer_t       **peer;
+    uint32_t                            lookup[1];
+} ngx_http_upstream_maglev_t;
+
+
 typedef struct {
     ngx_http_complex_value_t            key;
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_uint_t                          config;
 #endif
     ngx_http_upstream_chash_points_t   *points;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_uint_t                          bounded;
 } ngx_http_upstream_hash_srv_conf_t;
 
 
@@ -43,6 +52,18 @@ typedef struct {
 } ngx_http_upstream_hash_peer_data_t;
 
 
+/*
+ * With "bounded=c" a peer is overloaded if it has at least
+ * c * (in-flight + 1) * weight / total_weight active connections,
+ * see "Consistent Hashing with Bounded Loads", Mirrokni et al.
+ * The bound is kept in hundredths.
+ */
+
+#define ngx_http_upstream_hash_overloaded(hp, peer, load)                     \
+    ((uint64_t) (peer)->conns * 100 * (hp)->rrp.peers->total_weight           \
+     >= (uint64_t) (hp)->conf->bounded * (load) * (peer)->weight)
+
+
 static ngx_int_t ngx_http_upstream_init_hash(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
 static ngx_int_t ngx_http_upstream_init_hash_peer(ngx_http_request_t *r,
@@ -63,6 +84,18 @@ static ngx_int_t ngx_http_upstream_init_chash_peer(ngx_http_request_t *r,
 static ngx_int_t ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc,
     void *data);
 
+static ngx_int_t ngx_http_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc,
+    void *data);
+
+static ngx_uint_t ngx_http_upstream_hash_load(
+    ngx_http_upstream_rr_peers_t *peers);
+
 static void *ngx_http_upstream_hash_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -71,7 +104,7 @@ static char *ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_hash_commands[] = {
 
     { ngx_string("hash"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
       ngx_http_upstream_hash,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -552,7 +585,8 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     intptr_t                            m;
     ngx_str_t                          *server;
     ngx_int_t                           total;
-    ngx_uint_t                          i, n, best_i;
+    ngx_uint_t                          i, n, best_i, load, skipped;
+    ngx_uint_t                          overloaded;
     ngx_http_upstream_rr_peer_t        *peer, *best;
     ngx_http_upstream_chash_point_t    *point;
     ngx_http_upstream_chash_points_t   *points;
@@ -591,6 +625,9 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     points = hcf->points;
     point = &points->point[0];
 
+    load = hcf->bounded ? ngx_http_upstream_hash_load(hp->rrp.peers) : 0;
+    skipped = 0;
+
     for ( ;; ) {
         server = point[hp->hash % points->number].server;
 
@@ -601,6 +638,7 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
         best = NULL;
         best_i = 0;
         total = 0;
+        overloaded = 0;
 
         for (peer = hp->rrp.peers->peer, i = 0;
              peer;
@@ -635,6 +673,11 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
+            if (load && ngx_http_upstream_hash_overloaded(hp, peer, load)) {
+                overloaded = 1;
+                continue;
+            }
+
             peer->current_weight += peer->effective_weight;
             total += peer->effective_weight;
 
@@ -653,6 +696,22 @@ ngx_http_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
             goto found;
         }
 
+        if (overloaded) {
+
+            /*
+             * walk further along the ring; if every peer turns out
+             * to be loaded, the bound is dropped
+             */
+
+            if (++skipped > hp->rrp.peers->number + 20) {
+                load = 0;
+                continue;
+            }
+
+            hp->hash++;
+            continue;
+        }
+
         hp->hash++;
         hp->tries++;
 
@@ -688,6 +747,338 @@ found:
 }
 
 
+static ngx_int_t
+ngx_http_upstream_init_maglev(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    if (ngx_http_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_http_upstream_init_maglev_peer;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (us->shm_zone) {
+        return NGX_OK;
+    }
+#endif
+
+    return ngx_http_upstream_update_maglev(cf->pool, us);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_update_maglev(ngx_pool_t *pool,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    size_t                              size;
+    uint32_t                           *skip, *pos;
+    ngx_uint_t                          number, filled, i, j, k, w;
+    ngx_http_upstream_rr_peer_t        *peer;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_maglev_t         *maglev;
+    ngx_http_upstream_hash_srv_conf_t  *hcf;
+
+    /*
+     * Maglev hashing, see "Maglev: A Fast and Reliable Software Network
+     * Load Balancer", Eisenbud et al.  Each peer walks its own permutation
+     * of the lookup table, determined by an offset and a skip derived from
+     * the peer address, and peers take turns, in proportion to their
+     * weights, claiming the next free entry.  The table size is a prime,
+     * so that every permutation visits all entries.
+     */
+
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    if (hcf->maglev) {
+        ngx_free(hcf->maglev);
+        hcf->maglev = NULL;
+    }
+
+    peers = us->peer.data;
+
+    number = 0;
+
+    if (peers->number) {
+
+        /* about 100 entries per weight unit, the nearest prime above */
+
+        for (number = ngx_max(peers->total_weight * 100, 257) | 1;
+             /* void */ ;
+             number += 2)
+        {
+            for (i = 3; i * i <= number; i += 2) {
+                if (number % i == 0) {
+                    break;
+                }
+            }
+
+            if (i * i > number) {
+                break;
+            }
+        }
+    }
+
+    size = sizeof(ngx_http_upstream_maglev_t) - sizeof(uint32_t)
+           + number * sizeof(uint32_t)
+           + peers->number * sizeof(ngx_http_upstream_rr_peer_t *);
+
+    maglev = pool ? ngx_palloc(pool, size) : ngx_alloc(size, ngx_cycle->log);
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->number = number;
+    maglev->peer = (ngx_http_upstream_rr_peer_t **)
+                                              &maglev->lookup[number];
+
+    if (number == 0) {
+        hcf->maglev = maglev;
+        return NGX_OK;
+    }
+
+    skip = ngx_alloc(2 * peers->number * sizeof(uint32_t), ngx_cycle->log);
+    if (skip == NULL) {
+        if (pool == NULL) {
+            ngx_free(maglev);
+        }
+
+        return NGX_ERROR;
+    }
+
+    pos = &skip[peers->number];
+
+    for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
+        maglev->peer[i] = peer;
+
+        pos[i] = ngx_crc32_long(peer->name.data, peer->name.len) % number;
+        skip[i] = ngx_murmur_hash2(peer->name.data, peer->name.len)
+                  % (number - 1) + 1;
+    }
+
+    ngx_memset(maglev->lookup, 0xff, number * sizeof(uint32_t));
+
+    filled = 0;
+
+    for ( ;; ) {
+
+        for (i = 0; i < peers->number; i++) {
+
+            w = maglev->peer[i]->weight;
+
+            for (k = 0; k < w; k++) {
+
+                do {
+                    j = pos[i];
+                    pos[i] = (pos[i] + skip[i]) % number;
+
+                } while (maglev->lookup[j] != (uint32_t) -1);
+
+                maglev->lookup[j] = i;
+
+                if (++filled == number) {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+
+    ngx_free(skip);
+
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_maglev_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_http_upstream_hash_srv_conf_t   *hcf;
+#endif
+
+    if (ngx_http_upstream_init_hash_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    r->upstream->peer.get = ngx_http_upstream_get_maglev_peer;
+
+    hp = r->upstream->peer.data;
+
+    hp->hash = ngx_crc32_long(hp->key.data, hp->key.len);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    hcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_upstream_hash_module);
+
+    ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->rrp.peers->config
+        && (hcf->maglev == NULL || hcf->config != *hp->rrp.peers->config))
+    {
+        if (ngx_http_upstream_update_maglev(NULL, us) != NGX_OK) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return NGX_ERROR;
+        }
+
+        hcf->config = *hp->rrp.peers->config;
+    }
+
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_maglev_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_hash_peer_data_t  *hp = data;
+
+    time_t                        now;
+    uintptr_t                     m;
+    ngx_uint_t                    n, p, load, skipped;
+    ngx_http_upstream_rr_peer_t  *peer;
+    ngx_http_upstream_maglev_t   *maglev;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get maglev peer, try: %ui", pc->tries);
+
+    ngx_http_upstream_rr_peers_rlock(hp->rrp.peers);
+
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return hp->get_rr_peer(pc, &hp->rrp);
+    }
+
+    pc->cached = 0;
+    pc->connection = NULL;
+
+    if (hp->rrp.peers->number == 0) {
+        pc->name = hp->rrp.peers->name;
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (hp->rrp.peers->config && hp->rrp.config != *hp->rrp.peers->config) {
+        pc->name = hp->rrp.peers->name;
+        ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+        return NGX_BUSY;
+    }
+#endif
+
+    now = ngx_time();
+
+    maglev = hp->conf->maglev;
+
+    load = hp->conf->bounded ? ngx_http_upstream_hash_load(hp->rrp.peers)
+                             : 0;
+    skipped = 0;
+
+    for ( ;; ) {
+
+        p = maglev->lookup[hp->hash % maglev->number];
+        peer = maglev->peer[p];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "maglev peer:%uD, peer:%ui", hp->hash, p);
+
+        n = p / (8 * sizeof(uintptr_t));
+        m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+
+        if (hp->rrp.tried[n] & m) {
+            goto next;
+        }
+
+        ngx_http_upstream_rr_peer_lock(hp->rrp.peers, peer);
+
+        if (peer->down) {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+            goto next;
+        }
+
+        if (load && ngx_http_upstream_hash_overloaded(hp, peer, load)) {
+            ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+
+            if (++skipped > hp->rrp.peers->number + 20) {
+                load = 0;
+                continue;
+            }
+
+            hp->hash++;
+            continue;
+        }
+
+        break;
+
+    next:
+
+        hp->hash++;
+
+        if (++hp->tries > 20) {
+            ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+            return hp->get_rr_peer(pc, &hp->rrp);
+        }
+    }
+
+    hp->rrp.current = peer;
+    ngx_http_upstream_rr_peer_ref(hp->rrp.peers, peer);
+
+    pc->sockaddr = peer->sockaddr;
+    pc->socklen = peer->socklen;
+    pc->name = &peer->name;
+
+    peer->conns++;
+
+    if (now - peer->checked > peer->fail_timeout) {
+        peer->checked = now;
+    }
+
+    ngx_http_upstream_rr_peer_unlock(hp->rrp.peers, peer);
+    ngx_http_upstream_rr_peers_unlock(hp->rrp.peers);
+
+    hp->rrp.tried[n] |= m;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_hash_load(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                    load;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /* connections in flight, including the one being established */
+
+    load = 1;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        load += peer->conns;
+    }
+
+    return load;
+}
+
+
 static void *
 ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
 {
@@ -699,6 +1090,8 @@ ngx_http_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
+    conf->bounded = 0;
 
     return conf;
 }
@@ -709,7 +1102,9 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_hash_srv_conf_t  *hcf = conf;
 
+    ngx_int_t                          n;
     ngx_str_t                         *value;
+    ngx_uint_t                         i;
     ngx_http_upstream_srv_conf_t      *uscf;
     ngx_http_compile_complex_value_t   ccv;
 
@@ -740,15 +1135,37 @@ ngx_http_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                   |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                   |NGX_HTTP_UPSTREAM_DOWN;
 
-    if (cf->args->nelts == 2) {
-        uscf->peer.init_upstream = ngx_http_upstream_init_hash;
+    uscf->peer.init_upstream = ngx_http_upstream_init_hash;
 
-    } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
-        uscf->peer.init_upstream = ngx_http_upstream_init_chash;
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (i == 2 && ngx_strcmp(value[i].data, "consistent") == 0) {
+            uscf->peer.init_upstream = ngx_http_upstream_init_chash;
+            continue;
+        }
+
+        if (i == 2 && ngx_strcmp(value[i].data, "maglev") == 0) {
+            uscf->peer.init_upstream = ngx_http_upstream_init_maglev;
+            continue;
+        }
+
+        if (i == 3 && ngx_strncmp(value[i].data, "bounded=", 8) == 0
+            && uscf->peer.init_upstream != ngx_http_upstream_init_hash)
+        {
+            n = ngx_atofp(value[i].data + 8, value[i].len - 8, 2);
+
+            if (n == NGX_ERROR || n <= 100) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid load bound \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            hcf->bounded = n;
+            continue;
+        }
 
-    } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
+                           "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
     }
 
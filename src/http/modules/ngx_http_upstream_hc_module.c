@@ -0,0 +1,1172 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_HC_HTTP      0
+#define NGX_HTTP_UPSTREAM_HC_TCP       1
+
+#define NGX_HTTP_UPSTREAM_HC_BUFFER    4096
+
+
+typedef struct {
+    ngx_uint_t                         from;
+    ngx_uint_t                         to;
+} ngx_http_upstream_hc_status_t;
+
+
+typedef struct {
+    ngx_str_t                          name;
+
+    ngx_array_t                       *status;
+    ngx_uint_t                         status_not;
+
+    ngx_str_t                          body;
+    ngx_uint_t                         body_not;
+#if (NGX_PCRE)
+    ngx_regex_t                       *body_regex;
+#endif
+} ngx_http_upstream_hc_match_t;
+
+
+typedef struct {
+    ngx_array_t                        matches;
+} ngx_http_upstream_hc_main_conf_t;
+
+
+typedef struct {
+    ngx_msec_t                         interval;
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         fails;
+    ngx_uint_t                         passes;
+    ngx_uint_t                         type;
+    in_port_t                          port;
+
+    ngx_str_t                          request;
+
+    ngx_str_t                          match_name;
+    ngx_http_upstream_hc_match_t      *match;
+
+    ngx_event_t                        event;
+} ngx_http_upstream_hc_srv_conf_t;
+
+
+typedef struct ngx_http_upstream_hc_peer_s  ngx_http_upstream_hc_peer_t;
+
+struct ngx_http_upstream_hc_peer_s {
+    ngx_peer_connection_t              pc;
+    ngx_pool_t                        *pool;
+    ngx_log_t                          log;
+
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_upstream_hc_srv_conf_t   *hcf;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_rr_peer_t       *peer;
+
+    ngx_buf_t                         *send;
+    ngx_buf_t                         *recv;
+
+    ngx_http_upstream_hc_peer_t       *next;
+};
+
+
+static void ngx_http_upstream_hc_timer(ngx_event_t *ev);
+static ngx_http_upstream_hc_peer_t *ngx_http_upstream_hc_create_peer(
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_write_handler(ngx_event_t *wev);
+static void ngx_http_upstream_hc_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_upstream_hc_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_hc_match(ngx_http_upstream_hc_peer_t *hp);
+static void ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp,
+    ngx_uint_t ok);
+
+static void *ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf);
+static void *ngx_http_upstream_hc_create_srv_conf(ngx_conf_t *cf);
+static ngx_int_t ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf);
+static char *ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_hc_match_block(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_upstream_hc_match_rule(ngx_conf_t *cf,
+    ngx_command_t *dummy, void *conf);
+static ngx_int_t ngx_http_upstream_hc_init_worker(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_hc_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_http_upstream_hc,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("match"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_TAKE1,
+      ngx_http_upstream_hc_match_block,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_hc_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_hc_postconfiguration, /* postconfiguration */
+
+    ngx_http_upstream_hc_create_main_conf, /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_hc_create_srv_conf,  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_hc_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_hc_module_ctx,      /* module context */
+    ngx_http_upstream_hc_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_hc_init_worker,      /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_hc_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                        i;
+    ngx_event_t                      *ev;
+    ngx_http_upstream_srv_conf_t     *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t    *umcf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL || uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscf,
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        ev = &hcf->event;
+
+        ev->handler = ngx_http_upstream_hc_timer;
+        ev->data = uscf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_hc_timer(ngx_event_t *ev)
+{
+    ngx_msec_t                        now;
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_peer_t      *hp, *probes, **last;
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    uscf = ev->data;
+    hcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_hc_module);
+
+    now = ngx_current_msec;
+
+    probes = NULL;
+    last = &probes;
+
+    /*
+     * Peers live in the upstream zone and are probed by whichever
+     * worker claims them first: the claim is the time of the next probe,
+     * moved forward under the lock.  Probes are started once the lock
+     * is released.
+     */
+
+    for (peers = uscf->peer.data; peers; peers = peers->next) {
+
+        ngx_http_upstream_rr_peers_wlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if ((ngx_msec_int_t) (peer->check_next - now) > 0) {
+                continue;
+            }
+
+            hp = ngx_http_upstream_hc_create_peer(uscf, peers, peer);
+            if (hp == NULL) {
+                break;
+            }
+
+            peer->check_next = now + hcf->interval;
+            ngx_http_upstream_rr_peer_ref(peers, peer);
+
+            *last = hp;
+            last = &hp->next;
+        }
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+    }
+
+    while (probes) {
+        hp = probes;
+        probes = hp->next;
+
+        ngx_http_upstream_hc_connect(hp);
+    }
+
+    ngx_add_timer(ev, hcf->interval);
+}
+
+
+static ngx_http_upstream_hc_peer_t *
+ngx_http_upstream_hc_create_peer(ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_pool_t                       *pool;
+    ngx_http_upstream_hc_peer_t      *hp;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_upstream_hc_module);
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    hp = ngx_pcalloc(pool, sizeof(ngx_http_upstream_hc_peer_t));
+    if (hp == NULL) {
+        goto failed;
+    }
+
+    hp->pool = pool;
+    hp->uscf = uscf;
+    hp->hcf = hcf;
+    hp->peers = peers;
+    hp->peer = peer;
+
+    hp->log = *ngx_cycle->log;
+    hp->log.action = "checking upstream peer health";
+    pool->log = &hp->log;
+
+    hp->pc.socklen = peer->socklen;
+    hp->pc.sockaddr = ngx_palloc(pool, peer->socklen);
+    if (hp->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(hp->pc.sockaddr, peer->sockaddr, peer->socklen);
+
+    if (hcf->port) {
+        ngx_inet_set_port(hp->pc.sockaddr, hcf->port);
+    }
+
+    hp->pc.name = ngx_palloc(pool, sizeof(ngx_str_t));
+    if (hp->pc.name == NULL) {
+        goto failed;
+    }
+
+    hp->pc.name->len = peer->name.len;
+    hp->pc.name->data = ngx_pstrdup(pool, &peer->name);
+    if (hp->pc.name->data == NULL) {
+        goto failed;
+    }
+
+    hp->pc.get = ngx_event_get_peer;
+    hp->pc.log = &hp->log;
+    hp->pc.log_error = NGX_ERROR_INFO;
+
+    if (hcf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+        return hp;
+    }
+
+    hp->send = ngx_calloc_buf(pool);
+    if (hp->send == NULL) {
+        goto failed;
+    }
+
+    hp->send->pos = hcf->request.data;
+    hp->send->last = hcf->request.data + hcf->request.len;
+
+    hp->recv = ngx_create_temp_buf(pool, NGX_HTTP_UPSTREAM_HC_BUFFER);
+    if (hp->recv == NULL) {
+        goto failed;
+    }
+
+    return hp;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_hc_connect(ngx_http_upstream_hc_peer_t *hp)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "health check peer %V", hp->pc.name);
+
+    rc = ngx_event_connect_peer(&hp->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    c = hp->pc.connection;
+
+    c->data = hp;
+    c->pool = hp->pool;
+
+    c->write->handler = ngx_http_upstream_hc_write_handler;
+    c->read->handler = ngx_http_upstream_hc_read_handler;
+
+    /* the whole check is limited by the timeout */
+
+    ngx_add_timer(c->read, hp->hcf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_http_upstream_hc_write_handler(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_write_handler(ngx_event_t *wev)
+{
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = wev->data;
+    hp = c->data;
+
+    if (ngx_http_upstream_hc_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (hp->hcf->type == NGX_HTTP_UPSTREAM_HC_TCP) {
+        ngx_http_upstream_hc_finalize(hp, 1);
+        return;
+    }
+
+    b = hp->send;
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    wev->handler = ngx_http_empty_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_hc_finalize(hp, 0);
+    }
+}
+
+
+static void
+ngx_http_upstream_hc_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hc_peer_t  *hp;
+
+    c = rev->data;
+    hp = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check of %V timed out", hp->pc.name);
+        ngx_http_upstream_hc_finalize(hp, 0);
+        return;
+    }
+
+    if (hp->recv == NULL) {
+
+        /* the tcp check is not connected yet */
+
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+        }
+
+        return;
+    }
+
+    b = hp->recv;
+
+    for ( ;; ) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_upstream_hc_finalize(hp, 0);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_upstream_hc_finalize(hp, 0);
+            return;
+        }
+
+        b->last += n;
+
+        if (n == 0 || b->last == b->end) {
+            break;
+        }
+    }
+
+    ngx_http_upstream_hc_finalize(hp, ngx_http_upstream_hc_match(hp) == NGX_OK);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_match(ngx_http_upstream_hc_peer_t *hp)
+{
+    u_char                         *p, *last;
+    ngx_str_t                       body;
+    ngx_uint_t                      code, i, found;
+    ngx_http_upstream_hc_match_t   *match;
+    ngx_http_upstream_hc_status_t  *status;
+
+    p = hp->recv->pos;
+    last = hp->recv->last;
+
+    /* "HTTP/1.x NNN " */
+
+    if (last - p < 12
+        || ngx_strncmp(p, "HTTP/1.", 7) != 0
+        || p[8] != ' '
+        || p[9] < '1' || p[9] > '5'
+        || p[10] < '0' || p[10] > '9'
+        || p[11] < '0' || p[11] > '9')
+    {
+        ngx_log_error(NGX_LOG_INFO, &hp->log, 0,
+                      "health check of %V: invalid response", hp->pc.name);
+        return NGX_DECLINED;
+    }
+
+    code = (p[9] - '0') * 100 + (p[10] - '0') * 10 + p[11] - '0';
+
+    match = hp->hcf->match;
+
+    if (match == NULL) {
+        return (code >= 200 && code < 400) ? NGX_OK : NGX_DECLINED;
+    }
+
+    if (match->status) {
+        status = match->status->elts;
+        found = 0;
+
+        for (i = 0; i < match->status->nelts; i++) {
+            if (code >= status[i].from && code <= status[i].to) {
+                found = 1;
+                break;
+            }
+        }
+
+        if (found == match->status_not) {
+            return NGX_DECLINED;
+        }
+    }
+
+#if (NGX_PCRE)
+    if (match->body.len == 0 && match->body_regex == NULL) {
+        return NGX_OK;
+    }
+#else
+    if (match->body.len == 0) {
+        return NGX_OK;
+    }
+#endif
+
+    /* the body, as far as it fits into the buffer */
+
+    p = ngx_strnstr(p, "\r\n\r\n", last - p);
+
+    if (p) {
+        body.data = p + 4;
+        body.len = last - body.data;
+
+    } else {
+        ngx_str_null(&body);
+    }
+
+#if (NGX_PCRE)
+    if (match->body_regex) {
+        found = (ngx_regex_exec(match->body_regex, &body, NULL, 0) >= 0);
+
+    } else
+#endif
+    {
+        /* a case-sensitive search, the body may contain null bytes */
+
+        found = 0;
+
+        if (body.len >= match->body.len) {
+            last = body.data + body.len - match->body.len + 1;
+
+            for (p = body.data; p < last; p++) {
+                p = ngx_strlchr(p, last, match->body.data[0]);
+
+                if (p == NULL) {
+                    break;
+                }
+
+                if (ngx_memcmp(p, match->body.data, match->body.len) == 0) {
+                    found = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    return (found != match->body_not) ? NGX_OK : NGX_DECLINED;
+}
+
+
+static void
+ngx_http_upstream_hc_finalize(ngx_http_upstream_hc_peer_t *hp, ngx_uint_t ok)
+{
+    ngx_http_upstream_rr_peer_t      *peer;
+    ngx_http_upstream_rr_peers_t     *peers;
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    if (hp->pc.connection) {
+        ngx_close_connection(hp->pc.connection);
+        hp->pc.connection = NULL;
+    }
+
+    hcf = hp->hcf;
+    peers = hp->peers;
+    peer = hp->peer;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, &hp->log, 0,
+                   "health check peer %V: %ui", hp->pc.name, ok);
+
+    if (ok) {
+        peer->check_fails = 0;
+
+        if ((peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+            && ++peer->check_passes >= hcf->passes)
+        {
+            peer->down &= ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_NOTICE, &hp->log, 0,
+                          "peer %V in upstream \"%V\" is healthy",
+                          hp->pc.name, &hp->uscf->host);
+        }
+
+    } else {
+        peer->check_passes = 0;
+
+        if (!(peer->down & NGX_HTTP_UPSTREAM_PEER_UNHEALTHY)
+            && ++peer->check_fails >= hcf->fails)
+        {
+            peer->down |= NGX_HTTP_UPSTREAM_PEER_UNHEALTHY;
+
+            ngx_log_error(NGX_LOG_WARN, &hp->log, 0,
+                          "peer %V in upstream \"%V\" is unhealthy",
+                          hp->pc.name, &hp->uscf->host);
+        }
+    }
+
+    if (ngx_http_upstream_rr_peer_unref(peers, peer) == NGX_OK) {
+        ngx_http_upstream_rr_peer_unlock(peers, peer);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(hp->pool);
+}
+
+
+static void *
+ngx_http_upstream_hc_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    hmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_main_conf_t));
+    if (hmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&hmcf->matches, cf->pool, 4,
+                       sizeof(ngx_http_upstream_hc_match_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    return hmcf;
+}
+
+
+static void *
+ngx_http_upstream_hc_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf;
+
+    hcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hc_srv_conf_t));
+    if (hcf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     hcf->interval = 0;
+     *     hcf->port = 0;
+     *     hcf->request = { 0, NULL };
+     *     hcf->match_name = { 0, NULL };
+     *     hcf->match = NULL;
+     *     hcf->event = { 0 };
+     */
+
+    return hcf;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_hc_postconfiguration(ngx_conf_t *cf)
+{
+    ngx_uint_t                         i, j;
+    ngx_http_upstream_hc_match_t      *match;
+    ngx_http_upstream_srv_conf_t      *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t     *umcf;
+    ngx_http_upstream_hc_srv_conf_t   *hcf;
+    ngx_http_upstream_hc_main_conf_t  *hmcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    hmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_hc_module);
+
+    uscfp = umcf->upstreams.elts;
+    match = hmcf->matches.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        hcf = ngx_http_conf_upstream_srv_conf(uscf,
+                                              ngx_http_upstream_hc_module);
+
+        if (hcf->interval == 0) {
+            continue;
+        }
+
+        if (uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires upstream \"%V\" "
+                          "to be in a shared memory zone in %s:%ui",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_ERROR;
+        }
+
+        if (hcf->match_name.len == 0) {
+            continue;
+        }
+
+        for (j = 0; j < hmcf->matches.nelts; j++) {
+            if (match[j].name.len == hcf->match_name.len
+                && ngx_strncmp(match[j].name.data, hcf->match_name.data,
+                               hcf->match_name.len)
+                   == 0)
+            {
+                hcf->match = &match[j];
+                break;
+            }
+        }
+
+        if (hcf->match == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check match \"%V\" not found in %s:%ui",
+                          &hcf->match_name, uscf->file_name, uscf->line);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static char *
+ngx_http_upstream_hc(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_hc_srv_conf_t  *hcf = conf;
+
+    u_char                        *p;
+    ngx_int_t                      n;
+    ngx_str_t                     *value, s, uri;
+    ngx_uint_t                     i;
+    ngx_http_upstream_srv_conf_t  *uscf;
+
+    if (hcf->interval) {
+        return "is duplicate";
+    }
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    hcf->interval = 5000;
+    hcf->timeout = NGX_CONF_UNSET_MSEC;
+    hcf->fails = 1;
+    hcf->passes = 1;
+    hcf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+
+    ngx_str_set(&uri, "/");
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            hcf->interval = ngx_parse_time(&s, 0);
+            if (hcf->interval == (ngx_msec_t) NGX_ERROR
+                || hcf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            hcf->timeout = ngx_parse_time(&s, 0);
+            if (hcf->timeout == (ngx_msec_t) NGX_ERROR || hcf->timeout == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            hcf->passes = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "port=", 5) == 0) {
+
+            n = ngx_atoi(&value[i].data[5], value[i].len - 5);
+            if (n < 1 || n > 65535) {
+                goto invalid;
+            }
+
+            hcf->port = (in_port_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "uri=", 4) == 0) {
+
+            uri.len = value[i].len - 4;
+            uri.data = &value[i].data[4];
+
+            if (uri.len == 0 || uri.data[0] != '/') {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "match=", 6) == 0) {
+
+            hcf->match_name.len = value[i].len - 6;
+            hcf->match_name.data = &value[i].data[6];
+
+            if (hcf->match_name.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=http") == 0) {
+            hcf->type = NGX_HTTP_UPSTREAM_HC_HTTP;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "type=tcp") == 0) {
+            hcf->type = NGX_HTTP_UPSTREAM_HC_TCP;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (hcf->timeout == NGX_CONF_UNSET_MSEC) {
+        hcf->timeout = ngx_min(hcf->interval, 5000);
+    }
+
+    if (hcf->type == NGX_HTTP_UPSTREAM_HC_TCP && hcf->match_name.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"match\" cannot be used with \"type=tcp\"");
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.len = sizeof("GET  HTTP/1.0" CRLF) - 1 + uri.len
+                       + sizeof("Host: " CRLF) - 1 + uscf->host.len
+                       + sizeof("User-Agent: nginx health check" CRLF) - 1
+                       + sizeof("Connection: close" CRLF CRLF) - 1;
+
+    p = ngx_pnalloc(cf->pool, hcf->request.len);
+    if (p == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    hcf->request.data = p;
+
+    p = ngx_sprintf(p, "GET %V HTTP/1.0" CRLF "Host: %V" CRLF, &uri,
+                    &uscf->host);
+    p = ngx_cpymem(p, "User-Agent: nginx health check" CRLF,
+                   sizeof("User-Agent: nginx health check" CRLF) - 1);
+    ngx_memcpy(p, "Connection: close" CRLF CRLF,
+               sizeof("Connection: close" CRLF CRLF) - 1);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_block(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_hc_main_conf_t  *hmcf = conf;
+
+    char                          *rv;
+    ngx_str_t                     *value;
+    ngx_uint_t                     i;
+    ngx_conf_t                     save;
+    ngx_http_upstream_hc_match_t  *match;
+
+    value = cf->args->elts;
+
+    match = hmcf->matches.elts;
+
+    for (i = 0; i < hmcf->matches.nelts; i++) {
+        if (match[i].name.len == value[1].len
+            && ngx_strncmp(match[i].name.data, value[1].data, value[1].len)
+               == 0)
+        {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate match \"%V\"", &value[1]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    match = ngx_array_push(&hmcf->matches);
+    if (match == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(match, sizeof(ngx_http_upstream_hc_match_t));
+
+    match->name = value[1];
+
+    save = *cf;
+    cf->handler = ngx_http_upstream_hc_match_rule;
+    cf->handler_conf = (char *) match;
+
+    rv = ngx_conf_parse(cf, NULL);
+
+    *cf = save;
+
+    return rv;
+}
+
+
+static char *
+ngx_http_upstream_hc_match_rule(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf)
+{
+    ngx_http_upstream_hc_match_t  *match = conf;
+
+    u_char                         *p;
+    ngx_int_t                       from, to;
+    ngx_str_t                      *value;
+    ngx_uint_t                      i;
+    ngx_http_upstream_hc_status_t  *status;
+#if (NGX_PCRE)
+    u_char                          errstr[NGX_MAX_CONF_ERRSTR];
+    ngx_regex_compile_t             rc;
+#endif
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[0].data, "status") == 0) {
+
+        if (match->status || cf->args->nelts < 2) {
+            goto invalid;
+        }
+
+        match->status = ngx_array_create(cf->pool, 2,
+                                         sizeof(ngx_http_upstream_hc_status_t));
+        if (match->status == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        i = 1;
+
+        if (ngx_strcmp(value[1].data, "!") == 0) {
+            match->status_not = 1;
+            i++;
+        }
+
+        if (i == cf->args->nelts) {
+            goto invalid;
+        }
+
+        for ( /* void */ ; i < cf->args->nelts; i++) {
+
+            p = (u_char *) ngx_strchr(value[i].data, '-');
+
+            if (p) {
+                from = ngx_atoi(value[i].data, p - value[i].data);
+                to = ngx_atoi(p + 1, value[i].data + value[i].len - p - 1);
+
+            } else {
+                from = ngx_atoi(value[i].data, value[i].len);
+                to = from;
+            }
+
+            if (from < 100 || to > 599 || from > to) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid status \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            status = ngx_array_push(match->status);
+            if (status == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            status->from = from;
+            status->to = to;
+        }
+
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[0].data, "body") == 0) {
+
+        if (match->body.data || cf->args->nelts < 2 || cf->args->nelts > 3) {
+            goto invalid;
+        }
+
+        i = 1;
+
+        if (cf->args->nelts == 3) {
+
+            if (ngx_strcmp(value[1].data, "!") == 0) {
+                match->body_not = 1;
+
+            } else if (ngx_strcmp(value[1].data, "~") == 0
+                       || ngx_strcmp(value[1].data, "!~") == 0)
+            {
+#if (NGX_PCRE)
+                match->body_not = (value[1].data[0] == '!');
+
+                ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+                rc.pattern = value[2];
+                rc.pool = cf->pool;
+                rc.err.len = NGX_MAX_CONF_ERRSTR;
+                rc.err.data = errstr;
+
+                if (ngx_regex_compile(&rc) != NGX_OK) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+                    return NGX_CONF_ERROR;
+                }
+
+                match->body_regex = rc.regex;
+                match->body = value[2];
+
+                return NGX_CONF_OK;
+#else
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "using regex \"%V\" requires PCRE library",
+                                   &value[2]);
+                return NGX_CONF_ERROR;
+#endif
+
+            } else {
+                goto invalid;
+            }
+
+            i++;
+        }
+
+        if (value[i].len == 0) {
+            goto invalid;
+        }
+
+        match->body = value[i];
+
+        return NGX_CONF_OK;
+    }
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid match rule \"%V\"", &value[0]);
+
+    return NGX_CONF_ERROR;
+}
@@ -10,8 +10,16 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_uint_t                         hits;
+    ngx_uint_t                         misses;
+    ngx_uint_t                         evictions;
+} ngx_http_upstream_keepalive_stats_t;
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
+    ngx_uint_t                         max_per_peer;
     ngx_uint_t                         requests;
     ngx_msec_t                         time;
     ngx_msec_t                         timeout;
@@ -19,20 +27,44 @@ typedef struct {
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_queue_t                       *peers;
+    ngx_uint_t                         peers_mask;
+    ngx_queue_t                        free_peers;
+
+    ngx_http_upstream_keepalive_stats_t  stats;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
+/*
+ * Idle connections are linked both into the upstream-wide LRU queue,
+ * which is used for eviction, and into the queue of their peer.
+ * Peers with idle connections are kept in a hash table keyed by
+ * the peer address, so a connection is found without scanning the cache.
+ */
+
+typedef struct {
+    ngx_queue_t                        node;
+    ngx_queue_t                        cache;
+    ngx_uint_t                         cached;
+    uint32_t                           hash;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+} ngx_http_upstream_keepalive_peer_t;
+
+
 typedef struct {
     ngx_http_upstream_keepalive_srv_conf_t  *conf;
 
     ngx_queue_t                        queue;
+    ngx_queue_t                        peer_queue;
     ngx_connection_t                  *connection;
 
-    socklen_t                          socklen;
-    ngx_sockaddr_t                     sockaddr;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
 } ngx_http_upstream_keepalive_cache_t;
 
@@ -62,6 +94,13 @@ static ngx_int_t ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+static ngx_http_upstream_keepalive_peer_t *
+    ngx_http_upstream_keepalive_find_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc,
+    uint32_t hash);
+static void ngx_http_upstream_keepalive_unlink(
+    ngx_http_upstream_keepalive_cache_t *item);
+
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
@@ -73,6 +112,10 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
     void *data);
 #endif
 
+static ngx_int_t ngx_http_upstream_keepalive_stats_variable(
+    ngx_http_request_t *r, ngx_http_variable_value_t *v, uintptr_t data);
+
+static ngx_int_t ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf);
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -81,7 +124,7 @@ static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
     { ngx_string("keepalive"),
-      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
       ngx_http_upstream_keepalive,
       NGX_HTTP_SRV_CONF_OFFSET,
       0,
@@ -113,7 +156,7 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
 
 
 static ngx_http_module_t  ngx_http_upstream_keepalive_module_ctx = {
-    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_keepalive_add_variables, /* preconfiguration */
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
@@ -143,11 +186,33 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
 };
 
 
+static ngx_http_variable_t  ngx_http_upstream_keepalive_vars[] = {
+
+    { ngx_string("upstream_keepalive_hits"), NULL,
+      ngx_http_upstream_keepalive_stats_variable,
+      offsetof(ngx_http_upstream_keepalive_stats_t, hits),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_keepalive_misses"), NULL,
+      ngx_http_upstream_keepalive_stats_variable,
+      offsetof(ngx_http_upstream_keepalive_stats_t, misses),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("upstream_keepalive_evictions"), NULL,
+      ngx_http_upstream_keepalive_stats_variable,
+      offsetof(ngx_http_upstream_keepalive_stats_t, evictions),
+      NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+      ngx_http_null_variable
+};
+
+
 static ngx_int_t
 ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us)
 {
-    ngx_uint_t                               i;
+    ngx_uint_t                               i, n;
+    ngx_http_upstream_keepalive_peer_t      *peers;
     ngx_http_upstream_keepalive_srv_conf_t  *kcf;
     ngx_http_upstream_keepalive_cache_t     *cached;
 
@@ -185,6 +250,36 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
         cached[i].conf = kcf;
     }
 
+    /*
+     * no more than max_cached peers may have idle connections,
+     * so the peers are preallocated as well
+     */
+
+    peers = ngx_pcalloc(cf->pool,
+                 sizeof(ngx_http_upstream_keepalive_peer_t) * kcf->max_cached);
+    if (peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_init(&kcf->free_peers);
+
+    for (i = 0; i < kcf->max_cached; i++) {
+        ngx_queue_insert_head(&kcf->free_peers, &peers[i].node);
+    }
+
+    for (n = 1; n < kcf->max_cached; n <<= 1) { /* void */ }
+
+    kcf->peers = ngx_palloc(cf->pool, sizeof(ngx_queue_t) * n);
+    if (kcf->peers == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        ngx_queue_init(&kcf->peers[i]);
+    }
+
+    kcf->peers_mask = n - 1;
+
     return NGX_OK;
 }
 
@@ -238,9 +333,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_int_t          rc;
-    ngx_queue_t       *q, *cache;
-    ngx_connection_t  *c;
+    ngx_int_t                            rc;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer");
@@ -255,29 +351,21 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
 
     /* search cache for suitable connection */
 
-    cache = &kp->conf->cache;
-
-    for (q = ngx_queue_head(cache);
-         q != ngx_queue_sentinel(cache);
-         q = ngx_queue_next(q))
-    {
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
-        c = item->connection;
-
-        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
-                         item->socklen, pc->socklen)
-            == 0)
-        {
-            ngx_queue_remove(q);
-            ngx_queue_insert_head(&kp->conf->free, q);
-
-            goto found;
-        }
+    peer = ngx_http_upstream_keepalive_find_peer(kp->conf, pc,
+                                   ngx_murmur_hash2((u_char *) pc->sockaddr,
+                                                    pc->socklen));
+    if (peer == NULL) {
+        kp->conf->stats.misses++;
+        return NGX_OK;
     }
 
-    return NGX_OK;
+    q = ngx_queue_head(&peer->cache);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, peer_queue);
+    c = item->connection;
+
+    ngx_http_upstream_keepalive_unlink(item);
 
-found:
+    kp->conf->stats.hits++;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "get keepalive peer: using connection %p", c);
@@ -308,9 +396,11 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
-    ngx_queue_t          *q;
-    ngx_connection_t     *c;
-    ngx_http_upstream_t  *u;
+    uint32_t                             hash;
+    ngx_queue_t                         *q;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_t                 *u;
+    ngx_http_upstream_keepalive_peer_t  *peer;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer");
@@ -358,24 +448,71 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
+    hash = ngx_murmur_hash2((u_char *) pc->sockaddr, pc->socklen);
+
+    peer = ngx_http_upstream_keepalive_find_peer(kp->conf, pc, hash);
+
+    if (peer && peer->cached >= kp->conf->max_per_peer) {
+
+        /* evict the oldest connection of the peer */
+
+        q = ngx_queue_last(&peer->cache);
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t,
+                              peer_queue);
+        goto evict;
+    }
+
     if (ngx_queue_empty(&kp->conf->free)) {
 
         q = ngx_queue_last(&kp->conf->cache);
-        ngx_queue_remove(q);
-
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        goto evict;
+    }
+
+    q = ngx_queue_head(&kp->conf->free);
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    ngx_queue_remove(q);
 
-        ngx_http_upstream_keepalive_close(item->connection);
+    goto cache;
 
-    } else {
-        q = ngx_queue_head(&kp->conf->free);
+evict:
+
+    ngx_http_upstream_keepalive_close(item->connection);
+    ngx_http_upstream_keepalive_unlink(item);
+
+    ngx_queue_remove(&item->queue);
+
+    kp->conf->stats.evictions++;
+
+    if (peer && peer->cached == 0) {
+        /* the peer was released by unlink */
+        peer = NULL;
+    }
+
+cache:
+
+    if (peer == NULL) {
+        q = ngx_queue_head(&kp->conf->free_peers);
         ngx_queue_remove(q);
 
-        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+        peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, node);
+
+        ngx_queue_init(&peer->cache);
+        peer->cached = 0;
+        peer->hash = hash;
+        peer->socklen = pc->socklen;
+        ngx_memcpy(&peer->sockaddr, pc->sockaddr, pc->socklen);
+
+        ngx_queue_insert_head(&kp->conf->peers[hash & kp->conf->peers_mask],
+                              &peer->node);
     }
 
-    ngx_queue_insert_head(&kp->conf->cache, q);
+    ngx_queue_insert_head(&kp->conf->cache, &item->queue);
+    ngx_queue_insert_head(&peer->cache, &item->peer_queue);
+    peer->cached++;
 
+    item->peer = peer;
     item->connection = c;
 
     pc->connection = NULL;
@@ -397,9 +534,6 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     c->write->log = ngx_cycle->log;
     c->pool->log = ngx_cycle->log;
 
-    item->socklen = pc->socklen;
-    ngx_memcpy(&item->sockaddr, pc->sockaddr, pc->socklen);
-
     if (c->read->ready) {
         ngx_http_upstream_keepalive_close_handler(c->read);
     }
@@ -410,6 +544,58 @@ invalid:
 }
 
 
+static ngx_http_upstream_keepalive_peer_t *
+ngx_http_upstream_keepalive_find_peer(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_peer_connection_t *pc,
+    uint32_t hash)
+{
+    ngx_queue_t                         *q, *bucket;
+    ngx_http_upstream_keepalive_peer_t  *peer;
+
+    bucket = &kcf->peers[hash & kcf->peers_mask];
+
+    for (q = ngx_queue_head(bucket);
+         q != ngx_queue_sentinel(bucket);
+         q = ngx_queue_next(q))
+    {
+        peer = ngx_queue_data(q, ngx_http_upstream_keepalive_peer_t, node);
+
+        if (peer->hash == hash
+            && ngx_memn2cmp((u_char *) &peer->sockaddr,
+                            (u_char *) pc->sockaddr,
+                            peer->socklen, pc->socklen)
+               == 0)
+        {
+            return peer;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_keepalive_unlink(ngx_http_upstream_keepalive_cache_t *item)
+{
+    ngx_http_upstream_keepalive_peer_t      *peer;
+    ngx_http_upstream_keepalive_srv_conf_t  *conf;
+
+    conf = item->conf;
+    peer = item->peer;
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&conf->free, &item->queue);
+
+    ngx_queue_remove(&item->peer_queue);
+    item->peer = NULL;
+
+    if (--peer->cached == 0) {
+        ngx_queue_remove(&peer->node);
+        ngx_queue_insert_head(&conf->free_peers, &peer->node);
+    }
+}
+
+
 static void
 ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 {
@@ -421,7 +607,6 @@ ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev)
 static void
 ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 {
-    ngx_http_upstream_keepalive_srv_conf_t  *conf;
     ngx_http_upstream_keepalive_cache_t     *item;
 
     int                n;
@@ -452,12 +637,9 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 close:
 
     item = c->data;
-    conf = item->conf;
 
     ngx_http_upstream_keepalive_close(c);
-
-    ngx_queue_remove(&item->queue);
-    ngx_queue_insert_head(&conf->free, &item->queue);
+    ngx_http_upstream_keepalive_unlink(item);
 }
 
 
@@ -507,6 +689,66 @@ ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc, void *data)
 #endif
 
 
+static ngx_int_t
+ngx_http_upstream_keepalive_stats_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char                                  *p;
+    ngx_uint_t                               n;
+    ngx_http_upstream_t                     *u;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    u = r->upstream;
+
+    if (u == NULL || u->upstream == NULL || u->upstream->srv_conf == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    kcf = ngx_http_conf_upstream_srv_conf(u->upstream,
+                                          ngx_http_upstream_keepalive_module);
+
+    if (kcf->max_cached == 0) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    n = *(ngx_uint_t *) ((u_char *) &kcf->stats + data);
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", n) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t  *var, *v;
+
+    for (v = ngx_http_upstream_keepalive_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
 {
@@ -524,6 +766,7 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->stats = { 0 };
      */
 
     conf->time = NGX_CONF_UNSET_MSEC;
@@ -561,6 +804,27 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     kcf->max_cached = n;
+    kcf->max_per_peer = n;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "max_per_peer=", 13) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        n = ngx_atoi(value[2].data + 13, value[2].len - 13);
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid value \"%V\" in \"%V\" directive",
+                               &value[2], &cmd->name);
+            return NGX_CONF_ERROR;
+        }
+
+        kcf->max_per_peer = n;
+    }
 
     /* init upstream handler */
 
@@ -571,6 +835,7 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                   : ngx_http_upstream_init_round_robin;
 
     uscf->peer.init_upstream = ngx_http_upstream_init_keepalive;
+    uscf->keepalive = 1;
 
     return NGX_CONF_OK;
 }
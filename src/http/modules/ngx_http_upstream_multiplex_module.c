@@ -0,0 +1,2175 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * The module multiplexes HTTP/2 requests to an upstream peer over a few
+ * connections.
+ *
+ * A connection is established by the first request as usual, including
+ * SSL handshake, and is taken over by the module when the upstream module
+ * notifies the balancer that it is connected.  Each request then talks
+ * to a stream connection: a shared connection with its own events and
+ * pool, which exchanges HTTP/2 frames with the multiplexed connection.
+ *
+ * The request sees a connection of its own: the connection preface and
+ * connection-level frames it sends are consumed here, stream identifiers
+ * are rewritten in both directions, and connection-level flow control
+ * is handled by the module.  Connection settings and windows are passed
+ * to the stream as frames of the stream's own connection.
+ */
+
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_WINDOW     (256 * 1024)
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER                                    \
+    (2 * (NGX_HTTP_V2_DEFAULT_FRAME_SIZE + NGX_HTTP_V2_FRAME_HEADER_SIZE))
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_SID    0x7fffff00
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_NO_ERROR   0x0
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_CANCEL     0x8
+
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAMS_SETTING  0x3
+#define NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING  0x4
+
+
+typedef struct {
+    ngx_uint_t                         max_streams;
+    ngx_msec_t                         timeout;
+
+    ngx_rbtree_t                       rbtree;
+    ngx_rbtree_node_t                  sentinel;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_upstream_multiplex_srv_conf_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t                  node;
+    ngx_queue_t                        connections;
+
+    socklen_t                          socklen;
+    ngx_sockaddr_t                     sockaddr;
+} ngx_http_upstream_multiplex_peer_t;
+
+
+typedef struct {
+    ngx_queue_t                        queue;
+
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+    ngx_http_upstream_multiplex_peer_t      *peer;
+
+    ngx_connection_t                  *connection;
+    ngx_buf_t                         *buffer;
+
+    ngx_rbtree_t                       rbtree;
+    ngx_rbtree_node_t                  sentinel;
+
+    ngx_queue_t                        streams;
+    ngx_uint_t                         nstreams;
+    ngx_uint_t                         max_streams;
+    ngx_uint_t                         next_stream_id;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+    size_t                             init_window;
+
+    ngx_queue_t                        out;
+
+    unsigned                           goaway:1;
+} ngx_http_upstream_multiplex_conn_t;
+
+
+typedef struct {
+    ngx_queue_t                        queue;
+
+    u_char                            *pos;
+    u_char                            *last;
+
+    size_t                             length;
+    ngx_uint_t                         type;
+
+    unsigned                           accounted:1;
+
+    u_char                             data[1];
+} ngx_http_upstream_multiplex_frame_t;
+
+
+typedef struct {
+    ngx_rbtree_node_t                  node;
+    ngx_queue_t                        queue;
+
+    ngx_http_upstream_multiplex_conn_t   *mc;
+    ngx_connection_t                     *connection;
+
+    ngx_queue_t                        in;
+    ngx_queue_t                        held;
+
+    ngx_http_upstream_multiplex_frame_t  *frame;
+    u_char                             head[NGX_HTTP_V2_FRAME_HEADER_SIZE];
+    ngx_uint_t                         nhead;
+    ngx_uint_t                         preface;
+
+    ssize_t                            send_window;
+    size_t                             consumed;
+
+    unsigned                           in_closed:1;
+    unsigned                           out_closed:1;
+    unsigned                           headers:1;
+    unsigned                           eof:1;
+} ngx_http_upstream_multiplex_stream_t;
+
+
+typedef struct {
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+
+    ngx_http_upstream_t                   *upstream;
+    ngx_http_upstream_multiplex_stream_t  *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+    ngx_event_notify_peer_pt           original_notify;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt      original_set_session;
+    ngx_event_save_peer_session_pt     original_save_session;
+#endif
+
+} ngx_http_upstream_multiplex_peer_data_t;
+
+
+static ngx_int_t ngx_http_upstream_init_multiplex_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_upstream_get_multiplex_peer(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_free_multiplex_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static void ngx_http_upstream_notify_multiplex_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t type);
+
+static ngx_http_upstream_multiplex_conn_t *
+    ngx_http_upstream_multiplex_find_connection(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, ngx_peer_connection_t *pc);
+static ngx_http_upstream_multiplex_peer_t *
+    ngx_http_upstream_multiplex_lookup_peer(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, struct sockaddr *sockaddr,
+    socklen_t socklen, uint32_t hash);
+static ngx_http_upstream_multiplex_conn_t *
+    ngx_http_upstream_multiplex_create_connection(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, ngx_peer_connection_t *pc);
+static void ngx_http_upstream_multiplex_read_handler(ngx_event_t *rev);
+static void ngx_http_upstream_multiplex_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_upstream_multiplex_process(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static ngx_int_t ngx_http_upstream_multiplex_frame_in(
+    ngx_http_upstream_multiplex_conn_t *mc, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_settings(
+    ngx_http_upstream_multiplex_conn_t *mc, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_goaway(
+    ngx_http_upstream_multiplex_conn_t *mc, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_flush(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_close_connection(
+    ngx_http_upstream_multiplex_conn_t *mc);
+static void ngx_http_upstream_multiplex_close(ngx_connection_t *c);
+
+static ngx_http_upstream_multiplex_stream_t *
+    ngx_http_upstream_multiplex_create_stream(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_log_t *log);
+static void ngx_http_upstream_multiplex_close_stream(
+    ngx_http_upstream_multiplex_stream_t *s);
+static void ngx_http_upstream_multiplex_detach_stream(
+    ngx_http_upstream_multiplex_stream_t *s);
+static ngx_http_upstream_multiplex_stream_t *
+    ngx_http_upstream_multiplex_get_stream(ngx_connection_t *c);
+static void ngx_http_upstream_multiplex_stream_cleanup(void *data);
+static ngx_int_t ngx_http_upstream_multiplex_frame_out(
+    ngx_http_upstream_multiplex_stream_t *s, u_char *p, size_t len);
+static ngx_int_t ngx_http_upstream_multiplex_stream_frame(
+    ngx_http_upstream_multiplex_stream_t *s,
+    ngx_http_upstream_multiplex_frame_t *f);
+static void ngx_http_upstream_multiplex_deliver(
+    ngx_http_upstream_multiplex_stream_t *s,
+    ngx_http_upstream_multiplex_frame_t *f);
+
+static ssize_t ngx_http_upstream_multiplex_recv(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ssize_t ngx_http_upstream_multiplex_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ssize_t ngx_http_upstream_multiplex_send(ngx_connection_t *c,
+    u_char *buf, size_t size);
+static ngx_chain_t *ngx_http_upstream_multiplex_send_chain(
+    ngx_connection_t *c, ngx_chain_t *in, off_t limit);
+
+static ngx_http_upstream_multiplex_frame_t *
+    ngx_http_upstream_multiplex_alloc_frame(size_t length, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid, ngx_log_t *log);
+static ngx_http_upstream_multiplex_frame_t *
+    ngx_http_upstream_multiplex_window_update(ngx_uint_t sid, size_t window,
+    ngx_log_t *log);
+static void ngx_http_upstream_multiplex_free_frames(ngx_queue_t *queue);
+static void ngx_http_upstream_multiplex_dummy_handler(ngx_event_t *ev);
+
+#if (NGX_HTTP_SSL)
+static void ngx_http_upstream_multiplex_ssl_save_session(ngx_connection_t *c);
+static ngx_int_t ngx_http_upstream_multiplex_set_session(
+    ngx_peer_connection_t *pc, void *data);
+static void ngx_http_upstream_multiplex_save_session(
+    ngx_peer_connection_t *pc, void *data);
+#endif
+
+static void *ngx_http_upstream_multiplex_create_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_multiplex(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_upstream_multiplex_commands[] = {
+
+    { ngx_string("multiplex"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_upstream_multiplex,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("multiplex_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_multiplex_srv_conf_t, timeout),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_multiplex_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_multiplex_create_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_upstream_multiplex_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_multiplex_module_ctx, /* module context */
+    ngx_http_upstream_multiplex_commands,    /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static u_char  ngx_http_upstream_multiplex_preface[] =
+    "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+
+static ngx_int_t
+ngx_http_upstream_init_multiplex(ngx_conf_t *cf,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_event_conf_t                        *ecf;
+    ngx_http_upstream_multiplex_srv_conf_t  *mcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init multiplex");
+
+    if (us->keepalive) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"multiplex\" cannot be used with \"keepalive\" "
+                      "in upstream \"%V\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    if (us->non_http2) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "upstream \"%V\" with \"multiplex\" can only be "
+                      "used by \"grpc_pass\" in %s:%ui",
+                      &us->host, us->file_name, us->line);
+        return NGX_ERROR;
+    }
+
+    /*
+     * the events block may follow the http block, in which case
+     * the event method is only checked when connections are taken over
+     */
+
+    if (ngx_get_conf(cf->cycle->conf_ctx, ngx_events_module)) {
+        ecf = ngx_event_get_conf(cf->cycle->conf_ctx, ngx_event_core_module);
+
+        if (ngx_strcmp(ecf->name, "epoll") != 0
+            && ngx_strcmp(ecf->name, "kqueue") != 0)
+        {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "\"multiplex\" requires the \"epoll\" or "
+                          "\"kqueue\" event method in upstream \"%V\" "
+                          "in %s:%ui", &us->host, us->file_name, us->line);
+            return NGX_ERROR;
+        }
+    }
+
+    mcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_multiplex_module);
+
+    ngx_conf_init_msec_value(mcf->timeout, 60000);
+
+    if (mcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_upstream_init_multiplex_peer;
+
+    ngx_rbtree_init(&mcf->rbtree, &mcf->sentinel, ngx_rbtree_insert_value);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_multiplex_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_upstream_multiplex_srv_conf_t   *mcf;
+    ngx_http_upstream_multiplex_peer_data_t  *mp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init multiplex peer");
+
+    mcf = ngx_http_conf_upstream_srv_conf(us,
+                                          ngx_http_upstream_multiplex_module);
+
+    mp = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_multiplex_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (mcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mp->conf = mcf;
+    mp->upstream = r->upstream;
+    mp->data = r->upstream->peer.data;
+    mp->original_get_peer = r->upstream->peer.get;
+    mp->original_free_peer = r->upstream->peer.free;
+    mp->original_notify = r->upstream->peer.notify;
+
+    r->upstream->peer.data = mp;
+    r->upstream->peer.get = ngx_http_upstream_get_multiplex_peer;
+    r->upstream->peer.free = ngx_http_upstream_free_multiplex_peer;
+    r->upstream->peer.notify = ngx_http_upstream_notify_multiplex_peer;
+
+#if (NGX_HTTP_SSL)
+    mp->original_set_session = r->upstream->peer.set_session;
+    mp->original_save_session = r->upstream->peer.save_session;
+    r->upstream->peer.set_session = ngx_http_upstream_multiplex_set_session;
+    r->upstream->peer.save_session = ngx_http_upstream_multiplex_save_session;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_get_multiplex_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    ngx_int_t                              rc;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get multiplex peer");
+
+    /* ask balancer */
+
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        return NGX_OK;
+    }
+
+    mc = ngx_http_upstream_multiplex_find_connection(mp->conf, pc);
+
+    if (mc == NULL) {
+        /* a new connection is taken over once connected */
+        return NGX_OK;
+    }
+
+    s = ngx_http_upstream_multiplex_create_stream(mc, pc->log);
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get multiplex peer: using connection %p, stream %p",
+                   mc->connection, s->connection);
+
+    mp->stream = s;
+
+    pc->connection = s->connection;
+    pc->cached = 0;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_free_multiplex_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free multiplex peer");
+
+    if (mp->stream) {
+        ngx_http_upstream_multiplex_close_stream(mp->stream);
+
+        mp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+
+static void
+ngx_http_upstream_notify_multiplex_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t type)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    ngx_connection_t                      *c, *sc;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    if (type != NGX_HTTP_UPSTREAM_NOTIFY_CONNECT
+        || mp->stream
+        || !(ngx_event_flags & NGX_USE_CLEAR_EVENT))
+    {
+        goto done;
+    }
+
+    c = pc->connection;
+
+    mc = ngx_http_upstream_multiplex_create_connection(mp->conf, pc);
+    if (mc == NULL) {
+        goto done;
+    }
+
+    s = ngx_http_upstream_multiplex_create_stream(mc, c->log);
+    if (s == NULL) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+        pc->connection = NULL;
+        goto done;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "multiplex peer: connection %p, stream %p",
+                   c, s->connection);
+
+    /* the stream inherits the request, the connection is now shared */
+
+    sc = s->connection;
+
+    sc->data = c->data;
+    sc->requests = c->requests;
+    sc->read->handler = c->read->handler;
+    sc->write->handler = c->write->handler;
+
+    c->data = mc;
+    c->read->handler = ngx_http_upstream_multiplex_read_handler;
+    c->write->handler = ngx_http_upstream_multiplex_write_handler;
+
+#if (NGX_HTTP_SSL)
+    if (c->ssl && c->ssl->save_session) {
+        c->ssl->save_session = ngx_http_upstream_multiplex_ssl_save_session;
+    }
+#endif
+
+    c->log = ngx_cycle->log;
+    c->read->log = ngx_cycle->log;
+    c->write->log = ngx_cycle->log;
+    c->pool->log = ngx_cycle->log;
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    mp->stream = s;
+    pc->connection = sc;
+
+    if (c->read->ready) {
+        ngx_post_event(c->read, &ngx_posted_events);
+    }
+
+done:
+
+    if (mp->original_notify) {
+        mp->original_notify(pc, mp->data, type);
+    }
+}
+
+
+static ngx_http_upstream_multiplex_conn_t *
+ngx_http_upstream_multiplex_find_connection(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, ngx_peer_connection_t *pc)
+{
+    ngx_queue_t                         *q;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+    ngx_http_upstream_multiplex_peer_t  *peer;
+
+    peer = ngx_http_upstream_multiplex_lookup_peer(conf, pc->sockaddr,
+                             pc->socklen,
+                             ngx_murmur_hash2((u_char *) pc->sockaddr,
+                                              pc->socklen));
+    if (peer == NULL) {
+        return NULL;
+    }
+
+    /* first fit keeps the number of connections low */
+
+    for (q = ngx_queue_head(&peer->connections);
+         q != ngx_queue_sentinel(&peer->connections);
+         q = ngx_queue_next(q))
+    {
+        mc = ngx_queue_data(q, ngx_http_upstream_multiplex_conn_t, queue);
+
+        if (!mc->goaway
+            && mc->nstreams < mc->max_streams
+            && mc->next_stream_id < NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_SID)
+        {
+            return mc;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_upstream_multiplex_peer_t *
+ngx_http_upstream_multiplex_lookup_peer(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, struct sockaddr *sockaddr,
+    socklen_t socklen, uint32_t hash)
+{
+    ngx_rbtree_node_t                   *node, *sentinel;
+    ngx_http_upstream_multiplex_peer_t  *peer;
+
+    node = conf->rbtree.root;
+    sentinel = conf->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        peer = (ngx_http_upstream_multiplex_peer_t *) node;
+
+        if (ngx_memn2cmp((u_char *) &peer->sockaddr, (u_char *) sockaddr,
+                         peer->socklen, socklen)
+            == 0)
+        {
+            return peer;
+        }
+
+        /* equal keys are inserted to the right */
+
+        node = node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_upstream_multiplex_conn_t *
+ngx_http_upstream_multiplex_create_connection(
+    ngx_http_upstream_multiplex_srv_conf_t *conf, ngx_peer_connection_t *pc)
+{
+    u_char                              *p;
+    size_t                               len;
+    uint32_t                             hash;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+    ngx_http_upstream_multiplex_peer_t  *peer;
+    ngx_http_upstream_multiplex_frame_t *f;
+
+    c = pc->connection;
+
+    mc = ngx_pcalloc(c->pool, sizeof(ngx_http_upstream_multiplex_conn_t));
+    if (mc == NULL) {
+        return NULL;
+    }
+
+    mc->buffer = ngx_create_temp_buf(c->pool,
+                                     NGX_HTTP_UPSTREAM_MULTIPLEX_BUFFER);
+    if (mc->buffer == NULL) {
+        return NULL;
+    }
+
+    /* connection preface, settings, and connection window */
+
+    len = sizeof(ngx_http_upstream_multiplex_preface) - 1
+          + NGX_HTTP_V2_FRAME_HEADER_SIZE + 3 * 6
+          + NGX_HTTP_V2_FRAME_HEADER_SIZE + 4;
+
+    f = ngx_http_upstream_multiplex_alloc_frame(
+                                        len - NGX_HTTP_V2_FRAME_HEADER_SIZE,
+                                        0, 0, 0, c->log);
+    if (f == NULL) {
+        return NULL;
+    }
+
+    p = ngx_cpymem(f->data, ngx_http_upstream_multiplex_preface,
+                   sizeof(ngx_http_upstream_multiplex_preface) - 1);
+
+    p = ngx_http_v2_write_len_and_type(p, 3 * 6, NGX_HTTP_V2_SETTINGS_FRAME);
+    *p++ = NGX_HTTP_V2_NO_FLAG;
+    p = ngx_http_v2_write_sid(p, 0);
+
+    /* no dynamic table, no push, bounded stream windows */
+
+    p = ngx_http_v2_write_uint16(p, 0x1);
+    p = ngx_http_v2_write_uint32(p, 0);
+    p = ngx_http_v2_write_uint16(p, 0x2);
+    p = ngx_http_v2_write_uint32(p, 0);
+    p = ngx_http_v2_write_uint16(p,
+                               NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_UPSTREAM_MULTIPLEX_WINDOW);
+
+    p = ngx_http_v2_write_len_and_type(p, 4, NGX_HTTP_V2_WINDOW_UPDATE_FRAME);
+    *p++ = NGX_HTTP_V2_NO_FLAG;
+    p = ngx_http_v2_write_sid(p, 0);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_V2_MAX_WINDOW
+                                    - NGX_HTTP_V2_DEFAULT_WINDOW);
+
+    f->last = p;
+    f->type = NGX_HTTP_V2_SETTINGS_FRAME;
+    f->length = 0;
+
+    hash = ngx_murmur_hash2((u_char *) pc->sockaddr, pc->socklen);
+
+    peer = ngx_http_upstream_multiplex_lookup_peer(conf, pc->sockaddr,
+                                                   pc->socklen, hash);
+
+    if (peer == NULL) {
+        peer = ngx_alloc(sizeof(ngx_http_upstream_multiplex_peer_t), c->log);
+        if (peer == NULL) {
+            ngx_free(f);
+            return NULL;
+        }
+
+        peer->node.key = hash;
+        peer->socklen = pc->socklen;
+        ngx_memcpy(&peer->sockaddr, pc->sockaddr, pc->socklen);
+        ngx_queue_init(&peer->connections);
+
+        ngx_rbtree_insert(&conf->rbtree, &peer->node);
+    }
+
+    ngx_queue_insert_tail(&peer->connections, &mc->queue);
+
+    mc->conf = conf;
+    mc->peer = peer;
+    mc->connection = c;
+
+    ngx_rbtree_init(&mc->rbtree, &mc->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&mc->streams);
+    ngx_queue_init(&mc->out);
+
+    mc->max_streams = conf->max_streams;
+    mc->next_stream_id = 1;
+
+    mc->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    mc->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    mc->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    ngx_queue_insert_tail(&mc->out, &f->queue);
+
+    return mc;
+}
+
+
+static void
+ngx_http_upstream_multiplex_read_handler(ngx_event_t *rev)
+{
+    ssize_t                              n;
+    ngx_buf_t                           *b;
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    c = rev->data;
+    mc = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex read handler");
+
+    if (rev->timedout || c->close) {
+        rev->timedout = 0;
+
+        if (mc->nstreams == 0) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+            return;
+        }
+    }
+
+    b = mc->buffer;
+
+    for ( ;; ) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0 || n == NGX_ERROR) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_upstream_multiplex_process(mc) != NGX_OK) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+            return;
+        }
+
+        if (mc->connection == NULL) {
+            /* closed after goaway */
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+        return;
+    }
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                    *c;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    c = wev->data;
+    mc = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex write handler");
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_process(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    u_char     *p;
+    size_t      len, size;
+    ngx_buf_t  *b;
+
+    b = mc->buffer;
+    p = b->pos;
+
+    while (b->last - p >= NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+
+        len = ngx_http_v2_parse_length(ngx_http_v2_parse_uint32(p));
+
+        if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                          "upstream sent too large http2 frame: %uz", len);
+            return NGX_ERROR;
+        }
+
+        size = NGX_HTTP_V2_FRAME_HEADER_SIZE + len;
+
+        if ((size_t) (b->last - p) < size) {
+            break;
+        }
+
+        if (ngx_http_upstream_multiplex_frame_in(mc, p, len) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (mc->connection == NULL) {
+            return NGX_OK;
+        }
+
+        p += size;
+    }
+
+    len = b->last - p;
+
+    ngx_memmove(b->start, p, len);
+
+    b->pos = b->start;
+    b->last = b->start + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_frame_in(ngx_http_upstream_multiplex_conn_t *mc,
+    u_char *p, size_t len)
+{
+    size_t                                 window;
+    ngx_uint_t                             type, flags, sid;
+    ngx_rbtree_node_t                     *node, *sentinel;
+    ngx_http_upstream_multiplex_frame_t   *f;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    type = ngx_http_v2_parse_type(ngx_http_v2_parse_uint32(p));
+    flags = p[4];
+    sid = ngx_http_v2_parse_sid(&p[5]);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mc->connection->log, 0,
+                   "multiplex frame type:%ui f:%Xi l:%uz sid:%ui",
+                   type, flags, len, sid);
+
+    p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+    if (sid == 0) {
+
+        switch (type) {
+
+        case NGX_HTTP_V2_SETTINGS_FRAME:
+            return ngx_http_upstream_multiplex_settings(mc, p, len);
+
+        case NGX_HTTP_V2_PING_FRAME:
+
+            if (flags & NGX_HTTP_V2_ACK_FLAG) {
+                return NGX_OK;
+            }
+
+            if (len != 8) {
+                return NGX_ERROR;
+            }
+
+            f = ngx_http_upstream_multiplex_alloc_frame(8,
+                                                     NGX_HTTP_V2_PING_FRAME,
+                                                     NGX_HTTP_V2_ACK_FLAG, 0,
+                                                     mc->connection->log);
+            if (f == NULL) {
+                return NGX_ERROR;
+            }
+
+            f->last = ngx_cpymem(f->last, p, 8);
+
+            ngx_queue_insert_tail(&mc->out, &f->queue);
+
+            return NGX_OK;
+
+        case NGX_HTTP_V2_GOAWAY_FRAME:
+            return ngx_http_upstream_multiplex_goaway(mc, p, len);
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+
+            if (len != 4) {
+                return NGX_ERROR;
+            }
+
+            window = ngx_http_v2_parse_window(p);
+
+            if (window == 0
+                || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW
+                                      - mc->send_window))
+            {
+                ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                              "upstream sent invalid window update: %uz",
+                              window);
+                return NGX_ERROR;
+            }
+
+            mc->send_window += window;
+
+            return NGX_OK;
+
+        default:
+            return NGX_OK;
+        }
+    }
+
+    if (type == NGX_HTTP_V2_PUSH_PROMISE_FRAME) {
+        ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                      "upstream sent push promise while push is disabled");
+        return NGX_ERROR;
+    }
+
+    if (type == NGX_HTTP_V2_DATA_FRAME) {
+
+        if (len > mc->recv_window) {
+            ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                          "upstream violated connection flow control");
+            return NGX_ERROR;
+        }
+
+        mc->recv_window -= len;
+
+        if (mc->recv_window < NGX_HTTP_V2_MAX_WINDOW / 4) {
+            f = ngx_http_upstream_multiplex_window_update(0,
+                                         NGX_HTTP_V2_MAX_WINDOW
+                                         - mc->recv_window,
+                                         mc->connection->log);
+            if (f == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_queue_insert_tail(&mc->out, &f->queue);
+
+            mc->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+        }
+    }
+
+    node = mc->rbtree.root;
+    sentinel = mc->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (sid != node->key) {
+            node = (sid < node->key) ? node->left : node->right;
+            continue;
+        }
+
+        s = (ngx_http_upstream_multiplex_stream_t *) node;
+
+        goto found;
+    }
+
+    /* the stream is already closed */
+
+    return NGX_OK;
+
+found:
+
+    f = ngx_http_upstream_multiplex_alloc_frame(len, type, flags, 1,
+                                                mc->connection->log);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    f->last = ngx_cpymem(f->last, p, len);
+
+    if (type == NGX_HTTP_V2_RST_STREAM_FRAME) {
+        s->in_closed = 1;
+        s->out_closed = 1;
+
+    } else if ((type == NGX_HTTP_V2_DATA_FRAME
+                || type == NGX_HTTP_V2_HEADERS_FRAME)
+               && (flags & NGX_HTTP_V2_END_STREAM_FLAG))
+    {
+        s->in_closed = 1;
+    }
+
+    ngx_http_upstream_multiplex_deliver(s, f);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_settings(ngx_http_upstream_multiplex_conn_t *mc,
+    u_char *p, size_t len)
+{
+    u_char                                *end;
+    ngx_uint_t                             id, value;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_frame_t   *f;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    if (len % 6) {
+        ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                      "upstream sent settings frame "
+                      "with invalid length: %uz", len);
+        return NGX_ERROR;
+    }
+
+    for (end = p + len; p < end; p += 6) {
+
+        id = ngx_http_v2_parse_uint16(p);
+        value = ngx_http_v2_parse_uint32(&p[2]);
+
+        switch (id) {
+
+        case NGX_HTTP_UPSTREAM_MULTIPLEX_MAX_STREAMS_SETTING:
+            mc->max_streams = ngx_min(value, mc->conf->max_streams);
+            break;
+
+        case NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                              "upstream sent too large initial window: %ui",
+                              value);
+                return NGX_ERROR;
+            }
+
+            mc->init_window = value;
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    /* stream windows are maintained by the streams */
+
+    for (q = ngx_queue_head(&mc->streams);
+         q != ngx_queue_sentinel(&mc->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        f = ngx_http_upstream_multiplex_alloc_frame(len,
+                                                 NGX_HTTP_V2_SETTINGS_FRAME,
+                                                 NGX_HTTP_V2_NO_FLAG, 0,
+                                                 mc->connection->log);
+        if (f == NULL) {
+            return NGX_ERROR;
+        }
+
+        f->last = ngx_cpymem(f->last, end - len, len);
+
+        ngx_http_upstream_multiplex_deliver(s, f);
+    }
+
+    f = ngx_http_upstream_multiplex_alloc_frame(0, NGX_HTTP_V2_SETTINGS_FRAME,
+                                                NGX_HTTP_V2_ACK_FLAG, 0,
+                                                mc->connection->log);
+    if (f == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_queue_insert_tail(&mc->out, &f->queue);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_goaway(ngx_http_upstream_multiplex_conn_t *mc,
+    u_char *p, size_t len)
+{
+    ngx_uint_t                             last;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    if (len < 8) {
+        ngx_log_error(NGX_LOG_ERR, mc->connection->log, 0,
+                      "upstream sent goaway frame "
+                      "with invalid length: %uz", len);
+        return NGX_ERROR;
+    }
+
+    last = ngx_http_v2_parse_sid(p);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mc->connection->log, 0,
+                   "multiplex goaway: %ui, stream %ui",
+                   (ngx_uint_t) ngx_http_v2_parse_uint32(&p[4]), last);
+
+    mc->goaway = 1;
+
+    /*
+     * streams not processed by the upstream see the connection closed,
+     * so the requests are retried
+     */
+
+    q = ngx_queue_head(&mc->streams);
+
+    while (q != ngx_queue_sentinel(&mc->streams)) {
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+        q = ngx_queue_next(q);
+
+        if (s->node.key == 0 || s->node.key > last) {
+            ngx_http_upstream_multiplex_detach_stream(s);
+        }
+    }
+
+    if (mc->nstreams == 0) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_flush(ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_uint_t                            i, n;
+    ngx_buf_t                             bufs[NGX_IOVS_PREALLOCATE];
+    ngx_queue_t                          *q;
+    ngx_chain_t                          *cl, chain[NGX_IOVS_PREALLOCATE];
+    ngx_connection_t                     *c;
+    ngx_http_upstream_multiplex_frame_t  *f;
+
+    c = mc->connection;
+
+    while (!ngx_queue_empty(&mc->out)) {
+
+        n = 0;
+
+        for (q = ngx_queue_head(&mc->out);
+             q != ngx_queue_sentinel(&mc->out)
+             && n < NGX_IOVS_PREALLOCATE;
+             q = ngx_queue_next(q))
+        {
+            f = ngx_queue_data(q, ngx_http_upstream_multiplex_frame_t, queue);
+
+            if (!f->accounted) {
+
+                if (f->type == NGX_HTTP_V2_DATA_FRAME) {
+
+                    if ((ssize_t) f->length > mc->send_window) {
+                        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                                       "multiplex connection window "
+                                       "exhausted");
+                        break;
+                    }
+
+                    mc->send_window -= f->length;
+                }
+
+                f->accounted = 1;
+            }
+
+            ngx_memzero(&bufs[n], sizeof(ngx_buf_t));
+
+            bufs[n].pos = f->pos;
+            bufs[n].last = f->last;
+            bufs[n].memory = 1;
+
+            chain[n].buf = &bufs[n];
+            chain[n].next = &chain[n + 1];
+
+            n++;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        bufs[n - 1].flush = 1;
+        chain[n - 1].next = NULL;
+
+        cl = c->send_chain(c, chain, 0);
+
+        if (cl == NGX_CHAIN_ERROR) {
+            return NGX_ERROR;
+        }
+
+        for (i = 0; i < n; i++) {
+            q = ngx_queue_head(&mc->out);
+            f = ngx_queue_data(q, ngx_http_upstream_multiplex_frame_t, queue);
+
+            f->pos = bufs[i].pos;
+
+            if (f->pos != f->last) {
+                break;
+            }
+
+            ngx_queue_remove(q);
+            ngx_free(f);
+        }
+
+        if (cl) {
+            break;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_multiplex_close_connection(
+    ngx_http_upstream_multiplex_conn_t *mc)
+{
+    ngx_queue_t                           *q;
+    ngx_connection_t                      *c;
+    ngx_http_upstream_multiplex_peer_t    *peer;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    c = mc->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "multiplex close connection %p", c);
+
+    while (!ngx_queue_empty(&mc->streams)) {
+        q = ngx_queue_head(&mc->streams);
+        s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+        ngx_http_upstream_multiplex_detach_stream(s);
+    }
+
+    ngx_http_upstream_multiplex_free_frames(&mc->out);
+
+    peer = mc->peer;
+
+    ngx_queue_remove(&mc->queue);
+
+    if (ngx_queue_empty(&peer->connections)) {
+        ngx_rbtree_delete(&mc->conf->rbtree, &peer->node);
+        ngx_free(peer);
+    }
+
+    mc->connection = NULL;
+
+    ngx_http_upstream_multiplex_close(c);
+}
+
+
+static void
+ngx_http_upstream_multiplex_close(ngx_connection_t *c)
+{
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        c->ssl->no_send_shutdown = 1;
+
+        if (ngx_ssl_shutdown(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_upstream_multiplex_close;
+            return;
+        }
+    }
+
+#endif
+
+    ngx_destroy_pool(c->pool);
+    ngx_close_connection(c);
+}
+
+
+static ngx_http_upstream_multiplex_stream_t *
+ngx_http_upstream_multiplex_create_stream(
+    ngx_http_upstream_multiplex_conn_t *mc, ngx_log_t *log)
+{
+    u_char                                *p;
+    ngx_pool_t                            *pool;
+    ngx_connection_t                      *c, *sc;
+    ngx_pool_cleanup_t                    *cln;
+    ngx_http_upstream_multiplex_frame_t   *f;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    c = mc->connection;
+
+    pool = ngx_create_pool(128, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    s = ngx_pcalloc(pool, sizeof(ngx_http_upstream_multiplex_stream_t));
+    if (s == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    ngx_queue_init(&s->in);
+    ngx_queue_init(&s->held);
+
+    cln = ngx_pool_cleanup_add(pool, 0);
+    if (cln == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    cln->handler = ngx_http_upstream_multiplex_stream_cleanup;
+    cln->data = s;
+
+    /*
+     * the stream starts with the connection settings
+     * and the connection window opened, which is then kept open
+     */
+
+    f = ngx_http_upstream_multiplex_alloc_frame(6, NGX_HTTP_V2_SETTINGS_FRAME,
+                                                NGX_HTTP_V2_NO_FLAG, 0, log);
+    if (f == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    p = f->last;
+    p = ngx_http_v2_write_uint16(p,
+                               NGX_HTTP_UPSTREAM_MULTIPLEX_INIT_WINDOW_SETTING);
+    f->last = ngx_http_v2_write_uint32(p, mc->init_window);
+
+    ngx_queue_insert_tail(&s->in, &f->queue);
+
+    f = ngx_http_upstream_multiplex_window_update(0,
+                                                  NGX_HTTP_V2_MAX_WINDOW
+                                                  - NGX_HTTP_V2_DEFAULT_WINDOW,
+                                                  log);
+    if (f == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    ngx_queue_insert_tail(&s->in, &f->queue);
+
+    s->send_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    sc = ngx_get_connection(c->fd, log);
+    if (sc == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    sc->shared = 1;
+    sc->type = SOCK_STREAM;
+    sc->pool = pool;
+    sc->log = log;
+#if (NGX_SSL)
+    sc->ssl = c->ssl;
+#endif
+    sc->sockaddr = &mc->peer->sockaddr.sockaddr;
+    sc->socklen = mc->peer->socklen;
+    sc->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+    sc->start_time = ngx_current_msec;
+    sc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    sc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+
+    sc->recv = ngx_http_upstream_multiplex_recv;
+    sc->send = ngx_http_upstream_multiplex_send;
+    sc->recv_chain = ngx_http_upstream_multiplex_recv_chain;
+    sc->send_chain = ngx_http_upstream_multiplex_send_chain;
+
+    /* the events are never added to the event method */
+
+    sc->read->active = 1;
+    sc->read->ready = 1;
+    sc->write->active = 1;
+    sc->write->ready = 1;
+
+    sc->read->log = log;
+    sc->write->log = log;
+
+    sc->read->handler = ngx_http_upstream_multiplex_dummy_handler;
+    sc->write->handler = ngx_http_upstream_multiplex_dummy_handler;
+
+    s->connection = sc;
+    s->mc = mc;
+
+    ngx_queue_insert_tail(&mc->streams, &s->queue);
+    mc->nstreams++;
+
+    c->idle = 0;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    return s;
+}
+
+
+static void
+ngx_http_upstream_multiplex_close_stream(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    ngx_uint_t                             error;
+    ngx_connection_t                      *c, *sc;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_frame_t   *f;
+
+    mc = s->mc;
+    sc = s->connection;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, sc->log, 0,
+                   "multiplex close stream %p, id:%ui",
+                   sc, (ngx_uint_t) s->node.key);
+
+    if (mc == NULL) {
+        goto close;
+    }
+
+    c = mc->connection;
+
+    if (s->node.key
+        && ngx_queue_empty(&s->held)
+        && !(s->in_closed && s->out_closed))
+    {
+        /* a response may end before the request body is sent */
+
+        error = s->in_closed ? NGX_HTTP_UPSTREAM_MULTIPLEX_NO_ERROR
+                             : NGX_HTTP_UPSTREAM_MULTIPLEX_CANCEL;
+
+        f = ngx_http_upstream_multiplex_alloc_frame(4,
+                                                 NGX_HTTP_V2_RST_STREAM_FRAME,
+                                                 NGX_HTTP_V2_NO_FLAG,
+                                                 s->node.key, c->log);
+        if (f == NULL) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+            goto close;
+        }
+
+        f->last = ngx_http_v2_write_uint32(f->last, error);
+
+        ngx_queue_insert_tail(&mc->out, &f->queue);
+    }
+
+    ngx_http_upstream_multiplex_detach_stream(s);
+
+    if (mc->nstreams == 0) {
+
+        if (mc->goaway || ngx_terminate || ngx_exiting) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+            goto close;
+        }
+
+        c->idle = 1;
+        ngx_add_timer(c->read, mc->conf->timeout);
+    }
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+    }
+
+close:
+
+    ngx_destroy_pool(sc->pool);
+    ngx_close_connection(sc);
+}
+
+
+static void
+ngx_http_upstream_multiplex_detach_stream(
+    ngx_http_upstream_multiplex_stream_t *s)
+{
+    ngx_connection_t                    *sc;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+    sc = s->connection;
+
+    if (s->node.key) {
+        ngx_rbtree_delete(&mc->rbtree, &s->node);
+    }
+
+    ngx_queue_remove(&s->queue);
+    mc->nstreams--;
+
+    s->mc = NULL;
+
+    /* a complete response is not cut by the connection close */
+
+    if (!s->in_closed) {
+        s->eof = 1;
+    }
+
+    ngx_http_upstream_multiplex_free_frames(&s->held);
+
+    /* let the request see the end of the stream */
+
+    sc->read->ready = 1;
+
+    if (!sc->read->posted) {
+        ngx_post_event(sc->read, &ngx_posted_events);
+    }
+}
+
+
+static ngx_http_upstream_multiplex_stream_t *
+ngx_http_upstream_multiplex_get_stream(ngx_connection_t *c)
+{
+    ngx_pool_cleanup_t  *cln;
+
+    for (cln = c->pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler == ngx_http_upstream_multiplex_stream_cleanup) {
+            return cln->data;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_multiplex_stream_cleanup(void *data)
+{
+    ngx_http_upstream_multiplex_stream_t  *s = data;
+
+    ngx_http_upstream_multiplex_free_frames(&s->in);
+    ngx_http_upstream_multiplex_free_frames(&s->held);
+
+    if (s->frame) {
+        ngx_free(s->frame);
+        s->frame = NULL;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_frame_out(ngx_http_upstream_multiplex_stream_t *s,
+    u_char *p, size_t len)
+{
+    size_t                                n;
+    ngx_connection_t                     *sc;
+    ngx_http_upstream_multiplex_frame_t  *f;
+
+    sc = s->connection;
+
+    while (len) {
+
+        if (s->preface < sizeof(ngx_http_upstream_multiplex_preface) - 1) {
+
+            n = ngx_min(len, sizeof(ngx_http_upstream_multiplex_preface) - 1
+                             - s->preface);
+
+            if (ngx_memcmp(p, ngx_http_upstream_multiplex_preface + s->preface,
+                           n)
+                != 0)
+            {
+                ngx_log_error(NGX_LOG_ERR, sc->log, 0,
+                              "multiplexing requires http2 upstream");
+                return NGX_ERROR;
+            }
+
+            s->preface += n;
+            p += n;
+            len -= n;
+
+            continue;
+        }
+
+        if (s->frame == NULL) {
+
+            n = ngx_min(len, NGX_HTTP_V2_FRAME_HEADER_SIZE - s->nhead);
+
+            ngx_memcpy(s->head + s->nhead, p, n);
+
+            s->nhead += n;
+            p += n;
+            len -= n;
+
+            if (s->nhead < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+                break;
+            }
+
+            s->nhead = 0;
+
+            n = ngx_http_v2_parse_length(ngx_http_v2_parse_uint32(s->head));
+
+            f = ngx_http_upstream_multiplex_alloc_frame(n, 0, 0, 0, sc->log);
+            if (f == NULL) {
+                return NGX_ERROR;
+            }
+
+            ngx_memcpy(f->data, s->head, NGX_HTTP_V2_FRAME_HEADER_SIZE);
+
+            f->type = ngx_http_v2_parse_type(ngx_http_v2_parse_uint32(s->head));
+            f->length = n;
+
+            s->frame = f;
+        }
+
+        f = s->frame;
+
+        n = ngx_min(len, (size_t) (f->data + NGX_HTTP_V2_FRAME_HEADER_SIZE
+                                   + f->length - f->last));
+
+        f->last = ngx_cpymem(f->last, p, n);
+
+        p += n;
+        len -= n;
+
+        if (f->last == f->data + NGX_HTTP_V2_FRAME_HEADER_SIZE + f->length) {
+            s->frame = NULL;
+
+            if (ngx_http_upstream_multiplex_stream_frame(s, f) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_stream_frame(
+    ngx_http_upstream_multiplex_stream_t *s,
+    ngx_http_upstream_multiplex_frame_t *f)
+{
+    ngx_uint_t                           flags, sid;
+    ngx_http_upstream_multiplex_conn_t  *mc;
+
+    mc = s->mc;
+
+    flags = f->data[4];
+    sid = ngx_http_v2_parse_sid(&f->data[5]);
+
+    if (mc == NULL) {
+        ngx_free(f);
+        return NGX_ERROR;
+    }
+
+    if (sid == 0 || s->out_closed) {
+        /* connection level frames are handled by the multiplexer */
+        ngx_free(f);
+        return NGX_OK;
+    }
+
+    if (s->node.key == 0) {
+
+        if (f->type != NGX_HTTP_V2_HEADERS_FRAME) {
+            ngx_free(f);
+            return NGX_OK;
+        }
+
+        s->node.key = mc->next_stream_id;
+        mc->next_stream_id += 2;
+
+        ngx_rbtree_insert(&mc->rbtree, &s->node);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection->log, 0,
+                       "multiplex stream %p, id:%ui",
+                       s->connection, (ngx_uint_t) s->node.key);
+    }
+
+    (void) ngx_http_v2_write_sid(&f->data[5], s->node.key);
+
+    switch (f->type) {
+
+    case NGX_HTTP_V2_DATA_FRAME:
+
+        s->send_window -= f->length;
+
+        if (s->send_window < NGX_HTTP_V2_MAX_WINDOW / 2) {
+            ngx_http_upstream_multiplex_deliver(s,
+                ngx_http_upstream_multiplex_window_update(0,
+                                     NGX_HTTP_V2_MAX_WINDOW - s->send_window,
+                                     s->connection->log));
+
+            s->send_window = NGX_HTTP_V2_MAX_WINDOW;
+        }
+
+        /* fall through */
+
+    case NGX_HTTP_V2_HEADERS_FRAME:
+
+        if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+            s->out_closed = 1;
+        }
+
+        break;
+
+    case NGX_HTTP_V2_RST_STREAM_FRAME:
+        s->in_closed = 1;
+        s->out_closed = 1;
+        break;
+    }
+
+    /* a header block is sent without other frames in between */
+
+    if (f->type == NGX_HTTP_V2_HEADERS_FRAME
+        && !(flags & NGX_HTTP_V2_END_HEADERS_FLAG))
+    {
+        s->headers = 1;
+    }
+
+    if (!s->headers) {
+        ngx_queue_insert_tail(&mc->out, &f->queue);
+        return NGX_OK;
+    }
+
+    ngx_queue_insert_tail(&s->held, &f->queue);
+
+    if (f->type == NGX_HTTP_V2_CONTINUATION_FRAME
+        && (flags & NGX_HTTP_V2_END_HEADERS_FLAG))
+    {
+        s->headers = 0;
+
+        ngx_queue_add(&mc->out, &s->held);
+        ngx_queue_init(&s->held);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_multiplex_deliver(ngx_http_upstream_multiplex_stream_t *s,
+    ngx_http_upstream_multiplex_frame_t *f)
+{
+    ngx_event_t  *rev;
+
+    if (f == NULL) {
+        /* out of memory, the request sees the stream closed */
+        ngx_http_upstream_multiplex_detach_stream(s);
+        return;
+    }
+
+    ngx_queue_insert_tail(&s->in, &f->queue);
+
+    rev = s->connection->read;
+
+    rev->ready = 1;
+
+    if (!rev->posted) {
+        ngx_post_event(rev, &ngx_posted_events);
+    }
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_recv(ngx_connection_t *c, u_char *buf,
+    size_t size)
+{
+    size_t                                 n, len;
+    ngx_queue_t                           *q;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_frame_t   *f;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    s = ngx_http_upstream_multiplex_get_stream(c);
+
+    if (s == NULL) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    n = 0;
+
+    while (n < size && !ngx_queue_empty(&s->in)) {
+        q = ngx_queue_head(&s->in);
+        f = ngx_queue_data(q, ngx_http_upstream_multiplex_frame_t, queue);
+
+        len = ngx_min(size - n, (size_t) (f->last - f->pos));
+
+        buf = ngx_cpymem(buf, f->pos, len);
+
+        f->pos += len;
+        n += len;
+
+        if (f->pos != f->last) {
+            break;
+        }
+
+        if (f->type == NGX_HTTP_V2_DATA_FRAME) {
+            s->consumed += f->length;
+        }
+
+        ngx_queue_remove(q);
+        ngx_free(f);
+    }
+
+    mc = s->mc;
+
+    if (mc && s->node.key && !s->in_closed
+        && s->consumed >= NGX_HTTP_UPSTREAM_MULTIPLEX_WINDOW / 2)
+    {
+        f = ngx_http_upstream_multiplex_window_update(s->node.key, s->consumed,
+                                                      c->log);
+        if (f == NULL) {
+            c->read->error = 1;
+            return NGX_ERROR;
+        }
+
+        ngx_queue_insert_tail(&mc->out, &f->queue);
+
+        s->consumed = 0;
+
+        if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+            ngx_http_upstream_multiplex_close_connection(mc);
+        }
+    }
+
+    if (n) {
+        c->read->ready = !ngx_queue_empty(&s->in) || s->eof;
+        return n;
+    }
+
+    if (s->eof) {
+        c->read->eof = 1;
+        return 0;
+    }
+
+    c->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t   size;
+    ssize_t  n, total;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+
+        size = in->buf->end - in->buf->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            size = ngx_min(size, (size_t) (limit - total));
+        }
+
+        n = ngx_http_upstream_multiplex_recv(c, in->buf->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_upstream_multiplex_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t    b;
+    ngx_chain_t  cl;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.memory = 1;
+    b.pos = buf;
+    b.last = buf + size;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    if (ngx_http_upstream_multiplex_send_chain(c, &cl, 0) == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    return size;
+}
+
+
+static ngx_chain_t *
+ngx_http_upstream_multiplex_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    off_t                                  sent;
+    size_t                                 size;
+    ngx_buf_t                             *b;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    s = ngx_http_upstream_multiplex_get_stream(c);
+
+    if (s == NULL) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    mc = s->mc;
+
+    if (mc == NULL) {
+
+        if (!s->in_closed) {
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        /* control frames after the response are not needed */
+
+        for ( /* void */ ; in; in = in->next) {
+            in->buf->pos = in->buf->last;
+        }
+
+        return NULL;
+    }
+
+    sent = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "multiplexed stream got file buffer");
+            return NGX_CHAIN_ERROR;
+        }
+
+        size = b->last - b->pos;
+
+        if (limit) {
+            if (sent >= limit) {
+                break;
+            }
+
+            size = ngx_min(size, (size_t) (limit - sent));
+        }
+
+        if (ngx_http_upstream_multiplex_frame_out(s, b->pos, size) != NGX_OK) {
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        b->pos += size;
+        sent += size;
+
+        if (b->pos != b->last) {
+            break;
+        }
+    }
+
+    c->sent += sent;
+
+    if (ngx_http_upstream_multiplex_flush(mc) != NGX_OK) {
+        ngx_http_upstream_multiplex_close_connection(mc);
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    return in;
+}
+
+
+static ngx_http_upstream_multiplex_frame_t *
+ngx_http_upstream_multiplex_alloc_frame(size_t length, ngx_uint_t type,
+    ngx_uint_t flags, ngx_uint_t sid, ngx_log_t *log)
+{
+    u_char                               *p;
+    ngx_http_upstream_multiplex_frame_t  *f;
+
+    f = ngx_alloc(offsetof(ngx_http_upstream_multiplex_frame_t, data)
+                  + NGX_HTTP_V2_FRAME_HEADER_SIZE + length, log);
+    if (f == NULL) {
+        return NULL;
+    }
+
+    p = ngx_http_v2_write_len_and_type(f->data, length, type);
+    *p++ = flags;
+    p = ngx_http_v2_write_sid(p, sid);
+
+    f->pos = f->data;
+    f->last = p;
+    f->length = length;
+    f->type = type;
+    f->accounted = 0;
+
+    return f;
+}
+
+
+static ngx_http_upstream_multiplex_frame_t *
+ngx_http_upstream_multiplex_window_update(ngx_uint_t sid, size_t window,
+    ngx_log_t *log)
+{
+    ngx_http_upstream_multiplex_frame_t  *f;
+
+    f = ngx_http_upstream_multiplex_alloc_frame(4,
+                                             NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                             NGX_HTTP_V2_NO_FLAG, sid, log);
+    if (f == NULL) {
+        return NULL;
+    }
+
+    f->last = ngx_http_v2_write_uint32(f->last, window);
+
+    return f;
+}
+
+
+static void
+ngx_http_upstream_multiplex_free_frames(ngx_queue_t *queue)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_multiplex_frame_t  *f;
+
+    while (!ngx_queue_empty(queue)) {
+        q = ngx_queue_head(queue);
+        f = ngx_queue_data(q, ngx_http_upstream_multiplex_frame_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_free(f);
+    }
+}
+
+
+static void
+ngx_http_upstream_multiplex_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "multiplex dummy handler");
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static void
+ngx_http_upstream_multiplex_ssl_save_session(ngx_connection_t *c)
+{
+    ngx_queue_t                           *q;
+    ngx_http_request_t                    *r;
+    ngx_http_upstream_t                   *u;
+    ngx_http_upstream_multiplex_conn_t    *mc;
+    ngx_http_upstream_multiplex_stream_t  *s;
+
+    /* sessions received later are saved on behalf of a stream */
+
+    mc = c->data;
+
+    if (mc->connection == NULL || ngx_queue_empty(&mc->streams)) {
+        return;
+    }
+
+    q = ngx_queue_head(&mc->streams);
+    s = ngx_queue_data(q, ngx_http_upstream_multiplex_stream_t, queue);
+
+    r = s->connection->data;
+    u = r->upstream;
+
+    u->peer.save_session(&u->peer, u->peer.data);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_multiplex_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    return mp->original_set_session(pc, mp->data);
+}
+
+
+static void
+ngx_http_upstream_multiplex_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_upstream_multiplex_peer_data_t  *mp = data;
+
+    mp->original_save_session(pc, mp->data);
+    return;
+}
+
+#endif
+
+
+static void *
+ngx_http_upstream_multiplex_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_multiplex_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool,
+                       sizeof(ngx_http_upstream_multiplex_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     *     conf->max_streams = 0;
+     */
+
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_multiplex(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t            *uscf;
+    ngx_http_upstream_multiplex_srv_conf_t  *mcf = conf;
+
+    ngx_int_t   n;
+    ngx_str_t  *value;
+
+    if (mcf->max_streams) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->max_streams = n;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    mcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_upstream_init_multiplex;
+
+    return NGX_CONF_OK;
+}
@@ -9,6 +9,14 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER     1
+#define NGX_HTTP_UPSTREAM_LEAST_TIME_LAST_BYTE  2
+
+/* the time constant of the response time decay */
+
+#define NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY      10000
+
+
 typedef struct {
     ngx_http_upstream_rr_peer_t          *peer;
     ngx_uint_t                            range;
@@ -17,6 +25,7 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                            two;
+    ngx_uint_t                            least_time;
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_uint_t                            config;
 #endif
@@ -29,6 +38,7 @@ typedef struct {
     ngx_http_upstream_rr_peer_data_t      rrp;
 
     ngx_http_upstream_random_srv_conf_t  *conf;
+    ngx_http_request_t                   *request;
     u_char                                tries;
 } ngx_http_upstream_random_peer_data_t;
 
@@ -47,6 +57,10 @@ static ngx_int_t ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc,
 static ngx_uint_t ngx_http_upstream_peek_random_peer(
     ngx_http_upstream_rr_peers_t *peers,
     ngx_http_upstream_random_peer_data_t *rp);
+static uint64_t ngx_http_upstream_random_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_int_t weight);
+static void ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
 static void *ngx_http_upstream_random_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
@@ -188,7 +202,12 @@ ngx_http_upstream_init_random_peer(ngx_http_request_t *r,
         r->upstream->peer.get = ngx_http_upstream_get_random_peer;
     }
 
+    if (rcf->least_time) {
+        r->upstream->peer.free = ngx_http_upstream_free_random_peer;
+    }
+
     rp->conf = rcf;
+    rp->request = r;
     rp->tries = 0;
 
     ngx_http_upstream_rr_peers_rlock(rp->rrp.peers);
@@ -390,7 +409,18 @@ ngx_http_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->least_time) {
+                if (ngx_http_upstream_random_cost(peer, prev->weight)
+                    > ngx_http_upstream_random_cost(prev, peer->weight))
+                {
+                    peer = prev;
+                    n = p / (8 * sizeof(uintptr_t));
+                    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+                }
+
+            } else if (peer->conns * prev->weight
+                       > prev->conns * peer->weight)
+            {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -457,6 +487,96 @@ ngx_http_upstream_peek_random_peer(ngx_http_upstream_rr_peers_t *peers,
 }
 
 
+/*
+ * The least_time cost of a peer is its peak EWMA response time multiplied
+ * by the number of requests in flight, and divided by its weight; both
+ * sides are multiplied by the other peer weight for comparison.
+ *
+ * The response time estimate decays toward zero while a peer is not
+ * used, so that a peer which was slow is eventually retried.
+ */
+
+static uint64_t
+ngx_http_upstream_random_cost(ngx_http_upstream_rr_peer_t *peer,
+    ngx_int_t weight)
+{
+    uint64_t    rtt;
+    ngx_msec_t  elapsed;
+
+    elapsed = ngx_current_msec - peer->rtt_time;
+
+    rtt = (uint64_t) peer->rtt * NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY
+          / (NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY + elapsed);
+
+    return (rtt + 1) * (peer->conns + 1) * weight;
+}
+
+
+static void
+ngx_http_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_upstream_random_peer_data_t  *rp = data;
+
+    ngx_msec_t                     rtt, elapsed;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    u = rp->request->upstream;
+    peer = rp->rrp.current;
+
+    if (state & NGX_PEER_FAILED || peer == NULL) {
+        goto done;
+    }
+
+    if (rp->conf->least_time == NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER) {
+        rtt = u->state->header_time;
+
+        if (rtt == (ngx_msec_t) -1) {
+            goto done;
+        }
+
+    } else {
+        rtt = ngx_current_msec - u->start_time;
+    }
+
+    peers = rp->rrp.peers;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+    ngx_http_upstream_rr_peer_lock(peers, peer);
+
+    /*
+     * peak EWMA: a slower response is taken as is, a faster one
+     * is averaged with a weight depending on the time elapsed
+     */
+
+    elapsed = ngx_min(ngx_current_msec - peer->rtt_time,
+                      10 * NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY);
+
+    if (rtt > peer->rtt || peer->rtt_time == 0) {
+        peer->rtt = rtt;
+
+    } else {
+        peer->rtt = ((uint64_t) peer->rtt * NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY
+                     + (uint64_t) rtt * elapsed)
+                    / (NGX_HTTP_UPSTREAM_LEAST_TIME_DECAY + elapsed);
+    }
+
+    peer->rtt_time = ngx_current_msec;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free random peer rtt:%M ewma:%M", rtt, peer->rtt);
+
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+done:
+
+    ngx_http_upstream_free_round_robin_peer(pc, &rp->rrp, state);
+}
+
+
 static void *
 ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
 {
@@ -471,6 +591,7 @@ ngx_http_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->least_time = 0;
      */
 
     return conf;
@@ -521,11 +642,21 @@ ngx_http_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
-        return NGX_CONF_ERROR;
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=header") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_LEAST_TIME_HEADER;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=last_byte") == 0) {
+        rcf->least_time = NGX_HTTP_UPSTREAM_LEAST_TIME_LAST_BYTE;
+        return NGX_CONF_OK;
     }
 
-    return NGX_CONF_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
 }
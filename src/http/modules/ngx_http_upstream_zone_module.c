@@ -617,7 +617,7 @@ ngx_http_upstream_zone_remove_peer_locked(ngx_http_upstream_rr_peers_t *peers,
 {
     peers->total_weight -= peer->weight;
     peers->number--;
-    peers->tries -= (peer->down == 0);
+    peers->tries -= ((peer->down & ~NGX_HTTP_UPSTREAM_PEER_UNHEALTHY) == 0);
     (*peers->config)++;
     peers->weighted = (peers->total_weight != peers->number);
 
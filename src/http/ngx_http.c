@@ -11,6 +11,7 @@
 
 
 static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static ngx_int_t ngx_http_init_module(ngx_cycle_t *cycle);
 static ngx_int_t ngx_http_init_phases(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
 static ngx_int_t ngx_http_init_headers_in_hash(ngx_conf_t *cf,
@@ -108,7 +109,7 @@ ngx_module_t  ngx_http_module = {
     ngx_http_commands,                     /* module directives */
     NGX_CORE_MODULE,                       /* module type */
     NULL,                                  /* init master */
-    NULL,                                  /* init module */
+    ngx_http_init_module,                  /* init module */
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
@@ -148,7 +149,6 @@ ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     ngx_http_max_module = ngx_count_modules(cf->cycle, NGX_HTTP_MODULE);
 
-
     /* the http main_conf context, it is the same in the all http contexts */
 
     ctx->main_conf = ngx_pcalloc(cf->pool,
@@ -346,6 +346,17 @@ failed:
 }
 
 
+static ngx_int_t
+ngx_http_init_module(ngx_cycle_t *cycle)
+{
+#if (NGX_HTTP_V2 || NGX_HTTP_V3)
+    ngx_http_huff_decode_init();
+#endif
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_init_phases(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf)
 {
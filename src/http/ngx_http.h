@@ -118,9 +118,13 @@ void ngx_http_split_args(ngx_http_request_t *r, ngx_str_t *uri,
     ngx_str_t *args);
 ngx_int_t ngx_http_parse_chunked(ngx_http_request_t *r, ngx_buf_t *b,
     ngx_http_chunked_t *ctx, ngx_uint_t keep_trailers);
+ngx_int_t ngx_http_parse_priority(u_char *p, u_char *end, ngx_uint_t *urgency,
+    ngx_uint_t *incremental);
 
 
 ngx_http_request_t *ngx_http_create_request(ngx_connection_t *c);
+ngx_http_request_t *ngx_http_create_request_with_pool(ngx_connection_t *c,
+    ngx_pool_t *pool);
 ngx_int_t ngx_http_process_request_uri(ngx_http_request_t *r);
 ngx_int_t ngx_http_process_request_header(ngx_http_request_t *r);
 void ngx_http_process_request(ngx_http_request_t *r);
@@ -178,6 +182,7 @@ ngx_uint_t  ngx_http_degraded(ngx_http_request_t *);
 
 
 #if (NGX_HTTP_V2 || NGX_HTTP_V3)
+void ngx_http_huff_decode_init(void);
 ngx_int_t ngx_http_huff_decode(u_char *state, u_char *src, size_t len,
     u_char **dst, ngx_uint_t last, ngx_log_t *log);
 size_t ngx_http_huff_encode(u_char *src, size_t len, u_char *dst,
@@ -36,6 +36,9 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct ngx_http_file_cache_ram_s  ngx_http_file_cache_ram_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -59,9 +62,20 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_ram_t       *ram;
 } ngx_http_file_cache_node_t;
 
 
+struct ngx_http_file_cache_ram_s {
+    ngx_queue_t                      queue;
+    ngx_http_file_cache_node_t      *node;
+    ngx_file_uniq_t                  uniq;
+    size_t                           size;
+    size_t                           len;
+    u_char                           data[1];
+};
+
+
 struct ngx_http_cache_s {
     ngx_file_t                       file;
     ngx_array_t                      keys;
@@ -119,6 +133,7 @@ struct ngx_http_cache_s {
     unsigned                         secondary:1;
     unsigned                         update_variant:1;
     unsigned                         background:1;
+    unsigned                         ram:1;
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
@@ -153,6 +168,15 @@ typedef struct {
     off_t                            size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+
+    ngx_pid_t                        manager;
+    time_t                           manager_expire;
+
+    ngx_queue_t                      ram_queue;
+    size_t                           ram_size;
+    u_char                          *sketch;
+    ngx_uint_t                       sketch_mask;
+    ngx_uint_t                       sketch_adds;
 } ngx_http_file_cache_sh_t;
 
 
@@ -176,10 +200,17 @@ struct ngx_http_file_cache_s {
     ngx_msec_t                       loader_sleep;
     ngx_msec_t                       loader_threshold;
 
+    ngx_uint_t                       loaded;
+    ngx_msec_t                       loader_last;
+
     ngx_uint_t                       manager_files;
     ngx_msec_t                       manager_sleep;
     ngx_msec_t                       manager_threshold;
 
+    size_t                           ram;
+
+    ngx_str_t                        index;
+
     ngx_shm_zone_t                  *shm_zone;
 
     ngx_uint_t                       use_temp_path;
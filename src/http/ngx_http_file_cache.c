@@ -11,6 +11,27 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_FILE_CACHE_BATCH  64
+#define NGX_HTTP_FILE_CACHE_INDEX  512
+
+#define NGX_HTTP_FILE_CACHE_INDEX_VERSION  1
+
+
+typedef struct {
+    uint32_t                         version;
+    uint32_t                         size;
+    ngx_uint_t                       cache_version;
+    size_t                           bsize;
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    off_t                            fs_size;
+    time_t                           expire;
+} ngx_http_file_cache_index_entry_t;
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
@@ -30,6 +51,18 @@ static void ngx_http_cache_thread_event_handler(ngx_event_t *ev);
 #endif
 static ngx_int_t ngx_http_file_cache_exists(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_ram_read(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_evict_locked(ngx_http_file_cache_t *cache,
+    ngx_uint_t n);
+static void ngx_http_file_cache_ram_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static size_t ngx_http_file_cache_ram_size(size_t len);
+static ngx_uint_t ngx_http_file_cache_frequency(ngx_http_file_cache_t *cache,
+    u_char *key, ngx_uint_t add);
+static ngx_uint_t ngx_http_file_cache_sketch_width(size_t ram);
 static ngx_int_t ngx_http_file_cache_name(ngx_http_request_t *r,
     ngx_path_t *path);
 static ngx_http_file_cache_node_t *
@@ -45,10 +78,15 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
-static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache,
+    off_t need, ngx_uint_t batch);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
-    ngx_queue_t *q, u_char *name);
+    ngx_http_file_cache_node_t **nodes, ngx_uint_t n, u_char *name);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_file_cache_manager_lock(
+    ngx_http_file_cache_t *cache);
+#endif
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -60,6 +98,8 @@ static ngx_int_t ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_load_index(ngx_http_file_cache_t *cache);
+static void ngx_http_file_cache_save_index(void *data);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
@@ -121,6 +161,11 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
+        if (cache->ram && cache->sh->sketch == NULL) {
+            /* the RAM tier was not configured previously */
+            cache->ram = 0;
+        }
+
         return NGX_OK;
     }
 
@@ -152,6 +197,21 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
     cache->sh->count = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
 
+    ngx_queue_init(&cache->sh->ram_queue);
+    cache->sh->ram_size = 0;
+
+    if (cache->ram) {
+        n = ngx_http_file_cache_sketch_width(cache->ram);
+
+        cache->sh->sketch = ngx_slab_calloc(cache->shpool, 4 * n);
+        if (cache->sh->sketch == NULL) {
+            return NGX_ERROR;
+        }
+
+        cache->sh->sketch_mask = n - 1;
+        cache->sh->sketch_adds = 0;
+    }
+
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
     cache->max_size /= cache->bsize;
@@ -264,6 +324,7 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 ngx_int_t
 ngx_http_file_cache_open(ngx_http_request_t *r)
 {
+    size_t                     size;
     ngx_int_t                  rc, rv;
     ngx_uint_t                 test;
     ngx_http_cache_t          *c;
@@ -282,6 +343,8 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return ngx_http_file_cache_read(r, c);
     }
 
+    c->ram = 0;
+
     cache = c->file_cache;
 
     if (c->node == NULL) {
@@ -345,6 +408,14 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (c->exists && cache->ram) {
+        rc = ngx_http_file_cache_ram_read(r, c);
+
+        if (rc != NGX_DECLINED) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -384,7 +455,17 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
     c->length = of.size;
     c->fs_size = (of.fs_size + cache->bsize - 1) / cache->bsize;
 
-    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    size = c->body_start;
+
+    if (cache->ram
+        && c->length > (off_t) size
+        && c->length <= (off_t) c->buffer_size)
+    {
+        /* small files are read whole to be kept in the RAM tier */
+        size = (size_t) c->length;
+    }
+
+    c->buf = ngx_create_temp_buf(r->pool, size);
     if (c->buf == NULL) {
         return NGX_ERROR;
     }
@@ -551,10 +632,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->ram) {
+        n = (ssize_t) c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -676,6 +762,10 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return rc;
     }
 
+    if (cache->ram && !c->ram && (off_t) n == c->length) {
+        ngx_http_file_cache_ram_admit(cache, c);
+    }
+
     return NGX_OK;
 }
 
@@ -683,6 +773,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    size_t                     size;
 #if (NGX_HAVE_FILE_AIO || NGX_THREADS)
     ssize_t                    n;
     ngx_http_core_loc_conf_t  *clcf;
@@ -690,10 +781,12 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 #endif
 
+    size = c->buf->end - c->buf->pos;
+
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -722,7 +815,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -732,7 +825,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, size, 0);
 }
 
 
@@ -889,6 +982,10 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     if (fcn == NULL) {
         fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+        if (cache->sh->sketch) {
+            (void) ngx_http_file_cache_frequency(cache, c->key, 1);
+        }
     }
 
     if (fcn) {
@@ -929,12 +1026,23 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 
     fcn = ngx_slab_calloc_locked(cache->shpool,
                                  sizeof(ngx_http_file_cache_node_t));
+
+    if (fcn == NULL && !ngx_queue_empty(&cache->sh->ram_queue)) {
+
+        /* cached bodies give way to the keys */
+
+        ngx_http_file_cache_ram_evict_locked(cache, 8);
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+    }
+
     if (fcn == NULL) {
         ngx_http_file_cache_set_watermark(cache);
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        (void) ngx_http_file_cache_forced_expire(cache);
+        (void) ngx_http_file_cache_forced_expire(cache, 0, 1);
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -964,6 +1072,10 @@ renew:
 
     rc = NGX_DECLINED;
 
+    if (fcn->ram) {
+        ngx_http_file_cache_ram_free_locked(cache, fcn);
+    }
+
     fcn->valid_msec = 0;
     fcn->error = 0;
     fcn->exists = 0;
@@ -990,6 +1102,273 @@ failed:
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_ram_read(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_buf_t                  *b;
+    ngx_http_file_cache_t      *cache;
+    ngx_http_file_cache_ram_t  *ram;
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ram = c->node->ram;
+
+    if (ram == NULL || ram->uniq != c->node->uniq) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    b = ngx_create_temp_buf(r->pool, ram->len);
+    if (b == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_ERROR;
+    }
+
+    /* the data are accounted by ngx_http_file_cache_read() */
+
+    ngx_memcpy(b->pos, ram->data, ram->len);
+
+    c->length = ram->len;
+    c->uniq = ram->uniq;
+    c->fs_size = c->node->fs_size;
+
+    ngx_queue_remove(&ram->queue);
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %O", c->length);
+
+    c->buf = b;
+    c->ram = 1;
+
+    return ngx_http_file_cache_read(r, c);
+}
+
+
+static void
+ngx_http_file_cache_ram_admit(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c)
+{
+    u_char                      *p, key[NGX_HTTP_CACHE_KEY_LEN];
+    size_t                       size, freed;
+    ngx_uint_t                   n, freq;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_ram_t   *ram;
+    ngx_http_file_cache_node_t  *fcn;
+
+    size = ngx_http_file_cache_ram_size((size_t) c->length);
+
+    if (size > cache->ram) {
+        return;
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+
+    if (fcn->ram || !fcn->exists || c->uniq == 0) {
+        goto done;
+    }
+
+    if (fcn->uniq == 0) {
+        /* nodes added by the cache loader do not know the file yet */
+        fcn->uniq = c->uniq;
+
+    } else if (fcn->uniq != c->uniq) {
+        goto done;
+    }
+
+    if (cache->sh->ram_size + size > cache->ram) {
+
+        /*
+         * TinyLFU admission: the object replaces the least recently
+         * used ones only if it is requested more often than each of them
+         */
+
+        freq = ngx_http_file_cache_frequency(cache, c->key, 0);
+        freed = 0;
+        n = 0;
+
+        for (q = ngx_queue_last(&cache->sh->ram_queue);
+             q != ngx_queue_sentinel(&cache->sh->ram_queue);
+             q = ngx_queue_prev(q))
+        {
+            ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+
+            p = ngx_cpymem(key, &ram->node->node.key,
+                           sizeof(ngx_rbtree_key_t));
+            ngx_memcpy(p, ram->node->key,
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            if (ngx_http_file_cache_frequency(cache, key, 0) >= freq) {
+                goto done;
+            }
+
+            freed += ram->size;
+            n++;
+
+            if (cache->sh->ram_size - freed + size <= cache->ram) {
+                break;
+            }
+
+            if (n == 8) {
+                goto done;
+            }
+        }
+
+        if (q == ngx_queue_sentinel(&cache->sh->ram_queue)) {
+            goto done;
+        }
+
+        ngx_http_file_cache_ram_evict_locked(cache, n);
+    }
+
+    ram = ngx_slab_alloc_locked(cache->shpool,
+                                offsetof(ngx_http_file_cache_ram_t, data)
+                                + (size_t) c->length);
+
+    if (ram == NULL && !ngx_queue_empty(&cache->sh->ram_queue)) {
+        ngx_http_file_cache_ram_evict_locked(cache, 8);
+
+        ram = ngx_slab_alloc_locked(cache->shpool,
+                                    offsetof(ngx_http_file_cache_ram_t, data)
+                                    + (size_t) c->length);
+    }
+
+    if (ram == NULL) {
+        goto done;
+    }
+
+    ram->node = fcn;
+    ram->uniq = c->uniq;
+    ram->size = size;
+    ram->len = (size_t) c->length;
+
+    ngx_memcpy(ram->data, c->buf->pos, ram->len);
+
+    ngx_queue_insert_head(&cache->sh->ram_queue, &ram->queue);
+    cache->sh->ram_size += size;
+
+    fcn->ram = ram;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_http_file_cache_ram_evict_locked(ngx_http_file_cache_t *cache,
+    ngx_uint_t n)
+{
+    ngx_queue_t                *q;
+    ngx_http_file_cache_ram_t  *ram;
+
+    while (n-- && !ngx_queue_empty(&cache->sh->ram_queue)) {
+        q = ngx_queue_last(&cache->sh->ram_queue);
+        ram = ngx_queue_data(q, ngx_http_file_cache_ram_t, queue);
+
+        ngx_http_file_cache_ram_free_locked(cache, ram->node);
+    }
+}
+
+
+static void
+ngx_http_file_cache_ram_free_locked(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_http_file_cache_ram_t  *ram;
+
+    ram = fcn->ram;
+
+    ngx_queue_remove(&ram->queue);
+    cache->sh->ram_size -= ram->size;
+
+    ngx_slab_free_locked(cache->shpool, ram);
+
+    fcn->ram = NULL;
+}
+
+
+static size_t
+ngx_http_file_cache_ram_size(size_t len)
+{
+    size_t  size, n;
+
+    /* memory actually taken from the slab allocator */
+
+    size = offsetof(ngx_http_file_cache_ram_t, data) + len;
+
+    if (size > ngx_pagesize / 2) {
+        return ngx_align(size, ngx_pagesize);
+    }
+
+    for (n = 8; n < size; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_frequency(ngx_http_file_cache_t *cache, u_char *key,
+    ngx_uint_t add)
+{
+    u_char      *counter;
+    uint32_t     hash[4];
+    ngx_uint_t   i, width, freq;
+
+    /*
+     * a count-min sketch of one byte counters saturating at 15, indexed
+     * by the four 32-bit words of the MD5 key; the counters are halved
+     * after 10 * width additions, so old popularity fades away
+     */
+
+    ngx_memcpy(hash, key, sizeof(hash));
+
+    width = cache->sh->sketch_mask + 1;
+    freq = 15;
+
+    for (i = 0; i < 4; i++) {
+        counter = &cache->sh->sketch[i * width
+                                     + (hash[i] & cache->sh->sketch_mask)];
+
+        if (add && *counter < 15) {
+            (*counter)++;
+        }
+
+        if (*counter < freq) {
+            freq = *counter;
+        }
+    }
+
+    if (add && ++cache->sh->sketch_adds >= 10 * width) {
+
+        for (i = 0; i < 4 * width; i++) {
+            cache->sh->sketch[i] >>= 1;
+        }
+
+        cache->sh->sketch_adds /= 2;
+    }
+
+    return freq;
+}
+
+
+static ngx_uint_t
+ngx_http_file_cache_sketch_width(size_t ram)
+{
+    ngx_uint_t  n;
+
+    for (n = 256; n < ram / 1024; n <<= 1) { /* void */ }
+
+    return n;
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_name(ngx_http_request_t *r, ngx_path_t *path)
 {
@@ -1471,6 +1850,10 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
+    if (c->node->ram) {
+        ngx_http_file_cache_ram_free_locked(cache, c->node);
+    }
+
     c->node->count--;
     c->node->error = 0;
     c->node->uniq = uniq;
@@ -1497,6 +1880,8 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     ngx_file_t                     file;
     ngx_file_info_t                fi;
     ngx_http_cache_t              *c;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_ram_t     *ram;
     ngx_http_file_cache_header_t   h;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
@@ -1609,8 +1994,26 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
         ngx_memcpy(h.variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
     }
 
-    (void) ngx_write_file(&file, (u_char *) &h,
-                          sizeof(ngx_http_file_cache_header_t), 0);
+    if (ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto done;
+    }
+
+    cache = c->file_cache;
+
+    if (cache->ram) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        ram = c->node->ram;
+
+        if (ram && ram->uniq == c->uniq) {
+            ngx_memcpy(ram->data, &h, sizeof(ngx_http_file_cache_header_t));
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
 
 done:
 
@@ -1641,9 +2044,11 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!c->ram) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
     }
 
     rc = ngx_http_send_header(r);
@@ -1652,17 +2057,25 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
-    b->file_pos = c->body_start;
-    b->file_last = c->length;
+    if (c->ram) {
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+        b->memory = (c->length - c->body_start) ? 1 : 0;
+
+    } else {
+        b->file_pos = c->body_start;
+        b->file_last = c->length;
+
+        b->in_file = (c->length - c->body_start) ? 1 : 0;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+    }
 
-    b->in_file = (c->length - c->body_start) ? 1 : 0;
     b->last_buf = (r == r->main) ? 1 : 0;
     b->last_in_chain = 1;
-    b->sync = (b->last_buf || b->in_file) ? 0 : 1;
-
-    b->file->fd = c->file.fd;
-    b->file->name = c->file.name;
-    b->file->log = r->connection->log;
+    b->sync = (b->last_buf || b->in_file || b->memory) ? 0 : 1;
 
     out.buf = b;
     out.next = NULL;
@@ -1758,15 +2171,17 @@ ngx_http_file_cache_cleanup(void *data)
 
 
 static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache, off_t need,
+    ngx_uint_t batch)
 {
     u_char                      *name, *p;
     size_t                       len;
+    off_t                        size;
     time_t                       wait;
-    ngx_uint_t                   tries;
+    ngx_uint_t                   n, count, tries;
     ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_queue_t                 *q, *prev, *sentinel;
+    ngx_http_file_cache_node_t  *fcn, *nodes[NGX_HTTP_FILE_CACHE_BATCH];
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
@@ -1785,19 +2200,29 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
     wait = 10;
     tries = 20;
     sentinel = NULL;
+    n = 0;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+    /*
+     * a batch of the least recently used entries is collected
+     * to get below both the size and the number of entries limits
+     */
 
-        q = ngx_queue_last(&cache->sh->queue);
+    size = cache->sh->size - cache->max_size + 1;
 
-        if (q == sentinel) {
-            break;
-        }
+    if (size < need) {
+        size = need;
+    }
+
+    count = (cache->sh->count >= cache->sh->watermark)
+            ? cache->sh->count - cache->sh->watermark + 1 : 0;
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue) && q != sentinel;
+         q = prev)
+    {
+        prev = ngx_queue_prev(q);
 
         fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
@@ -1807,9 +2232,17 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
                   fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
         if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
+            nodes[n++] = fcn;
+
+            if (fcn->exists) {
+                size -= fcn->fs_size;
+            }
+
+            if ((size <= 0 && n >= count) || n == batch) {
+                break;
+            }
+
+            continue;
         }
 
         if (fcn->deleting) {
@@ -1848,6 +2281,12 @@ ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
         break;
     }
 
+    if (n) {
+        ngx_http_file_cache_delete(cache, nodes, n, name);
+        cache->files += n;
+        wait = 0;
+    }
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     ngx_free(name);
@@ -1862,10 +2301,11 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
     u_char                      *name, *p;
     size_t                       len;
     time_t                       now, wait;
+    ngx_uint_t                   n;
     ngx_path_t                  *path;
     ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_queue_t                 *q, *prev;
+    ngx_http_file_cache_node_t  *fcn, *nodes[NGX_HTTP_FILE_CACHE_BATCH];
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
@@ -1892,59 +2332,76 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
-            break;
-        }
+        n = 0;
+        wait = 10;
 
-        q = ngx_queue_last(&cache->sh->queue);
+        for (q = ngx_queue_last(&cache->sh->queue);
+             q != ngx_queue_sentinel(&cache->sh->queue);
+             q = prev)
+        {
+            prev = ngx_queue_prev(q);
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+            fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
 
-        wait = fcn->expire - now;
+            wait = fcn->expire - now;
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
-        }
+            if (wait > 0) {
+                wait = wait > 10 ? 10 : wait;
+                break;
+            }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+            ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
                        fcn->count, fcn->exists,
                        fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+            if (fcn->count == 0) {
+                nodes[n++] = fcn;
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+                if (n == NGX_HTTP_FILE_CACHE_BATCH
+                    || cache->files + n >= cache->manager_files)
+                {
+                    break;
+                }
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+                continue;
+            }
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+            if (fcn->deleting) {
+                wait = 1;
+                break;
+            }
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+            p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                             sizeof(ngx_rbtree_key_t));
+            len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+            (void) ngx_hex_dump(p, fcn->key, len);
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+            /*
+             * abnormally exited workers may leave locked cache entries,
+             * and although it may be safe to remove them completely,
+             * we prefer to just move them to the top of the inactive queue
+             */
 
-next:
+            ngx_queue_remove(q);
+            fcn->expire = ngx_time() + cache->inactive;
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
 
-        if (++cache->files >= cache->manager_files) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                       "ignore long locked inactive cache entry %*s, count:%d",
+                       (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+        }
+
+        if (n) {
+            ngx_http_file_cache_delete(cache, nodes, n, name);
+            cache->files += n;
+        }
+
+        if (wait > 0) {
+            break;
+        }
+
+        if (cache->files >= cache->manager_files) {
             wait = 0;
             break;
         }
@@ -1968,20 +2425,61 @@ next:
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t **nodes, ngx_uint_t n, u_char *name)
 {
     u_char                      *p;
     size_t                       len;
+    ngx_uint_t                   i, deleting;
     ngx_path_t                  *path;
     ngx_http_file_cache_node_t  *fcn;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    /*
+     * the mutex is released once for the whole batch
+     * while the files are deleted
+     */
+
+    deleting = 0;
+
+    for (i = 0; i < n; i++) {
+        fcn = nodes[i];
+
+        if (fcn->ram) {
+            ngx_http_file_cache_ram_free_locked(cache, fcn);
+        }
+
+        if (fcn->exists) {
+            cache->sh->size -= fcn->fs_size;
+
+            fcn->count++;
+            fcn->deleting = 1;
+            deleting = 1;
+            continue;
+        }
+
+        ngx_queue_remove(&fcn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+
+        nodes[i] = NULL;
+    }
+
+    if (!deleting) {
+        return;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    path = cache->path;
+
+    for (i = 0; i < n; i++) {
+        fcn = nodes[i];
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
+        if (fcn == NULL) {
+            continue;
+        }
 
-        path = cache->path;
         p = name + path->name.len + 1 + path->len;
         p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
                          sizeof(ngx_rbtree_key_t));
@@ -1989,10 +2487,6 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
         p = ngx_hex_dump(p, fcn->key, len);
         *p = '\0';
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
-
         len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
         ngx_create_hashed_filename(path, name, len);
 
@@ -2003,17 +2497,26 @@ ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
             ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
                           ngx_delete_file_n " \"%s\" failed", name);
         }
+    }
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < n; i++) {
+        fcn = nodes[i];
+
+        if (fcn == NULL) {
+            continue;
+        }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
         fcn->count--;
         fcn->deleting = 0;
-    }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+        if (fcn->count == 0) {
+            ngx_queue_remove(&fcn->queue);
+            ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+            ngx_slab_free_locked(cache->shpool, fcn);
+            cache->sh->count--;
+        }
     }
 }
 
@@ -2023,13 +2526,30 @@ ngx_http_file_cache_manager(void *data)
 {
     ngx_http_file_cache_t  *cache = data;
 
-    off_t       size, free;
+    off_t       size, free, need;
     time_t      wait;
     ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    ngx_uint_t  count, watermark, files;
+
+#if (NGX_THREADS)
+
+    if (cache->path->thread_pool
+        && ngx_http_file_cache_manager_lock(cache) != NGX_OK)
+    {
+        return 1000;
+    }
+
+#endif
 
     cache->last = ngx_current_msec;
+
+    /* the files are counted by the expiry functions under the mutex */
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
     cache->files = 0;
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    files = 0;
 
     next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
 
@@ -2044,6 +2564,7 @@ ngx_http_file_cache_manager(void *data)
         size = cache->sh->size;
         count = cache->sh->count;
         watermark = cache->sh->watermark;
+        files = cache->files;
 
         ngx_shmtx_unlock(&cache->shpool->mutex);
 
@@ -2051,6 +2572,13 @@ ngx_http_file_cache_manager(void *data)
                        "http file cache size: %O c:%ui w:%i",
                        size, count, (ngx_int_t) watermark);
 
+        if (files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        need = 0;
+
         if (size < cache->max_size && count < watermark) {
 
             if (!cache->min_free) {
@@ -2065,9 +2593,12 @@ ngx_http_file_cache_manager(void *data)
             if (free > cache->min_free) {
                 break;
             }
+
+            need = (cache->min_free - free) / cache->bsize + 1;
         }
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+        wait = ngx_http_file_cache_forced_expire(cache, need,
+                                                 NGX_HTTP_FILE_CACHE_BATCH);
 
         if (wait > 0) {
             next = (ngx_msec_t) wait * 1000;
@@ -2078,11 +2609,6 @@ ngx_http_file_cache_manager(void *data)
             break;
         }
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
-
         ngx_time_update();
 
         elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
@@ -2099,12 +2625,44 @@ done:
 
     ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+                   files, elapsed, next);
 
     return next;
 }
 
 
+#if (NGX_THREADS)
+
+static ngx_int_t
+ngx_http_file_cache_manager_lock(ngx_http_file_cache_t *cache)
+{
+    time_t     now;
+    ngx_int_t  rc;
+
+    /*
+     * the manager runs in all workers, but only one of them
+     * manages the cache as long as it keeps renewing the lease
+     */
+
+    now = ngx_time();
+    rc = NGX_BUSY;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (cache->sh->manager == ngx_pid || cache->sh->manager_expire < now) {
+        cache->sh->manager = ngx_pid;
+        cache->sh->manager_expire = now + 20;
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+#endif
+
+
 static void
 ngx_http_file_cache_loader(void *data)
 {
@@ -2123,6 +2681,32 @@ ngx_http_file_cache_loader(void *data)
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                    "http file cache loader");
 
+    if (cache->index.len) {
+
+        switch (ngx_http_file_cache_load_index(cache)) {
+
+        case NGX_OK:
+            cache->sh->cold = 0;
+            cache->sh->loading = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "http file cache: %V %.3fM, bsize: %uz, "
+                          "loaded from index",
+                          &cache->path->name,
+                          ((double) cache->sh->size * cache->bsize)
+                          / (1024 * 1024),
+                          cache->bsize);
+            return;
+
+        case NGX_ABORT:
+            cache->sh->loading = 0;
+            return;
+
+        default: /* NGX_DECLINED */
+            break;
+        }
+    }
+
     tree.init_handler = NULL;
     tree.file_handler = ngx_http_file_cache_manage_file;
     tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
@@ -2132,8 +2716,8 @@ ngx_http_file_cache_loader(void *data)
     tree.alloc = 0;
     tree.log = ngx_cycle->log;
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    cache->loader_last = ngx_current_msec;
+    cache->loaded = 0;
 
     if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
         cache->sh->loading = 0;
@@ -2166,17 +2750,25 @@ ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 
     cache = ctx->data;
 
+    if (cache->index.len
+        && path->len >= cache->index.len
+        && ngx_strncmp(path->data, cache->index.data, cache->index.len) == 0)
+    {
+        return NGX_OK;
+    }
+
     if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
         (void) ngx_http_file_cache_delete_file(ctx, path);
     }
 
-    if (++cache->files >= cache->loader_files) {
+    if (++cache->loaded >= cache->loader_files) {
         ngx_http_file_cache_loader_sleep(cache);
 
     } else {
         ngx_time_update();
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+        elapsed = ngx_abs((ngx_msec_int_t)
+                          (ngx_current_msec - cache->loader_last));
 
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
                        "http file cache loader time elapsed: %M", elapsed);
@@ -2210,8 +2802,8 @@ ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
 
     ngx_time_update();
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    cache->loader_last = ngx_current_msec;
+    cache->loaded = 0;
 }
 
 
@@ -2324,6 +2916,324 @@ ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_load_index(ngx_http_file_cache_t *cache)
+{
+    ssize_t                              n;
+    ngx_fd_t                             fd;
+    ngx_int_t                            rc;
+    ngx_uint_t                           i, loaded;
+    ngx_err_t                            err;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entry, *entries;
+    ngx_http_file_cache_index_header_t   header;
+
+    fd = ngx_open_file(cache->index.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", cache->index.data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    rc = NGX_DECLINED;
+    loaded = 0;
+    entries = NULL;
+
+    /* the loader may run in a thread with a small stack */
+
+    entries = ngx_alloc(NGX_HTTP_FILE_CACHE_INDEX
+                        * sizeof(ngx_http_file_cache_index_entry_t),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        goto done;
+    }
+
+    n = ngx_read_fd(fd, &header, sizeof(ngx_http_file_cache_index_header_t));
+
+    if (n != sizeof(ngx_http_file_cache_index_header_t)
+        || header.version != NGX_HTTP_FILE_CACHE_INDEX_VERSION
+        || header.size != sizeof(ngx_http_file_cache_index_entry_t)
+        || header.cache_version != NGX_HTTP_CACHE_VERSION
+        || header.bsize != cache->bsize)
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache index \"%s\" is invalid, ignored",
+                      cache->index.data);
+        goto done;
+    }
+
+    /*
+     * the index lists the entries from the least recently used ones,
+     * so inserting each entry at the queue head keeps the order
+     */
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            rc = NGX_ABORT;
+            break;
+        }
+
+        n = ngx_read_fd(fd, entries,
+                        NGX_HTTP_FILE_CACHE_INDEX
+                        * sizeof(ngx_http_file_cache_index_entry_t));
+
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_read_fd_n " \"%s\" failed", cache->index.data);
+            break;
+        }
+
+        if (n == 0) {
+            rc = NGX_OK;
+            break;
+        }
+
+        if (n % sizeof(ngx_http_file_cache_index_entry_t)) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                          "cache index \"%s\" is truncated",
+                          cache->index.data);
+            break;
+        }
+
+        n /= sizeof(ngx_http_file_cache_index_entry_t);
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        for (i = 0; i < (ngx_uint_t) n; i++) {
+            entry = &entries[i];
+
+            fcn = ngx_http_file_cache_lookup(cache, entry->key);
+
+            if (fcn) {
+                ngx_queue_remove(&fcn->queue);
+                ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+                continue;
+            }
+
+            fcn = ngx_slab_calloc_locked(cache->shpool,
+                                         sizeof(ngx_http_file_cache_node_t));
+            if (fcn == NULL) {
+                ngx_http_file_cache_set_watermark(cache);
+                ngx_shmtx_unlock(&cache->shpool->mutex);
+
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                              "could not allocate node%s",
+                              cache->shpool->log_ctx);
+                goto done;
+            }
+
+            cache->sh->count++;
+
+            ngx_memcpy((u_char *) &fcn->node.key, entry->key,
+                       sizeof(ngx_rbtree_key_t));
+
+            ngx_memcpy(fcn->key, &entry->key[sizeof(ngx_rbtree_key_t)],
+                       NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+            ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+            fcn->uses = 1;
+            fcn->exists = 1;
+            fcn->fs_size = entry->fs_size;
+            fcn->expire = entry->expire;
+
+            cache->sh->size += entry->fs_size;
+
+            ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        loaded += n;
+    }
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index: %ui entries, rc:%i", loaded, rc);
+
+    if (entries) {
+        ngx_free(entries);
+    }
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", cache->index.data);
+    }
+
+    /*
+     * the index is removed once loaded: it is only valid until
+     * the next change in the cache, and is saved again on exit
+     */
+
+    if (rc != NGX_ABORT
+        && ngx_delete_file(cache->index.data) == NGX_FILE_ERROR)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", cache->index.data);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_file_cache_save_index(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    u_char                              *name;
+    size_t                               size;
+    ngx_fd_t                             fd;
+    ngx_uint_t                           n, count;
+    ngx_queue_t                         *q;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entry, *entries;
+    ngx_http_file_cache_index_header_t   header;
+
+    if (cache->sh == NULL || cache->sh->cold) {
+        return;
+    }
+
+    entries = ngx_alloc(NGX_HTTP_FILE_CACHE_INDEX
+                        * sizeof(ngx_http_file_cache_index_entry_t)
+                        + cache->index.len + sizeof(".tmp"),
+                        ngx_cycle->log);
+    if (entries == NULL) {
+        return;
+    }
+
+    name = (u_char *) &entries[NGX_HTTP_FILE_CACHE_INDEX];
+
+    ngx_sprintf(name, "%V.tmp%Z", &cache->index);
+
+    fd = ngx_open_file(name, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+        ngx_free(entries);
+        return;
+    }
+
+    ngx_memzero(&header, sizeof(ngx_http_file_cache_index_header_t));
+
+    header.version = NGX_HTTP_FILE_CACHE_INDEX_VERSION;
+    header.size = sizeof(ngx_http_file_cache_index_entry_t);
+    header.cache_version = NGX_HTTP_CACHE_VERSION;
+    header.bsize = cache->bsize;
+
+    if (ngx_write_fd(fd, &header, sizeof(ngx_http_file_cache_index_header_t))
+        != sizeof(ngx_http_file_cache_index_header_t))
+    {
+        goto failed;
+    }
+
+    /*
+     * a worker may have exited abnormally with the mutex locked,
+     * the index is not saved then
+     */
+
+    if (!ngx_shmtx_trylock(&cache->shpool->mutex)) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache index \"%V\" is not saved, cache is locked",
+                      &cache->index);
+        goto failed;
+    }
+
+    n = 0;
+    count = 0;
+
+    for (q = ngx_queue_last(&cache->sh->queue);
+         q != ngx_queue_sentinel(&cache->sh->queue);
+         q = ngx_queue_prev(q))
+    {
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        if (!fcn->exists || fcn->deleting) {
+            continue;
+        }
+
+        entry = &entries[n++];
+
+        ngx_memcpy(entry->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&entry->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        entry->fs_size = fcn->fs_size;
+        entry->expire = fcn->expire;
+
+        if (n < NGX_HTTP_FILE_CACHE_INDEX) {
+            continue;
+        }
+
+        size = n * sizeof(ngx_http_file_cache_index_entry_t);
+
+        if (ngx_write_fd(fd, entries, size) != (ssize_t) size) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            goto failed;
+        }
+
+        count += n;
+        n = 0;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    size = n * sizeof(ngx_http_file_cache_index_entry_t);
+
+    if (n && ngx_write_fd(fd, entries, size) != (ssize_t) size) {
+        goto failed;
+    }
+
+    count += n;
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if (ngx_rename_file(name, cache->index.data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      name, cache->index.data);
+
+        (void) ngx_delete_file(name);
+
+    } else {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache: %V index saved, %ui entries",
+                      &cache->path->name, count);
+    }
+
+    ngx_free(entries);
+
+    return;
+
+failed:
+
+    ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                  "cache index \"%s\" is not saved", name);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    (void) ngx_delete_file(name);
+
+    ngx_free(entries);
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 {
@@ -2383,14 +3293,17 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     off_t                   max_size, min_free;
     u_char                 *last, *p;
     time_t                  inactive;
-    ssize_t                 size;
+    ssize_t                 size, ram;
     ngx_str_t               s, name, *value;
     ngx_int_t               loader_files, manager_files;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, index;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
+#if (NGX_THREADS)
+    ngx_thread_pool_t      *tp;
+#endif
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
     if (cache == NULL) {
@@ -2403,6 +3316,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     use_temp_path = 1;
+    index = 0;
 
     inactive = 600;
 
@@ -2416,6 +3330,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     name.len = 0;
     size = 0;
+    ram = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
     min_free = 0;
 
@@ -2489,6 +3404,49 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "thread_pool=", 12) == 0) {
+
+#if (NGX_THREADS)
+
+            s.len = value[i].len - 12;
+            s.data = value[i].data + 12;
+
+            tp = ngx_thread_pool_add(cf, &s);
+            if (tp == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            cache->path->thread_pool = tp;
+
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "\"thread_pool\" parameter requires "
+                               "threads support");
+            return NGX_CONF_ERROR;
+#endif
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2523,6 +3481,21 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "ram=", 4) == 0) {
+
+            s.len = value[i].len - 4;
+            s.data = value[i].data + 4;
+
+            ram = ngx_parse_size(&s);
+            if (ram == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
 
             s.len = value[i].len - 9;
@@ -2675,6 +3648,18 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->path->manager = ngx_http_file_cache_manager;
     cache->path->loader = ngx_http_file_cache_loader;
     cache->path->data = cache;
+
+    if (index) {
+        cache->index.len = cache->path->name.len + sizeof("/index") - 1;
+        cache->index.data = ngx_pnalloc(cf->pool, cache->index.len + 1);
+        if (cache->index.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(cache->index.data, "%V/index%Z", &cache->path->name);
+
+        cache->path->saver = ngx_http_file_cache_save_index;
+    }
     cache->path->conf_file = cf->conf_file->file.name.data;
     cache->path->line = cf->conf_file->line;
     cache->loader_files = loader_files;
@@ -2688,6 +3673,11 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (ram) {
+        /* the RAM tier and its frequency sketch share the keys zone */
+        size += ram + 4 * ngx_http_file_cache_sketch_width(ram);
+    }
+
     cache->shm_zone = ngx_shared_memory_add(cf, &name, size, cmd->post);
     if (cache->shm_zone == NULL) {
         return NGX_CONF_ERROR;
@@ -2708,6 +3698,7 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->inactive = inactive;
     cache->max_size = max_size;
     cache->min_free = min_free;
+    cache->ram = ram;
 
     caches = (ngx_array_t *) (confp + cmd->offset);
 
@@ -18,8 +18,21 @@ typedef struct {
 } ngx_http_huff_decode_code_t;
 
 
-static ngx_inline ngx_int_t ngx_http_huff_decode_bits(u_char *state,
-    u_char *ending, ngx_uint_t bits, u_char **dst);
+/*
+ * The octet table is derived from the nibble state machine below and
+ * shares its states, so a string may be split at any octet boundary.
+ * An octet carries at most two symbols, since the shortest code is 5 bits.
+ */
+
+#define NGX_HTTP_HUFF_EMIT_MASK  0x03
+#define NGX_HTTP_HUFF_ENDING     0x04
+#define NGX_HTTP_HUFF_ERROR      0x08
+
+typedef struct {
+    u_char  next;
+    u_char  flags;
+    u_char  sym[2];
+} ngx_http_huff_decode_octet_t;
 
 
 static ngx_http_huff_decode_code_t  ngx_http_huff_decode_codes[256][16] =
@@ -2639,41 +2652,128 @@ static ngx_http_huff_decode_code_t  ngx_http_huff_decode_codes[256][16] =
 };
 
 
+static ngx_http_huff_decode_octet_t  ngx_http_huff_decode_octets[256][256];
+
+/*
+ * 0 - not built, 1 - being built, 2 - ready; embedded instances
+ * may initialize modules from several threads at once
+ */
+
+static ngx_atomic_t  ngx_http_huff_decode_octets_state;
+
+
+void
+ngx_http_huff_decode_init(void)
+{
+    ngx_uint_t                     state, ch, n;
+    ngx_http_huff_decode_code_t    hi, lo;
+    ngx_http_huff_decode_octet_t  *octet;
+
+    if (ngx_http_huff_decode_octets_state == 2) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&ngx_http_huff_decode_octets_state, 0, 1)) {
+
+        while (ngx_http_huff_decode_octets_state != 2) {
+            ngx_sched_yield();
+        }
+
+        ngx_memory_barrier();
+
+        return;
+    }
+
+    for (state = 0; state < 256; state++) {
+        for (ch = 0; ch < 256; ch++) {
+            octet = &ngx_http_huff_decode_octets[state][ch];
+
+            hi = ngx_http_huff_decode_codes[state][ch >> 4];
+
+            if (hi.next == state) {
+                octet->flags = NGX_HTTP_HUFF_ERROR;
+                continue;
+            }
+
+            lo = ngx_http_huff_decode_codes[hi.next][ch & 0xf];
+
+            if (lo.next == hi.next) {
+                octet->flags = NGX_HTTP_HUFF_ERROR;
+                continue;
+            }
+
+            n = 0;
+
+            if (hi.emit) {
+                octet->sym[n++] = hi.sym;
+            }
+
+            if (lo.emit) {
+                octet->sym[n++] = lo.sym;
+            }
+
+            octet->next = lo.next;
+            octet->flags = n | (lo.ending ? NGX_HTTP_HUFF_ENDING : 0);
+        }
+    }
+
+    ngx_memory_barrier();
+
+    ngx_http_huff_decode_octets_state = 2;
+}
+
+
 ngx_int_t
 ngx_http_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
     ngx_uint_t last, ngx_log_t *log)
 {
-    u_char  *end, ch, ending;
+    u_char                        *end, *p, ch, st, ending;
+    ngx_http_huff_decode_octet_t  *octet;
 
     ch = 0;
+    st = *state;
     ending = 1;
 
+    p = *dst;
     end = src + len;
 
     while (src != end) {
         ch = *src++;
 
-        if (ngx_http_huff_decode_bits(state, &ending, ch >> 4, dst)
-            != NGX_OK)
-        {
-            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
-                           "http huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch >> 4);
+        octet = &ngx_http_huff_decode_octets[st][ch];
 
-            return NGX_ERROR;
-        }
+        switch (octet->flags & (NGX_HTTP_HUFF_EMIT_MASK|NGX_HTTP_HUFF_ERROR)) {
+
+        case 0:
+            break;
 
-        if (ngx_http_huff_decode_bits(state, &ending, ch & 0xf, dst)
-            != NGX_OK)
-        {
+        case 1:
+            *p++ = octet->sym[0];
+            break;
+
+        case 2:
+            *p++ = octet->sym[0];
+            *p++ = octet->sym[1];
+            break;
+
+        default: /* NGX_HTTP_HUFF_ERROR */
             ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
                            "http huffman decoding error at state %d: "
-                           "bad code 0x%Xd", *state, ch & 0xf);
+                           "bad code 0x%Xd", st, ch);
+
+            *dst = p;
+            *state = st;
 
             return NGX_ERROR;
         }
+
+        ending = octet->flags & NGX_HTTP_HUFF_ENDING;
+        st = octet->next;
     }
 
+    *dst = p;
+    *state = st;
+
     if (last) {
         if (!ending) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
@@ -2688,27 +2788,3 @@ ngx_http_huff_decode(u_char *state, u_char *src, size_t len, u_char **dst,
 
     return NGX_OK;
 }
-
-
-
-static ngx_inline ngx_int_t
-ngx_http_huff_decode_bits(u_char *state, u_char *ending, ngx_uint_t bits,
-    u_char **dst)
-{
-    ngx_http_huff_decode_code_t  code;
-
-    code = ngx_http_huff_decode_codes[*state][bits];
-
-    if (code.next == *state) {
-        return NGX_ERROR;
-    }
-
-    if (code.emit) {
-        *(*dst)++ = code.sym;
-    }
-
-    *ending = code.ending;
-    *state = code.next;
-
-    return NGX_OK;
-}
@@ -183,18 +183,27 @@ static ngx_http_huff_encode_code_t  ngx_http_huff_encode_table_lc[256] =
 #else /* NGX_PTR_SIZE == 4 */
 
 #define ngx_http_huff_encode_buf(dst, buf)                                    \
-    (*(uint32_t *) (dst) = htonl(buf))
+    (((uint32_t *) (dst))[0] = htonl((uint32_t) ((buf) >> 32)),               \
+     ((uint32_t *) (dst))[1] = htonl((uint32_t) (buf)))
 
 #endif
 
 
+/*
+ * Codes are accumulated in a 64-bit buffer, which is stored in one go
+ * once full.  As long as four successive codes fit in 56 bits, which is
+ * the case for runs of letters, digits, and most punctuation typically
+ * found in header values, they are combined and accumulated together.
+ */
+
 size_t
 ngx_http_huff_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower)
 {
     u_char                       *end;
     size_t                        hlen;
-    ngx_uint_t                    buf, pending, code;
-    ngx_http_huff_encode_code_t  *table, *next;
+    uint64_t                      buf, code;
+    ngx_uint_t                    pending, n;
+    ngx_http_huff_encode_code_t  *table, *c0, *c1, *c2, *c3;
 
     table = lower ? ngx_http_huff_encode_table_lc
                   : ngx_http_huff_encode_table;
@@ -205,12 +214,35 @@ ngx_http_huff_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower)
     end = src + len;
 
     while (src != end) {
-        next = &table[*src++];
 
-        code = next->code;
-        pending += next->len;
+        if (end - src >= 4) {
+            c0 = &table[src[0]];
+            c1 = &table[src[1]];
+            c2 = &table[src[2]];
+            c3 = &table[src[3]];
+
+            n = c0->len + c1->len + c2->len + c3->len;
+
+            if (n <= 56) {
+                code = c0->code;
+                code = (code << c1->len) | c1->code;
+                code = (code << c2->len) | c2->code;
+                code = (code << c3->len) | c3->code;
+
+                src += 4;
+                goto accumulate;
+            }
+        }
+
+        c0 = &table[*src++];
+
+        code = c0->code;
+        n = c0->len;
+
+    accumulate:
+
+        pending += n;
 
-        /* accumulate bits */
         if (pending < sizeof(buf) * 8) {
             buf |= code << (sizeof(buf) * 8 - pending);
             continue;
@@ -235,7 +267,7 @@ ngx_http_huff_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower)
         return hlen;
     }
 
-    buf |= (ngx_uint_t) -1 >> pending;
+    buf |= (uint64_t) -1 >> pending;
 
     pending = ngx_align(pending, 8);
 
@@ -2413,3 +2413,124 @@ invalid:
 
     return NGX_ERROR;
 }
+
+
+/*
+ * parses the RFC 9218 priority field value, a structured field dictionary:
+ * "u" is the urgency from 0 to 7, "i" marks an incremental response;
+ * invalid or unknown members are ignored, values of other members
+ * and parameters are not validated
+ */
+
+ngx_int_t
+ngx_http_parse_priority(u_char *p, u_char *end, ngx_uint_t *urgency,
+    ngx_uint_t *incremental)
+{
+    u_char      ch, *key, *value;
+    size_t      len;
+    ngx_uint_t  u, i, quoted;
+
+    u = NGX_HTTP_PRIORITY_URGENCY;
+    i = 0;
+
+    for ( ;; ) {
+
+        while (p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if (p == end) {
+            break;
+        }
+
+        key = p;
+
+        if ((*p < 'a' || *p > 'z') && *p != '*') {
+            return NGX_ERROR;
+        }
+
+        while (p < end) {
+            ch = *p;
+
+            if ((ch >= 'a' && ch <= 'z') || (ch >= '0' && ch <= '9')
+                || ch == '_' || ch == '-' || ch == '.' || ch == '*')
+            {
+                p++;
+                continue;
+            }
+
+            break;
+        }
+
+        len = p - key;
+        value = NULL;
+
+        if (p < end && *p == '=') {
+            value = ++p;
+        }
+
+        quoted = 0;
+
+        /* skip the value and parameters up to the next member */
+
+        while (p < end) {
+            ch = *p;
+
+            if (quoted) {
+                if (ch == '\\') {
+                    p++;
+
+                } else if (ch == '"') {
+                    quoted = 0;
+                }
+
+            } else if (ch == '"') {
+                quoted = 1;
+
+            } else if (ch == ',') {
+                break;
+            }
+
+            p++;
+        }
+
+        if (quoted) {
+            return NGX_ERROR;
+        }
+
+        if (len == 1 && key[0] == 'u') {
+
+            if (value && end - value > 0
+                && value[0] >= '0'
+                && value[0] <= '0' + NGX_HTTP_PRIORITY_MAX_URGENCY
+                && (value + 1 == end || value[1] == ','
+                    || value[1] == ';' || value[1] == ' '
+                    || value[1] == '\t'))
+            {
+                u = value[0] - '0';
+            }
+
+        } else if (len == 1 && key[0] == 'i') {
+
+            if (value == NULL) {
+                i = 1;
+
+            } else if (end - value >= 2 && value[0] == '?'
+                       && (value[1] == '0' || value[1] == '1'))
+            {
+                i = value[1] - '0';
+            }
+        }
+
+        if (p == end) {
+            break;
+        }
+
+        p++;
+    }
+
+    *urgency = u;
+    *incremental = i;
+
+    return NGX_OK;
+}
@@ -12,6 +12,8 @@
 
 static void ngx_http_wait_request_handler(ngx_event_t *ev);
 ngx_http_request_t *ngx_http_alloc_request(ngx_connection_t *c);
+static ngx_http_request_t *ngx_http_alloc_request_with_pool(
+    ngx_connection_t *c, ngx_pool_t *pool);
 static void ngx_http_process_request_line(ngx_event_t *rev);
 static void ngx_http_process_request_headers(ngx_event_t *rev);
 static ssize_t ngx_http_read_request_header(ngx_http_request_t *r);
@@ -138,6 +140,12 @@ ngx_http_header_t  ngx_http_headers_in[] = {
                  offsetof(ngx_http_headers_in_t, upgrade),
                  ngx_http_process_header_line },
 
+#if (NGX_HTTP_V2 || NGX_HTTP_V3)
+    { ngx_string("Priority"),
+                 offsetof(ngx_http_headers_in_t, priority),
+                 ngx_http_process_header_line },
+#endif
+
 #if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS)
     { ngx_string("Accept-Encoding"),
                  offsetof(ngx_http_headers_in_t, accept_encoding),
@@ -526,12 +534,19 @@ ngx_http_wait_request_handler(ngx_event_t *rev)
 
 ngx_http_request_t *
 ngx_http_create_request(ngx_connection_t *c)
+{
+    return ngx_http_create_request_with_pool(c, NULL);
+}
+
+
+ngx_http_request_t *
+ngx_http_create_request_with_pool(ngx_connection_t *c, ngx_pool_t *pool)
 {
     ngx_http_request_t        *r;
     ngx_http_log_ctx_t        *ctx;
     ngx_http_core_loc_conf_t  *clcf;
 
-    r = ngx_http_alloc_request(c);
+    r = ngx_http_alloc_request_with_pool(c, pool);
     if (r == NULL) {
         return NULL;
     }
@@ -559,7 +574,13 @@ ngx_http_create_request(ngx_connection_t *c)
 ngx_http_request_t *
 ngx_http_alloc_request(ngx_connection_t *c)
 {
-    ngx_pool_t                 *pool;
+    return ngx_http_alloc_request_with_pool(c, NULL);
+}
+
+
+static ngx_http_request_t *
+ngx_http_alloc_request_with_pool(ngx_connection_t *c, ngx_pool_t *pool)
+{
     ngx_time_t                 *tp;
     ngx_http_request_t         *r;
     ngx_http_connection_t      *hc;
@@ -570,9 +591,11 @@ ngx_http_alloc_request(ngx_connection_t *c)
 
     cscf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_core_module);
 
-    pool = ngx_create_pool(cscf->request_pool_size, c->log);
     if (pool == NULL) {
-        return NULL;
+        pool = ngx_create_pool(cscf->request_pool_size, c->log);
+        if (pool == NULL) {
+            return NULL;
+        }
     }
 
     r = ngx_pcalloc(pool, sizeof(ngx_http_request_t));
@@ -1054,6 +1077,7 @@ ngx_http_ssl_certificate(ngx_ssl_conn_t *ssl_conn, void *arg)
                        "ssl key: \"%s\"", key.data);
 
         if (ngx_ssl_connection_certificate(c, r->pool, &cert, &key,
+                                           sscf->certificate_cache,
                                            sscf->passwords)
             != NGX_OK)
         {
@@ -3786,6 +3810,11 @@ ngx_http_free_request(ngx_http_request_t *r, ngx_int_t rc)
     pool = r->pool;
     r->pool = NULL;
 
+    if (r->reuse_pool) {
+        /* the pool is recycled by the caller */
+        return;
+    }
+
     ngx_destroy_pool(pool);
 }
 
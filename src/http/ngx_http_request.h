@@ -22,6 +22,10 @@
 #define NGX_HTTP_DISCARD_BUFFER_SIZE       4096
 #define NGX_HTTP_LINGERING_BUFFER_SIZE     4096
 
+/* RFC 9218 */
+#define NGX_HTTP_PRIORITY_URGENCY          3
+#define NGX_HTTP_PRIORITY_MAX_URGENCY      7
+
 
 #define NGX_HTTP_VERSION_9                 9
 #define NGX_HTTP_VERSION_10                1000
@@ -208,6 +212,10 @@ typedef struct {
     ngx_table_elt_t                  *expect;
     ngx_table_elt_t                  *upgrade;
 
+#if (NGX_HTTP_V2 || NGX_HTTP_V3)
+    ngx_table_elt_t                  *priority;
+#endif
+
 #if (NGX_HTTP_GZIP || NGX_HTTP_HEADERS || NGX_AS_LIB)
     ngx_table_elt_t                  *accept_encoding;
     ngx_table_elt_t                  *via;
@@ -588,6 +596,7 @@ struct ngx_http_request_s {
     unsigned                          done:1;
     unsigned                          logged:1;
     unsigned                          terminated:1;
+    unsigned                          reuse_pool:1;
 
     unsigned                          buffered:4;
 
@@ -10,6 +10,9 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_SPLICE_SIZE  65536
+
+
 #if (NGX_HTTP_CACHE)
 static ngx_int_t ngx_http_upstream_cache(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
@@ -29,6 +32,30 @@ static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
+static ngx_int_t ngx_http_upstream_collapse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_wait_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_collapse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_process(ngx_http_request_t *r);
+static void ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_body(ngx_http_upstream_t *u,
+    ngx_chain_t *in);
+static ngx_uint_t ngx_http_upstream_collapse_drain(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_finalize(ngx_http_upstream_t *u,
+    ngx_int_t rc);
+static void ngx_http_upstream_collapse_finish(ngx_http_upstream_collapse_t *c,
+    ngx_uint_t error);
+static void ngx_http_upstream_collapse_release(
+    ngx_http_upstream_collapse_t *c);
+static void ngx_http_upstream_collapse_wake(ngx_http_upstream_collapse_t *c);
+static void ngx_http_upstream_collapse_detach(
+    ngx_http_upstream_collapse_waiter_t *w);
+static void ngx_http_upstream_collapse_unref(ngx_http_upstream_collapse_t *c);
+static void ngx_http_upstream_collapse_cleanup(void *data);
+
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
@@ -77,6 +104,21 @@ static void
 static void
     ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_uint_t do_write);
+#if (NGX_HAVE_SPLICE)
+static ngx_uint_t ngx_http_upstream_splice_test(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_http_upstream_splice_t *ngx_http_upstream_splice_pipe(
+    ngx_http_request_t *r, ngx_uint_t from_upstream);
+static void ngx_http_upstream_splice_cleanup(void *data);
+static ssize_t ngx_http_upstream_splice_recv(ngx_connection_t *c,
+    ngx_http_upstream_splice_t *sp, size_t size);
+static ssize_t ngx_http_upstream_splice_send(ngx_connection_t *c,
+    ngx_http_upstream_splice_t *sp);
+static ngx_int_t ngx_http_upstream_splice_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+static ngx_int_t ngx_http_upstream_splice_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+#endif
 #if (NGX_THREADS)
 static ngx_int_t ngx_http_upstream_thread_handler(ngx_thread_task_t *task,
     ngx_file_t *file);
@@ -631,6 +673,33 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
 #endif
 
+    if (u->conf->collapse
+#if (NGX_HTTP_CACHE)
+        && !u->conf->cache
+#endif
+       )
+    {
+        ngx_int_t  rc;
+
+        rc = ngx_http_upstream_collapse(r, u);
+
+        if (rc == NGX_BUSY) {
+            r->write_event_handler = ngx_http_upstream_init_request;
+            return;
+        }
+
+        if (rc == NGX_DONE) {
+            return;
+        }
+
+        r->write_event_handler = ngx_http_request_empty_handler;
+
+        if (rc == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
     u->store = u->conf->store;
 
     if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
@@ -990,226 +1059,990 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
             u->buffer.last = u->buffer.pos;
         }
 
-        break;
+        break;
+
+    case NGX_HTTP_CACHE_SCARCE:
+
+        u->cacheable = 0;
+
+        break;
+
+    case NGX_AGAIN:
+
+        return NGX_BUSY;
+
+    case NGX_ERROR:
+
+        return NGX_ERROR;
+
+    default:
+
+        /* cached NGX_HTTP_BAD_GATEWAY, NGX_HTTP_GATEWAY_TIME_OUT, etc. */
+
+        u->cache_status = NGX_HTTP_CACHE_HIT;
+
+        return rc;
+    }
+
+    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
+        u->cacheable = 0;
+    }
+
+    r->cached = 0;
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_get(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_http_file_cache_t **cache)
+{
+    ngx_str_t               *name, val;
+    ngx_uint_t               i;
+    ngx_http_file_cache_t  **caches;
+
+    if (u->conf->cache_zone) {
+        *cache = u->conf->cache_zone->data;
+        return NGX_OK;
+    }
+
+    if (ngx_http_complex_value(r, u->conf->cache_value, &val) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (val.len == 0
+        || (val.len == 3 && ngx_strncmp(val.data, "off", 3) == 0))
+    {
+        return NGX_DECLINED;
+    }
+
+    caches = u->caches->elts;
+
+    for (i = 0; i < u->caches->nelts; i++) {
+        name = &caches[i]->shm_zone->shm.name;
+
+        if (name->len == val.len
+            && ngx_strncmp(name->data, val.data, val.len) == 0)
+        {
+            *cache = caches[i];
+            return NGX_OK;
+        }
+    }
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                  "cache \"%V\" not found", &val);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t          rc;
+    ngx_http_cache_t  *c;
+
+    r->cached = 1;
+    c = r->cache;
+
+    if (c->header_start == c->body_start) {
+        r->http_version = NGX_HTTP_VERSION_9;
+        return ngx_http_cache_send(r);
+    }
+
+    /* TODO: cache stack */
+
+    u->buffer = *c->buf;
+    u->buffer.pos += c->header_start;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+    u->headers_in.last_modified_time = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    rc = u->process_header(r);
+
+    if (rc == NGX_OK) {
+
+        if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+            return NGX_DONE;
+        }
+
+        return ngx_http_cache_send(r);
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_AGAIN) {
+        rc = NGX_HTTP_UPSTREAM_INVALID_HEADER;
+    }
+
+    /* rc == NGX_HTTP_UPSTREAM_INVALID_HEADER */
+
+    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                  "cache file \"%s\" contains invalid header",
+                  c->file.name.data);
+
+    /* TODO: delete file */
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_request_t  *sr;
+
+    if (r == r->main) {
+        r->preserve_body = 1;
+    }
+
+    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL,
+                            NGX_HTTP_SUBREQUEST_CLONE
+                            |NGX_HTTP_SUBREQUEST_BACKGROUND)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    sr->header_only = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    off_t             offset;
+    u_char           *p, *start;
+    ngx_table_elt_t  *h;
+
+    h = r->headers_in.range;
+
+    if (h == NULL
+        || !u->cacheable
+        || u->conf->cache_max_range_offset == NGX_MAX_OFF_T_VALUE)
+    {
+        return NGX_OK;
+    }
+
+    if (u->conf->cache_max_range_offset == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (h->value.len < 7
+        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
+    {
+        return NGX_OK;
+    }
+
+    p = h->value.data + 6;
+
+    while (*p == ' ') { p++; }
+
+    if (*p == '-') {
+        return NGX_DECLINED;
+    }
+
+    start = p;
+
+    while (*p >= '0' && *p <= '9') { p++; }
+
+    offset = ngx_atoof(start, p - start);
+
+    if (offset >= u->conf->cache_max_range_offset) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_http_upstream_collapse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    uint32_t                              hash;
+    ngx_str_t                             key;
+    ngx_pool_t                           *pool;
+    ngx_pool_cleanup_t                   *cln;
+    ngx_http_upstream_collapse_t         *c;
+    ngx_http_upstream_main_conf_t        *umcf;
+    ngx_http_upstream_collapse_waiter_t  *w;
+
+    w = u->collapse_waiter;
+
+    if (w) {
+
+        /* woken up or timed out while waiting */
+
+        c = w->collapse;
+
+        if (c == NULL) {
+            return NGX_DECLINED;
+        }
+
+        if (c->header) {
+            return ngx_http_upstream_collapse_send(r, u);
+        }
+
+        if (!w->event.timedout) {
+            return NGX_BUSY;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "upstream collapse timeout");
+
+        ngx_http_upstream_collapse_detach(w);
+
+        return NGX_DECLINED;
+    }
+
+    if (r != r->main
+        || r->method != NGX_HTTP_GET
+        || r->request_body_no_buffering)
+    {
+        return NGX_DECLINED;
+    }
+
+    if (ngx_http_complex_value(r, u->conf->collapse_key, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    c = (ngx_http_upstream_collapse_t *)
+            ngx_str_rbtree_lookup(&umcf->collapse, &key, hash);
+
+    if (c == NULL
+        && (r->headers_in.range
+            || r->headers_in.if_modified_since
+            || r->headers_in.if_unmodified_since
+            || r->headers_in.if_none_match
+            || r->headers_in.if_match))
+    {
+        /* the response may depend on more than the key */
+        return NGX_DECLINED;
+    }
+
+    w = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_collapse_waiter_t));
+    if (w == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_collapse_cleanup;
+    cln->data = w;
+
+    w->request = r;
+    w->event.handler = ngx_http_upstream_collapse_wait_handler;
+    w->event.data = w;
+    w->event.log = r->connection->log;
+
+    u->collapse_waiter = w;
+
+    if (c == NULL) {
+
+        /* the first request goes to the upstream */
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        c = ngx_pcalloc(pool, sizeof(ngx_http_upstream_collapse_t));
+        if (c == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_ERROR;
+        }
+
+        c->node.str.data = ngx_pstrdup(pool, &key);
+        if (c->node.str.data == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_ERROR;
+        }
+
+        c->node.str.len = key.len;
+        c->node.node.key = hash;
+
+        c->rbtree = &umcf->collapse;
+        c->pool = pool;
+        c->count = 1;
+        c->last = &c->body;
+
+        ngx_queue_init(&c->waiters);
+
+        ngx_rbtree_insert(c->rbtree, &c->node.node);
+
+        u->collapse = c;
+
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse: \"%V\"", &key);
+
+    w->collapse = c;
+    c->count++;
+
+    ngx_queue_insert_tail(&c->waiters, &w->queue);
+
+    if (c->header) {
+        return ngx_http_upstream_collapse_send(r, u);
+    }
+
+    ngx_add_timer(&w->event, u->conf->collapse_timeout);
+
+    return NGX_BUSY;
+}
+
+
+static void
+ngx_http_upstream_collapse_wait_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                     *c;
+    ngx_http_request_t                   *r;
+    ngx_http_upstream_collapse_waiter_t  *w;
+
+    w = ev->data;
+    r = w->request;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream collapse wait: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                      rc;
+    ngx_uint_t                     i;
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h, *ho;
+    ngx_http_cleanup_t            *cln;
+    ngx_http_upstream_collapse_t  *c;
+
+    c = u->collapse_waiter->collapse;
+
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_cleanup;
+    cln->data = r;
+    u->cleanup = &cln->handler;
+
+    r->headers_out.status = c->status;
+    r->headers_out.status_line = c->status_line;
+    r->headers_out.content_type = c->content_type;
+    r->headers_out.content_type_len = c->content_type.len;
+    r->headers_out.charset = c->charset;
+    r->headers_out.content_length_n = c->content_length_n;
+    r->headers_out.last_modified_time = c->last_modified_time;
+
+    part = &c->headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        ho = ngx_list_push(&r->headers_out.headers);
+        if (ho == NULL) {
+            return NGX_ERROR;
+        }
+
+        *ho = h[i];
+
+        if (ho->key.len == sizeof("Last-Modified") - 1
+            && ngx_strcasecmp(ho->key.data, (u_char *) "Last-Modified") == 0)
+        {
+            r->headers_out.last_modified = ho;
+
+        } else if (ho->key.len == sizeof("ETag") - 1
+                   && ngx_strcasecmp(ho->key.data, (u_char *) "ETag") == 0)
+        {
+            r->headers_out.etag = ho;
+
+        } else if (ho->key.len == sizeof("Content-Encoding") - 1
+                   && ngx_strcasecmp(ho->key.data,
+                                     (u_char *) "Content-Encoding")
+                      == 0)
+        {
+            r->headers_out.content_encoding = ho;
+        }
+    }
+
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_upstream_collapse_process;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return NGX_DONE;
+    }
+
+    u->header_sent = 1;
+
+    ngx_http_upstream_collapse_process(r);
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_collapse_process(ngx_http_request_t *r)
+{
+    ngx_int_t                             rc;
+    ngx_chain_t                          *cl, *tl, *out, **ll;
+    ngx_connection_t                     *c;
+    ngx_http_upstream_t                  *u;
+    ngx_http_core_loc_conf_t             *clcf;
+    ngx_http_upstream_collapse_t         *col;
+    ngx_http_upstream_collapse_waiter_t  *w;
+
+    c = r->connection;
+    u = r->upstream;
+    w = u->collapse_waiter;
+    col = w->collapse;
+
+    c->log->action = "sending to client";
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    out = NULL;
+    ll = &out;
+
+    for (cl = w->sent ? w->sent->next : col->body; cl; cl = cl->next) {
+
+        tl = ngx_chain_get_free_buf(r->pool, &w->free);
+        if (tl == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        tl->buf->pos = cl->buf->pos;
+        tl->buf->last = cl->buf->last;
+        tl->buf->memory = 1;
+        tl->buf->flush = (cl->next == NULL);
+        tl->buf->tag = (ngx_buf_tag_t) &ngx_http_upstream_module;
+
+        *ll = tl;
+        ll = &tl->next;
+
+        w->sent = cl;
+    }
+
+    if (out || w->busy || c->buffered) {
+
+        rc = ngx_http_output_filter(r, out);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        ngx_chain_update_chains(r->pool, &w->free, &w->busy, &out,
+                                (ngx_buf_tag_t) &ngx_http_upstream_module);
+    }
+
+    if (col->done) {
+        ngx_http_upstream_finalize_request(r, u,
+                                   col->error ? NGX_HTTP_BAD_GATEWAY : 0);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (c->write->active && !c->write->ready) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_collapse_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    u_char                        *p;
+    ngx_uint_t                     i;
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *h, *ho, *cc;
+    ngx_http_upstream_collapse_t  *c;
+
+    c = u->collapse;
+
+    if (u->upgrade
+        || u->headers_in.set_cookie
+        || u->headers_in.vary
+        || (u->headers_in.status_n >= NGX_HTTP_INTERNAL_SERVER_ERROR
+            && !u->conf->collapse_errors)
+        || (u->headers_in.content_length_n > 0
+            && u->headers_in.content_length_n
+               > (off_t) u->conf->collapse_max_size))
+    {
+        goto unshared;
+    }
+
+    for (cc = u->headers_in.cache_control; cc; cc = cc->next) {
+        p = cc->value.data;
+
+        if (ngx_strlcasestrn(p, p + cc->value.len,
+                             (u_char *) "private", 7 - 1)
+            || ngx_strlcasestrn(p, p + cc->value.len,
+                                (u_char *) "no-store", 8 - 1))
+        {
+            goto unshared;
+        }
+    }
+
+    if (ngx_list_init(&c->headers, c->pool, 8, sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        goto unshared;
+    }
+
+    part = &r->headers_out.headers.part;
+    h = part->elts;
+
+    for (i = 0; /* void */; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            h = part->elts;
+            i = 0;
+        }
+
+        if (h[i].hash == 0) {
+            continue;
+        }
+
+        ho = ngx_list_push(&c->headers);
+        if (ho == NULL) {
+            goto unshared;
+        }
+
+        *ho = h[i];
+        ho->next = NULL;
+
+        ho->key.data = ngx_pstrdup(c->pool, &h[i].key);
+        ho->value.data = ngx_pstrdup(c->pool, &h[i].value);
+        ho->lowcase_key = ngx_pnalloc(c->pool, h[i].key.len);
+
+        if (ho->key.data == NULL
+            || ho->value.data == NULL
+            || ho->lowcase_key == NULL)
+        {
+            goto unshared;
+        }
+
+        ngx_strlow(ho->lowcase_key, h[i].key.data, h[i].key.len);
+    }
+
+    c->status_line.data = ngx_pstrdup(c->pool, &r->headers_out.status_line);
+    c->content_type.data = ngx_pstrdup(c->pool,
+                                       &r->headers_out.content_type);
+    c->charset.data = ngx_pstrdup(c->pool, &r->headers_out.charset);
+
+    if ((r->headers_out.status_line.len && c->status_line.data == NULL)
+        || (r->headers_out.content_type.len && c->content_type.data == NULL)
+        || (r->headers_out.charset.len && c->charset.data == NULL))
+    {
+        goto unshared;
+    }
+
+    c->status = r->headers_out.status;
+    c->status_line.len = r->headers_out.status_line.len;
+    c->content_type.len = r->headers_out.content_type.len;
+    c->charset.len = r->headers_out.charset.len;
+    c->content_length_n = r->headers_out.content_length_n;
+    c->last_modified_time = r->headers_out.last_modified_time;
+
+    c->header = 1;
+
+    ngx_http_upstream_collapse_wake(c);
+
+    return;
+
+unshared:
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse: response not shared");
+
+    u->collapse = NULL;
+
+    ngx_http_upstream_collapse_release(c);
+}
+
+
+static void
+ngx_http_upstream_collapse_body(ngx_http_upstream_t *u, ngx_chain_t *in)
+{
+    size_t                         size;
+    ngx_buf_t                     *b;
+    ngx_chain_t                   *cl;
+    ngx_http_upstream_collapse_t  *c;
+
+    c = u->collapse;
+    if (c == NULL || !c->header) {
+        return;
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+
+        if (ngx_buf_special(in->buf)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(in->buf)) {
+            goto failed;
+        }
+
+        size = in->buf->last - in->buf->pos;
+
+        if (c->size + size > u->conf->collapse_max_size) {
+            goto failed;
+        }
+
+        b = ngx_create_temp_buf(c->pool, size);
+        if (b == NULL) {
+            goto failed;
+        }
+
+        b->last = ngx_cpymem(b->pos, in->buf->pos, size);
+
+        cl = ngx_alloc_chain_link(c->pool);
+        if (cl == NULL) {
+            goto failed;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        *c->last = cl;
+        c->last = &cl->next;
+        c->size += size;
+    }
+
+    ngx_http_upstream_collapse_wake(c);
+    return;
+
+failed:
+    /* waiters which already sent the header cannot be served */
+
+    u->collapse = NULL;
+
+    ngx_http_upstream_collapse_finish(c, 1);
+    ngx_http_upstream_collapse_unref(c);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_collapse_drain(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_chain_t                   *cl;
+    ngx_event_t                   *wev;
+    ngx_http_upstream_collapse_t  *c;
+
+    /*
+     * if the client of the request which reads the upstream response
+     * is gone, the response is still read for the collapsed requests
+     * which are sending it, and is no longer sent to the client
+     */
+
+    c = u->collapse;
+
+    if (c == NULL || !c->header || c->count == 1 || u->peer.connection == NULL)
+    {
+        return 0;
+    }
+
+    if (u->collapse_drain) {
+        return 1;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse drain");
+
+    u->collapse_drain = 1;
+    r->connection->error = 1;
+
+    /* the buffers still in the output chain are not going to be sent */
+
+    for (cl = u->busy_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->last;
+    }
+
+    if (u->buffering) {
+
+        for (cl = u->pipe->busy; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+        }
+
+        /* let the pipe pass the data to ngx_http_upstream_output_filter() */
+
+        wev = r->connection->write;
+
+        wev->ready = 1;
+        wev->delayed = 0;
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+    }
+
+    return 1;
+}
 
-    case NGX_HTTP_CACHE_SCARCE:
 
-        u->cacheable = 0;
+static void
+ngx_http_upstream_collapse_finalize(ngx_http_upstream_t *u, ngx_int_t rc)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_collapse_t         *c;
+    ngx_http_upstream_collapse_waiter_t  *w;
 
-        break;
+    w = u->collapse_waiter;
 
-    case NGX_AGAIN:
+    if (w && w->collapse) {
 
-        return NGX_BUSY;
+        if (w->sent) {
+            /*
+             * the record buffers may still be in the output chain,
+             * the reference is released by the request pool cleanup
+             */
 
-    case NGX_ERROR:
+            ngx_queue_remove(&w->queue);
+            ngx_queue_init(&w->queue);
 
-        return NGX_ERROR;
+        } else {
+            ngx_http_upstream_collapse_detach(w);
+        }
+    }
 
-    default:
+    c = u->collapse;
 
-        /* cached NGX_HTTP_BAD_GATEWAY, NGX_HTTP_GATEWAY_TIME_OUT, etc. */
+    if (c == NULL) {
+        return;
+    }
 
-        u->cache_status = NGX_HTTP_CACHE_HIT;
+    u->collapse = NULL;
 
-        return rc;
+    if (c->header) {
+        ngx_http_upstream_collapse_finish(c, rc != NGX_OK);
+        ngx_http_upstream_collapse_unref(c);
+        return;
     }
 
-    if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
-        u->cacheable = 0;
+    if (ngx_queue_empty(&c->waiters)) {
+        ngx_http_upstream_collapse_unref(c);
+        return;
     }
 
-    r->cached = 0;
+    /* the next waiter takes over the request to the upstream */
 
-    return NGX_DECLINED;
-}
+    q = ngx_queue_head(&c->waiters);
+    w = ngx_queue_data(q, ngx_http_upstream_collapse_waiter_t, queue);
 
+    ngx_queue_remove(q);
 
-static ngx_int_t
-ngx_http_upstream_cache_get(ngx_http_request_t *r, ngx_http_upstream_t *u,
-    ngx_http_file_cache_t **cache)
-{
-    ngx_str_t               *name, val;
-    ngx_uint_t               i;
-    ngx_http_file_cache_t  **caches;
+    w->collapse = NULL;
+    w->request->upstream->collapse = c;
 
-    if (u->conf->cache_zone) {
-        *cache = u->conf->cache_zone->data;
-        return NGX_OK;
-    }
+    c->count--;
 
-    if (ngx_http_complex_value(r, u->conf->cache_value, &val) != NGX_OK) {
-        return NGX_ERROR;
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
     }
 
-    if (val.len == 0
-        || (val.len == 3 && ngx_strncmp(val.data, "off", 3) == 0))
-    {
-        return NGX_DECLINED;
+    if (!w->event.posted) {
+        ngx_post_event(&w->event, &ngx_posted_events);
     }
+}
 
-    caches = u->caches->elts;
-
-    for (i = 0; i < u->caches->nelts; i++) {
-        name = &caches[i]->shm_zone->shm.name;
 
-        if (name->len == val.len
-            && ngx_strncmp(name->data, val.data, val.len) == 0)
-        {
-            *cache = caches[i];
-            return NGX_OK;
-        }
+static void
+ngx_http_upstream_collapse_finish(ngx_http_upstream_collapse_t *c,
+    ngx_uint_t error)
+{
+    if (!c->done) {
+        ngx_rbtree_delete(c->rbtree, &c->node.node);
     }
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "cache \"%V\" not found", &val);
+    c->done = 1;
+    c->error = error;
 
-    return NGX_ERROR;
+    ngx_http_upstream_collapse_wake(c);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_cache_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_collapse_release(ngx_http_upstream_collapse_t *c)
 {
-    ngx_int_t          rc;
-    ngx_http_cache_t  *c;
-
-    r->cached = 1;
-    c = r->cache;
+    ngx_queue_t                          *q;
+    ngx_http_upstream_collapse_waiter_t  *w;
 
-    if (c->header_start == c->body_start) {
-        r->http_version = NGX_HTTP_VERSION_9;
-        return ngx_http_cache_send(r);
-    }
+    /* the waiters go to the upstream on their own */
 
-    /* TODO: cache stack */
+    while (!ngx_queue_empty(&c->waiters)) {
+        q = ngx_queue_head(&c->waiters);
+        w = ngx_queue_data(q, ngx_http_upstream_collapse_waiter_t, queue);
 
-    u->buffer = *c->buf;
-    u->buffer.pos += c->header_start;
+        ngx_http_upstream_collapse_detach(w);
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
-    u->headers_in.content_length_n = -1;
-    u->headers_in.last_modified_time = -1;
+        if (w->event.timer_set) {
+            ngx_del_timer(&w->event);
+        }
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+        if (!w->event.posted) {
+            ngx_post_event(&w->event, &ngx_posted_events);
+        }
     }
 
-    if (ngx_list_init(&u->headers_in.trailers, r->pool, 2,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
-    }
+    ngx_http_upstream_collapse_finish(c, 1);
+    ngx_http_upstream_collapse_unref(c);
+}
 
-    rc = u->process_header(r);
 
-    if (rc == NGX_OK) {
+static void
+ngx_http_upstream_collapse_wake(ngx_http_upstream_collapse_t *c)
+{
+    ngx_queue_t                          *q;
+    ngx_http_upstream_collapse_waiter_t  *w;
 
-        if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
-            return NGX_DONE;
+    for (q = ngx_queue_head(&c->waiters);
+         q != ngx_queue_sentinel(&c->waiters);
+         q = ngx_queue_next(q))
+    {
+        w = ngx_queue_data(q, ngx_http_upstream_collapse_waiter_t, queue);
+        if (w->event.timer_set) {
+            ngx_del_timer(&w->event);
         }
 
-        return ngx_http_cache_send(r);
-    }
-
-    if (rc == NGX_ERROR) {
-        return NGX_ERROR;
+        if (!w->event.posted) {
+            ngx_post_event(&w->event, &ngx_posted_events);
+        }
     }
+}
 
-    if (rc == NGX_AGAIN) {
-        rc = NGX_HTTP_UPSTREAM_INVALID_HEADER;
-    }
 
-    /* rc == NGX_HTTP_UPSTREAM_INVALID_HEADER */
+static void
+ngx_http_upstream_collapse_detach(ngx_http_upstream_collapse_waiter_t *w)
+{
+    ngx_http_upstream_collapse_t  *c;
 
-    ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
-                  "cache file \"%s\" contains invalid header",
-                  c->file.name.data);
+    c = w->collapse;
 
-    /* TODO: delete file */
+    ngx_queue_remove(&w->queue);
+    w->collapse = NULL;
 
-    return rc;
+    ngx_http_upstream_collapse_unref(c);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_cache_background_update(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_collapse_unref(ngx_http_upstream_collapse_t *c)
 {
-    ngx_http_request_t  *sr;
-
-    if (r == r->main) {
-        r->preserve_body = 1;
+    if (--c->count) {
+        return;
     }
 
-    if (ngx_http_subrequest(r, &r->uri, &r->args, &sr, NULL,
-                            NGX_HTTP_SUBREQUEST_CLONE
-                            |NGX_HTTP_SUBREQUEST_BACKGROUND)
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (!c->done) {
+        ngx_rbtree_delete(c->rbtree, &c->node.node);
     }
 
-    sr->header_only = 1;
-
-    return NGX_OK;
+    ngx_destroy_pool(c->pool);
 }
 
 
-static ngx_int_t
-ngx_http_upstream_cache_check_range(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+static void
+ngx_http_upstream_collapse_cleanup(void *data)
 {
-    off_t             offset;
-    u_char           *p, *start;
-    ngx_table_elt_t  *h;
-
-    h = r->headers_in.range;
+    ngx_http_upstream_collapse_waiter_t  *w = data;
 
-    if (h == NULL
-        || !u->cacheable
-        || u->conf->cache_max_range_offset == NGX_MAX_OFF_T_VALUE)
-    {
-        return NGX_OK;
-    }
+    ngx_http_upstream_t  *u;
 
-    if (u->conf->cache_max_range_offset == 0) {
-        return NGX_DECLINED;
+    if (w->event.timer_set) {
+        ngx_del_timer(&w->event);
     }
 
-    if (h->value.len < 7
-        || ngx_strncasecmp(h->value.data, (u_char *) "bytes=", 6) != 0)
-    {
-        return NGX_OK;
+    if (w->event.posted) {
+        ngx_delete_posted_event(&w->event);
     }
 
-    p = h->value.data + 6;
-
-    while (*p == ' ') { p++; }
-
-    if (*p == '-') {
-        return NGX_DECLINED;
+    if (w->collapse) {
+        ngx_http_upstream_collapse_detach(w);
     }
 
-    start = p;
-
-    while (*p >= '0' && *p <= '9') { p++; }
-
-    offset = ngx_atoof(start, p - start);
+    u = w->request->upstream;
 
-    if (offset >= u->conf->cache_max_range_offset) {
-        return NGX_DECLINED;
+    if (u && u->collapse_waiter == w) {
+        ngx_http_upstream_collapse_finalize(u, NGX_ERROR);
     }
-
-    return NGX_OK;
 }
 
-#endif
-
 
 static void
 ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
@@ -1369,7 +2202,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             }
         }
 
-        if (!u->cacheable) {
+        if (!u->cacheable && !ngx_http_upstream_collapse_drain(r, u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1386,7 +2219,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
 #if (NGX_HTTP_V3)
 
     if (c->quic) {
-        if (c->write->error) {
+        if (c->write->error && !ngx_http_upstream_collapse_drain(r, u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1411,7 +2244,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             ev->error = 1;
         }
 
-        if (!u->cacheable && u->peer.connection) {
+        if (!u->cacheable && u->peer.connection
+            && !ngx_http_upstream_collapse_drain(r, u))
+        {
             ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
                           "kevent() reported that client prematurely closed "
                           "connection, so upstream connection is closed too");
@@ -1464,7 +2299,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             ev->error = 1;
         }
 
-        if (!u->cacheable && u->peer.connection) {
+        if (!u->cacheable && u->peer.connection
+            && !ngx_http_upstream_collapse_drain(r, u))
+        {
             ngx_log_error(NGX_LOG_INFO, ev->log, err,
                         "epoll_wait() reported that client prematurely closed "
                         "connection, so upstream connection is closed too");
@@ -1527,7 +2364,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ev->eof = 1;
     c->error = 1;
 
-    if (!u->cacheable && u->peer.connection) {
+    if (!u->cacheable && u->peer.connection
+        && !ngx_http_upstream_collapse_drain(r, u))
+    {
         ngx_log_error(NGX_LOG_INFO, ev->log, err,
                       "client prematurely closed connection, "
                       "so upstream connection is closed too");
@@ -2018,7 +2857,7 @@ ngx_http_upstream_ssl_certificate(ngx_http_request_t *r,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http upstream ssl key: \"%s\"", key.data);
 
-    if (ngx_ssl_connection_certificate(c, r->pool, &cert, &key,
+    if (ngx_ssl_connection_certificate(c, r->pool, &cert, &key, NULL,
                                        u->conf->ssl_passwords)
         != NGX_OK)
     {
@@ -2138,6 +2977,26 @@ ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
         return;
     }
 
+    if (!u->request_sent && u->peer.notify) {
+
+        /* the balancer may replace the connection, e.g., with a stream */
+
+        u->peer.notify(&u->peer, u->peer.data,
+                       NGX_HTTP_UPSTREAM_NOTIFY_CONNECT);
+
+        if (u->peer.connection == NULL) {
+            ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+            return;
+        }
+
+        if (u->peer.connection != c) {
+            c = u->peer.connection;
+
+            u->writer.connection = c;
+            u->output.sendfile = c->sendfile;
+        }
+    }
+
     c->log->action = "sending request to upstream";
 
     rc = ngx_http_upstream_send_request_body(r, u, do_write);
@@ -3061,6 +3920,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
 
+    if (u->collapse) {
+        ngx_http_upstream_collapse_header(r, u);
+    }
+
     rc = ngx_http_send_header(r);
 
     if (rc == NGX_ERROR || rc > NGX_OK || r->post_action) {
@@ -3139,6 +4002,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             return;
         }
 
+#if (NGX_HAVE_SPLICE)
+        u->splice = ngx_http_upstream_splice_test(r, u);
+#endif
+
         if (clcf->tcp_nodelay && ngx_tcp_nodelay(c) != NGX_OK) {
             ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
             return;
@@ -3311,6 +4178,11 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     }
 
     p->max_temp_file_size = u->conf->max_temp_file_size;
+
+    if (u->collapse) {
+        /* collapsed responses are kept in memory */
+        p->max_temp_file_size = 0;
+    }
     p->temp_file_write_size = u->conf->temp_file_write_size;
 
 #if (NGX_THREADS)
@@ -3416,6 +4288,10 @@ ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
     r->keepalive = 0;
     c->log->action = "proxying upgraded connection";
 
+#if (NGX_HAVE_SPLICE)
+    u->splice = ngx_http_upstream_splice_test(r, u);
+#endif
+
     u->read_event_handler = ngx_http_upstream_upgraded_read_upstream;
     u->write_event_handler = ngx_http_upstream_upgraded_write_upstream;
     r->read_event_handler = ngx_http_upstream_upgraded_read_downstream;
@@ -3488,6 +4364,9 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
     size_t                     size;
     ssize_t                    n;
     ngx_buf_t                 *b;
+#if (NGX_HAVE_SPLICE)
+    ngx_int_t                  rc;
+#endif
     ngx_uint_t                 flags;
     ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
     ngx_http_upstream_t       *u;
@@ -3548,6 +4427,26 @@ ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
 
     for ( ;; ) {
 
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice && b->pos == b->last) {
+
+            rc = ngx_http_upstream_splice_upgraded(r, from_upstream, do_write);
+
+            if (rc == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            if (rc == NGX_OK) {
+                break;
+            }
+
+            /* NGX_DECLINED: the data is read with c->recv() */
+        }
+
+#endif
+
         if (do_write) {
 
             size = b->last - b->pos;
@@ -3690,11 +4589,15 @@ ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r)
 
     c->log->action = "sending to client";
 
-    if (wev->timedout) {
+    if (wev->timedout && !u->collapse_drain) {
         c->timedout = 1;
         ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
-        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
-        return;
+
+        if (!ngx_http_upstream_collapse_drain(r, u)) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_REQUEST_TIME_OUT);
+            return;
+        }
     }
 
     ngx_http_upstream_process_non_buffered_request(r, 1);
@@ -3733,6 +4636,7 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
     ngx_buf_t                 *b;
     ngx_int_t                  rc;
     ngx_uint_t                 flags;
+    ngx_chain_t               *cl;
     ngx_connection_t          *downstream, *upstream;
     ngx_http_upstream_t       *u;
     ngx_http_core_loc_conf_t  *clcf;
@@ -3750,13 +4654,35 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
         if (do_write) {
 
             if (u->out_bufs || u->busy_bufs || downstream->buffered) {
-                rc = ngx_http_output_filter(r, u->out_bufs);
+                if (u->collapse) {
+                    ngx_http_upstream_collapse_body(u, u->out_bufs);
+                }
+
+                if (u->collapse_drain) {
+                    rc = ngx_http_upstream_collapse_drain(r, u)
+                         ? NGX_OK : NGX_ERROR;
+
+                } else {
+                    rc = ngx_http_output_filter(r, u->out_bufs);
+
+                    if (rc == NGX_ERROR
+                        && ngx_http_upstream_collapse_drain(r, u))
+                    {
+                        rc = NGX_OK;
+                    }
+                }
 
                 if (rc == NGX_ERROR) {
                     ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
                     return;
                 }
 
+                if (u->collapse_drain) {
+                    for (cl = u->out_bufs; cl; cl = cl->next) {
+                        cl->buf->pos = cl->buf->last;
+                    }
+                }
+
                 ngx_chain_update_chains(r->pool, &u->free_bufs, &u->busy_bufs,
                                         &u->out_bufs, u->output.tag);
             }
@@ -3790,6 +4716,38 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
             }
         }
 
+#if (NGX_HAVE_SPLICE)
+
+        if (u->splice
+            && u->out_bufs == NULL
+            && u->busy_bufs == NULL
+            && !downstream->buffered
+            && r->out == NULL)
+        {
+            rc = ngx_http_upstream_splice_body(r, u);
+
+            if (rc == NGX_ERROR) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+            if (rc == NGX_AGAIN) {
+                break;
+            }
+
+            if (rc == NGX_OK) {
+                do_write = 1;
+                continue;
+            }
+
+            /* NGX_DECLINED: the data is read with upstream->recv() */
+
+            b->pos = b->start;
+            b->last = b->start;
+        }
+
+#endif
+
         size = b->end - b->last;
 
         if (size && upstream->read->ready) {
@@ -3820,7 +4778,7 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
-    if (downstream->data == r) {
+    if (downstream->data == r && !u->collapse_drain) {
         if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
             != NGX_OK)
         {
@@ -3829,7 +4787,9 @@ ngx_http_upstream_process_non_buffered_request(ngx_http_request_t *r,
         }
     }
 
-    if (downstream->write->active && !downstream->write->ready) {
+    if (downstream->write->active && !downstream->write->ready
+        && !u->collapse_drain)
+    {
         ngx_add_timer(downstream->write, clcf->send_timeout);
 
     } else if (downstream->write->timer_set) {
@@ -3925,6 +4885,412 @@ ngx_http_upstream_non_buffered_filter(void *data, ssize_t bytes)
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_uint_t
+ngx_http_upstream_splice_test(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+#if (NGX_SSL)
+    ngx_connection_t  *c, *pc;
+#endif
+
+    /* rate limiting is done in the write filter, which splice() bypasses */
+
+    if (!u->conf->splice
+        || r != r->main
+        || r->http_version >= NGX_HTTP_VERSION_20
+        || r->limit_rate
+        || r->limit_rate_after)
+    {
+        return 0;
+    }
+
+#if (NGX_SSL)
+
+    /*
+     * TLS connections can be spliced only if the kernel does the crypto:
+     * kTLS receive on the connection read from, and kTLS send
+     * (c->ssl->sendfile) on the connection written to
+     */
+
+    c = r->connection;
+    pc = u->peer.connection;
+
+    if (u->upgrade) {
+        if ((c->ssl && !(c->ssl->sendfile && c->ssl->ktls_recv))
+            || (pc->ssl && !(pc->ssl->sendfile && pc->ssl->ktls_recv)))
+        {
+            return 0;
+        }
+
+    } else if ((c->ssl && !c->ssl->sendfile)
+               || (pc->ssl && !pc->ssl->ktls_recv))
+    {
+        return 0;
+    }
+
+#endif
+
+    if (u->upgrade) {
+        return 1;
+    }
+
+    /*
+     * the body bypasses output filters, so it is only spliced if
+     * no filter is going to change it: the response keeps its length
+     * and is neither chunked, nor ranged, nor buffered in memory
+     */
+
+    if (!u->plain_body
+        || u->collapse
+        || r->header_only
+        || r->chunked
+        || r->allow_ranges
+        || r->filter_need_in_memory
+        || r->filter_need_temporary
+        || r->headers_out.content_length_n < 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+static ngx_http_upstream_splice_t *
+ngx_http_upstream_splice_pipe(ngx_http_request_t *r, ngx_uint_t from_upstream)
+{
+    int                          fd[2];
+    ngx_pool_cleanup_t          *cln;
+    ngx_http_upstream_t         *u;
+    ngx_http_upstream_splice_t  *sp;
+
+    u = r->upstream;
+
+    if (u->splice_pipe[from_upstream]) {
+        return u->splice_pipe[from_upstream];
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_http_upstream_splice_t));
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    if (pipe(fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      "pipe() failed");
+        return NULL;
+    }
+
+    sp = cln->data;
+
+    sp->fd[0] = fd[0];
+    sp->fd[1] = fd[1];
+    sp->size = 0;
+
+    cln->handler = ngx_http_upstream_splice_cleanup;
+
+    if (ngx_nonblocking(fd[0]) == -1 || ngx_nonblocking(fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_socket_errno,
+                      ngx_nonblocking_n " pipe failed");
+        return NULL;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream splice pipe: %d:%d, fu:%ui",
+                   fd[0], fd[1], from_upstream);
+
+    u->splice_pipe[from_upstream] = sp;
+
+    return sp;
+}
+
+
+static void
+ngx_http_upstream_splice_cleanup(void *data)
+{
+    ngx_http_upstream_splice_t  *sp = data;
+
+    if (close(sp->fd[0]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+
+    if (close(sp->fd[1]) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "close() pipe failed");
+    }
+}
+
+
+static ssize_t
+ngx_http_upstream_splice_recv(ngx_connection_t *c,
+    ngx_http_upstream_splice_t *sp, size_t size)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *rev;
+
+    /*
+     * the pipe is only filled when empty, so EAGAIN always means
+     * that there is nothing to read from the socket
+     */
+
+    rev = c->read;
+
+#if (NGX_SSL)
+
+    /* data already read by OpenSSL has to be returned by SSL_read() */
+
+    if (c->ssl && SSL_has_pending(c->ssl->connection)) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    for ( ;; ) {
+        n = splice(c->fd, NULL, sp->fd[1], NULL, size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "splice recv: fd:%d %z of %uz", c->fd, n, size);
+
+        if (n > 0) {
+            sp->size = n;
+            return n;
+        }
+
+        if (n == 0) {
+            rev->ready = 0;
+            rev->eof = 1;
+            return 0;
+        }
+
+        err = ngx_errno;
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, err,
+                           "splice() not ready");
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            rev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+#if (NGX_SSL)
+
+        if (c->ssl && (err == NGX_EINVAL || err == NGX_EIO)) {
+
+            /* a non-data TLS record, to be processed by SSL_read() */
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, err,
+                           "splice() declined");
+            return NGX_DECLINED;
+        }
+
+#endif
+
+        rev->error = 1;
+        ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+}
+
+
+static ssize_t
+ngx_http_upstream_splice_send(ngx_connection_t *c,
+    ngx_http_upstream_splice_t *sp)
+{
+    ssize_t       n;
+    ngx_err_t     err;
+    ngx_event_t  *wev;
+
+    wev = c->write;
+
+    for ( ;; ) {
+        n = splice(sp->fd[0], NULL, c->fd, NULL, sp->size,
+                   SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "splice send: fd:%d %z of %uz", c->fd, n, sp->size);
+
+        if (n > 0) {
+            sp->size -= n;
+            c->sent += n;
+
+            if (sp->size) {
+                wev->ready = 0;
+            }
+
+            return n;
+        }
+
+        err = ngx_errno;
+
+        if (n == 0) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, err,
+                          "splice() returned zero");
+            wev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        if (err == NGX_EAGAIN || err == NGX_EINTR) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, err,
+                           "splice() not ready");
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            wev->ready = 0;
+            return NGX_AGAIN;
+        }
+
+        wev->error = 1;
+        ngx_connection_error(c, err, "splice() failed");
+
+        return NGX_ERROR;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    ssize_t                      n;
+    ngx_connection_t            *src, *dst;
+    ngx_http_upstream_t         *u;
+    ngx_http_upstream_splice_t  *sp;
+
+    u = r->upstream;
+
+    if (from_upstream) {
+        src = u->peer.connection;
+        dst = r->connection;
+
+    } else {
+        src = r->connection;
+        dst = u->peer.connection;
+    }
+
+    sp = ngx_http_upstream_splice_pipe(r, from_upstream);
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+
+        if (do_write && sp->size && dst->write->ready) {
+            if (ngx_http_upstream_splice_send(dst, sp) == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (sp->size || !src->read->ready) {
+            return NGX_OK;
+        }
+
+        n = ngx_http_upstream_splice_recv(src, sp,
+                                          NGX_HTTP_UPSTREAM_SPLICE_SIZE);
+
+        if (n == NGX_AGAIN || n == 0) {
+            return NGX_OK;
+        }
+
+        if (n == NGX_DECLINED) {
+            return NGX_DECLINED;
+        }
+
+        if (n == NGX_ERROR) {
+            src->read->eof = 1;
+            return NGX_OK;
+        }
+
+        if (from_upstream) {
+            u->state->bytes_received += n;
+        }
+
+        do_write = 1;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_splice_body(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t                       size;
+    ssize_t                      n;
+    ngx_connection_t            *downstream, *upstream;
+    ngx_http_upstream_splice_t  *sp;
+
+    /*
+     * u->length accounts for the bytes sent to the client, so
+     * the response is finalized only once the pipe is drained
+     */
+
+    downstream = r->connection;
+    upstream = u->peer.connection;
+
+    sp = ngx_http_upstream_splice_pipe(r, 1);
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (sp->size && downstream->write->ready) {
+
+        n = ngx_http_upstream_splice_send(downstream, sp);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n > 0) {
+            if (u->length != -1) {
+                u->length -= n;
+
+                if (u->length == 0) {
+                    u->keepalive = !u->headers_in.connection_close;
+                }
+            }
+
+            return NGX_OK;
+        }
+    }
+
+    if (sp->size || u->length == 0 || !upstream->read->ready) {
+        return NGX_AGAIN;
+    }
+
+    size = NGX_HTTP_UPSTREAM_SPLICE_SIZE;
+
+    if (u->length != -1 && (off_t) size > u->length) {
+        size = (size_t) u->length;
+    }
+
+    n = ngx_http_upstream_splice_recv(upstream, sp, size);
+
+    if (n == NGX_AGAIN || n == NGX_DECLINED) {
+        return n;
+    }
+
+    if (n > 0) {
+        u->state->bytes_received += n;
+        u->state->response_length += n;
+    }
+
+    /* data, eof, or error: let the caller check the upstream state */
+
+    return NGX_OK;
+}
+
+#endif
+
+
 #if (NGX_THREADS)
 
 static ngx_int_t
@@ -4060,16 +5426,38 @@ ngx_http_upstream_thread_event_handler(ngx_event_t *ev)
 static ngx_int_t
 ngx_http_upstream_output_filter(void *data, ngx_chain_t *chain)
 {
-    ngx_int_t            rc;
-    ngx_event_pipe_t    *p;
-    ngx_http_request_t  *r;
+    ngx_int_t             rc;
+    ngx_chain_t          *cl;
+    ngx_event_pipe_t     *p;
+    ngx_http_request_t   *r;
+    ngx_http_upstream_t  *u;
 
     r = data;
-    p = r->upstream->pipe;
+    u = r->upstream;
+    p = u->pipe;
+
+    if (u->collapse) {
+        ngx_http_upstream_collapse_body(u, chain);
+    }
 
-    rc = ngx_http_output_filter(r, chain);
+    if (u->collapse_drain) {
+        rc = ngx_http_upstream_collapse_drain(r, u) ? NGX_OK : NGX_ERROR;
 
-    p->aio = r->aio;
+    } else {
+        rc = ngx_http_output_filter(r, chain);
+
+        p->aio = r->aio;
+
+        if (rc == NGX_ERROR && ngx_http_upstream_collapse_drain(r, u)) {
+            rc = NGX_OK;
+        }
+    }
+
+    if (u->collapse_drain && rc == NGX_OK) {
+        for (cl = chain; cl; cl = cl->next) {
+            cl->buf->pos = cl->buf->last;
+        }
+    }
 
     return rc;
 }
@@ -4097,12 +5485,21 @@ ngx_http_upstream_process_downstream(ngx_http_request_t *r)
     p->aio = r->aio;
 #endif
 
-    if (wev->timedout) {
+    if (wev->timedout && !u->collapse_drain) {
 
-        p->downstream_error = 1;
         c->timedout = 1;
         ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
 
+        if (ngx_http_upstream_collapse_drain(r, u)) {
+            if (ngx_event_pipe(p, 1) == NGX_ABORT) {
+                ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+                return;
+            }
+
+        } else {
+            p->downstream_error = 1;
+        }
+
     } else {
 
         if (wev->delayed) {
@@ -4561,6 +5958,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     *u->cleanup = NULL;
     u->cleanup = NULL;
 
+    if (u->collapse_waiter) {
+        ngx_http_upstream_collapse_finalize(u, rc);
+    }
+
     if (u->resolved && u->resolved->ctx) {
         ngx_resolve_name_done(u->resolved->ctx);
         u->resolved->ctx = NULL;
@@ -4689,6 +6090,7 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
     }
 
     if (r->header_only
+        || u->collapse_drain
         || (u->pipe && u->pipe->downstream_error))
     {
         ngx_http_finalize_request(r, rc);
@@ -6551,6 +7953,9 @@ ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
         if (flags & NGX_HTTP_UPSTREAM_CREATE) {
             uscfp[i]->flags = flags;
             uscfp[i]->port = 0;
+
+        } else if (!(flags & NGX_HTTP_UPSTREAM_HTTP2)) {
+            uscfp[i]->non_http2 = 1;
         }
 
         return uscfp[i];
@@ -6567,6 +7972,8 @@ ngx_http_upstream_add(ngx_conf_t *cf, ngx_url_t *u, ngx_uint_t flags)
     uscf->line = cf->conf_file->line;
     uscf->port = u->port;
     uscf->no_port = u->no_port;
+    uscf->non_http2 = !(flags & (NGX_HTTP_UPSTREAM_CREATE
+                                 |NGX_HTTP_UPSTREAM_HTTP2));
 #if (NGX_HTTP_UPSTREAM_ZONE)
     uscf->resolver_timeout = NGX_CONF_UNSET_MSEC;
 #endif
@@ -6937,6 +8344,9 @@ ngx_http_upstream_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_rbtree_init(&umcf->collapse, &umcf->collapse_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return umcf;
 }
 
@@ -74,6 +74,9 @@ typedef struct {
     ngx_hash_t                       headers_in_hash;
     ngx_array_t                      upstreams;
                                              /* ngx_http_upstream_srv_conf_t */
+
+    ngx_rbtree_t                     collapse;
+    ngx_rbtree_node_t                collapse_sentinel;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -122,6 +125,10 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
 #define NGX_HTTP_UPSTREAM_MODIFY        0x0040
 #define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
+#define NGX_HTTP_UPSTREAM_HTTP2         0x1000
+
+
+#define NGX_HTTP_UPSTREAM_NOTIFY_CONNECT     0x1
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -137,6 +144,9 @@ struct ngx_http_upstream_srv_conf_s {
     in_port_t                        port;
     ngx_uint_t                       no_port;  /* unsigned no_port:1 */
 
+    unsigned                         keepalive:1;
+    unsigned                         non_http2:1;
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_shm_zone_t                  *shm_zone;
     ngx_resolver_t                  *resolver;
@@ -190,6 +200,7 @@ typedef struct {
     ngx_flag_t                       intercept_errors;
     ngx_flag_t                       cyclic_temp_file;
     ngx_flag_t                       force_ranges;
+    ngx_flag_t                       splice;
 
     ngx_path_t                      *temp_path;
 
@@ -224,6 +235,12 @@ typedef struct {
     ngx_array_t                     *no_cache;
 #endif
 
+    ngx_flag_t                       collapse;
+    ngx_flag_t                       collapse_errors;
+    ngx_http_complex_value_t        *collapse_key;
+    ngx_msec_t                       collapse_timeout;
+    size_t                           collapse_max_size;
+
     ngx_array_t                     *store_lengths;
     ngx_array_t                     *store_values;
 
@@ -322,6 +339,49 @@ typedef struct {
 } ngx_http_upstream_resolved_t;
 
 
+typedef struct {
+    ngx_str_node_t                   node;
+    ngx_rbtree_t                    *rbtree;
+    ngx_pool_t                      *pool;
+    ngx_uint_t                       count;
+    ngx_queue_t                      waiters;
+
+    ngx_uint_t                       status;
+    ngx_str_t                        status_line;
+    ngx_str_t                        content_type;
+    ngx_str_t                        charset;
+    off_t                            content_length_n;
+    time_t                           last_modified_time;
+    ngx_list_t                       headers;
+
+    ngx_chain_t                     *body;
+    ngx_chain_t                    **last;
+    size_t                           size;
+
+    unsigned                         header:1;
+    unsigned                         done:1;
+    unsigned                         error:1;
+} ngx_http_upstream_collapse_t;
+
+
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_http_request_t              *request;
+    ngx_http_upstream_collapse_t    *collapse;
+    ngx_event_t                      event;
+
+    ngx_chain_t                     *sent;
+    ngx_chain_t                     *free;
+    ngx_chain_t                     *busy;
+} ngx_http_upstream_collapse_waiter_t;
+
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+} ngx_http_upstream_splice_t;
+
+
 typedef void (*ngx_http_upstream_handler_pt)(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 
@@ -351,6 +411,10 @@ struct ngx_http_upstream_s {
 
     ngx_buf_t                        from_client;
 
+#if (NGX_HAVE_SPLICE || NGX_COMPAT)
+    ngx_http_upstream_splice_t      *splice_pipe[2];
+#endif
+
     ngx_buf_t                        buffer;
     off_t                            length;
 
@@ -390,6 +454,9 @@ struct ngx_http_upstream_s {
 
     ngx_http_cleanup_pt             *cleanup;
 
+    ngx_http_upstream_collapse_t        *collapse;
+    ngx_http_upstream_collapse_waiter_t *collapse_waiter;
+
     unsigned                         store:1;
     unsigned                         cacheable:1;
     unsigned                         accel:1;
@@ -403,6 +470,13 @@ struct ngx_http_upstream_s {
     unsigned                         upgrade:1;
     unsigned                         error:1;
 
+    /* the body is passed as is, and u->length delimits it */
+    unsigned                         plain_body:1;
+    unsigned                         splice:1;
+
+    /* the client is gone, the response is read for collapsed requests */
+    unsigned                         collapse_drain:1;
+
     unsigned                         request_sent:1;
     unsigned                         request_body_sent:1;
     unsigned                         request_body_blocked:1;
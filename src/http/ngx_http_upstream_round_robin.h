@@ -18,6 +18,11 @@ typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 typedef struct ngx_http_upstream_rr_peer_s   ngx_http_upstream_rr_peer_t;
 
 
+/* the peer "down" bit set by active health checks */
+
+#define NGX_HTTP_UPSTREAM_PEER_UNHEALTHY  0x02
+
+
 #if (NGX_HTTP_UPSTREAM_ZONE)
 
 typedef struct {
@@ -55,8 +60,15 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_msec_t                      rtt;
+    ngx_msec_t                      rtt_time;
+
     ngx_uint_t                      down;
 
+    ngx_msec_t                      check_next;
+    ngx_uint_t                      check_fails;
+    ngx_uint_t                      check_passes;
+
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
     int                             ssl_session_len;
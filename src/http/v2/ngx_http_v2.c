@@ -31,6 +31,7 @@
 #define NGX_HTTP_V2_SETTINGS_ACK_SIZE            0
 #define NGX_HTTP_V2_RST_STREAM_SIZE              4
 #define NGX_HTTP_V2_PRIORITY_SIZE                5
+#define NGX_HTTP_V2_PRIORITY_UPDATE_SIZE         4
 #define NGX_HTTP_V2_PING_SIZE                    8
 #define NGX_HTTP_V2_GOAWAY_SIZE                  8
 #define NGX_HTTP_V2_WINDOW_UPDATE_SIZE           4
@@ -51,6 +52,7 @@
 
 static void ngx_http_v2_read_handler(ngx_event_t *rev);
 static void ngx_http_v2_write_handler(ngx_event_t *wev);
+static void ngx_http_v2_flush_handler(ngx_event_t *ev);
 static void ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c);
 static void ngx_http_v2_lingering_close(ngx_connection_t *c);
 static void ngx_http_v2_lingering_close_handler(ngx_event_t *rev);
@@ -85,6 +87,8 @@ static u_char *ngx_http_v2_handle_continuation(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end, ngx_http_v2_handler_pt handler);
 static u_char *ngx_http_v2_state_priority(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end);
+static u_char *ngx_http_v2_state_priority_update(
+    ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end);
 static u_char *ngx_http_v2_state_rst_stream(ngx_http_v2_connection_t *h2c,
     u_char *pos, u_char *end);
 static u_char *ngx_http_v2_state_settings(ngx_http_v2_connection_t *h2c,
@@ -178,7 +182,14 @@ static ngx_int_t ngx_http_v2_adjust_windows(ngx_http_v2_connection_t *h2c,
 static void ngx_http_v2_set_dependency(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_node_t *node, ngx_uint_t depend, ngx_uint_t exclusive);
 static void ngx_http_v2_node_children_update(ngx_http_v2_node_t *node);
-
+static void ngx_http_v2_set_priority(ngx_http_v2_node_t *node, u_char *p,
+    u_char *end);
+
+static ngx_pool_t *ngx_http_v2_get_pool(ngx_http_v2_connection_t *h2c,
+    size_t size, ngx_log_t *log);
+static void ngx_http_v2_free_pool(ngx_http_v2_connection_t *h2c,
+    ngx_pool_t *pool);
+static void ngx_http_v2_free_pools_cleanup(void *data);
 static void ngx_http_v2_pool_cleanup(void *data);
 
 
@@ -245,10 +256,27 @@ ngx_http_v2_init(ngx_event_t *rev)
 
     h2c->frame_size = NGX_HTTP_V2_DEFAULT_FRAME_SIZE;
 
+    h2c->flush.handler = ngx_http_v2_flush_handler;
+    h2c->flush.data = c;
+    h2c->flush.log = c->log;
+
     h2scf = ngx_http_get_module_srv_conf(hc->conf_ctx, ngx_http_v2_module);
 
     h2c->priority_limit = ngx_max(h2scf->concurrent_streams, 100);
 
+    h2c->hpack_enc.max_size = h2scf->encoder_table_size;
+    h2c->hpack_enc.limit = NGX_HTTP_V2_TABLE_SIZE;
+
+    h2c->hpack_enc.size = ngx_min(h2c->hpack_enc.max_size,
+                                  NGX_HTTP_V2_TABLE_SIZE);
+    h2c->hpack_enc.free = h2c->hpack_enc.size;
+
+    if (h2c->hpack_enc.max_size
+        && h2c->hpack_enc.max_size < NGX_HTTP_V2_TABLE_SIZE)
+    {
+        h2c->table_update = 1;
+    }
+
     h2c->pool = ngx_create_pool(h2scf->pool_size, h2c->connection->log);
     if (h2c->pool == NULL) {
         ngx_http_close_connection(c);
@@ -517,6 +545,14 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
     c = h2c->connection;
     wev = c->write;
 
+    if (h2c->flush.timer_set) {
+        ngx_del_timer(&h2c->flush);
+    }
+
+    if (h2c->flush.posted) {
+        ngx_delete_posted_event(&h2c->flush);
+    }
+
     if (c->error) {
         goto error;
     }
@@ -525,6 +561,8 @@ ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c)
         return NGX_AGAIN;
     }
 
+    h2c->pending_bytes = 0;
+
     cl = NULL;
     out = NULL;
 
@@ -619,6 +657,70 @@ error:
 }
 
 
+ngx_int_t
+ngx_http_v2_flush_output_queue(ngx_http_v2_connection_t *h2c)
+{
+    ngx_connection_t        *c;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    c = h2c->connection;
+
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
+
+    if (!h2scf->coalesce
+        || c->error
+        || !c->write->ready
+        || h2c->pending_bytes >= NGX_HTTP_V2_FLUSH_SIZE)
+    {
+        return ngx_http_v2_send_output_queue(h2c);
+    }
+
+    /*
+     * frames of other streams that become ready within the same
+     * event loop iteration, or within the flush delay, are sent
+     * together in a single write
+     */
+
+    if (h2c->flush.posted || h2c->flush.timer_set) {
+        return NGX_DONE;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 flush delayed, pending:%uz", h2c->pending_bytes);
+
+    if (h2scf->flush_delay) {
+        ngx_add_timer(&h2c->flush, h2scf->flush_delay);
+
+    } else {
+        ngx_post_event(&h2c->flush, &ngx_posted_events);
+    }
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_v2_flush_handler(ngx_event_t *ev)
+{
+    ngx_connection_t          *c;
+    ngx_http_v2_connection_t  *h2c;
+
+    c = ev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "http2 flush handler");
+
+    ev->timedout = 0;
+
+    if (h2c->last_out == NULL) {
+        return;
+    }
+
+    ngx_http_v2_write_handler(c->write);
+}
+
+
 static void
 ngx_http_v2_handle_connection(ngx_http_v2_connection_t *h2c)
 {
@@ -905,6 +1007,10 @@ ngx_http_v2_state_head(ngx_http_v2_connection_t *h2c, u_char *pos, u_char *end)
                    "http2 frame type:%ui f:%Xd l:%uz sid:%ui",
                    type, h2c->state.flags, h2c->state.length, h2c->state.sid);
 
+    if (type == NGX_HTTP_V2_PRIORITY_UPDATE_FRAME) {
+        return ngx_http_v2_state_priority_update(h2c, pos, end);
+    }
+
     if (type >= NGX_HTTP_V2_FRAME_STATES) {
         ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
                       "client sent frame with unknown type %ui", type);
@@ -1266,7 +1372,7 @@ ngx_http_v2_state_headers(ngx_http_v2_connection_t *h2c, u_char *pos,
 
     h2c->last_sid = h2c->state.sid;
 
-    h2c->state.pool = ngx_create_pool(1024, h2c->connection->log);
+    h2c->state.pool = ngx_http_v2_get_pool(h2c, 1024, h2c->connection->log);
     if (h2c->state.pool == NULL) {
         return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_INTERNAL_ERROR);
     }
@@ -1896,7 +2002,7 @@ ngx_http_v2_state_header_complete(ngx_http_v2_connection_t *h2c, u_char *pos,
     }
 
     if (!h2c->state.keep_pool) {
-        ngx_destroy_pool(h2c->state.pool);
+        ngx_http_v2_free_pool(h2c, h2c->state.pool);
     }
 
     h2c->state.pool = NULL;
@@ -2052,6 +2158,83 @@ ngx_http_v2_state_priority(ngx_http_v2_connection_t *h2c, u_char *pos,
 }
 
 
+static u_char *
+ngx_http_v2_state_priority_update(ngx_http_v2_connection_t *h2c, u_char *pos,
+    u_char *end)
+{
+    u_char              *p;
+    ngx_uint_t           sid;
+    ngx_http_v2_node_t  *node;
+
+    if (h2c->state.length < NGX_HTTP_V2_PRIORITY_UPDATE_SIZE) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent PRIORITY_UPDATE frame "
+                      "with incorrect length %uz", h2c->state.length);
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_SIZE_ERROR);
+    }
+
+    if (h2c->state.sid) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent PRIORITY_UPDATE frame "
+                      "with incorrect identifier");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if ((size_t) (end - pos) < h2c->state.length) {
+
+        if (h2c->state.length <= NGX_HTTP_V2_STATE_BUFFER_SIZE) {
+            return ngx_http_v2_state_save(h2c, pos, end,
+                                          ngx_http_v2_state_priority_update);
+        }
+
+        /* priority field values do not need that much */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 PRIORITY_UPDATE frame of length %uz ignored",
+                       h2c->state.length);
+
+        return ngx_http_v2_state_skip(h2c, pos, end);
+    }
+
+    if (--h2c->priority_limit == 0) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent too many PRIORITY_UPDATE frames");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_ENHANCE_YOUR_CALM);
+    }
+
+    sid = ngx_http_v2_parse_sid(pos);
+
+    p = pos + NGX_HTTP_V2_PRIORITY_UPDATE_SIZE;
+    pos += h2c->state.length;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 PRIORITY_UPDATE frame sid:%ui \"%*s\"",
+                   sid, pos - p, p);
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_INFO, h2c->connection->log, 0,
+                      "client sent PRIORITY_UPDATE frame "
+                      "with incorrect prioritized stream");
+
+        return ngx_http_v2_connection_error(h2c, NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    /* updates for streams not known yet are ignored */
+
+    node = ngx_http_v2_get_node_by_id(h2c, sid, 0);
+
+    if (node) {
+        ngx_http_v2_set_priority(node, p, pos);
+        node->priority_update = 1;
+    }
+
+    return ngx_http_v2_state_complete(h2c, pos, end);
+}
+
+
 static u_char *
 ngx_http_v2_state_rst_stream(ngx_http_v2_connection_t *h2c, u_char *pos,
     u_char *end)
@@ -2246,6 +2429,7 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
+            h2c->hpack_enc.limit = value;
             h2c->table_update = 1;
             break;
 
@@ -2970,6 +3154,7 @@ static ngx_http_v2_stream_t *
 ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
 {
     ngx_log_t                 *log;
+    ngx_pool_t                *pool;
     ngx_event_t               *rev, *wev;
     ngx_connection_t          *fc;
     ngx_http_log_ctx_t        *ctx;
@@ -3046,7 +3231,15 @@ ngx_http_v2_create_stream(ngx_http_v2_connection_t *h2c)
     fc->sndlowat = 1;
     fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
 
-    r = ngx_http_create_request(fc);
+    cscf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                        ngx_http_core_module);
+
+    pool = ngx_http_v2_get_pool(h2c, cscf->request_pool_size, log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    r = ngx_http_create_request_with_pool(fc, pool);
     if (r == NULL) {
         return NULL;
     }
@@ -3141,6 +3334,7 @@ ngx_http_v2_get_node_by_id(ngx_http_v2_connection_t *h2c, ngx_uint_t sid,
     }
 
     node->id = sid;
+    node->urgency = NGX_HTTP_PRIORITY_URGENCY;
 
     ngx_queue_init(&node->children);
 
@@ -3737,6 +3931,7 @@ ngx_http_v2_construct_cookie_header(ngx_http_request_t *r)
 static void
 ngx_http_v2_run_request(ngx_http_request_t *r)
 {
+    ngx_table_elt_t           *h;
     ngx_connection_t          *fc;
     ngx_http_v2_srv_conf_t    *h2scf;
     ngx_http_v2_connection_t  *h2c;
@@ -3768,6 +3963,13 @@ ngx_http_v2_run_request(ngx_http_request_t *r)
         goto failed;
     }
 
+    h = r->headers_in.priority;
+
+    if (h && !r->stream->node->priority_update) {
+        ngx_http_v2_set_priority(r->stream->node, h->value.data,
+                                 h->value.data + h->value.len);
+    }
+
     if (r->headers_in.content_length_n > 0 && r->stream->in_closed) {
         ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
                       "client prematurely closed stream");
@@ -4396,9 +4598,10 @@ ngx_http_v2_terminate_stream(ngx_http_v2_connection_t *h2c,
 void
 ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 {
-    ngx_pool_t                *pool;
+    ngx_pool_t                *pool, *rpool;
     ngx_event_t               *ev;
     ngx_connection_t          *fc;
+    ngx_http_request_t        *r;
     ngx_http_v2_node_t        *node;
     ngx_http_v2_connection_t  *h2c;
 
@@ -4458,10 +4661,21 @@ ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc)
 
     h2c->frames -= stream->frames;
 
-    ngx_http_free_request(stream->request, rc);
+    /*
+     * The request pool, which also holds the stream object, is kept
+     * for subsequent streams of the connection.
+     */
+
+    r = stream->request;
+    rpool = r->pool;
+    r->reuse_pool = 1;
+
+    ngx_http_free_request(r, rc);
+
+    ngx_http_v2_free_pool(h2c, rpool);
 
     if (pool != h2c->state.pool) {
-        ngx_destroy_pool(pool);
+        ngx_http_v2_free_pool(h2c, pool);
 
     } else {
         /* pool will be destroyed when the complete header is parsed */
@@ -4906,11 +5120,136 @@ ngx_http_v2_node_children_update(ngx_http_v2_node_t *node)
 }
 
 
+static ngx_pool_t *
+ngx_http_v2_get_pool(ngx_http_v2_connection_t *h2c, size_t size,
+    ngx_log_t *log)
+{
+    ngx_uint_t   i;
+    ngx_pool_t  *pool;
+
+    for (i = h2c->nfree_pools; i > 0; i--) {
+        pool = h2c->free_pools[i - 1];
+
+        if ((size_t) (pool->d.end - (u_char *) pool) == size) {
+            h2c->free_pools[i - 1] = h2c->free_pools[--h2c->nfree_pools];
+
+            pool->log = log;
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 reuse pool %p", pool);
+
+            return pool;
+        }
+    }
+
+    return ngx_create_pool(size, log);
+}
+
+
+static void
+ngx_http_v2_free_pool(ngx_http_v2_connection_t *h2c, ngx_pool_t *pool)
+{
+    ngx_pool_t              *p, *next;
+    ngx_pool_cleanup_t      *cln;
+    ngx_http_v2_srv_conf_t  *h2scf;
+
+    if (h2c->pool == NULL) {
+        goto destroy;
+    }
+
+    h2scf = ngx_http_get_module_srv_conf(h2c->http_connection->conf_ctx,
+                                         ngx_http_v2_module);
+
+    if (h2c->free_pools == NULL) {
+        cln = ngx_pool_cleanup_add(h2c->pool, 0);
+        if (cln == NULL) {
+            goto destroy;
+        }
+
+        h2c->free_pools = ngx_palloc(h2c->pool, h2scf->concurrent_streams
+                                                * sizeof(ngx_pool_t *));
+        if (h2c->free_pools == NULL) {
+            goto destroy;
+        }
+
+        cln->handler = ngx_http_v2_free_pools_cleanup;
+        cln->data = h2c;
+    }
+
+    if (h2c->nfree_pools == h2scf->concurrent_streams) {
+        goto destroy;
+    }
+
+    for (cln = pool->cleanup; cln; cln = cln->next) {
+        if (cln->handler) {
+            cln->handler(cln->data);
+        }
+    }
+
+    pool->cleanup = NULL;
+
+    ngx_reset_pool(pool);
+
+    /* only the first block is kept to bound memory held by idle pools */
+
+    for (p = pool->d.next; p; p = next) {
+        next = p->d.next;
+        ngx_free(p);
+    }
+
+    pool->d.next = NULL;
+
+    h2c->free_pools[h2c->nfree_pools++] = pool;
+
+    return;
+
+destroy:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_v2_free_pools_cleanup(void *data)
+{
+    ngx_http_v2_connection_t  *h2c = data;
+
+    while (h2c->nfree_pools) {
+        ngx_destroy_pool(h2c->free_pools[--h2c->nfree_pools]);
+    }
+
+    h2c->free_pools = NULL;
+}
+
+
+static void
+ngx_http_v2_set_priority(ngx_http_v2_node_t *node, u_char *p, u_char *end)
+{
+    ngx_uint_t  urgency, incremental;
+
+    if (ngx_http_parse_priority(p, end, &urgency, &incremental) != NGX_OK) {
+        return;
+    }
+
+    node->urgency = urgency;
+    node->incremental = incremental;
+    node->priority = 1;
+}
+
+
 static void
 ngx_http_v2_pool_cleanup(void *data)
 {
     ngx_http_v2_connection_t  *h2c = data;
 
+    if (h2c->flush.timer_set) {
+        ngx_del_timer(&h2c->flush);
+    }
+
+    if (h2c->flush.posted) {
+        ngx_delete_posted_event(&h2c->flush);
+    }
+
     if (h2c->state.pool) {
         ngx_destroy_pool(h2c->state.pool);
     }
@@ -26,6 +26,9 @@
 
 #define NGX_HTTP_V2_FRAME_HEADER_SIZE    9
 
+/* queued output that fills a TLS record is sent without waiting */
+#define NGX_HTTP_V2_FLUSH_SIZE           16384
+
 /* frame types */
 #define NGX_HTTP_V2_DATA_FRAME           0x0
 #define NGX_HTTP_V2_HEADERS_FRAME        0x1
@@ -37,6 +40,7 @@
 #define NGX_HTTP_V2_GOAWAY_FRAME         0x7
 #define NGX_HTTP_V2_WINDOW_UPDATE_FRAME  0x8
 #define NGX_HTTP_V2_CONTINUATION_FRAME   0x9
+#define NGX_HTTP_V2_PRIORITY_UPDATE_FRAME  0x10
 
 /* frame flags */
 #define NGX_HTTP_V2_NO_FLAG              0x00
@@ -51,6 +55,9 @@
 
 #define NGX_HTTP_V2_DEFAULT_WEIGHT       16
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -67,6 +74,9 @@ typedef struct {
     ngx_uint_t                       concurrent_streams;
     size_t                           preread_size;
     ngx_uint_t                       streams_index_mask;
+    size_t                           encoder_table_size;
+    ngx_flag_t                       coalesce;
+    ngx_msec_t                       flush_delay;
 } ngx_http_v2_srv_conf_t;
 
 
@@ -121,6 +131,33 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+    ngx_uint_t                       name_hash;
+    ngx_uint_t                       hash;
+    ngx_uint_t                       offset;
+    ngx_uint_t                       hits;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+    ngx_uint_t                       offset;
+
+    size_t                           size;
+    size_t                           free;
+    size_t                           limit;
+    size_t                           max_size;
+    u_char                          *storage;
+    u_char                          *pos;
+} ngx_http_v2_hpack_enc_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -141,17 +178,24 @@ struct ngx_http_v2_connection_s {
 
     size_t                           frame_size;
 
+    size_t                           pending_bytes;
+    ngx_event_t                      flush;
+
     ngx_queue_t                      waiting;
 
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_enc_t          hpack_enc;
 
     ngx_pool_t                      *pool;
 
     ngx_http_v2_out_frame_t         *free_frames;
     ngx_connection_t                *free_fake_connections;
 
+    ngx_pool_t                     **free_pools;
+    ngx_uint_t                       nfree_pools;
+
     ngx_http_v2_node_t             **streams_index;
 
     ngx_http_v2_out_frame_t         *last_out;
@@ -166,6 +210,7 @@ struct ngx_http_v2_connection_s {
 
     unsigned                         settings_ack:1;
     unsigned                         table_update:1;
+    unsigned                         table_reset:1;
     unsigned                         blocked:1;
     unsigned                         goaway:1;
 };
@@ -182,6 +227,12 @@ struct ngx_http_v2_node_s {
     ngx_uint_t                       weight;
     double                           rel_weight;
     ngx_http_v2_stream_t            *stream;
+
+    /* RFC 9218 */
+    unsigned                         urgency:3;
+    unsigned                         incremental:1;
+    unsigned                         priority:1;
+    unsigned                         priority_update:1;
 };
 
 
@@ -233,35 +284,75 @@ struct ngx_http_v2_out_frame_s {
 
     ngx_http_v2_stream_t            *stream;
     size_t                           length;
+    ngx_uint_t                       round;
 
     unsigned                         blocked:1;
     unsigned                         fin:1;
 };
 
 
+/*
+ * whether the queued frame "q" is to be sent before the new frame "f":
+ * RFC 9218 urgency is compared first, then frames of incremental streams
+ * are interleaved round-robin, and non-incremental streams are sent in the
+ * order of stream identifiers; without RFC 9218 priorities the RFC 7540
+ * dependency tree is used
+ */
+
+static ngx_inline ngx_uint_t
+ngx_http_v2_frame_precedes(ngx_http_v2_out_frame_t *q,
+    ngx_http_v2_out_frame_t *f)
+{
+    ngx_http_v2_node_t  *qn, *sn;
+
+    if (q->stream == f->stream) {
+        return 1;
+    }
+
+    qn = q->stream->node;
+    sn = f->stream->node;
+
+    if (qn->urgency != sn->urgency) {
+        return qn->urgency < sn->urgency;
+    }
+
+    if (qn->priority || sn->priority) {
+
+        if (qn->incremental && sn->incremental) {
+            return q->round <= f->round;
+        }
+
+        return qn->id < sn->id;
+    }
+
+    return qn->rank < sn->rank
+           || (qn->rank == sn->rank && qn->rel_weight >= sn->rel_weight);
+}
+
+
 static ngx_inline void
 ngx_http_v2_queue_frame(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_out_frame_t *frame)
 {
     ngx_http_v2_out_frame_t  **out;
 
+    frame->round = frame->stream->queued;
+
     for (out = &h2c->last_out; *out; out = &(*out)->next) {
 
         if ((*out)->blocked || (*out)->stream == NULL) {
             break;
         }
 
-        if ((*out)->stream->node->rank < frame->stream->node->rank
-            || ((*out)->stream->node->rank == frame->stream->node->rank
-                && (*out)->stream->node->rel_weight
-                   >= frame->stream->node->rel_weight))
-        {
+        if (ngx_http_v2_frame_precedes(*out, frame)) {
             break;
         }
     }
 
     frame->next = *out;
     *out = frame;
+
+    h2c->pending_bytes += NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length;
 }
 
 
@@ -280,6 +371,8 @@ ngx_http_v2_queue_blocked_frame(ngx_http_v2_connection_t *h2c,
 
     frame->next = *out;
     *out = frame;
+
+    h2c->pending_bytes += NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length;
 }
 
 
@@ -289,6 +382,8 @@ ngx_http_v2_queue_ordered_frame(ngx_http_v2_connection_t *h2c,
 {
     frame->next = h2c->last_out;
     h2c->last_out = frame;
+
+    h2c->pending_bytes += NGX_HTTP_V2_FRAME_HEADER_SIZE + frame->length;
 }
 
 
@@ -300,6 +395,7 @@ ngx_int_t ngx_http_v2_read_unbuffered_request_body(ngx_http_request_t *r);
 void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
+ngx_int_t ngx_http_v2_flush_output_queue(ngx_http_v2_connection_t *h2c);
 
 
 ngx_str_t *ngx_http_v2_get_static_name(ngx_uint_t index);
@@ -311,6 +407,12 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+ngx_int_t ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t *index);
+ngx_int_t ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *name, ngx_str_t *value);
+void ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size);
+
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
@@ -414,6 +516,8 @@ ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
 u_char *ngx_http_v2_string_encode(u_char *dst, u_char *src, size_t len,
     u_char *tmp, ngx_uint_t lower);
+u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
+    ngx_uint_t value);
 
 
 extern ngx_module_t  ngx_http_v2_module;
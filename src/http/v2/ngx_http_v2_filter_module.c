@@ -27,6 +27,17 @@
 #define NGX_HTTP_V2_NO_TRAILERS           (ngx_http_v2_out_frame_t *) -1
 
 
+#define NGX_HTTP_V2_INDEX                 0
+#define NGX_HTTP_V2_NO_INDEX              1
+#define NGX_HTTP_V2_NEVER_INDEX           2
+
+
+static u_char *ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+static u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c,
+    u_char *pos, ngx_uint_t index, ngx_str_t *name, ngx_str_t *value,
+    ngx_uint_t indexing, u_char *tmp);
+static ngx_uint_t ngx_http_v2_header_indexing(ngx_str_t *name);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_headers_frame(
     ngx_http_request_t *r, u_char *pos, u_char *end, ngx_uint_t fin);
 static ngx_http_v2_out_frame_t *ngx_http_v2_create_trailers_frame(
@@ -97,12 +108,25 @@ ngx_module_t  ngx_http_v2_filter_module = {
 static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 
 
+/* per-response values, not worth adding to the encoder table */
+
+static ngx_str_t  ngx_http_v2_no_index_headers[] = {
+    ngx_string("age"),
+    ngx_string("content-length"),
+    ngx_string("content-range"),
+    ngx_string("etag"),
+    ngx_string("last-modified"),
+    ngx_string("location"),
+    ngx_null_string
+};
+
+
 static ngx_int_t
 ngx_http_v2_header_filter(ngx_http_request_t *r)
 {
     u_char                     status, *pos, *start, *p, *tmp;
     size_t                     len, tmp_len;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, value;
     ngx_uint_t                 i, port, fin;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
@@ -114,6 +138,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     buf[sizeof("Wed, 31 Dec 1986 18:00:00 GMT")];
 
     static const u_char nginx[5] = "\x84\xaa\x63\x55\xe7";
 #if (NGX_HTTP_GZIP)
@@ -211,7 +236,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
     h2c = stream->connection;
 
-    len = h2c->table_update ? 1 : 0;
+    len = h2c->table_update ? 2 * NGX_HTTP_V2_INT_OCTETS : 0;
 
     len += status ? 1 : 1 + ngx_http_v2_literal_size("418");
 
@@ -334,6 +359,15 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         len += 1 + NGX_HTTP_V2_INT_OCTETS + r->headers_out.location->value.len;
     }
 
+    if (h2c->hpack_enc.max_size) {
+        /*
+         * a static name index may take an extra octet
+         * for each of the headers above if not indexed
+         */
+
+        len += 8;
+    }
+
     tmp_len = len;
 
 #if (NGX_HTTP_GZIP)
@@ -402,10 +436,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     start = pos;
 
     if (h2c->table_update) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 table size update: 0");
-        *pos++ = (1 << 5) | 0;
-        h2c->table_update = 0;
+        pos = ngx_http_v2_write_table_update(h2c, pos);
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -416,12 +447,32 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         *pos++ = status;
 
     } else {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_STATUS_INDEX);
-        *pos++ = NGX_HTTP_V2_ENCODE_RAW | 3;
-        pos = ngx_sprintf(pos, "%03ui", r->headers_out.status);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%03ui", r->headers_out.status) - buf;
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_STATUS_INDEX,
+                                       NULL, &value, NGX_HTTP_V2_INDEX, tmp);
     }
 
-    if (r->headers_out.server == NULL) {
+    if (r->headers_out.server == NULL && h2c->hpack_enc.max_size) {
+
+        if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
+            ngx_str_set(&value, NGINX_VER);
+
+        } else if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_BUILD) {
+            ngx_str_set(&value, NGINX_VER_BUILD);
+
+        } else {
+            ngx_str_set(&value, "nginx");
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"server: %V\"", &value);
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_SERVER_INDEX,
+                                       NULL, &value, NGX_HTTP_V2_INDEX, tmp);
+
+    } else if (r->headers_out.server == NULL) {
 
         if (clcf->server_tokens == NGX_HTTP_SERVER_TOKENS_ON) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
@@ -469,13 +520,13 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_DATE_INDEX);
-        pos = ngx_http_v2_write_value(pos, ngx_cached_http_time.data,
-                                      ngx_cached_http_time.len, tmp);
+        value = ngx_cached_http_time;
+
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_DATE_INDEX,
+                                       NULL, &value, NGX_HTTP_V2_INDEX, tmp);
     }
 
     if (r->headers_out.content_type.len) {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_TYPE_INDEX);
 
         if (r->headers_out.content_type_len == r->headers_out.content_type.len
             && r->headers_out.charset.len)
@@ -485,7 +536,7 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
 
             p = ngx_pnalloc(r->pool, len);
             if (p == NULL) {
-                return NGX_ERROR;
+                goto failed;
             }
 
             p = ngx_cpymem(p, r->headers_out.content_type.data,
@@ -506,8 +557,10 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        pos = ngx_http_v2_write_value(pos, r->headers_out.content_type.data,
-                                      r->headers_out.content_type.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_TYPE_INDEX, NULL,
+                                       &r->headers_out.content_type,
+                                       NGX_HTTP_V2_INDEX, tmp);
     }
 
     if (r->headers_out.content_length == NULL
@@ -517,30 +570,28 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"content-length: %O\"",
                        r->headers_out.content_length_n);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_CONTENT_LENGTH_INDEX);
+        value.data = buf;
+        value.len = ngx_sprintf(buf, "%O", r->headers_out.content_length_n)
+                    - buf;
 
-        p = pos;
-        pos = ngx_sprintf(pos + 1, "%O", r->headers_out.content_length_n);
-        *p = NGX_HTTP_V2_ENCODE_RAW | (u_char) (pos - p - 1);
+        pos = ngx_http_v2_write_header(h2c, pos,
+                                       NGX_HTTP_V2_CONTENT_LENGTH_INDEX, NULL,
+                                       &value, NGX_HTTP_V2_NO_INDEX, tmp);
     }
 
     if (r->headers_out.last_modified == NULL
         && r->headers_out.last_modified_time != -1)
     {
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LAST_MODIFIED_INDEX);
-
-        ngx_http_time(pos, r->headers_out.last_modified_time);
-        len = sizeof("Wed, 31 Dec 1986 18:00:00 GMT") - 1;
+        value.data = buf;
+        value.len = ngx_http_time(buf, r->headers_out.last_modified_time)
+                    - buf;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
-                       "http2 output header: \"last-modified: %*s\"",
-                       len, pos);
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                       "http2 output header: \"last-modified: %V\"", &value);
 
-        /*
-         * Date will always be encoded using huffman in the temporary buffer,
-         * so it's safe here to use src and dst pointing to the same address.
-         */
-        pos = ngx_http_v2_write_value(pos, pos, len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos,
+                                       NGX_HTTP_V2_LAST_MODIFIED_INDEX, NULL,
+                                       &value, NGX_HTTP_V2_NO_INDEX, tmp);
     }
 
     if (r->headers_out.location && r->headers_out.location->value.len) {
@@ -548,9 +599,9 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
                        "http2 output header: \"location: %V\"",
                        &r->headers_out.location->value);
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_LOCATION_INDEX);
-        pos = ngx_http_v2_write_value(pos, r->headers_out.location->value.data,
-                                      r->headers_out.location->value.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_LOCATION_INDEX,
+                                       NULL, &r->headers_out.location->value,
+                                       NGX_HTTP_V2_NO_INDEX, tmp);
     }
 
 #if (NGX_HTTP_GZIP)
@@ -558,8 +609,17 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, fc->log, 0,
                        "http2 output header: \"vary: Accept-Encoding\"");
 
-        *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
-        pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        if (h2c->hpack_enc.max_size) {
+            ngx_str_set(&value, "Accept-Encoding");
+
+            pos = ngx_http_v2_write_header(h2c, pos, NGX_HTTP_V2_VARY_INDEX,
+                                           NULL, &value, NGX_HTTP_V2_INDEX,
+                                           tmp);
+
+        } else {
+            *pos++ = ngx_http_v2_inc_indexed(NGX_HTTP_V2_VARY_INDEX);
+            pos = ngx_cpymem(pos, accept_encoding, sizeof(accept_encoding));
+        }
     }
 #endif
 
@@ -592,32 +652,30 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
         }
 #endif
 
-        *pos++ = 0;
-
-        pos = ngx_http_v2_write_name(pos, header[i].key.data,
-                                     header[i].key.len, tmp);
-
-        pos = ngx_http_v2_write_value(pos, header[i].value.data,
-                                      header[i].value.len, tmp);
+        pos = ngx_http_v2_write_header(h2c, pos, 0, &header[i].key,
+                                       &header[i].value,
+                                       ngx_http_v2_header_indexing(
+                                                             &header[i].key),
+                                       tmp);
     }
 
     fin = r->header_only
           || (r->headers_out.content_length_n == 0 && !r->expect_trailers);
 
+    cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        goto failed;
+    }
+
     frame = ngx_http_v2_create_headers_frame(r, start, pos, fin);
     if (frame == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     ngx_http_v2_queue_blocked_frame(h2c, frame);
 
     stream->queued = 1;
 
-    cln = ngx_http_cleanup_add(r, 0);
-    if (cln == NULL) {
-        return NGX_ERROR;
-    }
-
     cln->handler = ngx_http_v2_filter_cleanup;
     cln->data = stream;
 
@@ -626,6 +684,149 @@ ngx_http_v2_header_filter(ngx_http_request_t *r)
     fc->need_flush_buf = 1;
 
     return ngx_http_v2_filter_send(fc, stream);
+
+failed:
+
+    if (h2c->hpack_enc.max_size) {
+
+        /*
+         * the header block will never be sent, so the peer's dynamic
+         * table is to be emptied to get both sides back in sync
+         */
+
+        ngx_http_v2_table_resize(h2c, 0);
+
+        h2c->table_update = 1;
+        h2c->table_reset = 1;
+    }
+
+    return NGX_ERROR;
+}
+
+
+static u_char *
+ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    size_t  size;
+
+    h2c->table_update = 0;
+
+    if (h2c->hpack_enc.max_size == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: 0");
+
+        *pos++ = (1 << 5) | 0;
+
+        return pos;
+    }
+
+    if (h2c->table_reset) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: 0");
+
+        *pos++ = (1 << 5) | 0;
+
+        h2c->table_reset = 0;
+    }
+
+    size = ngx_min(h2c->hpack_enc.max_size, h2c->hpack_enc.limit);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", size);
+
+    ngx_http_v2_table_resize(h2c, size);
+
+    *pos = 1 << 5;
+
+    return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), size);
+}
+
+
+static u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing,
+    u_char *tmp)
+{
+    ngx_int_t   rc;
+    ngx_uint_t  prefix;
+
+    if (h2c->hpack_enc.max_size == 0) {
+
+        if (index) {
+            *pos++ = ngx_http_v2_inc_indexed(index);
+
+        } else {
+            *pos++ = 0;
+            pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+        }
+
+        return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+    }
+
+    if (index) {
+        name = ngx_http_v2_get_static_name(index);
+    }
+
+    rc = ngx_http_v2_table_find(h2c, name, value, &index);
+
+    if (rc == NGX_OK) {
+        *pos = 0x80;
+        return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), index);
+    }
+
+    if (rc == NGX_AGAIN
+        || (indexing == NGX_HTTP_V2_INDEX
+            && 32 + name->len + value->len <= h2c->hpack_enc.size / 4))
+    {
+        if (ngx_http_v2_table_insert(h2c, name, value) == NGX_OK) {
+            *pos = 0x40;
+            prefix = ngx_http_v2_prefix(6);
+            goto literal;
+        }
+
+        if (rc == NGX_AGAIN) {
+            *pos = 0x80;
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7), index);
+        }
+    }
+
+    *pos = (indexing == NGX_HTTP_V2_NEVER_INDEX) ? 0x10 : 0;
+    prefix = ngx_http_v2_prefix(4);
+
+literal:
+
+    pos = ngx_http_v2_write_int(pos, prefix, index);
+
+    if (index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_header_indexing(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    if (name->len == sizeof("set-cookie") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "set-cookie",
+                           sizeof("set-cookie") - 1)
+           == 0)
+    {
+        return NGX_HTTP_V2_NEVER_INDEX;
+    }
+
+    for (h = ngx_http_v2_no_index_headers; h->len; h++) {
+        if (name->len == h->len
+            && ngx_strncasecmp(name->data, h->data, h->len) == 0)
+        {
+            return NGX_HTTP_V2_NO_INDEX;
+        }
+    }
+
+    return NGX_HTTP_V2_INDEX;
 }
 
 
@@ -1250,6 +1451,7 @@ ngx_http_v2_waiting_queue(ngx_http_v2_connection_t *h2c,
 static ngx_inline ngx_int_t
 ngx_http_v2_filter_send(ngx_connection_t *fc, ngx_http_v2_stream_t *stream)
 {
+    ngx_int_t          rc;
     ngx_connection_t  *c;
 
     c = stream->connection->connection;
@@ -1261,7 +1463,9 @@ ngx_http_v2_filter_send(ngx_connection_t *fc, ngx_http_v2_stream_t *stream)
 
     stream->blocked = 1;
 
-    if (ngx_http_v2_send_output_queue(stream->connection) == NGX_ERROR) {
+    rc = ngx_http_v2_flush_output_queue(stream->connection);
+
+    if (rc == NGX_ERROR) {
         fc->error = 1;
         return NGX_ERROR;
     }
@@ -1272,7 +1476,9 @@ ngx_http_v2_filter_send(ngx_connection_t *fc, ngx_http_v2_stream_t *stream)
         fc->buffered |= NGX_HTTP_V2_BUFFERED;
         fc->write->active = 1;
         fc->write->ready = 0;
-        return NGX_AGAIN;
+
+        /* frames held for coalescing are not a blocked write */
+        return (rc == NGX_DONE) ? NGX_OK : NGX_AGAIN;
     }
 
     fc->buffered &= ~NGX_HTTP_V2_BUFFERED;
@@ -10,11 +10,16 @@
 #include <ngx_http.h>
 
 
-#define NGX_HTTP_V2_TABLE_SIZE  4096
-
-
 static ngx_int_t ngx_http_v2_table_account(ngx_http_v2_connection_t *h2c,
     size_t size);
+static void ngx_http_v2_table_evict(ngx_http_v2_connection_t *h2c,
+    size_t size);
+static ngx_uint_t ngx_http_v2_table_hash(ngx_uint_t key, u_char *data,
+    size_t len, ngx_uint_t lower);
+static ngx_int_t ngx_http_v2_table_cmp(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *entry, ngx_str_t *str, ngx_uint_t lower);
+static u_char *ngx_http_v2_table_store(ngx_http_v2_connection_t *h2c,
+    ngx_str_t *str, ngx_uint_t lower);
 
 
 static ngx_http_v2_header_t  ngx_http_v2_static_table[] = {
@@ -361,3 +366,256 @@ ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size)
 
     return NGX_OK;
 }
+
+
+ngx_int_t
+ngx_http_v2_table_find(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t *index)
+{
+    size_t                      rest;
+    ngx_uint_t                  i, n, hash, name_hash;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry, *oldest;
+
+    enc = &h2c->hpack_enc;
+
+    if (enc->added != enc->deleted) {
+        name_hash = ngx_http_v2_table_hash(0, name->data, name->len, 1);
+        hash = ngx_http_v2_table_hash(name_hash, value->data, value->len, 0);
+
+        for (n = enc->added; n != enc->deleted; /* void */) {
+            entry = &enc->entries[--n % enc->allocated];
+
+            if (entry->name_hash != name_hash
+                || ngx_http_v2_table_cmp(h2c, &entry->name, name, 1) != 0)
+            {
+                continue;
+            }
+
+            if (entry->hash == hash
+                && ngx_http_v2_table_cmp(h2c, &entry->value, value, 0) == 0)
+            {
+                *index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - n;
+
+                /*
+                 * an entry that is used repeatedly and is about
+                 * to be evicted is suggested to be inserted anew
+                 */
+
+                oldest = &enc->entries[enc->deleted % enc->allocated];
+                rest = enc->free + entry->offset - oldest->offset;
+
+                if (entry->hits++ && rest < enc->size / 4) {
+                    return NGX_AGAIN;
+                }
+
+                return NGX_OK;
+            }
+
+            if (*index == 0) {
+                *index = NGX_HTTP_V2_STATIC_TABLE_ENTRIES + enc->added - n;
+            }
+        }
+    }
+
+    if (*index) {
+        return NGX_DECLINED;
+    }
+
+    for (i = NGX_HTTP_V2_STATUS_500_INDEX;
+         i < NGX_HTTP_V2_STATIC_TABLE_ENTRIES;
+         i++)
+    {
+        if (ngx_http_v2_static_table[i].name.len == name->len
+            && ngx_strncasecmp(ngx_http_v2_static_table[i].name.data,
+                               name->data, name->len)
+               == 0)
+        {
+            *index = i + 1;
+            break;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+ngx_int_t
+ngx_http_v2_table_insert(ngx_http_v2_connection_t *h2c, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    size_t                      size;
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    size = 32 + name->len + value->len;
+
+    if (size > enc->size) {
+        return NGX_DECLINED;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 encoder table add: \"%V: %V\" free:%uz",
+                   name, value, enc->free);
+
+    if (enc->entries == NULL) {
+        enc->allocated = enc->max_size / 32;
+
+        enc->entries = ngx_palloc(h2c->connection->pool,
+                                  sizeof(ngx_http_v2_hpack_entry_t)
+                                  * enc->allocated);
+        if (enc->entries == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->storage = ngx_palloc(h2c->connection->pool, enc->max_size);
+        if (enc->storage == NULL) {
+            return NGX_ERROR;
+        }
+
+        enc->pos = enc->storage;
+    }
+
+    ngx_http_v2_table_evict(h2c, size);
+
+    enc->free -= size;
+
+    entry = &enc->entries[enc->added++ % enc->allocated];
+
+    entry->name.len = name->len;
+    entry->name.data = ngx_http_v2_table_store(h2c, name, 1);
+
+    entry->value.len = value->len;
+    entry->value.data = ngx_http_v2_table_store(h2c, value, 0);
+
+    entry->name_hash = ngx_http_v2_table_hash(0, name->data, name->len, 1);
+    entry->hash = ngx_http_v2_table_hash(entry->name_hash, value->data,
+                                         value->len, 0);
+
+    entry->offset = enc->offset;
+    entry->hits = 0;
+
+    enc->offset += size;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v2_table_resize(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 encoder table size: %uz was:%uz", size, enc->size);
+
+    if (size < enc->size) {
+        ngx_http_v2_table_evict(h2c, enc->size - size);
+        enc->free -= enc->size - size;
+
+    } else {
+        enc->free += size - enc->size;
+    }
+
+    enc->size = size;
+}
+
+
+static void
+ngx_http_v2_table_evict(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_enc_t    *enc;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    enc = &h2c->hpack_enc;
+
+    while (size > enc->free) {
+        entry = &enc->entries[enc->deleted++ % enc->allocated];
+        enc->free += 32 + entry->name.len + entry->value.len;
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_v2_table_hash(ngx_uint_t key, u_char *data, size_t len,
+    ngx_uint_t lower)
+{
+    u_char  *end;
+
+    for (end = data + len; data != end; data++) {
+        key = ngx_hash(key, lower ? ngx_tolower(*data) : *data);
+    }
+
+    return key;
+}
+
+
+static ngx_int_t
+ngx_http_v2_table_cmp(ngx_http_v2_connection_t *h2c, ngx_str_t *entry,
+    ngx_str_t *str, ngx_uint_t lower)
+{
+    u_char     *storage;
+    size_t      rest;
+    ngx_int_t   rc;
+
+    if (entry->len != str->len) {
+        return 1;
+    }
+
+    storage = h2c->hpack_enc.storage;
+    rest = storage + h2c->hpack_enc.max_size - entry->data;
+
+    if (rest >= str->len) {
+        return lower ? ngx_strncasecmp(entry->data, str->data, str->len)
+                     : ngx_memcmp(entry->data, str->data, str->len);
+    }
+
+    rc = lower ? ngx_strncasecmp(entry->data, str->data, rest)
+               : ngx_memcmp(entry->data, str->data, rest);
+
+    if (rc != 0) {
+        return rc;
+    }
+
+    return lower ? ngx_strncasecmp(storage, str->data + rest, str->len - rest)
+                 : ngx_memcmp(storage, str->data + rest, str->len - rest);
+}
+
+
+static u_char *
+ngx_http_v2_table_store(ngx_http_v2_connection_t *h2c, ngx_str_t *str,
+    ngx_uint_t lower)
+{
+    u_char                   *data;
+    size_t                    avail, n;
+    ngx_http_v2_hpack_enc_t  *enc;
+
+    enc = &h2c->hpack_enc;
+
+    data = enc->pos;
+    avail = enc->storage + enc->max_size - enc->pos;
+
+    n = ngx_min(avail, str->len);
+
+    if (lower) {
+        ngx_strlow(enc->pos, str->data, n);
+        ngx_strlow(enc->storage, str->data + n, str->len - n);
+
+    } else {
+        ngx_memcpy(enc->pos, str->data, n);
+        ngx_memcpy(enc->storage, str->data + n, str->len - n);
+    }
+
+    if (n < str->len || n == avail) {
+        enc->pos = enc->storage + (str->len - n);
+
+    } else {
+        enc->pos += n;
+    }
+
+    return data;
+}
@@ -38,12 +38,14 @@
 #define NGX_HTTP_V3_FRAME_PUSH_PROMISE             0x05
 #define NGX_HTTP_V3_FRAME_GOAWAY                   0x07
 #define NGX_HTTP_V3_FRAME_MAX_PUSH_ID              0x0d
+#define NGX_HTTP_V3_FRAME_PRIORITY_UPDATE          0xf0700
 
 #define NGX_HTTP_V3_PARAM_MAX_TABLE_CAPACITY       0x01
 #define NGX_HTTP_V3_PARAM_MAX_FIELD_SECTION_SIZE   0x06
 #define NGX_HTTP_V3_PARAM_BLOCKED_STREAMS          0x07
 
 #define NGX_HTTP_V3_MAX_TABLE_CAPACITY             4096
+#define NGX_HTTP_V3_MAX_ENCODER_CAPACITY           65536
 
 #define NGX_HTTP_V3_STREAM_CLIENT_CONTROL          0
 #define NGX_HTTP_V3_STREAM_SERVER_CONTROL          1
@@ -107,6 +109,7 @@ typedef struct {
     ngx_flag_t                    enable_hq;
     size_t                        max_table_capacity;
     ngx_uint_t                    max_blocked_streams;
+    size_t                        encoder_table_capacity;
     ngx_uint_t                    max_concurrent_streams;
     ngx_quic_conf_t               quic;
 } ngx_http_v3_srv_conf_t;
@@ -124,6 +127,7 @@ struct ngx_http_v3_session_s {
     ngx_http_connection_t        *http_connection;
 
     ngx_http_v3_dynamic_table_t   table;
+    ngx_http_v3_encoder_table_t   encoder;
 
     ngx_event_t                   keepalive;
     ngx_uint_t                    nrequests;
@@ -36,6 +36,7 @@ typedef struct {
 
 
 static ngx_int_t ngx_http_v3_header_filter(ngx_http_request_t *r);
+static ngx_uint_t ngx_http_v3_header_indexing(ngx_str_t *name);
 static ngx_int_t ngx_http_v3_body_filter(ngx_http_request_t *r,
     ngx_chain_t *in);
 static ngx_chain_t *ngx_http_v3_create_trailers(ngx_http_request_t *r,
@@ -78,23 +79,39 @@ static ngx_http_output_header_filter_pt  ngx_http_next_header_filter;
 static ngx_http_output_body_filter_pt    ngx_http_next_body_filter;
 
 
+/* per-response values, not worth inserting into the encoder table */
+
+static ngx_str_t  ngx_http_v3_no_index_headers[] = {
+    ngx_string("age"),
+    ngx_string("content-length"),
+    ngx_string("content-range"),
+    ngx_string("etag"),
+    ngx_string("last-modified"),
+    ngx_string("location"),
+    ngx_null_string
+};
+
+
 static ngx_int_t
 ngx_http_v3_header_filter(ngx_http_request_t *r)
 {
-    u_char                    *p;
-    size_t                     len, n;
-    ngx_buf_t                 *b;
-    ngx_str_t                  host, location;
-    ngx_uint_t                 i, port;
-    ngx_chain_t               *out, *hl, *cl, **ll;
-    ngx_list_part_t           *part;
-    ngx_table_elt_t           *header;
-    ngx_connection_t          *c;
-    ngx_http_v3_session_t     *h3c;
-    ngx_http_v3_filter_ctx_t  *ctx;
-    ngx_http_core_loc_conf_t  *clcf;
-    ngx_http_core_srv_conf_t  *cscf;
-    u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                        *p;
+    size_t                         len, n;
+    ngx_int_t                      rc;
+    ngx_buf_t                     *b;
+    ngx_str_t                      host, location, value;
+    ngx_uint_t                     i, port, encode;
+    ngx_chain_t                   *out, *hl, *cl, **ll;
+    ngx_list_part_t               *part;
+    ngx_table_elt_t               *header;
+    ngx_connection_t              *c;
+    ngx_http_v3_session_t         *h3c;
+    ngx_http_v3_filter_ctx_t      *ctx;
+    ngx_http_core_loc_conf_t      *clcf;
+    ngx_http_core_srv_conf_t      *cscf;
+    ngx_http_v3_encode_section_t   es;
+    u_char                         addr[NGX_SOCKADDR_STRLEN];
+    u_char                         prefix[2 * NGX_HTTP_V3_PREFIX_INT_LEN];
 
     if (r->http_version != NGX_HTTP_VERSION_30) {
         return ngx_http_next_header_filter(r);
@@ -316,13 +333,28 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 header len:%uz", len);
 
-    b = ngx_create_temp_buf(r->pool, len);
+    /* dynamic table references need a longer prefix */
+
+    b = ngx_create_temp_buf(r->pool, len + sizeof(prefix));
     if (b == NULL) {
         return NGX_ERROR;
     }
 
-    b->last = (u_char *) ngx_http_v3_encode_field_section_prefix(b->last,
-                                                                 0, 0, 0);
+    rc = ngx_http_v3_encoder_begin(c, &es, r->pool, len);
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    encode = (rc == NGX_OK);
+
+    if (encode) {
+        b->pos += sizeof(prefix);
+        b->last = b->pos;
+
+    } else {
+        b->last = (u_char *) ngx_http_v3_encode_field_section_prefix(b->last,
+                                                                     0, 0, 0);
+    }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 output header: \":status: %03ui\"",
@@ -332,6 +364,15 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
         b->last = (u_char *) ngx_http_v3_encode_field_ri(b->last, 0,
                                                 NGX_HTTP_V3_HEADER_STATUS_200);
 
+    } else if (encode) {
+        value.data = prefix;
+        value.len = ngx_sprintf(prefix, "%03ui", r->headers_out.status)
+                    - prefix;
+
+        b->last = ngx_http_v3_encoder_field(c, &es, b->last,
+                                            NGX_HTTP_V3_HEADER_STATUS_200,
+                                            NULL, &value, NGX_HTTP_V3_INDEX);
+
     } else {
         b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
                                                  NGX_HTTP_V3_HEADER_STATUS_200,
@@ -356,9 +397,20 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 output header: \"server: %*s\"", n, p);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
+        if (encode) {
+            value.data = p;
+            value.len = n;
+
+            b->last = ngx_http_v3_encoder_field(c, &es, b->last,
+                                                NGX_HTTP_V3_HEADER_SERVER,
+                                                NULL, &value,
+                                                NGX_HTTP_V3_INDEX);
+
+        } else {
+            b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
                                                      NGX_HTTP_V3_HEADER_SERVER,
                                                      p, n);
+        }
     }
 
     if (r->headers_out.date == NULL) {
@@ -366,10 +418,20 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                        "http3 output header: \"date: %V\"",
                        &ngx_cached_http_time);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
+        if (encode) {
+            value = ngx_cached_http_time;
+
+            b->last = ngx_http_v3_encoder_field(c, &es, b->last,
+                                                NGX_HTTP_V3_HEADER_DATE,
+                                                NULL, &value,
+                                                NGX_HTTP_V3_INDEX);
+
+        } else {
+            b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
                                                      NGX_HTTP_V3_HEADER_DATE,
                                                      ngx_cached_http_time.data,
                                                      ngx_cached_http_time.len);
+        }
     }
 
     if (r->headers_out.content_type.len) {
@@ -381,7 +443,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
             p = ngx_pnalloc(r->pool, n);
             if (p == NULL) {
-                return NGX_ERROR;
+                goto failed;
             }
 
             p = ngx_cpymem(p, r->headers_out.content_type.data,
@@ -402,10 +464,18 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                        "http3 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
+        if (encode) {
+            b->last = ngx_http_v3_encoder_field(c, &es, b->last,
+                                    NGX_HTTP_V3_HEADER_CONTENT_TYPE_TEXT_PLAIN,
+                                    NULL, &r->headers_out.content_type,
+                                    NGX_HTTP_V3_INDEX);
+
+        } else {
+            b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
                                     NGX_HTTP_V3_HEADER_CONTENT_TYPE_TEXT_PLAIN,
                                     r->headers_out.content_type.data,
                                     r->headers_out.content_type.len);
+        }
     }
 
     if (r->headers_out.content_length == NULL
@@ -439,7 +509,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
         p = ngx_pnalloc(r->pool, n);
         if (p == NULL) {
-            return NGX_ERROR;
+            goto failed;
         }
 
         ngx_http_time(p, r->headers_out.last_modified_time);
@@ -496,9 +566,25 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                        "http3 output header: \"%V: %V\"",
                        &header[i].key, &header[i].value);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_l(b->last,
-                                                        &header[i].key,
-                                                        &header[i].value);
+        if (encode) {
+            b->last = ngx_http_v3_encoder_field(c, &es, b->last, -1,
+                                      &header[i].key, &header[i].value,
+                                      ngx_http_v3_header_indexing(
+                                                              &header[i].key));
+
+        } else {
+            b->last = (u_char *) ngx_http_v3_encode_field_l(b->last,
+                                                            &header[i].key,
+                                                            &header[i].value);
+        }
+    }
+
+    if (encode) {
+        p = ngx_http_v3_encoder_prefix(c, &es, prefix);
+        n = p - prefix;
+
+        b->pos -= n;
+        ngx_memcpy(b->pos, prefix, n);
     }
 
     if (r->header_only) {
@@ -507,7 +593,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
     cl = ngx_alloc_chain_link(r->pool);
     if (cl == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     cl->buf = b;
@@ -522,7 +608,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
     b = ngx_create_temp_buf(r->pool, len);
     if (b == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     b->last = (u_char *) ngx_http_v3_encode_varlen_int(b->last,
@@ -531,7 +617,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
     hl = ngx_alloc_chain_link(r->pool);
     if (hl == NULL) {
-        return NGX_ERROR;
+        goto failed;
     }
 
     hl->buf = b;
@@ -549,7 +635,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
         b = ngx_create_temp_buf(r->pool, len);
         if (b == NULL) {
-            return NGX_ERROR;
+            goto failed;
         }
 
         b->last = (u_char *) ngx_http_v3_encode_varlen_int(b->last,
@@ -562,7 +648,7 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
         cl = ngx_alloc_chain_link(r->pool);
         if (cl == NULL) {
-            return NGX_ERROR;
+            goto failed;
         }
 
         cl->buf = b;
@@ -573,18 +659,63 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
     } else {
         ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_v3_filter_ctx_t));
         if (ctx == NULL) {
-            return NGX_ERROR;
+            goto failed;
         }
 
         ngx_http_set_ctx(r, ctx, ngx_http_v3_filter_module);
     }
 
+    if (encode && ngx_http_v3_encoder_end(c, &es) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     for (cl = out; cl; cl = cl->next) {
         h3c->total_bytes += cl->buf->last - cl->buf->pos;
         r->header_size += cl->buf->last - cl->buf->pos;
     }
 
     return ngx_http_write_filter(r, out);
+
+failed:
+
+    if (encode) {
+
+        /*
+         * instructions already added to the encoder table are still
+         * to be sent, while the field section itself is dropped
+         */
+
+        es.insert_count = 0;
+
+        (void) ngx_http_v3_encoder_end(c, &es);
+    }
+
+    return NGX_ERROR;
+}
+
+
+static ngx_uint_t
+ngx_http_v3_header_indexing(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    if (name->len == sizeof("set-cookie") - 1
+        && ngx_strncasecmp(name->data, (u_char *) "set-cookie",
+                           sizeof("set-cookie") - 1)
+           == 0)
+    {
+        return NGX_HTTP_V3_NEVER_INDEX;
+    }
+
+    for (h = ngx_http_v3_no_index_headers; h->len; h++) {
+        if (name->len == h->len
+            && ngx_strncasecmp(name->data, h->data, h->len) == 0)
+        {
+            return NGX_HTTP_V3_NO_INDEX;
+        }
+    }
+
+    return NGX_HTTP_V3_INDEX;
 }
 
 
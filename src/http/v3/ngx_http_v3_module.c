@@ -12,12 +12,28 @@
 
 static ngx_int_t ngx_http_v3_variable(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_v3_memory_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_v3_add_variables(ngx_conf_t *cf);
 static void *ngx_http_v3_create_srv_conf(ngx_conf_t *cf);
 static char *ngx_http_v3_merge_srv_conf(ngx_conf_t *cf, void *parent,
     void *child);
 static char *ngx_http_quic_host_key(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_v3_encoder_table_capacity(ngx_conf_t *cf, void *post,
+    void *data);
+
+
+static ngx_conf_post_t  ngx_http_v3_encoder_table_capacity_post =
+    { ngx_http_v3_encoder_table_capacity };
+
+
+static ngx_conf_enum_t  ngx_http_v3_congestion_control[] = {
+    { ngx_string("reno"), NGX_QUIC_CC_RENO },
+    { ngx_string("cubic"), NGX_QUIC_CC_CUBIC },
+    { ngx_string("bbr"), NGX_QUIC_CC_BBR },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_v3_commands[] = {
@@ -43,6 +59,13 @@ static ngx_command_t  ngx_http_v3_commands[] = {
       offsetof(ngx_http_v3_srv_conf_t, max_concurrent_streams),
       NULL },
 
+    { ngx_string("http3_encoder_table_capacity"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v3_srv_conf_t, encoder_table_capacity),
+      &ngx_http_v3_encoder_table_capacity_post },
+
     { ngx_string("http3_stream_buffer_size"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_size_slot,
@@ -64,6 +87,20 @@ static ngx_command_t  ngx_http_v3_commands[] = {
       offsetof(ngx_http_v3_srv_conf_t, quic.gso_enabled),
       NULL },
 
+    { ngx_string("quic_congestion_control"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v3_srv_conf_t, quic.congestion_control),
+      &ngx_http_v3_congestion_control },
+
+    { ngx_string("quic_pacing"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_v3_srv_conf_t, quic.pacing),
+      NULL },
+
     { ngx_string("quic_host_key"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_http_quic_host_key,
@@ -117,6 +154,15 @@ static ngx_http_variable_t  ngx_http_v3_vars[] = {
 
     { ngx_string("http3"), NULL, ngx_http_v3_variable, 0, 0, 0 },
 
+    { ngx_string("quic_memory_used"), NULL, ngx_http_v3_memory_variable,
+      offsetof(ngx_quic_memory_t, used), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_memory_cached"), NULL, ngx_http_v3_memory_variable,
+      offsetof(ngx_quic_memory_t, cached), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("quic_memory_denied"), NULL, ngx_http_v3_memory_variable,
+      offsetof(ngx_quic_memory_t, denied), NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
       ngx_http_null_variable
 };
 
@@ -157,6 +203,33 @@ ngx_http_v3_variable(ngx_http_request_t *r,
 }
 
 
+static ngx_int_t
+ngx_http_v3_memory_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char             *p;
+    ngx_uint_t          value;
+    ngx_quic_memory_t  *m;
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    m = ngx_quic_get_memory((ngx_cycle_t *) ngx_cycle);
+
+    value = *(ngx_uint_t *) ((char *) m + data);
+
+    v->len = ngx_sprintf(p, "%ui", value) - p;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_v3_add_variables(ngx_conf_t *cf)
 {
@@ -200,12 +273,15 @@ ngx_http_v3_create_srv_conf(ngx_conf_t *cf)
     h3scf->enable_hq = NGX_CONF_UNSET;
     h3scf->max_table_capacity = NGX_HTTP_V3_MAX_TABLE_CAPACITY;
     h3scf->max_concurrent_streams = NGX_CONF_UNSET_UINT;
+    h3scf->encoder_table_capacity = NGX_CONF_UNSET_SIZE;
 
     h3scf->quic.stream_buffer_size = NGX_CONF_UNSET_SIZE;
     h3scf->quic.max_concurrent_streams_bidi = NGX_CONF_UNSET_UINT;
     h3scf->quic.max_concurrent_streams_uni = NGX_HTTP_V3_MAX_UNI_STREAMS;
     h3scf->quic.retry = NGX_CONF_UNSET;
     h3scf->quic.gso_enabled = NGX_CONF_UNSET;
+    h3scf->quic.pacing = NGX_CONF_UNSET;
+    h3scf->quic.congestion_control = NGX_CONF_UNSET_UINT;
     h3scf->quic.stream_close_code = NGX_HTTP_V3_ERR_NO_ERROR;
     h3scf->quic.stream_reject_code_bidi = NGX_HTTP_V3_ERR_REQUEST_REJECTED;
     h3scf->quic.active_connection_id_limit = NGX_CONF_UNSET_UINT;
@@ -235,6 +311,9 @@ ngx_http_v3_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     conf->max_blocked_streams = conf->max_concurrent_streams;
 
+    ngx_conf_merge_size_value(conf->encoder_table_capacity,
+                              prev->encoder_table_capacity, 0);
+
     ngx_conf_merge_size_value(conf->quic.stream_buffer_size,
                               prev->quic.stream_buffer_size,
                               65536);
@@ -243,6 +322,11 @@ ngx_http_v3_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->quic.retry, prev->quic.retry, 0);
     ngx_conf_merge_value(conf->quic.gso_enabled, prev->quic.gso_enabled, 0);
+    ngx_conf_merge_value(conf->quic.pacing, prev->quic.pacing, 0);
+
+    ngx_conf_merge_uint_value(conf->quic.congestion_control,
+                              prev->quic.congestion_control,
+                              NGX_QUIC_CC_RENO);
 
     ngx_conf_merge_str_value(conf->quic.host_key, prev->quic.host_key, "");
 
@@ -391,3 +475,20 @@ failed:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_v3_encoder_table_capacity(ngx_conf_t *cf, void *post, void *data)
+{
+    size_t *sp = data;
+
+    if (*sp > NGX_HTTP_V3_MAX_ENCODER_CAPACITY) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "the maximum encoder table capacity is %uz",
+                           (size_t) NGX_HTTP_V3_MAX_ENCODER_CAPACITY);
+
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
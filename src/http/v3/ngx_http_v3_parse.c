@@ -46,6 +46,8 @@ static ngx_int_t ngx_http_v3_parse_control(ngx_connection_t *c,
     ngx_http_v3_parse_control_t *st, ngx_buf_t *b);
 static ngx_int_t ngx_http_v3_parse_settings(ngx_connection_t *c,
     ngx_http_v3_parse_settings_t *st, ngx_buf_t *b);
+static ngx_int_t ngx_http_v3_parse_priority_update(ngx_connection_t *c,
+    ngx_http_v3_parse_priority_update_t *st, ngx_buf_t *b, ngx_uint_t last);
 
 static ngx_int_t ngx_http_v3_parse_encoder(ngx_connection_t *c,
     ngx_http_v3_parse_encoder_t *st, ngx_buf_t *b);
@@ -594,7 +596,7 @@ static ngx_int_t
 ngx_http_v3_parse_literal(ngx_connection_t *c, ngx_http_v3_parse_literal_t *st,
     ngx_buf_t *b)
 {
-    u_char                     ch;
+    size_t                     size;
     ngx_uint_t                 n;
     ngx_http_core_srv_conf_t  *cscf;
     enum {
@@ -643,11 +645,12 @@ ngx_http_v3_parse_literal(ngx_connection_t *c, ngx_http_v3_parse_literal_t *st,
                 return NGX_AGAIN;
             }
 
-            ch = *b->pos++;
+            size = ngx_min((size_t) (b->last - b->pos), st->length);
 
             if (st->huffman) {
-                if (ngx_http_huff_decode(&st->huffstate, &ch, 1, &st->last,
-                                         st->length == 1, c->log)
+                if (ngx_http_huff_decode(&st->huffstate, b->pos, size,
+                                         &st->last, st->length == size,
+                                         c->log)
                     != NGX_OK)
                 {
                     ngx_log_error(NGX_LOG_INFO, c->log, 0,
@@ -656,10 +659,13 @@ ngx_http_v3_parse_literal(ngx_connection_t *c, ngx_http_v3_parse_literal_t *st,
                 }
 
             } else {
-                *st->last++ = ch;
+                st->last = ngx_cpymem(st->last, b->pos, size);
             }
 
-            if (--st->length) {
+            b->pos += size;
+            st->length -= size;
+
+            if (st->length) {
                 break;
             }
 
@@ -1157,14 +1163,16 @@ static ngx_int_t
 ngx_http_v3_parse_control(ngx_connection_t *c, ngx_http_v3_parse_control_t *st,
     ngx_buf_t *b)
 {
-    ngx_buf_t  loc;
-    ngx_int_t  rc;
+    ngx_buf_t   loc;
+    ngx_int_t   rc;
+    ngx_uint_t  last;
     enum {
         sw_start = 0,
         sw_first_type,
         sw_type,
         sw_length,
         sw_settings,
+        sw_priority_update,
         sw_skip
     };
 
@@ -1243,6 +1251,10 @@ ngx_http_v3_parse_control(ngx_connection_t *c, ngx_http_v3_parse_control_t *st,
                 st->state = sw_settings;
                 break;
 
+            case NGX_HTTP_V3_FRAME_PRIORITY_UPDATE:
+                st->state = sw_priority_update;
+                break;
+
             default:
                 ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
                                "http3 parse skip unknown frame");
@@ -1273,6 +1285,24 @@ ngx_http_v3_parse_control(ngx_connection_t *c, ngx_http_v3_parse_control_t *st,
 
             break;
 
+        case sw_priority_update:
+
+            last = ((ngx_uint_t) (b->last - b->pos) >= st->length);
+
+            ngx_http_v3_parse_start_local(b, &loc, st->length);
+
+            rc = ngx_http_v3_parse_priority_update(c, &st->priority_update,
+                                                   &loc, last);
+
+            ngx_http_v3_parse_end_local(b, &loc, &st->length);
+
+            if (rc != NGX_DONE) {
+                return rc;
+            }
+
+            st->state = sw_type;
+            break;
+
         case sw_skip:
 
             rc = ngx_http_v3_parse_skip(b, &st->length);
@@ -1287,6 +1317,99 @@ ngx_http_v3_parse_control(ngx_connection_t *c, ngx_http_v3_parse_control_t *st,
 }
 
 
+static ngx_int_t
+ngx_http_v3_parse_priority_update(ngx_connection_t *c,
+    ngx_http_v3_parse_priority_update_t *st, ngx_buf_t *b, ngx_uint_t last)
+{
+    size_t      n;
+    ngx_int_t   rc;
+    ngx_uint_t  urgency, incremental;
+    enum {
+        sw_start = 0,
+        sw_id,
+        sw_value
+    };
+
+    /* the value ends with the frame, "last" is set if "b" reaches the end */
+
+    for ( ;; ) {
+
+        switch (st->state) {
+
+        case sw_start:
+
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http3 parse priority update");
+
+            st->state = sw_id;
+
+            /* fall through */
+
+        case sw_id:
+
+            rc = ngx_http_v3_parse_varlen_int(c, &st->vlint, b);
+
+            if (rc == NGX_AGAIN && last) {
+                return NGX_HTTP_V3_ERR_FRAME_ERROR;
+            }
+
+            if (rc != NGX_DONE) {
+                return rc;
+            }
+
+            st->id = st->vlint.value;
+            st->len = 0;
+            st->state = sw_value;
+            break;
+
+        case sw_value:
+
+            n = b->last - b->pos;
+
+            if (st->len < sizeof(st->value)) {
+                ngx_memcpy(st->value + st->len, b->pos,
+                           ngx_min(n, sizeof(st->value) - st->len));
+            }
+
+            /* longer values are not stored and are ignored */
+
+            st->len += n;
+            b->pos = b->last;
+
+            if (!last) {
+                return NGX_AGAIN;
+            }
+
+            goto done;
+        }
+    }
+
+done:
+
+    st->state = sw_start;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 priority update id:%uL \"%*s\"",
+                   st->id, ngx_min(st->len, sizeof(st->value)), st->value);
+
+    if (st->id & (NGX_QUIC_STREAM_UNIDIRECTIONAL
+                  |NGX_QUIC_STREAM_SERVER_INITIATED))
+    {
+        return NGX_HTTP_V3_ERR_ID_ERROR;
+    }
+
+    if (st->len <= sizeof(st->value)
+        && ngx_http_parse_priority(st->value, st->value + st->len,
+                                   &urgency, &incremental)
+           == NGX_OK)
+    {
+        ngx_quic_set_stream_priority(c, st->id, urgency);
+    }
+
+    return NGX_DONE;
+}
+
+
 static ngx_int_t
 ngx_http_v3_parse_settings(ngx_connection_t *c,
     ngx_http_v3_parse_settings_t *st, ngx_buf_t *b)
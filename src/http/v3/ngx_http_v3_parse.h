@@ -34,6 +34,15 @@ typedef struct {
 } ngx_http_v3_parse_settings_t;
 
 
+typedef struct {
+    ngx_uint_t                      state;
+    uint64_t                        id;
+    size_t                          len;
+    u_char                          value[32];
+    ngx_http_v3_parse_varlen_int_t  vlint;
+} ngx_http_v3_parse_priority_update_t;
+
+
 typedef struct {
     ngx_uint_t                      state;
     ngx_uint_t                      insert_count;
@@ -103,6 +112,7 @@ typedef struct {
     ngx_uint_t                      length;
     ngx_http_v3_parse_varlen_int_t  vlint;
     ngx_http_v3_parse_settings_t    settings;
+    ngx_http_v3_parse_priority_update_t  priority_update;
 } ngx_http_v3_parse_control_t;
 
 
@@ -1003,6 +1003,8 @@ ngx_http_v3_process_request_header(ngx_http_request_t *r)
 {
     ssize_t                  n;
     ngx_buf_t               *b;
+    ngx_uint_t               urgency, incremental;
+    ngx_table_elt_t         *h;
     ngx_connection_t        *c;
     ngx_http_v3_session_t   *h3c;
     ngx_http_v3_srv_conf_t  *h3scf;
@@ -1094,6 +1096,18 @@ ngx_http_v3_process_request_header(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
+    urgency = NGX_HTTP_PRIORITY_URGENCY;
+
+    h = r->headers_in.priority;
+
+    if (h) {
+        (void) ngx_http_parse_priority(h->value.data,
+                                       h->value.data + h->value.len,
+                                       &urgency, &incremental);
+    }
+
+    ngx_quic_set_stream_priority(c, c->quic->id, urgency);
+
     return NGX_OK;
 
 failed:
@@ -16,6 +16,13 @@
 static ngx_int_t ngx_http_v3_evict(ngx_connection_t *c, size_t target);
 static void ngx_http_v3_unblock(void *data);
 static ngx_int_t ngx_http_v3_new_entry(ngx_connection_t *c);
+static u_char *ngx_http_v3_encoder_ref(ngx_http_v3_encode_section_t *es,
+    u_char *p, ngx_uint_t index);
+static ngx_uint_t ngx_http_v3_encoder_seen(ngx_http_v3_encoder_table_t *et,
+    ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_v3_encoder_insert(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, ngx_int_t index, ngx_str_t *name,
+    ngx_str_t *value);
 
 
 typedef struct {
@@ -331,19 +338,41 @@ void
 ngx_http_v3_cleanup_table(ngx_http_v3_session_t *h3c)
 {
     ngx_uint_t                    n;
+    ngx_queue_t                  *q;
     ngx_http_v3_dynamic_table_t  *dt;
+    ngx_http_v3_encoder_table_t  *et;
 
     dt = &h3c->table;
 
-    if (dt->elts == NULL) {
-        return;
+    if (dt->elts) {
+        for (n = 0; n < dt->nelts; n++) {
+            ngx_free(dt->elts[n]);
+        }
+
+        ngx_free(dt->elts);
+    }
+
+    et = &h3c->encoder;
+
+    if (et->elts) {
+        for (n = 0; n < et->nelts; n++) {
+            ngx_free(et->elts[n]);
+        }
+
+        ngx_free(et->elts);
     }
 
-    for (n = 0; n < dt->nelts; n++) {
-        ngx_free(dt->elts[n]);
+    while (!ngx_queue_empty(&et->sections)) {
+        q = ngx_queue_head(&et->sections);
+        ngx_queue_remove(q);
+        ngx_free(q);
     }
 
-    ngx_free(dt->elts);
+    while (!ngx_queue_empty(&et->free)) {
+        q = ngx_queue_head(&et->free);
+        ngx_queue_remove(q);
+        ngx_free(q);
+    }
 }
 
 
@@ -411,10 +440,36 @@ ngx_http_v3_duplicate(ngx_connection_t *c, ngx_uint_t index)
 ngx_int_t
 ngx_http_v3_ack_section(ngx_connection_t *c, ngx_uint_t stream_id)
 {
+    ngx_queue_t                  *q;
+    ngx_http_v3_section_t        *s;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 ack section %ui", stream_id);
 
-    /* we do not use dynamic tables */
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (s->stream_id != stream_id) {
+            continue;
+        }
+
+        if (et->known_received_count < s->insert_count) {
+            et->known_received_count = s->insert_count;
+        }
+
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&et->free, q);
+
+        return NGX_OK;
+    }
 
     return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
 }
@@ -423,12 +478,48 @@ ngx_http_v3_ack_section(ngx_connection_t *c, ngx_uint_t stream_id)
 ngx_int_t
 ngx_http_v3_inc_insert_count(ngx_connection_t *c, ngx_uint_t inc)
 {
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 increment insert count %ui", inc);
 
-    /* we do not use dynamic tables */
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
 
-    return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
+    if (inc == 0 || et->known_received_count + inc > et->base + et->nelts) {
+        return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
+    }
+
+    et->known_received_count += inc;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v3_cancel_sections(ngx_connection_t *c, ngx_uint_t stream_id)
+{
+    ngx_queue_t                  *q, *next;
+    ngx_http_v3_section_t        *s;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        s = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (s->stream_id == stream_id) {
+            ngx_queue_remove(q);
+            ngx_queue_insert_head(&et->free, q);
+        }
+    }
 }
 
 
@@ -687,11 +778,21 @@ ngx_http_v3_new_entry(ngx_connection_t *c)
 ngx_int_t
 ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
 {
+    ngx_http_v3_session_t  *h3c;
+
+    h3c = ngx_http_v3_get_session(c);
+
     switch (id) {
 
     case NGX_HTTP_V3_PARAM_MAX_TABLE_CAPACITY:
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 param QPACK_MAX_TABLE_CAPACITY:%uL", value);
+
+        if (value > NGX_MAX_UINT32_VALUE) {
+            return NGX_ERROR;
+        }
+
+        h3c->encoder.max_capacity = value;
         break;
 
     case NGX_HTTP_V3_PARAM_MAX_FIELD_SECTION_SIZE:
@@ -703,6 +804,8 @@ ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
     case NGX_HTTP_V3_PARAM_BLOCKED_STREAMS:
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 param QPACK_BLOCKED_STREAMS:%uL", value);
+
+        h3c->encoder.max_blocked = ngx_min(value, NGX_MAX_UINT32_VALUE);
         break;
 
     default:
@@ -713,3 +816,387 @@ ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
 
     return NGX_OK;
 }
+
+
+ngx_int_t
+ngx_http_v3_encoder_begin(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, ngx_pool_t *pool, size_t len)
+{
+    u_char                       *buf;
+    size_t                        capacity;
+    ngx_uint_t                    n;
+    ngx_queue_t                  *q;
+    ngx_http_v3_section_t        *s;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_srv_conf_t       *h3scf;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    capacity = 0;
+
+    if (et->capacity == 0) {
+        h3scf = ngx_http_v3_get_module_srv_conf(c, ngx_http_v3_module);
+
+        capacity = ngx_min(h3scf->encoder_table_capacity, et->max_capacity);
+
+        if (capacity < 32) {
+            return NGX_DECLINED;
+        }
+    }
+
+    /*
+     * encoder instructions never take more space than
+     * the literal field lines they stand for
+     */
+
+    buf = ngx_pnalloc(pool, len + NGX_HTTP_V3_PREFIX_INT_LEN);
+    if (buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    es->start = buf;
+
+    if (capacity) {
+        et->elts = ngx_alloc((capacity / 32 + 1) * sizeof(void *), c->log);
+        if (et->elts == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 encoder set capacity %uz", capacity);
+
+        et->capacity = capacity;
+
+        buf = (u_char *) ngx_http_v3_encode_set_capacity(buf, capacity);
+    }
+
+    es->pos = buf;
+    es->base = et->base + et->nelts;
+    es->insert_count = 0;
+    es->min_ref = (ngx_uint_t) -1;
+
+    /*
+     * a field section may refer to entries not yet acknowledged
+     * as long as the peer's blocked streams limit is not reached
+     */
+
+    n = 0;
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (s->insert_count > et->known_received_count) {
+            n++;
+        }
+    }
+
+    es->block = (n < et->max_blocked);
+
+    return NGX_OK;
+}
+
+
+u_char *
+ngx_http_v3_encoder_field(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, u_char *p, ngx_int_t index,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing)
+{
+    u_char                       *start;
+    ngx_str_t                     static_name;
+    ngx_uint_t                    n;
+    ngx_http_v3_field_t          *field;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    if (index >= 0) {
+        (void) ngx_http_v3_lookup_static(c, index, &static_name, NULL);
+        name = &static_name;
+    }
+
+    for (n = et->nelts; n > 0; n--) {
+        field = et->elts[n - 1];
+
+        if (field->name.len != name->len
+            || field->value.len != value->len
+            || ngx_strncasecmp(field->name.data, name->data, name->len) != 0
+            || ngx_memcmp(field->value.data, value->data, value->len) != 0)
+        {
+            continue;
+        }
+
+        if (et->base + n - 1 < et->known_received_count || es->block) {
+            return ngx_http_v3_encoder_ref(es, p, et->base + n - 1);
+        }
+
+        goto literal;
+    }
+
+    /*
+     * a field is only inserted when seen for the second time, so that
+     * per-response values do not cost an insertion for nothing
+     */
+
+    if (indexing == NGX_HTTP_V3_INDEX
+        && ngx_http_v3_table_entry_size(name, value) <= et->capacity / 4
+        && ngx_http_v3_encoder_seen(et, name, value)
+        && ngx_http_v3_encoder_insert(c, es, index, name, value) == NGX_OK
+        && es->block)
+    {
+        return ngx_http_v3_encoder_ref(es, p, et->base + et->nelts - 1);
+    }
+
+literal:
+
+    start = p;
+
+    if (index >= 0) {
+        p = (u_char *) ngx_http_v3_encode_field_lri(p, 0, index,
+                                                    value->data, value->len);
+
+        if (indexing == NGX_HTTP_V3_NEVER_INDEX) {
+            *start |= 0x20;
+        }
+
+    } else {
+        p = (u_char *) ngx_http_v3_encode_field_l(p, name, value);
+
+        if (indexing == NGX_HTTP_V3_NEVER_INDEX) {
+            *start |= 0x10;
+        }
+    }
+
+    return p;
+}
+
+
+u_char *
+ngx_http_v3_encoder_prefix(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, u_char *p)
+{
+    ngx_uint_t                    max_entries, insert_count;
+    ngx_http_v3_session_t        *h3c;
+
+    /* QPACK 4.5.1. Encoded Field Section Prefix */
+
+    if (es->insert_count == 0) {
+        return (u_char *) ngx_http_v3_encode_field_section_prefix(p, 0, 0, 0);
+    }
+
+    h3c = ngx_http_v3_get_session(c);
+
+    max_entries = h3c->encoder.max_capacity / 32;
+    insert_count = es->insert_count % (2 * max_entries) + 1;
+
+    if (es->base >= es->insert_count) {
+        return (u_char *) ngx_http_v3_encode_field_section_prefix(p,
+                                                insert_count, 0,
+                                                es->base - es->insert_count);
+    }
+
+    return (u_char *) ngx_http_v3_encode_field_section_prefix(p,
+                                            insert_count, 1,
+                                            es->insert_count - es->base - 1);
+}
+
+
+ngx_int_t
+ngx_http_v3_encoder_end(ngx_connection_t *c, ngx_http_v3_encode_section_t *es)
+{
+    ngx_queue_t                  *q;
+    ngx_http_v3_section_t        *s;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    if (es->pos != es->start) {
+        if (ngx_http_v3_send_encoder(c, es->start, es->pos - es->start)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (es->insert_count == 0) {
+        return NGX_OK;
+    }
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 encoder section insert_count:%ui base:%ui "
+                   "known:%uL", es->insert_count, es->base,
+                   et->known_received_count);
+
+    if (!ngx_queue_empty(&et->free)) {
+        q = ngx_queue_head(&et->free);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+    } else {
+        s = ngx_alloc(sizeof(ngx_http_v3_section_t), c->log);
+        if (s == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    s->stream_id = c->quic->id;
+    s->insert_count = es->insert_count;
+    s->min_ref = es->min_ref;
+
+    ngx_queue_insert_tail(&et->sections, &s->queue);
+
+    return NGX_OK;
+}
+
+
+static u_char *
+ngx_http_v3_encoder_ref(ngx_http_v3_encode_section_t *es, u_char *p,
+    ngx_uint_t index)
+{
+    if (es->insert_count < index + 1) {
+        es->insert_count = index + 1;
+    }
+
+    if (es->min_ref > index) {
+        es->min_ref = index;
+    }
+
+    if (index < es->base) {
+        return (u_char *) ngx_http_v3_encode_field_ri(p, 1,
+                                                      es->base - 1 - index);
+    }
+
+    return (u_char *) ngx_http_v3_encode_field_pbi(p, index - es->base);
+}
+
+
+static ngx_uint_t
+ngx_http_v3_encoder_seen(ngx_http_v3_encoder_table_t *et, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    uint32_t    hash;
+    ngx_uint_t  i;
+
+    hash = ngx_hash_key_lc(name->data, name->len);
+
+    for (i = 0; i < value->len; i++) {
+        hash = ngx_hash(hash, value->data[i]);
+    }
+
+    hash |= 1;
+
+    i = hash % NGX_HTTP_V3_ENCODER_SEEN;
+
+    if (et->seen[i] == hash) {
+        return 1;
+    }
+
+    et->seen[i] = hash;
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_v3_encoder_insert(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, ngx_int_t index, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char                       *p;
+    size_t                        size, avail;
+    ngx_uint_t                    i, n, limit;
+    ngx_queue_t                  *q;
+    ngx_http_v3_field_t          *field;
+    ngx_http_v3_section_t        *s;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    /*
+     * only entries which are acknowledged and not referenced
+     * by any outstanding field section may be evicted
+     */
+
+    limit = ngx_min(es->min_ref, et->known_received_count);
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+        limit = ngx_min(limit, s->min_ref);
+    }
+
+    size = ngx_http_v3_table_entry_size(name, value);
+    avail = et->capacity - et->size;
+
+    for (n = 0; avail < size; n++) {
+        if (n == et->nelts || et->base + n >= limit) {
+            return NGX_DECLINED;
+        }
+
+        field = et->elts[n];
+        avail += ngx_http_v3_table_entry_size(&field->name, &field->value);
+    }
+
+    p = ngx_alloc(sizeof(ngx_http_v3_field_t) + name->len + value->len,
+                  c->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < n; i++) {
+        field = et->elts[i];
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 encoder evict [%ui] \"%V\":\"%V\"",
+                       et->base + i, &field->name, &field->value);
+
+        et->size -= ngx_http_v3_table_entry_size(&field->name, &field->value);
+        ngx_free(field);
+    }
+
+    if (n) {
+        et->nelts -= n;
+        et->base += n;
+        ngx_memmove(et->elts, &et->elts[n], et->nelts * sizeof(void *));
+    }
+
+    field = (ngx_http_v3_field_t *) p;
+
+    field->name.data = p + sizeof(ngx_http_v3_field_t);
+    field->name.len = name->len;
+    ngx_strlow(field->name.data, name->data, name->len);
+
+    field->value.data = field->name.data + name->len;
+    field->value.len = value->len;
+    ngx_memcpy(field->value.data, value->data, value->len);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 encoder insert [%ui] \"%V\":\"%V\", size:%uz",
+                   et->base + et->nelts, name, value, size);
+
+    et->elts[et->nelts++] = field;
+    et->size += size;
+
+    if (index >= 0) {
+        es->pos = (u_char *) ngx_http_v3_encode_insert_ref(es->pos, 0, index,
+                                                           value);
+
+    } else {
+        es->pos = (u_char *) ngx_http_v3_encode_insert(es->pos, name, value);
+    }
+
+    return NGX_OK;
+}
@@ -32,6 +32,48 @@ typedef struct {
 } ngx_http_v3_dynamic_table_t;
 
 
+typedef struct {
+    ngx_queue_t                   queue;
+    ngx_uint_t                    stream_id;
+    ngx_uint_t                    insert_count;
+    ngx_uint_t                    min_ref;
+} ngx_http_v3_section_t;
+
+
+#define NGX_HTTP_V3_ENCODER_SEEN      64
+
+typedef struct {
+    ngx_http_v3_field_t         **elts;
+    ngx_uint_t                    nelts;
+    ngx_uint_t                    base;
+    size_t                        size;
+    size_t                        capacity;
+    size_t                        max_capacity;
+    ngx_uint_t                    max_blocked;
+    uint64_t                      known_received_count;
+    ngx_queue_t                   sections;
+    ngx_queue_t                   free;
+    uint32_t                      seen[NGX_HTTP_V3_ENCODER_SEEN];
+} ngx_http_v3_encoder_table_t;
+
+
+/* field section being encoded */
+
+typedef struct {
+    ngx_uint_t                    base;
+    ngx_uint_t                    insert_count;
+    ngx_uint_t                    min_ref;
+    ngx_uint_t                    block;
+    u_char                       *start;
+    u_char                       *pos;
+} ngx_http_v3_encode_section_t;
+
+
+#define NGX_HTTP_V3_INDEX             0
+#define NGX_HTTP_V3_NO_INDEX          1
+#define NGX_HTTP_V3_NEVER_INDEX       2
+
+
 void ngx_http_v3_inc_insert_count_handler(ngx_event_t *ev);
 void ngx_http_v3_cleanup_table(ngx_http_v3_session_t *h3c);
 ngx_int_t ngx_http_v3_ref_insert(ngx_connection_t *c, ngx_uint_t dynamic,
@@ -54,5 +96,16 @@ void ngx_http_v3_ack_insert_count(ngx_connection_t *c, uint64_t insert_count);
 ngx_int_t ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id,
     uint64_t value);
 
+ngx_int_t ngx_http_v3_encoder_begin(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, ngx_pool_t *pool, size_t len);
+u_char *ngx_http_v3_encoder_field(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, u_char *p, ngx_int_t index,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t indexing);
+u_char *ngx_http_v3_encoder_prefix(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es, u_char *p);
+ngx_int_t ngx_http_v3_encoder_end(ngx_connection_t *c,
+    ngx_http_v3_encode_section_t *es);
+void ngx_http_v3_cancel_sections(ngx_connection_t *c, ngx_uint_t stream_id);
+
 
 #endif /* _NGX_HTTP_V3_TABLE_H_INCLUDED_ */
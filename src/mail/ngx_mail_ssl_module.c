@@ -663,6 +663,7 @@ ngx_mail_ssl_session_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             }
 
             scf->shm_zone->init = ngx_ssl_session_cache_init;
+            scf->shm_zone->process = 1;
 
             continue;
         }
@@ -23,6 +23,10 @@ static ngx_as_lib_upcall_t* ngx_get_upcall(void) {
     return upcall;
 }
 
+ngx_as_lib_shared_t* ngx_as_lib_shared(void) {
+    return upcall ? upcall->shared : NULL;
+}
+
 extern ngx_module_t ngx_as_lib_http_module;
 static ngx_as_lib_api_t* ngx_as_lib_get_api_from_req(ngx_http_request_t* r) {
     ngx_as_lib_http_loc_conf_t* conf =
@@ -301,3 +305,9 @@ ngx_as_lib_api_t api = {
 ngx_as_lib_api_t* libngx(void) {
     return &api;
 }
+
+// declared in the public header only
+void ngx_as_lib_quit(void) {
+    ngx_quit = 1;
+    ngx_notify(NULL);
+}
@@ -36,6 +36,9 @@ struct ngx_as_lib_upcall_s {
     // void*  (*create_loc_conf)  (ngx_as_lib_api_t* api, void* ud, ngx_conf_t* cf);
     // char*  (*merge_loc_conf)   (ngx_as_lib_api_t* api, void* ud, ngx_conf_t* cf, void* prev, void* conf);
     intptr_t(*get_upstream_peer)(ngx_as_lib_api_t*api, void* ud, ngx_http_request_t* r, uintptr_t id, ngx_peer_connection_t* pc);
+
+    // zeroed memory allocated once by the host and passed to every instance
+    ngx_as_lib_shared_t* shared;
 };
 typedef struct ngx_as_lib_upcall_s ngx_as_lib_upcall_t;
 
@@ -570,7 +570,7 @@ ngx_process_get_status(void)
 static void
 ngx_unlock_mutexes(ngx_pid_t pid)
 {
-    ngx_uint_t        i;
+    ngx_uint_t        i, n;
     ngx_shm_zone_t   *shm_zone;
     ngx_list_part_t  *part;
     ngx_slab_pool_t  *sp;
@@ -610,6 +610,15 @@ ngx_unlock_mutexes(ngx_pid_t pid)
                           "shared memory zone \"%V\" was locked by %P",
                           &shm_zone[i].shm.name, pid);
         }
+
+        n = ngx_shm_hash_force_unlock(sp, pid);
+
+        if (n) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "%ui buckets in shared memory zone \"%V\" "
+                          "were locked by %P",
+                          n, &shm_zone[i].shm.name, pid);
+        }
     }
 }
 
@@ -10,6 +10,10 @@
 #include <ngx_event.h>
 #include <ngx_channel.h>
 
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
+
 
 static void ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n,
     ngx_int_t type);
@@ -26,6 +30,13 @@ static void ngx_channel_handler(ngx_event_t *ev);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+#if (NGX_THREADS)
+static void ngx_cache_manager_threads_init(ngx_cycle_t *cycle);
+static void ngx_cache_manager_thread_handler(void *data, ngx_log_t *log);
+static void ngx_cache_loader_thread_handler(void *data, ngx_log_t *log);
+static void ngx_cache_manager_thread_event_handler(ngx_event_t *ev);
+static void ngx_cache_manager_timer_handler(ngx_event_t *ev);
+#endif
 
 
 ngx_uint_t    ngx_process;
@@ -65,6 +76,18 @@ static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
 };
 
 
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_path_t         *path;
+    ngx_cycle_t        *cycle;
+    ngx_msec_t          next;
+    ngx_event_t         timer;
+} ngx_cache_manager_thread_ctx_t;
+
+#endif
+
+
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
 static ngx_open_file_t  ngx_exit_log_file;
@@ -294,6 +317,10 @@ ngx_single_process_cycle(ngx_cycle_t *cycle)
         }
     }
 
+#if (NGX_THREADS)
+    ngx_cache_manager_threads_init(cycle);
+#endif
+
 #if (NGX_AS_LIB)
     ngx_cpuset_t* cpu_affinity = ngx_get_cpu_affinity(0);
     if (cpu_affinity) {
@@ -368,6 +395,12 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
     path = ngx_cycle->paths.elts;
     for (i = 0; i < ngx_cycle->paths.nelts; i++) {
 
+#if (NGX_THREADS)
+        if (path[i]->thread_pool) {
+            continue;
+        }
+#endif
+
         if (path[i]->manager) {
             manager = 1;
         }
@@ -662,7 +695,8 @@ ngx_reap_children(ngx_cycle_t *cycle)
 static void
 ngx_master_process_exit(ngx_cycle_t *cycle)
 {
-    ngx_uint_t  i;
+    ngx_uint_t    i;
+    ngx_path_t  **path;
 
     ngx_delete_pidfile(cycle);
 
@@ -674,6 +708,14 @@ ngx_master_process_exit(ngx_cycle_t *cycle)
         }
     }
 
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->saver) {
+            path[i]->saver(path[i]->data);
+        }
+    }
+
     ngx_close_listening_sockets(cycle);
 
     /*
@@ -712,6 +754,10 @@ ngx_worker_process_cycle(ngx_cycle_t *cycle, void *data)
 
     ngx_worker_process_init(cycle, worker);
 
+#if (NGX_THREADS)
+    ngx_cache_manager_threads_init(cycle);
+#endif
+
     ngx_setproctitle("worker process");
 
     for ( ;; ) {
@@ -1155,6 +1201,12 @@ ngx_cache_manager_process_handler(ngx_event_t *ev)
     path = ngx_cycle->paths.elts;
     for (i = 0; i < ngx_cycle->paths.nelts; i++) {
 
+#if (NGX_THREADS)
+        if (path[i]->thread_pool) {
+            continue;
+        }
+#endif
+
         if (path[i]->manager) {
             n = path[i]->manager(path[i]->data);
 
@@ -1188,6 +1240,12 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
             break;
         }
 
+#if (NGX_THREADS)
+        if (path[i]->thread_pool) {
+            continue;
+        }
+#endif
+
         if (path[i]->loader) {
             path[i]->loader(path[i]->data);
             ngx_time_update();
@@ -1196,3 +1254,145 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
 
     exit(0);
 }
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_cache_manager_threads_init(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_path_t                     **path;
+    ngx_thread_task_t               *task;
+    ngx_cache_manager_thread_ctx_t  *ctx;
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->thread_pool == NULL || path[i]->manager == NULL) {
+            continue;
+        }
+
+        /*
+         * the tasks are allocated from the heap: in a single process
+         * a reconfigured cycle may release the pool while a task runs
+         */
+
+        task = ngx_calloc(sizeof(ngx_thread_task_t)
+                          + sizeof(ngx_cache_manager_thread_ctx_t),
+                          cycle->log);
+        if (task == NULL) {
+            return;
+        }
+
+        ctx = (ngx_cache_manager_thread_ctx_t *) (task + 1);
+
+        ctx->path = path[i];
+        ctx->cycle = cycle;
+
+        ctx->timer.handler = ngx_cache_manager_timer_handler;
+        ctx->timer.data = task;
+        ctx->timer.log = cycle->log;
+        ctx->timer.cancelable = 1;
+
+        task->ctx = ctx;
+        task->handler = ngx_cache_manager_thread_handler;
+        task->event.handler = ngx_cache_manager_thread_event_handler;
+        task->event.data = task;
+        task->event.log = cycle->log;
+
+        if (ngx_thread_task_post(path[i]->thread_pool, task) != NGX_OK) {
+            ngx_add_timer(&ctx->timer, 1000);
+        }
+
+        if (path[i]->loader == NULL) {
+            continue;
+        }
+
+        task = ngx_calloc(sizeof(ngx_thread_task_t)
+                          + sizeof(ngx_cache_manager_thread_ctx_t),
+                          cycle->log);
+        if (task == NULL) {
+            return;
+        }
+
+        ctx = (ngx_cache_manager_thread_ctx_t *) (task + 1);
+
+        ctx->path = path[i];
+        ctx->cycle = cycle;
+
+        task->ctx = ctx;
+        task->handler = ngx_cache_loader_thread_handler;
+        task->event.handler = ngx_cache_manager_thread_event_handler;
+        task->event.data = task;
+        task->event.log = cycle->log;
+
+        (void) ngx_thread_task_post(path[i]->thread_pool, task);
+    }
+}
+
+
+static void
+ngx_cache_manager_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_cache_manager_thread_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "cache manager thread: \"%V\"", &ctx->path->name);
+
+    ctx->next = ctx->path->manager(ctx->path->data);
+}
+
+
+static void
+ngx_cache_loader_thread_handler(void *data, ngx_log_t *log)
+{
+    ngx_cache_manager_thread_ctx_t *ctx = data;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, log, 0,
+                   "cache loader thread: \"%V\"", &ctx->path->name);
+
+    ctx->path->loader(ctx->path->data);
+}
+
+
+static void
+ngx_cache_manager_thread_event_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t               *task;
+    ngx_cache_manager_thread_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+
+    if (task->handler == ngx_cache_loader_thread_handler
+        || ctx->cycle != ngx_cycle || ngx_exiting || ngx_terminate)
+    {
+        ngx_free(task);
+        return;
+    }
+
+    ngx_add_timer(&ctx->timer, ctx->next ? ctx->next : 1);
+}
+
+
+static void
+ngx_cache_manager_timer_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t               *task;
+    ngx_cache_manager_thread_ctx_t  *ctx;
+
+    task = ev->data;
+    ctx = task->ctx;
+
+    if (ctx->cycle != ngx_cycle || ngx_exiting) {
+        ngx_free(task);
+        return;
+    }
+
+    if (ngx_thread_task_post(ctx->path->thread_pool, task) != NGX_OK) {
+        ngx_add_timer(&ctx->timer, 1000);
+    }
+}
+
+#endif
@@ -37,6 +37,8 @@ typedef struct {
     ngx_array_t     *certificate_values;
     ngx_array_t     *certificate_key_values;
 
+    ngx_ssl_cache_t *certificate_cache;
+
     ngx_str_t        dhparam;
     ngx_str_t        ecdh_curve;
     ngx_str_t        client_certificate;
@@ -62,6 +64,8 @@ typedef struct {
     ngx_flag_t       stapling_verify;
     ngx_str_t        stapling_file;
     ngx_str_t        stapling_responder;
+
+    ngx_thread_pool_t  *thread_pool;
 } ngx_stream_ssl_srv_conf_t;
 
 